@@ -1,4 +1,6 @@
 #include "app.hpp"
+#include <algorithm>
+#include <thread>
 #include <string>
 #include <iostream>
 
@@ -11,16 +13,75 @@ void main_app::general_setup()
 
 }
 
-void main_app::draw_scene()
+// Runs on the simulation thread. alpha is how far rendering is between the last two
+// simulation steps; everything draw_scene needs has to be copied into the packet.
+void main_app::build_frame(knu::graphics::frame_packet &packet, float alpha)
 {
-	glClearBufferfv(GL_COLOR, 0, clearColorVal);
-	glClearBufferfv(GL_DEPTH, 0, &clearDepthVal);
-    
-    
+	KNU_PROFILE_ZONE("build_frame");
+	packet.frame_index = frame_count++;
+	packet.alpha = alpha;
+	packet.viewport_width = viewport_width;
+	packet.viewport_height = viewport_height;
+	std::copy(std::begin(clearColorVal), std::end(clearColorVal), std::begin(packet.clear_color));
+	packet.clear_depth = clearDepthVal;
+	std::copy(view_matrix.data(), view_matrix.data() + 16, std::begin(packet.view));
+	std::copy(perspective_matrix.data(), perspective_matrix.data() + 16, std::begin(packet.projection));
+
+	// plain copies, but enough of them to be worth spreading over the workers. Draw items
+	// don't carry a program or textures yet, so they sort by material, then front to back.
+	packet.draws.resize(scene_items.size());
+	packet.queue.resize(scene_items.size());
+	knu::graphics::render_command *commands = packet.queue.commands();
+	const float *view = packet.view;
+	jobs.parallel_for(0, scene_items.size(), 1024, [&](std::size_t first, std::size_t last) {
+		std::copy(scene_items.begin() + first, scene_items.begin() + last, packet.draws.begin() + first);
+		for (std::size_t i = first; i < last; ++i)
+		{
+			const float *m = scene_items[i].model;
+			float distance = -(view[2] * m[12] + view[6] * m[13] + view[10] * m[14] + view[14]);
+			std::uint32_t depth = knu::graphics::sort_key::depth(distance, 100.0f);
+			commands[i] = { knu::graphics::sort_key::make(0, 0, scene_items[i].material, 0, depth), static_cast<std::uint32_t>(i) };
+		}
+	});
+	packet.queue.sort(jobs);
+	queue_stats = packet.queue.get_stats();
+}
+
+// Runs on whichever thread owns the context and must only read the packet.
+void main_app::draw_scene(const knu::graphics::frame_packet &packet)
+{
+	knu::profiler::get().resolve_gpu();
+	KNU_PROFILE_ZONE("draw_scene");
+	KNU_PROFILE_GPU_ZONE("draw_scene");
+
+	// the target only reallocates when the size crosses a power of two bucket
+	scene_target.ensure(packet.viewport_width, packet.viewport_height);
+	scene_target.bind();
+	glClearBufferfv(GL_COLOR, 0, packet.clear_color);
+	glClearBufferfv(GL_DEPTH, 0, &packet.clear_depth);
+
+	// Submission follows the sorted queue, a run at a time, binding only what its changed
+	// bits say differs from the previous run. Draw items carry ids but no gl objects yet,
+	// so the binds are counted rather than made and the run's draws are not issued.
+	std::uint64_t binds = 0;
+	packet.queue.execute([&binds](const knu::graphics::render_run &run) {
+		binds += (run.changed & knu::graphics::render_program_changed) != 0;
+		binds += (run.changed & knu::graphics::render_material_changed) != 0;
+		binds += (run.changed & knu::graphics::render_texture_changed) != 0;
+	});
+	state_binds.fetch_add(binds, std::memory_order_relaxed);
+
+	capture.frame(scene_target.obj(), packet.viewport_width, packet.viewport_height, packet.frame_index);
+	exporter.frame(scene_target.obj(), packet.viewport_width, packet.viewport_height, packet.frame_index);
+
+	// headless contexts have no default framebuffer to show, the target is the output
+	if (!window.is_headless())
+		scene_target.blit_to_default(packet.viewport_width, packet.viewport_height);
 }
 
 void main_app::update(knu_time seconds)
 {
+	KNU_PROFILE_ZONE("update");
 
 }
 
@@ -29,7 +90,7 @@ void main_app::load_shaders()
 
 }
 
-void main_app::process_messages(SDL_Event *event)
+void main_app::process_messages(const SDL_Event *event)
 {
 	switch (event->type)
 	{
@@ -53,6 +114,10 @@ void main_app::process_messages(SDL_Event *event)
 		{
 			if (event->key.keysym.sym == SDLK_ESCAPE)
 				window.set_quit(true);
+			else if (event->key.keysym.sym == SDLK_F11)
+				capture.is_recording() ? stop_capture() : start_capture();
+			else if (event->key.keysym.sym == SDLK_F12)
+				save_profile("profile");
 		}break;
             
         case SDL_QUIT:
@@ -65,9 +130,17 @@ void main_app::process_messages(SDL_Event *event)
 
 void main_app::resize(int w, int h)
 {
-	glViewport(0, 0, w, h);
-    //defaultProjectionMatrix = make_perspective<float>(degrees_to_radians(70.0f), static_cast<float>(w) / h, 0.1f, 100.0f);
-	//defaultOrthographicMatrix = make_ortho<float>(0.0f, (float)w, 0.0f, (float)h, 0.01f, 1000.0f);
+	// the viewport follows every event, projections wait for the size to settle
+	viewport_width = w;
+	viewport_height = h;
+	resizer.notify(w, h);
+}
+
+void main_app::update_projection(int w, int h)
+{
+	float aspect = h > 0 ? static_cast<float>(w) / h : 1.0f;
+	fill_perspective(perspective_matrix.data(), 70.0f, aspect, 0.1f, 100.0f);
+	fill_ortho(orthographic_matrix.data(), 0.0f, static_cast<float>(w), 0.0f, static_cast<float>(h), 0.01f, 1000.0f);
 }
 
 void main_app::get_window_size(int &w, int &h)
@@ -88,55 +161,201 @@ int main_app::window_height()
 	get_window_size(w, h);
 	return h;
 }
-main_app::main_app():
-	window(1024, 768, MAJOR_VERSION, MINOR_VERSION, false, 24, 0)
+main_app::main_app(bool headless, int width, int height):
+	simulation_clock(120.0, 8),
+	jobs((std::max)(2u, std::thread::hardware_concurrency()) - 1),	// leave a core to the render thread
+	queue_stats(),
+	state_binds(0),
+	threaded_rendering(true),
+	pipeline_depth(2),
+	frame_count(0),
+	frame_limit(0),
+	viewport_width(0),
+	viewport_height(0)
 {
-	window.set_event_callback(std::bind(&main_app::process_messages, this, std::placeholders::_1));
+	if (headless)
+		window.create_headless(width, height, MAJOR_VERSION, MINOR_VERSION, false);
+	else
+		window.create(width, height, MAJOR_VERSION, MINOR_VERSION, false, 24, 0);
+	window.set_event_queue(&events);
 	clearColorVal[0] = 0.1f; clearColorVal[1] = 0.2f; clearColorVal[2] = 0.4f; clearColorVal[3] = 1.0f;
 	clearDepthVal = 1.0f;
 
 }
 
+void main_app::set_frame_pacing(double target_fps, bool low_latency)
+{
+	double vsync_rate = 0.0;
+	if (target_fps == 0.0)
+	{
+		// vsync, adaptive or regular, paces presentation by itself and the pacer only needs
+		// the refresh period as its deadline. Only when the driver refuses any swap interval
+		// limit to the refresh rate rather than spin as fast as possible.
+		int refresh = window.get_refresh_rate();
+		double refresh_rate = refresh > 0 ? refresh : 60.0;
+		if (window.enable_adaptive_vsync() || window.set_swap_val(1))
+		{
+			target_fps = -1.0;
+			vsync_rate = refresh_rate;
+		}
+		else
+			target_fps = refresh_rate;
+	}
+
+	pacer.set_target_fps(target_fps > 0.0 ? target_fps : 0.0);
+	pacer.set_vsync_rate(vsync_rate);
+	pacer.set_low_latency(low_latency);
+}
+
+void main_app::set_threaded_rendering(bool enabled, int depth)
+{
+	threaded_rendering = enabled;
+	pipeline_depth = depth;
+}
+
+knu::timing_stats main_app::get_draw_stats()
+{
+	return threaded_rendering ? renderer.get_stats().render : draw_stats;
+}
+
+void main_app::set_simulation_rate(double hz, int max_substeps)
+{
+	simulation_clock.set_rate(hz);
+	simulation_clock.set_max_substeps(max_substeps);
+}
+
+void main_app::start_capture(const knu::graphics::capture_settings &settings)
+{
+	capture.start(settings);
+}
+
+void main_app::stop_capture()
+{
+	capture.stop();
+	knu::graphics::capture_stats s = capture.get_stats();
+	std::cout << "capture: " << s.encoded << " frames written, " << s.dropped_readback + s.dropped_memory << " dropped\n";
+}
+
+// Writes the last two seconds of zones as <base_name>.json (chrome trace) and .kprf.
+void main_app::save_profile(const std::string &base_name)
+{
+	std::uint64_t now = knu::profiler::now_ns();
+	knu::profile_capture capture = knu::profiler::get().capture(now > 2000000000ull ? now - 2000000000ull : 0);
+	knu::write_chrome_trace(base_name + ".json", capture);
+	knu::write_profile_binary(base_name + ".kprf", capture);
+	std::cout << "profile: " << capture.zones.size() << " zones written to " << base_name << ".json/.kprf\n";
+}
+
 int main_app::run()
 {
+	knu::profiler::get().set_thread_name("main");
 	last_time = current_time = std::chrono::steady_clock::now();
 	initialize_graphics();
     general_setup();
 
+	// a context that cannot be released cannot move to the render thread
+	if (threaded_rendering && !window.can_release_context())
+	{
+		std::cout << "render thread disabled, the headless context cannot be released\n";
+		threaded_rendering = false;
+	}
+
+	if (threaded_rendering)
+	{
+		window.release_context();
+		renderer.start(pipeline_depth,
+			[this]() { window.make_current(); knu::profiler::get().set_thread_name("render"); },
+			[this](const knu::graphics::frame_packet &packet) { draw_scene(packet); },
+			[this]() { window.swap_buffers(); },
+			[this]() { capture.release(); exporter.release(); scene_target.release(); knu::profiler::get().release_gpu(); window.release_context(); });
+	}
+
 	while (window.is_active())
 	{
+		pacer.begin_frame();
+		telemetry.begin_frame();
 		current_time = std::chrono::steady_clock::now();
 		window.poll_events();
+		events.drain([this](const knu::timed_event &e) { process_messages(&e.event); });
+
+		int settled_width, settled_height;
+		if (resizer.settle(settled_width, settled_height))
+			update_projection(settled_width, settled_height);
+
+		knu::frame_sample sample = {};
+
+		simulation_clock.accumulate(current_time - last_time);
+		while (simulation_clock.step())
+		{
+			auto start = std::chrono::steady_clock::now();
+			update(simulation_clock.step_duration<knu_time>());
+			update_stats.add(std::chrono::steady_clock::now() - start);
+			sample.update_ms += update_stats.last_ms;
+		}
 
-		update(current_time - last_time);
-		draw_scene();
+		auto build_start = std::chrono::steady_clock::now();
+		knu::graphics::frame_packet &packet = threaded_rendering ? renderer.begin_packet() : inline_packet;
+		build_frame(packet, simulation_clock.alpha());
+		build_stats.add(std::chrono::steady_clock::now() - build_start);
+		sample.build_ms = build_stats.last_ms;
+		sample.sort_ms = queue_stats.sort_ms;
+
+		if (threaded_rendering)
+			renderer.submit_packet();
+		else
+		{
+			auto draw_start = std::chrono::steady_clock::now();
+			draw_scene(packet);
+			draw_stats.add(std::chrono::steady_clock::now() - draw_start);
+		}
 
         last_time = current_time;
-		window.swap_buffers();
+		pacer.end_frame();
+		if (!threaded_rendering)
+			window.swap_buffers();
+		pacer.frame_presented();
+		sample.frame_ms = pacer.get_stats().interval_last_ms;
+
+		// with threaded rendering this is the latest frame the render thread finished
+		sample.draw_ms = get_draw_stats().last_ms;
+		if (frame_count > 1)
+			telemetry.add_frame(sample);
+
+		if (frame_limit && frame_count >= frame_limit)
+			window.set_quit(true);
 	}
 
+	if (threaded_rendering)
+	{
+		renderer.stop();
+		window.make_current();
+	}
+	else
+	{
+		capture.release();
+		exporter.release();
+		scene_target.release();
+		knu::profiler::get().release_gpu();
+	}
+	gl_debug.uninstall();
+
 	return 0;
 }
 
 void main_app::initialize_graphics()
 {
-#ifdef _WIN32
-	glDebugMessageCallback([](GLenum source, GLenum type, GLuint id, GLenum severity,
-		GLsizei length, const char *message, const void *user_param) {
-		std::string msg = std::string("source: ") + std::to_string(source) + "\n type: " + std::to_string(type)
-			+ "\n id: " + std::to_string(id) + "\n severity: " + std::to_string(severity)
-			+ "\n " + std::string(message) + "\n";
-
-#ifdef _WIN32
+	// asynchronous, rate limited and printed off the frame threads
+	if (gl_debug.install())
+		gl_debug.set_min_severity(GL_DEBUG_SEVERITY_LOW);
 
-#endif
-		std::cerr << msg << std::endl;
-
-	}, nullptr);
-	glEnable(GL_DEBUG_OUTPUT);
-	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
-#endif
 	int w, h; window.get_window_size(w, h);	resize(w, h);
+	resizer.settle(w, h);
+	update_projection(w, h);
+	// nothing to present to when headless, so run as fast as the gpu allows
+	if (window.is_headless())
+		set_frame_pacing(-1.0, false);
+	else
+		set_frame_pacing(0.0, true);
 }
 
 /*void APIENTRY debug_output1(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const char *message, const void *userParam)
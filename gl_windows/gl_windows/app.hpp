@@ -1,7 +1,20 @@
 #ifndef KNU_APP
 #define KNU_APP
 
+#include <atomic>
 #include <chrono>
+#include <string>
+#include <knu/fixed_timestep.hpp>
+#include <knu/event_queue.hpp>
+#include <knu/frame_capture.hpp>
+#include <knu/frame_export.hpp>
+#include <knu/frame_pacer.hpp>
+#include <knu/frame_stats.hpp>
+#include <knu/gl_debug.hpp>
+#include <knu/job_system.hpp>
+#include <knu/profiler.hpp>
+#include <knu/render_thread.hpp>
+#include <knu/resize_manager.hpp>
 #include <knu/window2.hpp>
 #include <knu/gl_utility.hpp>
 #include <knu/mathlibrary6.hpp>
@@ -16,33 +29,117 @@
 #define MAJOR_VERSION 3         // In sdl, for the time being, the only way to request a 4.1 context is
 #define MINOR_VERSION 2         // to request a 3.2 context on mac
 #endif
+#ifdef __linux__
+#define MAJOR_VERSION 4
+#define MINOR_VERSION 5
+#endif
 
 using knu_time = std::chrono::duration<float, std::ratio<1, 1000>>;
 
 class main_app
 {
 	window_class window;
+	knu::event_queue events;
 	std::chrono::steady_clock::time_point current_time, last_time;
+	knu::fixed_timestep simulation_clock;
+	knu::frame_pacer pacer;
+	knu::timing_stats update_stats;
+	knu::timing_stats build_stats;
+	knu::timing_stats draw_stats;
+	knu::frame_stats telemetry;
+	knu::graphics::gl_debug_sink gl_debug;
+	knu::job_system jobs;
+	knu::graphics::render_thread renderer;
+	knu::graphics::frame_packet inline_packet;
+	knu::graphics::render_queue_stats queue_stats;
+	std::atomic<std::uint64_t> state_binds;		// counted by draw_scene on the render thread
+	bool threaded_rendering;
+	int pipeline_depth;
+	std::uint64_t frame_count;
+	std::uint64_t frame_limit;		// quit after this many frames, 0 for no limit
+	std::vector<knu::graphics::draw_item> scene_items;	// simulation state, copied into each packet
+	int viewport_width, viewport_height;
+	knu::graphics::resize_manager resizer;
+	knu::graphics::render_target scene_target;		// gl thread only
+	knu::graphics::frame_capture capture;
+	knu::graphics::frame_export exporter;
 	float clearColorVal[4];
 	float clearDepthVal;
     knu::math::matrix4f perspective_matrix;
 	knu::math::matrix4f orthographic_matrix;
+	knu::math::matrix4f view_matrix;
 
 private:
 	void general_setup();
-	void draw_scene();
+	void build_frame(knu::graphics::frame_packet &packet, float alpha);
+	void draw_scene(const knu::graphics::frame_packet &packet);
 	void update(knu_time seconds);
 	void load_shaders();
 	void initialize_graphics();
-	void process_messages(SDL_Event *event);
+	void process_messages(const SDL_Event *event);
 	void resize(int w, int h);
+	void update_projection(int w, int h);
     void get_window_size(int &w, int &h);
 	int window_width();
 	int window_height();
 
 public:
-	main_app();
+	// A headless app renders into its offscreen target without a visible window, for batch
+	// rendering and performance runs on machines without a display.
+	main_app(bool headless = false, int width = 1024, int height = 768);
 	int run();
+
+	// Stops run() after the given number of frames, 0 runs until quit.
+	void set_frame_limit(std::uint64_t frames) { frame_limit = frames; }
+	bool is_headless() const { return window.is_headless(); }
+
+	// simulation ticks at a fixed rate (120 Hz by default) independent of the display
+	void set_simulation_rate(double hz, int max_substeps = 8);
+	const knu::timing_stats &get_update_stats() const { return update_stats; }
+	const knu::timing_stats &get_build_stats() const { return build_stats; }
+
+	// Sort time and state changes of the last frame's render queue, built with the packet.
+	const knu::graphics::render_queue_stats &get_queue_stats() const { return queue_stats; }
+	// Program, material and texture binds draw_scene needed walking the sorted runs, all frames.
+	std::uint64_t get_state_binds() const { return state_binds.load(std::memory_order_relaxed); }
+	knu::timing_stats get_draw_stats();
+	const knu::fixed_timestep &get_simulation_clock() const { return simulation_clock; }
+
+	// target_fps of 0 uses the display refresh rate when vsync is unavailable, a negative
+	// value disables the limiter. low_latency delays the frame start to just fit the deadline.
+	// Changes the swap interval, so call it while the context is current on this thread.
+	void set_frame_pacing(double target_fps, bool low_latency);
+
+	// Call before run(). When enabled the gl context moves to a render thread that draws
+	// frame packets while the simulation builds the next ones, up to depth frames ahead.
+	void set_threaded_rendering(bool enabled, int depth = 2);
+	knu::graphics::render_thread_stats get_render_stats() { return renderer.get_stats(); }
+	const knu::pacing_stats &get_pacing_stats() const { return pacer.get_stats(); }
+
+	// How long input waits between polling and handling, and how much coalescing saved.
+	knu::event_queue_stats get_event_stats() const { return events.get_stats(); }
+
+	// Rolling p50/p95/p99/max of frame, update, build and draw times and the hitches seen.
+	// Summaries go to frame_stats.log every 10 seconds, hitch profiles to hitch_<frame>.kprf.
+	const knu::frame_stats &get_telemetry() const { return telemetry; }
+
+	// Records every frame of the scene target to image files, also toggled with F11.
+	// Frames are dropped rather than stalling when readback or encoding falls behind.
+	void start_capture(const knu::graphics::capture_settings &settings = knu::graphics::capture_settings());
+	void stop_capture();
+	knu::graphics::capture_stats get_capture_stats() const { return capture.get_stats(); }
+
+	// Publishes every frame to a shared memory ring that local processes read with
+	// knu::shared_frame_reader. Readers that fall behind skip frames, rendering never waits.
+	void start_export(const knu::graphics::export_settings &settings = knu::graphics::export_settings()) { exporter.start(settings); }
+	void stop_export() { exporter.stop(); }
+	knu::graphics::export_stats get_export_stats() { return exporter.get_stats(); }
+
+	// Saves recent cpu and gpu zones, also bound to F12.
+	void save_profile(const std::string &base_name);
+
+	// Shared by update and build_frame; the main thread works through jobs while it waits.
+	knu::job_system &get_jobs() { return jobs; }
 };
 
 #endif
\ No newline at end of file
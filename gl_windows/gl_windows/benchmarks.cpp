@@ -0,0 +1,739 @@
+#include "benchmarks.hpp"
+#include <knu/image4.hpp>
+#include <knu/image_container.hpp>
+#include <knu/instancing.hpp>
+#include <knu/job_system.hpp>
+#include <knu/mesh_file.hpp>
+#include <knu/mesh_optimizer.hpp>
+#include <knu/mesh_simplifier.hpp>
+#include <knu/meshlet.hpp>
+#include <knu/obj_converter.hpp>
+#include <knu/profiler.hpp>
+#include <knu/render_queue.hpp>
+#include <knu/shared_frame_ring.hpp>
+#include <knu/texture_atlas.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace knu::graphics;
+
+namespace
+{
+	using bench_args = std::vector<std::string>;
+
+	// average milliseconds per call of fn over the given iterations
+	template<typename f>
+	double time_ms(int iterations, f fn)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; ++i)
+			fn();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / iterations;
+	}
+
+	// reads one byte per page so the mapped benchmarks pay for their page faults too
+	unsigned touch(const unsigned char *data, std::size_t size)
+	{
+		unsigned sum = 0;
+		for (std::size_t i = 0; i < size; i += 4096)
+			sum += data[i];
+		return sum;
+	}
+
+	int container_load(const bench_args &args)
+	{
+		if (args.size() < 2)
+		{
+			std::cout << "usage: container_load <image.png> <image.ktx2|image.dds> [iterations]\n";
+			return 1;
+		}
+
+		int iterations = args.size() > 2 ? std::stoi(args[2]) : 20;
+		unsigned sink = 0;
+		std::size_t png_bytes = 0, container_bytes = 0;
+
+		double png_ms = time_ms(iterations, [&]() {
+			image img;
+			img.load_image(args[0]);
+			png_bytes = img.get_size();
+			sink += touch(img.get_data(), png_bytes);
+		});
+
+		double container_ms = time_ms(iterations, [&]() {
+			image_container c(args[1]);
+			container_bytes = 0;
+			for (const auto &s : c.get_spans())
+			{
+				container_bytes += s.size;
+				sink += touch(s.data, s.size);
+			}
+		});
+
+		std::cout << "png decode:       " << png_ms << " ms (" << png_bytes << " bytes, level 0 only)\n"
+			<< "container mapped: " << container_ms << " ms (" << container_bytes << " bytes, all levels)\n"
+			<< "speedup:          " << png_ms / container_ms << "x\n"
+			<< "(checksum " << sink << ")\n";
+		return 0;
+	}
+
+	int atlas_pack(const bench_args &args)
+	{
+		int count = args.size() > 0 ? std::stoi(args[0]) : 5000;
+		unsigned seed = args.size() > 1 ? static_cast<unsigned>(std::stoul(args[1])) : 1234u;
+
+		// sprite sized rectangles, a mix of tiny icons and larger ui pieces
+		std::mt19937 rng(seed);
+		std::vector<std::pair<int, int>> sizes(count);
+		for (auto &s : sizes)
+		{
+			int scale = (rng() % 8 == 0) ? 128 : 32;
+			s.first = 4 + static_cast<int>(rng() % scale);
+			s.second = 4 + static_cast<int>(rng() % scale);
+		}
+
+		atlas_settings settings;
+		atlas_layout layout;
+		double ms = time_ms(10, [&]() { layout = pack_atlas(sizes, settings); });
+
+		std::cout << "sprites:      " << count << "\n"
+			<< "pages:        " << layout.pages << " (" << settings.page_width << "x" << settings.page_height
+			<< ", padding " << settings.padding << ")\n"
+			<< "efficiency:   " << layout.efficiency * 100.0 << " %\n"
+			<< "pack time:    " << ms << " ms\n"
+			<< "binds:        " << count << " -> " << layout.pages << " separate pages, 1 as a 2d array\n";
+		return 0;
+	}
+
+	// Throughput of the job system from one thread up to every hardware thread: a data
+	// parallel loop, then a flood of tiny jobs that mostly measures scheduling overhead.
+	int job_scaling(const bench_args &args)
+	{
+		std::size_t elements = args.size() > 0 ? std::stoul(args[0]) : 1u << 22;
+		int tiny_jobs = args.size() > 1 ? std::stoi(args[1]) : 100000;
+		unsigned max_threads = (std::max)(1u, std::thread::hardware_concurrency());
+
+		std::vector<float> data(elements);
+		double single_ms = 0.0;
+
+		std::cout << "threads  loop ms  speedup  tiny jobs/s  steals\n";
+		for (unsigned threads = 1; threads <= max_threads; ++threads)
+		{
+			knu::job_system jobs(threads);
+
+			double loop_ms = time_ms(5, [&]() {
+				jobs.parallel_for(0, elements, 4096, [&](std::size_t first, std::size_t last) {
+					for (std::size_t i = first; i < last; ++i)
+					{
+						float x = static_cast<float>(i) * 0.001f;
+						data[i] = std::sin(x) * std::cos(x * 0.5f) + std::sqrt(x);
+					}
+				});
+			});
+			if (threads == 1)
+				single_ms = loop_ms;
+
+			std::atomic<int> sink(0);
+			double tiny_ms = time_ms(1, [&]() {
+				knu::job_counter counter;
+				for (int i = 0; i < tiny_jobs; ++i)
+					jobs.run([&sink]() { sink.fetch_add(1, std::memory_order_relaxed); }, &counter);
+				jobs.wait(counter);
+			});
+
+			std::uint64_t steals = 0;
+			for (unsigned w = 0; w < threads; ++w)
+				steals += jobs.get_stolen(static_cast<int>(w));
+
+			std::cout << threads << "\t " << loop_ms << "\t  " << single_ms / loop_ms << "x\t   "
+				<< static_cast<std::uint64_t>(tiny_jobs / (tiny_ms / 1000.0)) << "\t" << steals << "\n";
+		}
+		return 0;
+	}
+
+	// Grouping and packing cost only, the part that grows with the instance count; the gl
+	// side is the same few draw calls whatever the count.
+	int instancing(const bench_args &args)
+	{
+		std::size_t max_instances = args.size() > 0 ? std::stoul(args[0]) : 1000000;
+		int mesh_count = args.size() > 1 ? std::stoi(args[1]) : 64;
+		int material_count = args.size() > 2 ? std::stoi(args[2]) : 8;
+		unsigned threads = args.size() > 3 ? static_cast<unsigned>(std::stoul(args[3])) : 0u;
+
+		knu::job_system jobs(threads);
+		std::mt19937 rng(7);
+		std::uniform_real_distribution<float> place(-50.0f, 50.0f), scale(0.5f, 2.0f);
+
+		std::vector<draw_item> items(max_instances);
+		for (auto &item : items)
+		{
+			float s = scale(rng);
+			const float model[16] = { s, 0.0f, 0.0f, 0.0f, 0.0f, s, 0.0f, 0.0f, 0.0f, 0.0f, s * 0.5f, 0.0f,
+				place(rng), place(rng), place(rng), 1.0f };
+			std::copy(model, model + 16, item.model);
+			item.mesh = static_cast<std::uint32_t>(rng() % mesh_count);
+			item.material = static_cast<std::uint32_t>(rng() % material_count);
+		}
+
+		instance_batcher batcher;
+		std::vector<instance_data> out(max_instances);
+
+		std::cout << "instances  draw calls  serial ms  " << jobs.get_thread_count() << " thr ms   MB\n";
+		for (std::size_t count = 1000; count <= max_instances; count *= 10)
+		{
+			int iterations = static_cast<int>((std::max)(std::size_t(1), 1000000 / count));
+			double serial_ms = time_ms(iterations, [&]() {
+				batcher.build(items.data(), count);
+				batcher.write(out.data());
+			});
+			double parallel_ms = time_ms(iterations, [&]() {
+				batcher.build(items.data(), count);
+				batcher.write(jobs, out.data());
+			});
+
+			std::cout << std::setw(9) << count << std::setw(12) << batcher.get_batches().size()
+				<< std::setw(11) << std::fixed << std::setprecision(3) << serial_ms
+				<< std::setw(11) << parallel_ms
+				<< std::setw(8) << std::setprecision(1) << count * sizeof(instance_data) / 1048576.0 << "\n";
+			std::cout.unsetf(std::ios::floatfield);
+		}
+		return 0;
+	}
+
+	// Cost of an empty cpu zone, enabled and disabled at run time.
+	int profiler_overhead(const bench_args &args)
+	{
+		int zones = args.size() > 0 ? std::stoi(args[0]) : 10000000;
+		knu::profiler &p = knu::profiler::get();
+
+		auto run_zones = [zones]() {
+			for (int i = 0; i < zones; ++i)
+			{
+				KNU_PROFILE_ZONE("bench");
+			}
+		};
+
+		p.set_enabled(false);
+		double disabled_ms = time_ms(1, run_zones);
+		p.set_enabled(true);
+		run_zones();	// registers this thread's ring and warms it
+		double enabled_ms = time_ms(1, run_zones);
+
+		std::cout << "zones:     " << zones << "\n"
+			<< "enabled:   " << enabled_ms * 1e6 / zones << " ns/zone\n"
+			<< "disabled:  " << disabled_ms * 1e6 / zones << " ns/zone\n"
+			<< "captured:  " << p.capture().zones.size() << " (ring holds " << knu::zone_ring::capacity << " per thread)\n";
+		return 0;
+	}
+
+	// Shared memory frame ring at 1080p and 4K: a writer publishes frames as fast as it can,
+	// or at target_fps, while a reader opens the ring by name, the way another process
+	// would, and copies out every frame it can. Latency is publish to acquire.
+	int shm_export(const bench_args &args)
+	{
+		double seconds = args.size() > 0 ? std::stod(args[0]) : 3.0;
+		std::uint32_t slots = args.size() > 1 ? static_cast<std::uint32_t>(std::stoul(args[1])) : 4u;
+		double target_fps = args.size() > 2 ? std::stod(args[2]) : 0.0;
+		const std::pair<std::uint32_t, std::uint32_t> sizes[] = { { 1920, 1080 }, { 3840, 2160 } };
+
+		std::cout << "size       written fps  read fps  skipped  latency avg/max ms  GB/s\n";
+		for (const auto &size : sizes)
+		{
+			std::string name = "knu_bench_frames";
+			knu::shared_frame_writer writer(name, slots, size.first, size.second);
+			std::vector<unsigned char> source(static_cast<std::size_t>(size.first) * size.second * 4, 0x80);
+
+			knu::shared_frame_reader reader;
+			if (!reader.open(name))
+				throw std::runtime_error("Unable to open the frame ring");
+
+			std::atomic<bool> done(false);
+			std::thread consumer([&]() {
+				std::vector<unsigned char> pixels;
+				knu::shared_frame frame;
+				while (!done.load(std::memory_order_acquire))
+					if (!reader.read(pixels, frame))
+						std::this_thread::yield();
+			});
+
+			auto start = std::chrono::steady_clock::now();
+			auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+			auto next_frame = start;
+			std::uint64_t frame = 0;
+			while (std::chrono::steady_clock::now() < deadline)
+			{
+				source[frame % source.size()] = static_cast<unsigned char>(frame);
+				writer.write(source.data(), size.first, size.second, frame++);
+				if (target_fps > 0.0)
+				{
+					next_frame += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / target_fps));
+					std::this_thread::sleep_until(next_frame);
+				}
+			}
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			// let the reader catch the last frame before it stops
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			done.store(true, std::memory_order_release);
+			consumer.join();
+
+			const knu::shared_frame_reader_stats &r = reader.get_stats();
+			std::cout << size.first << "x" << size.second << "  " << writer.get_stats().published / elapsed << "\t   "
+				<< r.received / elapsed << "\t   " << r.skipped << "\t    "
+				<< (r.received ? r.latency_ms_total / r.received : 0.0) << " / " << r.latency_ms_max << "\t"
+				<< writer.get_stats().bytes / elapsed / 1e9 << "\n";
+		}
+		return 0;
+	}
+
+	struct mesh_vertex
+	{
+		float position[3];
+		float normal[3];
+		float uv[2];
+	};
+
+	// A torus written out the way a careless exporter would: three vertices per triangle
+	// and the triangles in random order.
+	std::vector<mesh_vertex> scrambled_torus(int segments, unsigned seed)
+	{
+		const float pi = 3.14159265f, major = 1.0f, minor = 0.35f;
+		auto corner = [&](int i, int j) {
+			float u = 2.0f * pi * i / segments, v = 2.0f * pi * j / segments;
+			mesh_vertex m;
+			m.normal[0] = std::cos(u) * std::cos(v);
+			m.normal[1] = std::sin(u) * std::cos(v);
+			m.normal[2] = std::sin(v);
+			m.position[0] = std::cos(u) * major + m.normal[0] * minor;
+			m.position[1] = std::sin(u) * major + m.normal[1] * minor;
+			m.position[2] = m.normal[2] * minor;
+			m.uv[0] = static_cast<float>(i % segments) / segments;
+			m.uv[1] = static_cast<float>(j % segments) / segments;
+			return m;
+		};
+
+		std::vector<std::array<mesh_vertex, 3>> triangles;
+		for (int i = 0; i < segments; ++i)
+			for (int j = 0; j < segments; ++j)
+			{
+				mesh_vertex a = corner(i, j), b = corner(i + 1, j), c = corner(i + 1, j + 1), d = corner(i, j + 1);
+				triangles.push_back({ { a, b, c } });
+				triangles.push_back({ { a, c, d } });
+			}
+
+		std::mt19937 rng(seed);
+		std::shuffle(triangles.begin(), triangles.end(), rng);
+		std::vector<mesh_vertex> vertices;
+		vertices.reserve(triangles.size() * 3);
+		for (const auto &t : triangles)
+		{
+			int r = static_cast<int>(rng() % 3);	// rotating the corners keeps the winding
+			for (int k = 0; k < 3; ++k)
+				vertices.push_back(t[(k + r) % 3]);
+		}
+		return vertices;
+	}
+
+	int mesh_optimize(const bench_args &args)
+	{
+		int segments = args.size() > 0 ? std::stoi(args[0]) : 256;
+		unsigned seed = args.size() > 1 ? static_cast<unsigned>(std::stoul(args[1])) : 1u;
+
+		std::vector<mesh_vertex> vertices = scrambled_torus(segments, seed);
+		std::vector<std::uint32_t> indices;
+		std::vector<knu::math::vector3f> positions;
+
+		auto report = [&](const char *step, double ms) {
+			positions.clear();
+			positions.reserve(vertices.size());
+			for (const auto &v : vertices)
+				positions.emplace_back(v.position[0], v.position[1], v.position[2]);
+
+			vertex_cache_stats fifo16 = analyze_vertex_cache(indices, vertices.size(), 16);
+			vertex_cache_stats fifo32 = analyze_vertex_cache(indices, vertices.size(), 32);
+			overdraw_stats overdraw = analyze_overdraw(indices, positions);
+			vertex_fetch_stats fetch = analyze_vertex_fetch(indices, vertices.size(), sizeof(mesh_vertex));
+
+			std::cout << std::left << std::setw(10) << step << std::right << std::fixed << std::setprecision(3)
+				<< std::setw(10) << ms
+				<< std::setw(9) << vertices.size()
+				<< std::setw(8) << fifo16.acmr << std::setw(8) << fifo16.atvr
+				<< std::setw(8) << fifo32.acmr << std::setw(8) << fifo32.atvr
+				<< std::setw(10) << overdraw.overdraw
+				<< std::setw(10) << fetch.overfetch << "\n";
+		};
+
+		std::cout << segments * segments * 2 << " triangles\n"
+			<< "step            ms vertices  acmr16  atvr16  acmr32  atvr32  overdraw overfetch\n";
+
+		// unindexed input is its own index buffer
+		indices.resize(vertices.size());
+		for (std::size_t i = 0; i < indices.size(); ++i)
+			indices[i] = static_cast<std::uint32_t>(i);
+		report("input", 0.0);
+
+		double ms = time_ms(1, [&]() { weld_vertices(vertices, indices); });
+		report("weld", ms);
+
+		ms = time_ms(1, [&]() { optimize_vertex_cache(indices, vertices.size()); });
+		report("cache", ms);
+
+		ms = time_ms(1, [&]() { optimize_overdraw(indices, positions, 1.05f); });
+		report("overdraw", ms);
+
+		ms = time_ms(1, [&]() { optimize_vertex_fetch(vertices, indices); });
+		report("fetch", ms);
+		return 0;
+	}
+
+	// perspective * look_at(eye, origin, +z up) as 16 column major floats
+	void orbit_view_projection(float *out, const float eye[3], float fov_y_degrees, float aspect)
+	{
+		float f[3] = { -eye[0], -eye[1], -eye[2] };
+		float fl = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+		for (float &c : f)
+			c /= fl;
+		float up[3] = { 0.0f, 0.0f, 1.0f };
+		float s[3] = { f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2], f[0] * up[1] - f[1] * up[0] };
+		float sl = std::sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+		for (float &c : s)
+			c /= sl;
+		float u[3] = { s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0] };
+
+		float view[16] = {
+			s[0], u[0], -f[0], 0.0f,
+			s[1], u[1], -f[1], 0.0f,
+			s[2], u[2], -f[2], 0.0f,
+			-(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]),
+			-(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]),
+			f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2], 1.0f };
+		float projection[16];
+		knu::math::fill_perspective(projection, fov_y_degrees, aspect, 0.1f, 100.0f);
+
+		for (int c = 0; c < 4; ++c)
+			for (int r = 0; r < 4; ++r)
+			{
+				float sum = 0.0f;
+				for (int k = 0; k < 4; ++k)
+					sum += projection[k * 4 + r] * view[c * 4 + k];
+				out[c * 4 + r] = sum;
+			}
+	}
+
+	int meshlet_cull(const bench_args &args)
+	{
+		int segments = args.size() > 0 ? std::stoi(args[0]) : 512;
+		int views = args.size() > 1 ? std::stoi(args[1]) : 64;
+		unsigned threads = args.size() > 2 ? static_cast<unsigned>(std::stoul(args[2])) : 0u;
+
+		std::vector<mesh_vertex> vertices = scrambled_torus(segments, 1u);
+		std::vector<std::uint32_t> indices;
+		weld_vertices(vertices, indices);
+		optimize_vertex_cache(indices, vertices.size());
+
+		std::vector<knu::math::vector3f> positions;
+		positions.reserve(vertices.size());
+		for (const auto &v : vertices)
+			positions.emplace_back(v.position[0], v.position[1], v.position[2]);
+
+		meshlet_data data;
+		double build_ms = time_ms(1, [&]() { build_meshlets(indices, positions, data); });
+
+		double vertex_sum = 0.0, triangle_sum = 0.0;
+		std::size_t coned = 0;
+		for (std::size_t i = 0; i < data.meshlets.size(); ++i)
+		{
+			vertex_sum += data.meshlets[i].vertex_count;
+			triangle_sum += data.meshlets[i].triangle_count;
+			coned += data.bounds[i].cone_cutoff < 1.0f;
+		}
+		std::cout << indices.size() / 3 << " triangles, " << data.meshlets.size() << " meshlets built in " << build_ms << " ms\n"
+			<< "average " << vertex_sum / data.meshlets.size() << " vertices, " << triangle_sum / data.meshlets.size() << " triangles, "
+			<< 100.0 * coned / data.meshlets.size() << "% with a usable cone\n";
+
+		// the eye circles the torus at a few heights, inside and outside the ring
+		std::vector<meshlet_view> cameras(views);
+		for (int i = 0; i < views; ++i)
+		{
+			float angle = 6.2831853f * i / views;
+			float distance = i % 3 == 0 ? 0.5f : 2.5f + (i % 4);
+			float eye[3] = { std::cos(angle) * distance, std::sin(angle) * distance, 0.4f * ((i % 5) - 2) };
+			if (distance < 1.0f)
+				eye[2] = 0.05f;
+			float view_projection[16];
+			orbit_view_projection(view_projection, eye, 60.0f, 16.0f / 9.0f);
+			make_meshlet_view(cameras[i], view_projection, eye[0], eye[1], eye[2]);
+		}
+
+		knu::job_system jobs(threads);
+		meshlet_culler culler;
+		std::vector<draw_elements_indirect_command> commands;
+		std::size_t triangles = 0, culled = 0, frustum = 0, cone = 0, draws = 0;
+		const int iterations = 20;
+
+		auto run = [&](bool parallel) {
+			triangles = culled = frustum = cone = draws = 0;
+			return time_ms(iterations, [&]() {
+				for (const auto &camera : cameras)
+				{
+					commands.clear();
+					if (parallel)
+						culler.cull(jobs, data, camera, commands);
+					else
+						culler.cull(data, camera, commands);
+					meshlet_cull_stats s = culler.get_stats();
+					triangles += s.triangles;
+					culled += s.triangles - s.triangles_visible;
+					frustum += s.frustum_culled;
+					cone += s.cone_culled;
+					draws += s.commands;
+				}
+			});
+		};
+
+		for (int parallel = 0; parallel < 2; ++parallel)
+		{
+			double ms = run(parallel != 0);
+			double passes = static_cast<double>(iterations) * views;
+			std::cout << (parallel ? "job system (" : "serial (") << (parallel ? jobs.get_thread_count() : 1) << " threads):\n"
+				<< "  " << ms / views * 1000.0 << " us per view, " << culled / (ms * iterations) << " triangles culled per ms\n"
+				<< "  " << 100.0 * culled / triangles << "% triangles culled, "
+				<< frustum / passes << " meshlets outside, " << cone / passes << " backfacing, "
+				<< draws / passes << " indirect commands per view\n";
+		}
+		return 0;
+	}
+
+	int mesh_simplify(const bench_args &args)
+	{
+		int mesh_count = args.size() > 0 ? std::stoi(args[0]) : 8;
+		int segments = args.size() > 1 ? std::stoi(args[1]) : 128;
+		unsigned threads = args.size() > 2 ? static_cast<unsigned>(std::stoul(args[2])) : 0u;
+
+		lod_settings settings;
+		settings.levels = 8;
+		settings.attribute_weights = { 0.5f, 0.5f, 0.5f, 0.25f, 0.25f };	// normal, uv
+
+		std::vector<lod_mesh> meshes(mesh_count);
+		for (int m = 0; m < mesh_count; ++m)
+		{
+			std::vector<mesh_vertex> vertices = scrambled_torus(segments + m * 8, static_cast<unsigned>(m + 1));
+			weld_vertices(vertices, meshes[m].indices);
+			optimize_vertex_cache(meshes[m].indices, vertices.size());
+
+			meshes[m].positions.reserve(vertices.size());
+			for (const auto &v : vertices)
+			{
+				meshes[m].positions.emplace_back(v.position[0], v.position[1], v.position[2]);
+				meshes[m].attributes.insert(meshes[m].attributes.end(), v.normal, v.normal + 3);
+				meshes[m].attributes.insert(meshes[m].attributes.end(), v.uv, v.uv + 2);
+			}
+		}
+
+		double serial_ms = time_ms(1, [&]() {
+			for (auto &mesh : meshes)
+				build_lods(mesh, settings);
+		});
+
+		knu::job_system jobs(threads);
+		double parallel_ms = time_ms(1, [&]() { build_lods(jobs, meshes, settings); });
+
+		std::cout << mesh_count << " meshes, " << serial_ms << " ms serial, " << parallel_ms << " ms on "
+			<< jobs.get_thread_count() << " threads (" << serial_ms / parallel_ms << "x)\n\n"
+			<< "level triangles   error\n";
+		const lod_mesh &first = meshes[0];
+		for (std::size_t i = 0; i < first.levels.size(); ++i)
+			std::cout << std::setw(5) << i << std::setw(10) << first.levels[i].indices.size() / 3
+				<< std::setw(10) << std::fixed << std::setprecision(5) << first.levels[i].error << "\n";
+
+		// what the app's projection would pick at 768 lines with a one pixel budget
+		float projection[16];
+		knu::math::fill_perspective(projection, 70.0f, 4.0f / 3.0f, 0.1f, 100.0f);
+		std::cout << "\ndistance level triangles\n";
+		for (float distance = 0.25f; distance <= 64.0f; distance *= 2.0f)
+		{
+			std::size_t level = select_lod(first.levels, distance, projection, 768.0f);
+			std::cout << std::setw(8) << std::setprecision(2) << distance << std::setw(6) << level
+				<< std::setw(10) << first.levels[level].indices.size() / 3 << "\n";
+		}
+		return 0;
+	}
+
+	// the scrambled torus as text, welded so it looks like a typical exporter's output
+	void write_torus_obj(const std::string &name, int segments)
+	{
+		std::vector<mesh_vertex> vertices = scrambled_torus(segments, 1u);
+		std::vector<std::uint32_t> indices;
+		weld_vertices(vertices, indices);
+
+		std::ofstream out(name);
+		out << std::fixed << std::setprecision(6) << "usemtl torus\n";
+		for (const auto &v : vertices)
+			out << "v " << v.position[0] << " " << v.position[1] << " " << v.position[2] << "\n";
+		for (const auto &v : vertices)
+			out << "vt " << v.uv[0] << " " << v.uv[1] << "\n";
+		for (const auto &v : vertices)
+			out << "vn " << v.normal[0] << " " << v.normal[1] << " " << v.normal[2] << "\n";
+		for (std::size_t i = 0; i < indices.size(); i += 3)
+		{
+			out << "f";
+			for (int k = 0; k < 3; ++k)
+				out << " " << indices[i + k] + 1 << "/" << indices[i + k] + 1 << "/" << indices[i + k] + 1;
+			out << "\n";
+		}
+	}
+
+	int mesh_load(const bench_args &args)
+	{
+		std::string obj_name = args.size() > 0 ? args[0] : "mesh_load.obj";
+		int iterations = args.size() > 1 ? std::stoi(args[1]) : 5;
+		if (args.empty())
+			write_torus_obj(obj_name, 256);
+		std::string mesh_name = obj_name + ".kmsh";
+
+		knu::job_system jobs;
+		obj_mesh parsed;
+		double serial_ms = time_ms(iterations, [&]() { parse_obj(obj_name, parsed); });
+		double parallel_ms = time_ms(iterations, [&]() { parse_obj(jobs, obj_name, parsed); });
+		double bake_ms = time_ms(1, [&]() { write_obj_mesh(mesh_name, parsed); });
+
+		// opening plus reading every page, which is what the upload would do
+		unsigned sink = 0;
+		std::size_t bytes = 0;
+		double mapped_ms = time_ms(iterations, [&]() {
+			mesh_file mesh(mesh_name);
+			sink += touch(mesh.vertex_data(), mesh.vertex_bytes());
+			sink += touch(mesh.index_data(), mesh.index_bytes());
+			bytes = mesh.vertex_bytes() + mesh.index_bytes();
+		});
+
+		std::cout << parsed.vertices.size() << " vertices, " << parsed.indices.size() / 3 << " triangles, "
+			<< parsed.submeshes.size() << " submeshes\n"
+			<< "obj parse:          " << serial_ms << " ms\n"
+			<< "obj parse (" << jobs.get_thread_count() << " thr): " << parallel_ms << " ms\n"
+			<< "bake:               " << bake_ms << " ms\n"
+			<< "kmsh mapped:        " << mapped_ms << " ms (" << bytes << " bytes)\n"
+			<< "speedup:            " << (std::min)(serial_ms, parallel_ms) / mapped_ms << "x\n"
+			<< "(checksum " << sink << ")\n";
+		return 0;
+	}
+
+	// A scene's worth of draws in submission order: a few layers, programs shared by many
+	// materials, and textures that mostly follow the material.
+	int render_sort(const bench_args &args)
+	{
+		std::size_t count = args.size() > 0 ? std::stoul(args[0]) : 1000000;
+		int iterations = args.size() > 1 ? std::stoi(args[1]) : 10;
+		unsigned threads = args.size() > 2 ? static_cast<unsigned>(std::stoul(args[2])) : 0u;
+
+		knu::job_system jobs(threads);
+		std::mt19937 rng(11);
+		std::uniform_real_distribution<float> distance(0.1f, 100.0f);
+		std::vector<std::uint64_t> keys(count);
+		for (auto &key : keys)
+		{
+			std::uint32_t material = rng() % 2000;
+			std::uint32_t texture = rng() % 8 ? material % 1024 : rng() % 1024;
+			std::uint32_t layer = rng() % 10 ? 0 : 1 + rng() % 2;
+			key = sort_key::make(layer, material % 24, material, texture, sort_key::depth(distance(rng), 100.0f, layer == 2));
+		}
+
+		render_queue queue;
+		auto fill = [&]() {
+			queue.clear();
+			for (std::size_t i = 0; i < count; ++i)
+				queue.push(keys[i], static_cast<std::uint32_t>(i));
+		};
+
+		double serial_ms = 0.0, parallel_ms = 0.0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			fill();
+			queue.sort();
+			serial_ms += queue.get_stats().sort_ms;
+			fill();
+			queue.sort(jobs);
+			parallel_ms += queue.get_stats().sort_ms;
+		}
+
+		std::vector<render_command> reference(queue.get_commands().size());
+		double std_ms = time_ms(iterations, [&]() {
+			for (std::size_t i = 0; i < count; ++i)
+				reference[i] = render_command{ keys[i], static_cast<std::uint32_t>(i) };
+			std::stable_sort(reference.begin(), reference.end(), [](const render_command &a, const render_command &b) { return a.key < b.key; });
+		});
+
+		std::size_t draws = 0, binds = 0;
+		queue.execute([&](const render_run &run) {
+			draws += run.count;
+			for (unsigned bit = run.changed; bit; bit &= bit - 1)
+				++binds;
+		});
+
+		const render_queue_stats &s = queue.get_stats();
+		std::cout << count << " draws, " << s.sort_passes << " radix passes\n"
+			<< "radix sort:          " << serial_ms / iterations << " ms\n"
+			<< "radix sort (" << jobs.get_thread_count() << " thr):  " << parallel_ms / iterations << " ms\n"
+			<< "std::stable_sort:    " << std_ms << " ms\n"
+			<< "state changes:       " << s.unsorted_changes << " unsorted, "
+			<< s.program_changes + s.material_changes + s.texture_changes << " sorted ("
+			<< s.program_changes << " program, " << s.material_changes << " material, " << s.texture_changes << " texture)\n"
+			<< "runs:                " << s.runs << " (" << binds << " binds for " << draws << " draws)\n";
+		return 0;
+	}
+
+	const std::map<std::string, std::function<int(const bench_args &)>> &benchmarks()
+	{
+		static const std::map<std::string, std::function<int(const bench_args &)>> table =
+		{
+			{ "atlas_pack", atlas_pack },
+			{ "container_load", container_load },
+			{ "instancing", instancing },
+			{ "job_scaling", job_scaling },
+			{ "mesh_load", mesh_load },
+			{ "mesh_optimize", mesh_optimize },
+			{ "mesh_simplify", mesh_simplify },
+			{ "meshlet_cull", meshlet_cull },
+			{ "profiler_overhead", profiler_overhead },
+			{ "render_sort", render_sort },
+			{ "shm_export", shm_export },
+		};
+		return table;
+	}
+}
+
+int run_benchmark(int argc, char *argv[])
+{
+	const auto &table = benchmarks();
+
+	if (argc < 1 || table.find(argv[0]) == table.end())
+	{
+		std::cout << "available benchmarks:\n";
+		for (const auto &b : table)
+			std::cout << "  " << b.first << "\n";
+		return 1;
+	}
+
+	bench_args args(argv + 1, argv + argc);
+	try
+	{
+		return table.at(argv[0])(args);
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,8 @@
+#ifndef KNU_BENCHMARKS
+#define KNU_BENCHMARKS
+
+// Entry point for "gl_windows --bench <name> [args...]". Each benchmark prints its own
+// results to std::cout and returns a process exit code.
+int run_benchmark(int argc, char *argv[]);
+
+#endif
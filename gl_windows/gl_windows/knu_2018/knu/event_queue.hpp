@@ -0,0 +1,225 @@
+#ifndef KNU_EVENT_QUEUE_HPP
+#define KNU_EVENT_QUEUE_HPP
+
+#ifdef _WIN32
+#include <SDL.h>
+#undef main
+#endif
+
+#if defined(__APPLE__) || defined(__linux__)
+#include <SDL2/SDL.h>
+#endif
+
+#include <knu/fixed_timestep.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace knu
+{
+	struct timed_event
+	{
+		SDL_Event event;
+		std::uint64_t polled_ns;		// steady_clock when it left SDL
+		std::uint32_t sdl_age_ms;		// how long SDL held it before it was polled
+		std::uint32_t merged;			// events coalesced into this one, 0 if none
+	};
+
+	struct event_queue_stats
+	{
+		std::uint64_t pushed;
+		std::uint64_t coalesced;
+		std::uint64_t dropped;			// queue was full
+		timing_stats latency;			// poll to consume, measured by the consumer
+	};
+
+	// Fixed capacity single producer, single consumer queue between the thread polling SDL
+	// and whoever handles input. Runs of mouse motion and of resize events are merged
+	// before they are published, so a storm costs one slot per run instead of one per event.
+	class event_queue
+	{
+		std::unique_ptr<timed_event[]> slots;
+		std::size_t mask;
+		std::atomic<std::uint64_t> produced;
+		std::atomic<std::uint64_t> consumed;
+
+		// producer side
+		timed_event staged;
+		bool has_staged;
+		std::atomic<std::uint64_t> coalesced;
+		std::atomic<std::uint64_t> dropped;
+
+		// consumer side
+		timing_stats latency;
+
+	private:
+		static std::uint64_t now_ns()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		static bool is_coalescable(const SDL_Event &e)
+		{
+			return e.type == SDL_MOUSEMOTION || (e.type == SDL_WINDOWEVENT &&
+				(e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED));
+		}
+
+		// folds next into staged when both belong to the same run
+		bool merge(const SDL_Event &next)
+		{
+			SDL_Event &e = staged.event;
+			if (e.type != next.type)
+				return false;
+
+			if (e.type == SDL_MOUSEMOTION)
+			{
+				if (e.motion.windowID != next.motion.windowID || e.motion.which != next.motion.which || e.motion.state != next.motion.state)
+					return false;
+
+				// latest position, relative motion summed over the run
+				Sint32 xrel = e.motion.xrel + next.motion.xrel;
+				Sint32 yrel = e.motion.yrel + next.motion.yrel;
+				e.motion = next.motion;
+				e.motion.xrel = xrel;
+				e.motion.yrel = yrel;
+			}
+			else
+			{
+				// SDL sends a SIZE_CHANGED and RESIZED pair per step of a drag, so both kinds
+				// make one run with the latest size. It is published as a RESIZED only if it
+				// held one, a run of SIZE_CHANGED alone stays SIZE_CHANGED.
+				if (e.window.windowID != next.window.windowID || !is_coalescable(next))
+					return false;
+				bool resized = e.window.event == SDL_WINDOWEVENT_RESIZED || next.window.event == SDL_WINDOWEVENT_RESIZED;
+				e.window = next.window;
+				e.window.event = resized ? SDL_WINDOWEVENT_RESIZED : SDL_WINDOWEVENT_SIZE_CHANGED;
+			}
+
+			++staged.merged;
+			coalesced.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		void publish(const timed_event &e)
+		{
+			std::uint64_t p = produced.load(std::memory_order_relaxed);
+			if (p - consumed.load(std::memory_order_acquire) > mask)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			slots[p & mask] = e;
+			produced.store(p + 1, std::memory_order_release);
+		}
+
+	public:
+		explicit event_queue(std::size_t capacity = 1024) :
+			mask(0),
+			produced(0),
+			consumed(0),
+			staged(),
+			has_staged(false),
+			coalesced(0),
+			dropped(0)
+		{
+			std::size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			slots.reset(new timed_event[size]);
+			mask = size - 1;
+		}
+
+		// No copy constructor or assignment
+		event_queue(const event_queue &) = delete;
+		event_queue &operator=(const event_queue &) = delete;
+
+		// Producer. Coalescable events are held back until something else arrives or flush().
+		void push(const SDL_Event &event)
+		{
+			if (has_staged && merge(event))
+				return;
+
+			timed_event e;
+			e.event = event;
+			e.polled_ns = now_ns();
+			Uint32 ticks = SDL_GetTicks();
+			e.sdl_age_ms = ticks > event.common.timestamp ? ticks - event.common.timestamp : 0;
+			e.merged = 0;
+
+			if (has_staged)
+			{
+				publish(staged);
+				has_staged = false;
+			}
+
+			if (is_coalescable(event))
+			{
+				staged = e;
+				has_staged = true;
+			}
+			else
+				publish(e);
+		}
+
+		// Producer, after each batch of polling.
+		void flush()
+		{
+			if (has_staged)
+			{
+				publish(staged);
+				has_staged = false;
+			}
+		}
+
+		// Consumer. Copies up to max events into out and returns how many.
+		std::size_t drain(timed_event *out, std::size_t max)
+		{
+			std::uint64_t c = consumed.load(std::memory_order_relaxed);
+			std::uint64_t available = produced.load(std::memory_order_acquire) - c;
+			std::size_t n = static_cast<std::size_t>(available < max ? available : max);
+
+			std::uint64_t now = now_ns();
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				out[i] = slots[(c + i) & mask];
+				latency.add((now - out[i].polled_ns) / 1000000.0);
+			}
+
+			consumed.store(c + n, std::memory_order_release);
+			return n;
+		}
+
+		// Consumer. Calls handle(const timed_event &) for everything queued, in batches.
+		template<typename function>
+		std::size_t drain(function handle)
+		{
+			timed_event batch[32];
+			std::size_t total = 0, n;
+			while ((n = drain(batch, 32)) > 0)
+			{
+				for (std::size_t i = 0; i < n; ++i)
+					handle(batch[i]);
+				total += n;
+			}
+			return total;
+		}
+
+		// Consumer only, drain() updates the latency without synchronization.
+		event_queue_stats get_stats() const
+		{
+			event_queue_stats s;
+			s.pushed = produced.load(std::memory_order_acquire);
+			s.coalesced = coalesced.load(std::memory_order_relaxed);
+			s.dropped = dropped.load(std::memory_order_relaxed);
+			s.latency = latency;
+			return s;
+		}
+
+		std::size_t capacity() const { return mask + 1; }
+	};
+}
+
+#endif // !KNU_EVENT_QUEUE_HPP
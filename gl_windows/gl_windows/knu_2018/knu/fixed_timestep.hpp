@@ -0,0 +1,129 @@
+#ifndef KNU_FIXED_TIMESTEP_HPP
+#define KNU_FIXED_TIMESTEP_HPP
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace knu
+{
+	// Running millisecond statistics for one kind of work (a simulation tick, a draw, ...).
+	struct timing_stats
+	{
+		double last_ms;
+		double average_ms;		// exponential moving average
+		double max_ms;
+		std::uint64_t samples;
+
+		timing_stats() :
+			last_ms(0.0),
+			average_ms(0.0),
+			max_ms(0.0),
+			samples(0)
+		{}
+
+		void add(double ms)
+		{
+			last_ms = ms;
+			average_ms = samples ? average_ms + (ms - average_ms) * 0.05 : ms;
+			max_ms = ms > max_ms ? ms : max_ms;
+			++samples;
+		}
+
+		template<typename duration>
+		void add(duration d)
+		{
+			add(std::chrono::duration<double, std::milli>(d).count());
+		}
+	};
+
+	// Accumulates real frame time and hands it out as fixed simulation steps, e.g.
+	//
+	//	clock.accumulate(frame_time);
+	//	while (clock.step())
+	//		update(clock.step_duration());
+	//	draw(clock.alpha());
+	//
+	// Steps per frame are clamped to max_substeps; time that could not be simulated is
+	// dropped instead of carried over, so a slow frame cannot snowball into slower ones.
+	class fixed_timestep
+	{
+	public:
+		using duration = std::chrono::duration<double>;
+
+	private:
+		duration step_size;
+		duration accumulator;
+		int max_substeps;
+		int steps_this_frame;
+		std::uint64_t total_steps;
+		std::uint64_t dropped_steps;
+		timing_stats steps_per_frame;
+
+	public:
+		explicit fixed_timestep(double hz = 120.0, int max_substeps_ = 8) :
+			step_size(1.0 / hz),
+			accumulator(0.0),
+			max_substeps(max_substeps_),
+			steps_this_frame(0),
+			total_steps(0),
+			dropped_steps(0)
+		{
+		}
+
+		void set_rate(double hz) { step_size = duration(1.0 / hz); }
+		void set_max_substeps(int count) { max_substeps = count; }
+
+		template<typename rep, typename period>
+		void accumulate(std::chrono::duration<rep, period> frame_time)
+		{
+			if (steps_this_frame || total_steps)
+				steps_per_frame.add(static_cast<double>(steps_this_frame));
+			steps_this_frame = 0;
+
+			accumulator += std::chrono::duration_cast<duration>(frame_time);
+
+			// anything past max_substeps is lost, keep only the fraction of a step
+			duration limit = step_size * max_substeps;
+			if (accumulator > limit)
+			{
+				double excess = std::floor((accumulator - limit) / step_size);
+				dropped_steps += static_cast<std::uint64_t>(excess);
+				accumulator -= step_size * excess;
+			}
+		}
+
+		// true while there is a whole step left to simulate this frame
+		bool step()
+		{
+			if (accumulator < step_size || steps_this_frame >= max_substeps)
+				return false;
+
+			accumulator -= step_size;
+			++steps_this_frame;
+			++total_steps;
+			return true;
+		}
+
+		template<typename duration_type>
+		duration_type step_duration() const
+		{
+			return std::chrono::duration_cast<duration_type>(step_size);
+		}
+
+		// how far between the previous and the next simulation state the renderer is, [0, 1)
+		float alpha() const
+		{
+			float a = static_cast<float>(accumulator / step_size);
+			return a < 1.0f ? a : 1.0f;
+		}
+
+		double get_rate() const { return 1.0 / step_size.count(); }
+		int get_steps_this_frame() const { return steps_this_frame; }
+		std::uint64_t get_total_steps() const { return total_steps; }
+		std::uint64_t get_dropped_steps() const { return dropped_steps; }
+		const timing_stats &get_steps_per_frame() const { return steps_per_frame; }
+	};
+}
+
+#endif // !KNU_FIXED_TIMESTEP_HPP
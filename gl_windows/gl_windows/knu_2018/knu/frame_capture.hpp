@@ -0,0 +1,625 @@
+#ifndef KNU_FRAME_CAPTURE_HPP
+#define KNU_FRAME_CAPTURE_HPP
+
+#include <knu/gl_utility.hpp>
+#include <knu/fixed_timestep.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Tightly packed rgba8 rows, bottom row first as GL returns them.
+		struct readback_frame
+		{
+			const unsigned char *pixels;
+			int width;
+			int height;
+			std::uint64_t tag;
+			double latency_ms;		// from read() until the pixels were mapped
+		};
+
+		struct readback_stats
+		{
+			std::uint64_t issued;
+			std::uint64_t completed;
+			std::uint64_t dropped;		// every buffer was still in flight
+			timing_stats latency;
+		};
+
+		// Reads framebuffers into a ring of pixel pack buffers. read() only queues the copy
+		// on the gpu; collect() maps the buffers whose fences have signaled, usually a frame
+		// or two later, so the cpu never waits for the gpu to catch up. GL thread only.
+		class async_readback
+		{
+			struct slot
+			{
+				GLuint pbo;
+				GLsync fence;
+				std::size_t capacity;
+				int width;
+				int height;
+				std::uint64_t tag;
+				std::chrono::steady_clock::time_point issued;
+			};
+
+			std::vector<slot> ring;
+			std::size_t head;		// next slot to read into
+			std::size_t tail;		// oldest slot in flight
+			std::size_t in_flight;
+			readback_stats stats;
+
+		public:
+			explicit async_readback(std::size_t ring_size = 3) :
+				ring(ring_size < 2 ? 2 : ring_size),
+				head(0),
+				tail(0),
+				in_flight(0),
+				stats()
+			{
+				for (auto &s : ring)
+				{
+					s.pbo = 0;
+					s.fence = 0;
+					s.capacity = 0;
+				}
+			}
+
+			~async_readback()
+			{
+				release();
+			}
+
+			// No copy constructor or assignment
+			async_readback(const async_readback &) = delete;
+			async_readback &operator=(const async_readback &) = delete;
+
+			// Queues a copy of color attachment 0 of framebuffer (0 for the default one).
+			// Returns false and counts a drop when the whole ring is still in flight.
+			bool read(GLuint framebuffer, int width, int height, std::uint64_t tag)
+			{
+				if (in_flight == ring.size())
+				{
+					++stats.dropped;
+					return false;
+				}
+
+				slot &s = ring[head];
+				std::size_t bytes = static_cast<std::size_t>(width) * height * 4;
+				if (!s.pbo)
+					glGenBuffers(1, &s.pbo);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+				if (s.capacity < bytes)
+				{
+					glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+					s.capacity = bytes;
+				}
+
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+				glReadBuffer(framebuffer ? GL_COLOR_ATTACHMENT0 : GL_BACK);
+				glPixelStorei(GL_PACK_ALIGNMENT, 1);
+				glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+				s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+				s.width = width;
+				s.height = height;
+				s.tag = tag;
+				s.issued = std::chrono::steady_clock::now();
+
+				head = (head + 1) % ring.size();
+				++in_flight;
+				++stats.issued;
+				return true;
+			}
+
+			// Calls consume(const readback_frame &) for finished reads, oldest first. The pixels
+			// are only valid during the call. With wait set it blocks until nothing is in flight.
+			template<typename function>
+			std::size_t collect(function consume, bool wait = false)
+			{
+				std::size_t n = 0;
+				while (in_flight)
+				{
+					slot &s = ring[tail];
+					GLenum result = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000ull : 0);
+					if (result == GL_TIMEOUT_EXPIRED && !wait)
+						break;
+					glDeleteSync(s.fence);
+					s.fence = 0;
+
+					glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+					std::size_t bytes = static_cast<std::size_t>(s.width) * s.height * 4;
+					const void *mapped = result != GL_WAIT_FAILED ? glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT) : nullptr;
+					if (mapped)
+					{
+						readback_frame f = { static_cast<const unsigned char *>(mapped), s.width, s.height, s.tag,
+							std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - s.issued).count() };
+						stats.latency.add(f.latency_ms);
+						consume(f);
+						glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+						++stats.completed;
+						++n;
+					}
+					glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+					tail = (tail + 1) % ring.size();
+					--in_flight;
+				}
+				return n;
+			}
+
+			void release()
+			{
+				for (auto &s : ring)
+				{
+					if (s.fence)
+						glDeleteSync(s.fence);
+					if (s.pbo)
+						glDeleteBuffers(1, &s.pbo);
+					s.fence = 0;
+					s.pbo = 0;
+					s.capacity = 0;
+				}
+				head = tail = in_flight = 0;
+			}
+
+			std::size_t get_in_flight() const { return in_flight; }
+			const readback_stats &get_stats() const { return stats; }
+		};
+
+		enum class capture_format
+		{
+			raw,	// binary PAM, uncompressed pixels with a small header
+			qoi,	// fast lossless, the one to use while recording
+			png		// stored deflate, no compression library needed
+		};
+
+		// Encoders take bottom-up rgba8 rows as they come back from GL and write top-down images.
+		inline void encode_pam(const unsigned char *rgba, int width, int height, std::vector<unsigned char> &out)
+		{
+			std::string header = "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " + std::to_string(height)
+				+ "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+			std::size_t row = static_cast<std::size_t>(width) * 4;
+			out.assign(header.begin(), header.end());
+			out.reserve(out.size() + row * height);
+			for (int y = height - 1; y >= 0; --y)
+				out.insert(out.end(), rgba + row * y, rgba + row * (y + 1));
+		}
+
+		inline void encode_qoi(const unsigned char *rgba, int width, int height, std::vector<unsigned char> &out)
+		{
+			auto put32 = [&out](std::uint32_t v) {
+				out.push_back(static_cast<unsigned char>(v >> 24));
+				out.push_back(static_cast<unsigned char>(v >> 16));
+				out.push_back(static_cast<unsigned char>(v >> 8));
+				out.push_back(static_cast<unsigned char>(v));
+			};
+
+			out.clear();
+			out.reserve(14 + static_cast<std::size_t>(width) * height * 5 / 2 + 8);
+			out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+			put32(width);
+			put32(height);
+			out.push_back(4);		// channels
+			out.push_back(0);		// srgb with linear alpha
+
+			unsigned char index[64][4] = {};
+			unsigned char prev[4] = { 0, 0, 0, 255 };
+			int run = 0;
+			std::size_t row = static_cast<std::size_t>(width) * 4;
+			std::size_t total = static_cast<std::size_t>(width) * height, count = 0;
+
+			for (int y = height - 1; y >= 0; --y)
+			{
+				const unsigned char *p = rgba + row * y;
+				for (int x = 0; x < width; ++x, p += 4)
+				{
+					++count;
+					if (std::memcmp(p, prev, 4) == 0)
+					{
+						if (++run == 62 || count == total)
+						{
+							out.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+							run = 0;
+						}
+						continue;
+					}
+
+					if (run)
+					{
+						out.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+						run = 0;
+					}
+
+					int hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64;
+					if (std::memcmp(index[hash], p, 4) == 0)
+						out.push_back(static_cast<unsigned char>(hash));
+					else
+					{
+						std::memcpy(index[hash], p, 4);
+						if (p[3] == prev[3])
+						{
+							int dr = static_cast<signed char>(p[0] - prev[0]);
+							int dg = static_cast<signed char>(p[1] - prev[1]);
+							int db = static_cast<signed char>(p[2] - prev[2]);
+							int dr_dg = dr - dg, db_dg = db - dg;
+							if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+								out.push_back(static_cast<unsigned char>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+							else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+							{
+								out.push_back(static_cast<unsigned char>(0x80 | (dg + 32)));
+								out.push_back(static_cast<unsigned char>((dr_dg + 8) << 4 | (db_dg + 8)));
+							}
+							else
+								out.insert(out.end(), { 0xfe, p[0], p[1], p[2] });
+						}
+						else
+							out.insert(out.end(), { 0xff, p[0], p[1], p[2], p[3] });
+					}
+					std::memcpy(prev, p, 4);
+				}
+			}
+			out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+		}
+
+		inline void encode_png(const unsigned char *rgba, int width, int height, std::vector<unsigned char> &out)
+		{
+			static const std::uint32_t *crc_table = []() {
+				static std::uint32_t table[256];
+				for (std::uint32_t n = 0; n < 256; ++n)
+				{
+					std::uint32_t c = n;
+					for (int k = 0; k < 8; ++k)
+						c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					table[n] = c;
+				}
+				return table;
+			}();
+
+			auto put32 = [&out](std::uint32_t v) {
+				out.push_back(static_cast<unsigned char>(v >> 24));
+				out.push_back(static_cast<unsigned char>(v >> 16));
+				out.push_back(static_cast<unsigned char>(v >> 8));
+				out.push_back(static_cast<unsigned char>(v));
+			};
+			auto end_chunk = [&](std::size_t start) {
+				std::uint32_t c = 0xffffffffu;
+				for (std::size_t i = start; i < out.size(); ++i)
+					c = crc_table[(c ^ out[i]) & 0xff] ^ (c >> 8);
+				put32(c ^ 0xffffffffu);
+			};
+
+			std::size_t row = static_cast<std::size_t>(width) * 4;
+			std::size_t raw_size = (row + 1) * height;
+			std::size_t blocks = (raw_size + 65534) / 65535;
+
+			out.clear();
+			out.reserve(8 + 25 + 12 + 6 + blocks * 5 + raw_size + 12);
+			out.insert(out.end(), { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' });
+
+			put32(13);
+			std::size_t start = out.size();
+			out.insert(out.end(), { 'I', 'H', 'D', 'R' });
+			put32(width);
+			put32(height);
+			out.insert(out.end(), { 8, 6, 0, 0, 0 });		// 8 bit rgba, no interlace
+			end_chunk(start);
+
+			put32(static_cast<std::uint32_t>(2 + blocks * 5 + raw_size + 4));
+			start = out.size();
+			out.insert(out.end(), { 'I', 'D', 'A', 'T', 0x78, 0x01 });
+
+			// zlib stream of stored blocks over filter byte 0 + row, top row first
+			std::uint32_t a = 1, b = 0;
+			std::size_t block_left = 0, remaining = raw_size;
+			auto emit = [&](const unsigned char *data, std::size_t n) {
+				while (n)
+				{
+					if (!block_left)
+					{
+						block_left = remaining < 65535 ? remaining : 65535;
+						remaining -= block_left;
+						std::uint16_t len = static_cast<std::uint16_t>(block_left);
+						out.push_back(remaining ? 0 : 1);
+						out.insert(out.end(), { static_cast<unsigned char>(len), static_cast<unsigned char>(len >> 8),
+							static_cast<unsigned char>(~len), static_cast<unsigned char>(~len >> 8) });
+					}
+					std::size_t take = n < block_left ? n : block_left;
+					out.insert(out.end(), data, data + take);
+					for (std::size_t i = 0; i < take; ++i)
+					{
+						a = (a + data[i]) % 65521;
+						b = (b + a) % 65521;
+					}
+					data += take;
+					n -= take;
+					block_left -= take;
+				}
+			};
+
+			const unsigned char filter = 0;
+			for (int y = height - 1; y >= 0; --y)
+			{
+				emit(&filter, 1);
+				emit(rgba + row * y, row);
+			}
+			put32(b << 16 | a);
+			end_chunk(start);
+
+			put32(0);
+			start = out.size();
+			out.insert(out.end(), { 'I', 'E', 'N', 'D' });
+			end_chunk(start);
+		}
+
+		struct capture_settings
+		{
+			capture_format format;
+			std::string prefix;				// frames go to <prefix><frame index>.<ext>
+			std::size_t ring_size;			// pixel pack buffers in flight
+			std::size_t workers;			// encoder threads
+			std::size_t max_pending_bytes;	// pixels copied out but not yet written
+
+			capture_settings() :
+				format(capture_format::qoi),
+				prefix("capture_"),
+				ring_size(3),
+				workers(2),
+				max_pending_bytes(256u << 20)
+			{}
+		};
+
+		struct capture_stats
+		{
+			std::uint64_t requested;
+			std::uint64_t encoded;
+			std::uint64_t dropped_readback;		// gpu had not finished the oldest read
+			std::uint64_t dropped_memory;		// encoders were behind by max_pending_bytes
+			std::uint64_t failed;				// could not write the file
+			std::uint64_t bytes_written;
+			std::size_t pending_bytes;
+			timing_stats readback;				// read() to mapped
+			timing_stats encode;				// encode and write, per frame
+		};
+
+		// Records frames to image files without stalling rendering. The gl thread calls
+		// frame() once per frame after drawing; finished readbacks are copied out and encoded
+		// on a pool of worker threads. When either the gpu or the encoders fall behind,
+		// frames are dropped and counted instead of queueing without bound.
+		class frame_capture
+		{
+			struct encode_task
+			{
+				std::vector<unsigned char> pixels;
+				int width;
+				int height;
+				std::uint64_t frame_index;
+				capture_format format;
+				std::string file_name;
+			};
+
+			capture_settings settings;
+			std::atomic<bool> recording;
+			std::unique_ptr<async_readback> readback;	// gl thread
+
+			std::vector<std::thread> workers;
+			mutable std::mutex mutex;		// everything below
+			std::condition_variable wake;
+			std::condition_variable idle;
+			std::deque<encode_task> queue;
+			std::vector<std::vector<unsigned char>> spare;	// recycled pixel buffers
+			std::size_t busy;
+			bool quit;
+			capture_stats stats;
+
+		private:
+			static const char *extension(capture_format f)
+			{
+				switch (f)
+				{
+				case capture_format::raw: return ".pam";
+				case capture_format::png: return ".png";
+				default: return ".qoi";
+				}
+			}
+
+			void worker_main()
+			{
+				std::vector<unsigned char> encoded;
+				std::unique_lock<std::mutex> lock(mutex);
+				for (;;)
+				{
+					wake.wait(lock, [this]() { return quit || !queue.empty(); });
+					if (queue.empty())
+						return;
+
+					encode_task task = std::move(queue.front());
+					queue.pop_front();
+					++busy;
+					lock.unlock();
+
+					auto start = std::chrono::steady_clock::now();
+					switch (task.format)
+					{
+					case capture_format::raw: encode_pam(task.pixels.data(), task.width, task.height, encoded); break;
+					case capture_format::png: encode_png(task.pixels.data(), task.width, task.height, encoded); break;
+					default: encode_qoi(task.pixels.data(), task.width, task.height, encoded); break;
+					}
+					std::ofstream out(task.file_name, std::ios::binary);
+					out.write(reinterpret_cast<const char *>(encoded.data()), encoded.size());
+					bool ok = static_cast<bool>(out);
+					out.close();
+					auto elapsed = std::chrono::steady_clock::now() - start;
+
+					lock.lock();
+					--busy;
+					stats.pending_bytes -= task.pixels.size();
+					stats.encode.add(elapsed);
+					if (ok)
+					{
+						++stats.encoded;
+						stats.bytes_written += encoded.size();
+					}
+					else
+						++stats.failed;
+					spare.push_back(std::move(task.pixels));
+					if (queue.empty() && !busy)
+						idle.notify_all();
+				}
+			}
+
+			void consume(const readback_frame &f)
+			{
+				std::size_t bytes = static_cast<std::size_t>(f.width) * f.height * 4;
+				std::vector<unsigned char> pixels;
+				capture_format format;
+				std::string prefix;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					format = settings.format;
+					prefix = settings.prefix;
+					stats.readback.add(f.latency_ms);
+					if (stats.pending_bytes + bytes > settings.max_pending_bytes)
+					{
+						++stats.dropped_memory;
+						return;
+					}
+					stats.pending_bytes += bytes;
+					if (!spare.empty())
+					{
+						pixels = std::move(spare.back());
+						spare.pop_back();
+					}
+				}
+
+				// the only copy on the gl thread, straight out of the mapped buffer
+				pixels.resize(bytes);
+				std::memcpy(pixels.data(), f.pixels, bytes);
+
+				encode_task task = { std::move(pixels), f.width, f.height, f.tag, format,
+					prefix + std::to_string(f.tag) + extension(format) };
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_back(std::move(task));
+				wake.notify_one();
+			}
+
+		public:
+			explicit frame_capture(const capture_settings &settings_ = capture_settings()) :
+				settings(settings_),
+				recording(false),
+				busy(0),
+				quit(false),
+				stats()
+			{
+			}
+
+			~frame_capture()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					quit = true;
+					wake.notify_all();
+				}
+				for (auto &w : workers)
+					w.join();
+			}
+
+			// No copy constructor or assignment
+			frame_capture(const frame_capture &) = delete;
+			frame_capture &operator=(const frame_capture &) = delete;
+
+			// Thread that owns the capture, e.g. the main thread. Settings only change while
+			// stopped, the ring size takes effect after the next release().
+			void start(const capture_settings &settings_)
+			{
+				if (recording.load())
+					return;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					settings = settings_;
+				}
+				start();
+			}
+
+			void start()
+			{
+				std::size_t count = settings.workers ? settings.workers : 1;
+				while (workers.size() < count)
+					workers.emplace_back(&frame_capture::worker_main, this);
+				recording.store(true, std::memory_order_release);
+			}
+
+			// Any thread. Reads already issued are still written.
+			void stop()
+			{
+				recording.store(false, std::memory_order_release);
+			}
+
+			// Gl thread, once per frame after the frame is drawn into framebuffer.
+			void frame(GLuint framebuffer, int width, int height, std::uint64_t frame_index)
+			{
+				bool active = recording.load(std::memory_order_acquire);
+				if (!readback)
+				{
+					if (!active)
+						return;
+					readback.reset(new async_readback(settings.ring_size));
+				}
+
+				readback->collect([this](const readback_frame &f) { consume(f); }, !active);
+				if (!active)
+					return;
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					++stats.requested;
+				}
+				if (!readback->read(framebuffer, width, height, frame_index))
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					++stats.dropped_readback;
+				}
+			}
+
+			// Gl thread. Collects what is still in flight and deletes the buffers.
+			void release()
+			{
+				if (!readback)
+					return;
+				readback->collect([this](const readback_frame &f) { consume(f); }, true);
+				readback.reset();
+			}
+
+			// Blocks until the encoders have written everything queued.
+			void wait_idle()
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				idle.wait(lock, [this]() { return queue.empty() && !busy; });
+			}
+
+			bool is_recording() const { return recording.load(std::memory_order_acquire); }
+
+			capture_stats get_stats() const
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				return stats;
+			}
+		};
+	}
+}
+
+#endif // !KNU_FRAME_CAPTURE_HPP
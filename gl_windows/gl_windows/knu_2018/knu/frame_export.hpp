@@ -0,0 +1,158 @@
+#ifndef KNU_FRAME_EXPORT_HPP
+#define KNU_FRAME_EXPORT_HPP
+
+#include <knu/frame_capture.hpp>
+#include <knu/shared_frame_ring.hpp>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct export_settings
+		{
+			std::string name;			// shared memory name, readers open the same one
+			std::uint32_t slots;
+			std::uint32_t max_width;	// slots are sized for this, larger frames are skipped
+			std::uint32_t max_height;
+			std::size_t ring_size;		// pixel pack buffers in flight
+
+			export_settings() :
+				name("knu_frames"),
+				slots(4),
+				max_width(3840),
+				max_height(2160),
+				ring_size(3)
+			{}
+		};
+
+		struct export_stats
+		{
+			readback_stats readback;
+			shared_frame_writer_stats ring;
+		};
+
+		// Publishes rendered frames to a shared memory ring for other processes on the
+		// machine (see shared_frame_reader). Frames come back through async_readback and are
+		// copied once, from the mapped pixel buffer straight into the ring slot. start() and
+		// stop() may be called from any thread; the ring itself is created, written and
+		// closed on the gl thread inside frame().
+		class frame_export
+		{
+			std::mutex mutex;			// settings and stats
+			export_settings settings;
+			export_stats stats;
+			std::atomic<bool> enabled;
+
+			// gl thread
+			std::unique_ptr<async_readback> readback;
+			shared_frame_writer writer;
+
+		private:
+			void publish(const readback_frame &f)
+			{
+				unsigned char *dst = writer.begin_frame(f.width, f.height, f.tag);
+				if (!dst)
+					return;
+				std::memcpy(dst, f.pixels, static_cast<std::size_t>(f.width) * f.height * 4);
+				writer.end_frame();
+			}
+
+			void update_stats()
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stats.readback = readback ? readback->get_stats() : stats.readback;
+				stats.ring = writer.get_stats();
+			}
+
+		public:
+			frame_export() :
+				stats(),
+				enabled(false)
+			{
+			}
+
+			// No copy constructor or assignment
+			frame_export(const frame_export &) = delete;
+			frame_export &operator=(const frame_export &) = delete;
+
+			void start(const export_settings &settings_ = export_settings())
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					settings = settings_;
+				}
+				enabled.store(true, std::memory_order_release);
+			}
+
+			void stop()
+			{
+				enabled.store(false, std::memory_order_release);
+			}
+
+			// Gl thread, once per frame after the frame is drawn into framebuffer.
+			void frame(GLuint framebuffer, int width, int height, std::uint64_t frame_index)
+			{
+				if (!enabled.load(std::memory_order_acquire))
+				{
+					if (readback || writer.is_open())
+						release();
+					return;
+				}
+
+				if (!writer.is_open())
+				{
+					export_settings s;
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						s = settings;
+					}
+					// the name may be taken by another writer, a throw here would end the
+					// render thread, so export is switched off instead
+					try
+					{
+						writer.create(s.name, s.slots, s.max_width, s.max_height);
+					}
+					catch (const std::exception &e)
+					{
+						std::cerr << "frame export disabled: " << e.what() << std::endl;
+						enabled.store(false, std::memory_order_release);
+						return;
+					}
+					readback.reset(new async_readback(s.ring_size));
+				}
+
+				readback->collect([this](const readback_frame &f) { publish(f); });
+				readback->read(framebuffer, width, height, frame_index);
+				update_stats();
+			}
+
+			// Gl thread. Publishes what is still in flight, then removes the ring.
+			void release()
+			{
+				if (readback)
+				{
+					if (writer.is_open())
+						readback->collect([this](const readback_frame &f) { publish(f); }, true);
+					update_stats();
+					readback.reset();
+				}
+				writer.close();
+			}
+
+			bool is_enabled() const { return enabled.load(std::memory_order_acquire); }
+
+			export_stats get_stats()
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				return stats;
+			}
+		};
+	}
+}
+
+#endif // !KNU_FRAME_EXPORT_HPP
@@ -0,0 +1,221 @@
+#ifndef KNU_FRAME_PACER_HPP
+#define KNU_FRAME_PACER_HPP
+
+#include <knu/fixed_timestep.hpp>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#pragma comment(lib, "winmm.lib")
+#endif
+
+namespace knu
+{
+	struct pacing_stats
+	{
+		double target_ms;				// 0 when unlimited
+		double interval_last_ms;		// present to present of the last frame
+		double interval_mean_ms;		// present to present over the last window
+		double interval_jitter_ms;		// standard deviation of the same
+		double interval_max_ms;
+		double work_ms;					// average time from begin_frame to end_frame
+		double latency_delay_ms;		// how long the last frame start was pushed back
+		double wait_ms;					// how long the last frame waited for its deadline
+		std::uint64_t late_frames;		// frames whose work overran the deadline
+	};
+
+	// Limits the frame rate with a sleep-then-spin wait and, optionally, starts each frame
+	// as late as the measured frame cost allows so input is sampled close to presentation.
+	//
+	//	pacer.begin_frame();		// may wait to reduce input latency
+	//	poll, update, draw
+	//	pacer.end_frame();			// waits for the frame deadline
+	//	window.swap_buffers();
+	//	pacer.frame_presented();
+	class frame_pacer
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+		using milliseconds = std::chrono::duration<double, std::milli>;
+
+	private:
+		static const int window_size = 128;
+
+		milliseconds frame_period;
+		milliseconds vsync_period;		// display refresh when vsync paces presentation, else 0
+		milliseconds spin_threshold;	// below this the os scheduler is too coarse to sleep
+		milliseconds latency_margin;	// headroom left when delaying the frame start
+		bool low_latency;
+
+		clock::time_point deadline;
+		clock::time_point frame_start;
+		clock::time_point last_present;
+		timing_stats work;
+		double work_estimate_ms;		// decaying peak of the frame cost
+		std::array<double, window_size> intervals;
+		int interval_count;
+		int interval_next;
+		pacing_stats stats;
+
+	private:
+		void wait_until(clock::time_point t)
+		{
+			for (;;)
+			{
+				milliseconds remaining = t - clock::now();
+				if (remaining.count() <= 0.0)
+					return;
+
+				if (remaining > spin_threshold)
+					std::this_thread::sleep_for(remaining - spin_threshold);
+				else
+					std::this_thread::yield();
+			}
+		}
+
+		void update_jitter()
+		{
+			double sum = 0.0, longest = 0.0;
+			for (int i = 0; i < interval_count; ++i)
+			{
+				sum += intervals[i];
+				longest = intervals[i] > longest ? intervals[i] : longest;
+			}
+			double mean = sum / interval_count;
+
+			double variance = 0.0;
+			for (int i = 0; i < interval_count; ++i)
+				variance += (intervals[i] - mean) * (intervals[i] - mean);
+
+			stats.interval_mean_ms = mean;
+			stats.interval_jitter_ms = std::sqrt(variance / interval_count);
+			stats.interval_max_ms = longest;
+		}
+
+	public:
+		explicit frame_pacer(double target_fps = 0.0) :
+			frame_period(0.0),
+			vsync_period(0.0),
+			spin_threshold(1.5),
+			latency_margin(1.0),
+			low_latency(false),
+			work_estimate_ms(0.0),
+			intervals(),
+			interval_count(0),
+			interval_next(0),
+			stats()
+		{
+#ifdef _WIN32
+			// 1ms scheduler granularity so sleep_for is close enough to spin the rest
+			timeBeginPeriod(1);
+#endif
+			set_target_fps(target_fps);
+			deadline = frame_start = last_present = clock::now();
+		}
+
+		~frame_pacer()
+		{
+#ifdef _WIN32
+			timeEndPeriod(1);
+#endif
+		}
+
+		// No copy constructor or assignment
+		frame_pacer(const frame_pacer &) = delete;
+		frame_pacer &operator=(const frame_pacer &) = delete;
+
+		// 0 disables limiting, e.g. when vsync already paces presentation
+		void set_target_fps(double fps)
+		{
+			frame_period = milliseconds(fps > 0.0 ? 1000.0 / fps : 0.0);
+			stats.target_ms = frame_period.count();
+		}
+
+		// Refresh rate of the display when the swap interval, not the limiter, paces
+		// presentation; 0 when it does not. Gives low latency mode a deadline to aim at.
+		void set_vsync_rate(double hz)
+		{
+			vsync_period = milliseconds(hz > 0.0 ? 1000.0 / hz : 0.0);
+		}
+
+		// Delays the start of each frame by the slack the previous frames left before their
+		// deadline, minus a margin. Only has an effect with a target frame rate or a vsync
+		// rate, where the deadline is the refresh following the last present.
+		void set_low_latency(bool enabled, double margin_ms = 1.0)
+		{
+			low_latency = enabled;
+			latency_margin = milliseconds(margin_ms);
+		}
+
+		void begin_frame()
+		{
+			stats.latency_delay_ms = 0.0;
+
+			clock::time_point target = deadline;
+			bool has_deadline = frame_period.count() > 0.0;
+			if (!has_deadline && vsync_period.count() > 0.0)
+			{
+				target = last_present + std::chrono::duration_cast<clock::duration>(vsync_period);
+				has_deadline = true;
+			}
+
+			if (low_latency && has_deadline && work.samples)
+			{
+				clock::time_point start = target - std::chrono::duration_cast<clock::duration>(milliseconds(work_estimate_ms) + latency_margin);
+				clock::time_point now = clock::now();
+				if (start > now)
+				{
+					wait_until(start);
+					stats.latency_delay_ms = milliseconds(start - now).count();
+				}
+			}
+
+			frame_start = clock::now();
+		}
+
+		void end_frame()
+		{
+			clock::time_point now = clock::now();
+			work.add(now - frame_start);
+			work_estimate_ms = work.last_ms > work_estimate_ms * 0.98 ? work.last_ms : work_estimate_ms * 0.98;
+			stats.work_ms = work.average_ms;
+			stats.wait_ms = 0.0;
+
+			if (frame_period.count() <= 0.0)
+				return;
+
+			if (now > deadline)
+			{
+				++stats.late_frames;
+				// resynchronise instead of rushing the following frames to catch up
+				deadline = now;
+			}
+			else
+			{
+				wait_until(deadline);
+				stats.wait_ms = milliseconds(clock::now() - now).count();
+			}
+
+			deadline += std::chrono::duration_cast<clock::duration>(frame_period);
+		}
+
+		void frame_presented()
+		{
+			clock::time_point now = clock::now();
+			stats.interval_last_ms = milliseconds(now - last_present).count();
+			intervals[interval_next] = stats.interval_last_ms;
+			interval_next = (interval_next + 1) % window_size;
+			interval_count = interval_count < window_size ? interval_count + 1 : window_size;
+			last_present = now;
+
+			update_jitter();
+		}
+
+		const pacing_stats &get_stats() const { return stats; }
+	};
+}
+
+#endif // !KNU_FRAME_PACER_HPP
@@ -0,0 +1,409 @@
+#ifndef KNU_FRAME_STATS_HPP
+#define KNU_FRAME_STATS_HPP
+
+#include <knu/profiler.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace knu
+{
+	// Log-linear histogram of microsecond durations: exact below sub_bucket_count, then
+	// sub_bucket_count / 2 buckets per power of two, so every value is kept to within
+	// 1 / sub_bucket_count (under 1%) no matter how large.
+	class latency_histogram
+	{
+		static const int sub_bucket_bits = 7;
+		static const std::uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+		static const std::uint64_t half_count = sub_bucket_count / 2;
+		static const int max_shift = 40 - sub_bucket_bits;		// up to about 12 days
+
+		std::vector<std::uint64_t> counts;
+		std::uint64_t total;
+		std::uint64_t largest;
+
+	private:
+		static int highest_bit(std::uint64_t v)
+		{
+			int bit = 0;
+			while (v >>= 1)
+				++bit;
+			return bit;
+		}
+
+		static std::size_t index_of(std::uint64_t v)
+		{
+			if (v < sub_bucket_count)
+				return static_cast<std::size_t>(v);
+
+			int shift = highest_bit(v) - (sub_bucket_bits - 1);
+			if (shift > max_shift)
+				return static_cast<std::size_t>((max_shift + 1) * half_count + half_count - 1);
+			return static_cast<std::size_t>(shift * half_count + (v >> shift));
+		}
+
+		// middle of the range of values that land in bucket i
+		static std::uint64_t value_of(std::size_t i)
+		{
+			if (i < sub_bucket_count)
+				return i;
+
+			std::uint64_t shift = i / half_count - 1;
+			std::uint64_t mantissa = i - shift * half_count;
+			return (mantissa << shift) + ((std::uint64_t(1) << shift) - 1) / 2;
+		}
+
+	public:
+		latency_histogram() :
+			counts((max_shift + 2) * half_count, 0),
+			total(0),
+			largest(0)
+		{
+		}
+
+		void add(std::uint64_t us)
+		{
+			++counts[index_of(us)];
+			++total;
+			largest = us > largest ? us : largest;
+		}
+
+		// Only for values that were added before; the max is kept until reset().
+		void remove(std::uint64_t us)
+		{
+			--counts[index_of(us)];
+			--total;
+		}
+
+		void reset()
+		{
+			std::fill(counts.begin(), counts.end(), 0);
+			total = 0;
+			largest = 0;
+		}
+
+		// q in [0, 1]
+		std::uint64_t percentile(double q) const
+		{
+			if (!total)
+				return 0;
+
+			std::uint64_t rank = static_cast<std::uint64_t>(q * total + 0.5);
+			rank = rank < 1 ? 1 : (rank > total ? total : rank);
+
+			std::uint64_t seen = 0;
+			for (std::size_t i = 0; i < counts.size(); ++i)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+				{
+					std::uint64_t v = value_of(i);
+					return v < largest ? v : largest;
+				}
+			}
+			return largest;
+		}
+
+		std::uint64_t get_count() const { return total; }
+		std::uint64_t get_max() const { return largest; }
+	};
+
+	struct percentile_summary
+	{
+		double p50_ms;
+		double p95_ms;
+		double p99_ms;
+		double max_ms;
+		std::uint64_t samples;
+	};
+
+	// Histogram over the last window_size samples; the oldest sample leaves as a new one
+	// arrives, which keeps the percentiles current without rebuilding anything.
+	class rolling_histogram
+	{
+		latency_histogram window;
+		latency_histogram session;
+		std::vector<std::uint64_t> samples;
+		std::size_t next;
+		std::size_t filled;
+
+	private:
+		static percentile_summary summarize(const latency_histogram &h, std::uint64_t max_us)
+		{
+			percentile_summary s;
+			s.p50_ms = h.percentile(0.50) / 1000.0;
+			s.p95_ms = h.percentile(0.95) / 1000.0;
+			s.p99_ms = h.percentile(0.99) / 1000.0;
+			s.max_ms = max_us / 1000.0;
+			s.samples = h.get_count();
+			return s;
+		}
+
+	public:
+		explicit rolling_histogram(std::size_t window_size = 600) :
+			samples(window_size, 0),
+			next(0),
+			filled(0)
+		{
+		}
+
+		void add(double ms)
+		{
+			std::uint64_t us = ms > 0.0 ? static_cast<std::uint64_t>(ms * 1000.0 + 0.5) : 0;
+
+			if (filled == samples.size())
+				window.remove(samples[next]);
+			else
+				++filled;
+
+			samples[next] = us;
+			next = (next + 1) % samples.size();
+			window.add(us);
+			session.add(us);
+		}
+
+		percentile_summary get_window() const
+		{
+			std::uint64_t largest = 0;
+			for (std::size_t i = 0; i < filled; ++i)
+				largest = samples[i] > largest ? samples[i] : largest;
+			return summarize(window, largest);
+		}
+
+		percentile_summary get_session() const { return summarize(session, session.get_max()); }
+
+		double get_p50_ms() const { return window.percentile(0.50) / 1000.0; }
+	};
+
+	struct frame_sample
+	{
+		double frame_ms;		// present to present, as frame_pacer::frame_presented sees it
+		double update_ms;		// all simulation steps of the frame
+		double build_ms;		// packet building
+		double sort_ms;			// render queue sort, part of build_ms
+		double draw_ms;			// draw submission, on the render thread when threaded
+	};
+
+	struct hitch_record
+	{
+		std::uint64_t frame;
+		double frame_ms;
+		double p50_ms;			// rolling median when it happened
+		std::string capture_file;
+	};
+
+	struct telemetry_settings
+	{
+		std::size_t window_frames;		// frames behind the rolling percentiles
+		double hitch_factor;			// a frame this many times the median is a hitch...
+		double hitch_min_ms;			// ...as long as it is at least this long
+		std::size_t capture_frames;		// frames of profiler zones saved per hitch
+		std::size_t max_captures;		// per session, hitches after that are only logged
+		double dump_interval_s;
+		std::string log_file;			// empty disables the periodic dump
+		std::string capture_prefix;		// hitch captures go to <prefix><frame>.kprf
+
+		telemetry_settings() :
+			window_frames(600),
+			hitch_factor(2.0),
+			hitch_min_ms(8.0),
+			capture_frames(30),
+			max_captures(16),
+			dump_interval_s(10.0),
+			log_file("frame_stats.log"),
+			capture_prefix("hitch_")
+		{}
+	};
+
+	// Frame, update, build, sort and draw durations with rolling p50/p95/p99/max, hitch detection
+	// and a periodic summary line in a log file. Hitch captures and the log are written on a
+	// background thread so reporting a hitch does not cause the next one.
+	class frame_stats
+	{
+		using clock = std::chrono::steady_clock;
+
+		telemetry_settings settings;
+		rolling_histogram frame;
+		rolling_histogram update;
+		rolling_histogram build;
+		rolling_histogram sort;
+		rolling_histogram draw;
+		std::deque<std::uint64_t> frame_starts;		// profiler ns, capture_frames + 1 deep
+		std::vector<hitch_record> hitches;
+		std::uint64_t frame_count;
+		std::size_t captures;
+		clock::time_point session_start;
+		clock::time_point last_dump;
+
+		// background writer
+		std::thread writer;
+		std::mutex writer_mutex;
+		std::condition_variable writer_wake;
+		std::deque<std::function<void()>> writer_queue;
+		bool writer_quit;
+
+	private:
+		void writer_main()
+		{
+			std::unique_lock<std::mutex> lock(writer_mutex);
+			for (;;)
+			{
+				writer_wake.wait(lock, [this]() { return writer_quit || !writer_queue.empty(); });
+				if (writer_queue.empty())
+					return;
+
+				std::function<void()> task = std::move(writer_queue.front());
+				writer_queue.pop_front();
+				lock.unlock();
+				task();
+				lock.lock();
+			}
+		}
+
+		void post(std::function<void()> task)
+		{
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			writer_queue.push_back(std::move(task));
+			writer_wake.notify_one();
+		}
+
+		static void format(std::ostream &out, const char *name, const percentile_summary &s)
+		{
+			out << name << " p50 " << s.p50_ms << " p95 " << s.p95_ms << " p99 " << s.p99_ms << " max " << s.max_ms;
+		}
+
+		void detect_hitch(double frame_ms)
+		{
+			double median = frame.get_p50_ms();
+			if (frame_count < settings.window_frames / 4 || frame_ms < settings.hitch_min_ms || frame_ms < median * settings.hitch_factor)
+				return;
+
+			hitch_record h = { frame_count, frame_ms, median, std::string() };
+			if (captures < settings.max_captures && !frame_starts.empty())
+			{
+				++captures;
+				h.capture_file = settings.capture_prefix + std::to_string(frame_count) + ".kprf";
+
+				// the rings hold far more than a few frames, reading them a moment later is fine
+				std::uint64_t since = frame_starts.front();
+				std::string file_name = h.capture_file;
+				post([since, file_name]() {
+					try
+					{
+						write_profile_binary(file_name, profiler::get().capture(since));
+					}
+					catch (const std::exception &e)
+					{
+						std::cerr << e.what() << std::endl;
+					}
+				});
+			}
+			hitches.push_back(h);
+		}
+
+		void dump()
+		{
+			std::ostringstream line;
+			line << std::fixed << std::setprecision(2)
+				<< std::chrono::duration<double>(clock::now() - session_start).count() << "s frames " << frame_count << " | ";
+			format(line, "frame", frame.get_window());
+			line << " | ";
+			format(line, "update", update.get_window());
+			line << " | ";
+			format(line, "build", build.get_window());
+			line << " | ";
+			format(line, "sort", sort.get_window());
+			line << " | ";
+			format(line, "draw", draw.get_window());
+			line << " | hitches " << hitches.size() << "\n";
+
+			std::string text = line.str();
+			std::string file_name = settings.log_file;
+			post([text, file_name]() {
+				std::ofstream out(file_name, std::ios::app);
+				out << text;
+			});
+		}
+
+	public:
+		explicit frame_stats(const telemetry_settings &settings_ = telemetry_settings()) :
+			settings(settings_),
+			frame(settings_.window_frames),
+			update(settings_.window_frames),
+			build(settings_.window_frames),
+			sort(settings_.window_frames),
+			draw(settings_.window_frames),
+			frame_count(0),
+			captures(0),
+			session_start(clock::now()),
+			last_dump(session_start),
+			writer_quit(false)
+		{
+			writer = std::thread(&frame_stats::writer_main, this);
+		}
+
+		// Finishes any queued writes.
+		~frame_stats()
+		{
+			{
+				std::lock_guard<std::mutex> lock(writer_mutex);
+				writer_quit = true;
+				writer_wake.notify_one();
+			}
+			writer.join();
+		}
+
+		// No copy constructor or assignment
+		frame_stats(const frame_stats &) = delete;
+		frame_stats &operator=(const frame_stats &) = delete;
+
+		// Call when a frame starts so hitch captures can reach back capture_frames frames.
+		void begin_frame()
+		{
+			frame_starts.push_back(profiler::now_ns());
+			while (frame_starts.size() > settings.capture_frames + 1)
+				frame_starts.pop_front();
+		}
+
+		void add_frame(const frame_sample &s)
+		{
+			detect_hitch(s.frame_ms);
+
+			frame.add(s.frame_ms);
+			update.add(s.update_ms);
+			build.add(s.build_ms);
+			sort.add(s.sort_ms);
+			draw.add(s.draw_ms);
+			++frame_count;
+
+			clock::time_point now = clock::now();
+			if (!settings.log_file.empty() && std::chrono::duration<double>(now - last_dump).count() >= settings.dump_interval_s)
+			{
+				last_dump = now;
+				dump();
+			}
+		}
+
+		percentile_summary get_frame() const { return frame.get_window(); }
+		percentile_summary get_update() const { return update.get_window(); }
+		percentile_summary get_build() const { return build.get_window(); }
+		percentile_summary get_sort() const { return sort.get_window(); }
+		percentile_summary get_draw() const { return draw.get_window(); }
+		percentile_summary get_session_frame() const { return frame.get_session(); }
+		const std::vector<hitch_record> &get_hitches() const { return hitches; }
+		std::uint64_t get_frame_count() const { return frame_count; }
+	};
+}
+
+#endif // !KNU_FRAME_STATS_HPP
@@ -0,0 +1,429 @@
+#ifndef KNU_GL_DEBUG_HPP
+#define KNU_GL_DEBUG_HPP
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#include <OpenGL/gl3ext.h>
+#endif
+
+#ifdef WIN32
+#include <Windows.h>
+#include <GL/glew.h>
+#endif
+
+#ifdef __linux__
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/glcorearb.h>
+#endif
+
+// macOS stops at gl 4.1 without KHR_debug, these only keep the message names compiling
+#ifndef GL_DEBUG_SOURCE_API
+#define GL_DEBUG_SOURCE_API 0x8246
+#define GL_DEBUG_SOURCE_WINDOW_SYSTEM 0x8247
+#define GL_DEBUG_SOURCE_SHADER_COMPILER 0x8248
+#define GL_DEBUG_SOURCE_THIRD_PARTY 0x8249
+#define GL_DEBUG_SOURCE_APPLICATION 0x824A
+#define GL_DEBUG_TYPE_ERROR 0x824C
+#define GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR 0x824D
+#define GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR 0x824E
+#define GL_DEBUG_TYPE_PORTABILITY 0x824F
+#define GL_DEBUG_TYPE_PERFORMANCE 0x8250
+#define GL_DEBUG_TYPE_MARKER 0x8268
+#define GL_DEBUG_SEVERITY_HIGH 0x9146
+#define GL_DEBUG_SEVERITY_MEDIUM 0x9147
+#define GL_DEBUG_SEVERITY_LOW 0x9148
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct gl_debug_stats
+		{
+			std::uint64_t received;		// messages the driver handed to the callback
+			std::uint64_t printed;
+			std::uint64_t suppressed;	// repeats over the per id limit
+			std::uint64_t dropped;		// ring was full
+		};
+
+		// KHR_debug sink that keeps the driver callback cheap: the callback only copies the
+		// message into a preallocated ring, repeats of an id past a per second limit are
+		// counted instead of queued, and a background thread formats and prints. Messages
+		// are delivered asynchronously, so GL_DEBUG_OUTPUT_SYNCHRONOUS stays off unless asked.
+		class gl_debug_sink
+		{
+			static const std::size_t max_text = 240;
+			static const std::size_t table_size = 1024;
+			static const std::size_t max_probes = 16;
+
+			struct message
+			{
+				GLenum source;
+				GLenum type;
+				GLenum severity;
+				GLuint id;
+				std::uint32_t length;
+				char text[max_text];
+			};
+
+			struct cell
+			{
+				std::atomic<std::size_t> sequence;
+				message data;
+			};
+
+			// bounded multi producer ring, drivers may call back from several threads
+			std::unique_ptr<cell[]> cells;
+			std::size_t mask;
+			std::atomic<std::size_t> enqueue_position;
+			std::size_t dequeue_position;
+
+			// per (source, id) counts for the current second, open addressed with linear
+			// probing. A slot is claimed once and keeps its key, only the count is reset.
+			std::atomic<std::uint32_t> id_counts[table_size];
+			std::atomic<std::uint64_t> id_keys[table_size];		// 0 while unclaimed
+			std::uint32_t repeat_limit;
+
+			std::atomic<std::uint64_t> received;
+			std::atomic<std::uint64_t> printed;
+			std::atomic<std::uint64_t> suppressed;
+			std::atomic<std::uint64_t> dropped;
+
+			std::thread printer;
+			std::atomic<bool> running;
+			std::ostream *out;
+
+		private:
+			static std::uint64_t slot_key(GLenum source, GLuint id)
+			{
+				return std::uint64_t(1) << 63 | static_cast<std::uint64_t>(source & 0x7fffffff) << 32 | id;
+			}
+
+			// The slot counting (source, id), claiming a free one on first sight. Null when
+			// every probed slot belongs to other ids, those messages go unlimited.
+			std::atomic<std::uint32_t> *find_slot(GLenum source, GLuint id)
+			{
+				std::uint64_t key = slot_key(source, id);
+				std::size_t bucket = static_cast<std::size_t>((id * 2654435761u) ^ source);
+				for (std::size_t probe = 0; probe < max_probes; ++probe)
+				{
+					std::size_t i = (bucket + probe) & (table_size - 1);
+					std::uint64_t current = id_keys[i].load(std::memory_order_relaxed);
+					if (current == 0)
+					{
+						// another thread may claim it first, with this key or another
+						id_keys[i].compare_exchange_strong(current, key, std::memory_order_relaxed);
+						if (current == 0)
+							current = key;
+					}
+					if (current == key)
+						return &id_counts[i];
+				}
+				return nullptr;
+			}
+
+			static void APIENTRY callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+				GLsizei length, const GLchar *text, const void *user_param)
+			{
+				static_cast<gl_debug_sink *>(const_cast<void *>(user_param))->receive(source, type, id, severity, length, text);
+			}
+
+			void receive(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *text)
+			{
+				received.fetch_add(1, std::memory_order_relaxed);
+
+				std::atomic<std::uint32_t> *count = find_slot(source, id);
+				if (count && count->fetch_add(1, std::memory_order_relaxed) >= repeat_limit)
+				{
+					suppressed.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+
+				std::size_t pos = enqueue_position.load(std::memory_order_relaxed);
+				cell *c;
+				for (;;)
+				{
+					c = &cells[pos & mask];
+					std::size_t seq = c->sequence.load(std::memory_order_acquire);
+					std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+					if (diff == 0)
+					{
+						if (enqueue_position.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (diff < 0)
+					{
+						dropped.fetch_add(1, std::memory_order_relaxed);
+						return;
+					}
+					else
+						pos = enqueue_position.load(std::memory_order_relaxed);
+				}
+
+				if (length < 0)
+					length = static_cast<GLsizei>(std::strlen(text));
+				std::size_t n = static_cast<std::size_t>(length) < max_text ? static_cast<std::size_t>(length) : max_text;
+
+				c->data.source = source;
+				c->data.type = type;
+				c->data.severity = severity;
+				c->data.id = id;
+				c->data.length = static_cast<std::uint32_t>(n);
+				std::memcpy(c->data.text, text, n);
+				c->sequence.store(pos + 1, std::memory_order_release);
+			}
+
+			bool pop(message &m)
+			{
+				cell &c = cells[dequeue_position & mask];
+				if (c.sequence.load(std::memory_order_acquire) != dequeue_position + 1)
+					return false;
+
+				m = c.data;
+				c.sequence.store(dequeue_position + mask + 1, std::memory_order_release);
+				++dequeue_position;
+				return true;
+			}
+
+			static const char *source_name(GLenum source)
+			{
+				switch (source)
+				{
+				case GL_DEBUG_SOURCE_API: return "api";
+				case GL_DEBUG_SOURCE_WINDOW_SYSTEM: return "window system";
+				case GL_DEBUG_SOURCE_SHADER_COMPILER: return "shader compiler";
+				case GL_DEBUG_SOURCE_THIRD_PARTY: return "third party";
+				case GL_DEBUG_SOURCE_APPLICATION: return "application";
+				default: return "other";
+				}
+			}
+
+			static const char *type_name(GLenum type)
+			{
+				switch (type)
+				{
+				case GL_DEBUG_TYPE_ERROR: return "error";
+				case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+				case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+				case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+				case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+				case GL_DEBUG_TYPE_MARKER: return "marker";
+				default: return "other";
+				}
+			}
+
+			static const char *severity_name(GLenum severity)
+			{
+				switch (severity)
+				{
+				case GL_DEBUG_SEVERITY_HIGH: return "high";
+				case GL_DEBUG_SEVERITY_MEDIUM: return "medium";
+				case GL_DEBUG_SEVERITY_LOW: return "low";
+				default: return "notification";
+				}
+			}
+
+			void print(const std::string &text)
+			{
+#ifdef _WIN32
+				OutputDebugStringA(text.c_str());
+#endif
+				*out << text << std::flush;
+			}
+
+			void drain()
+			{
+				message m;
+				while (pop(m))
+				{
+					std::ostringstream line;
+					line << "gl " << severity_name(m.severity) << " " << type_name(m.type) << " from "
+						<< source_name(m.source) << " (id " << m.id << "): ";
+					line.write(m.text, m.length);
+					line << "\n";
+					print(line.str());
+					printed.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+
+			// opens a new rate limit window and reports what the last one held back
+			void report_repeats()
+			{
+				std::ostringstream line;
+				for (std::size_t i = 0; i < table_size; ++i)
+				{
+					std::uint32_t count = id_counts[i].exchange(0, std::memory_order_relaxed);
+					if (count > repeat_limit)
+					{
+						std::uint64_t key = id_keys[i].load(std::memory_order_relaxed);
+						line << "gl " << source_name(static_cast<GLenum>(key >> 32 & 0x7fffffff)) << " id "
+							<< static_cast<GLuint>(key) << " repeated " << count - repeat_limit << " more times\n";
+					}
+				}
+				if (line.tellp() > 0)
+					print(line.str());
+			}
+
+			void printer_main()
+			{
+				auto window_start = std::chrono::steady_clock::now();
+				while (running.load(std::memory_order_acquire))
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+					drain();
+
+					auto now = std::chrono::steady_clock::now();
+					if (now - window_start >= std::chrono::seconds(1))
+					{
+						report_repeats();
+						window_start = now;
+					}
+				}
+				drain();
+				report_repeats();
+			}
+
+		public:
+			explicit gl_debug_sink(std::size_t capacity = 256, std::uint32_t repeats_per_second = 4, std::ostream &stream = std::cerr) :
+				mask(0),
+				enqueue_position(0),
+				dequeue_position(0),
+				repeat_limit(repeats_per_second),
+				received(0),
+				printed(0),
+				suppressed(0),
+				dropped(0),
+				running(false),
+				out(&stream)
+			{
+				std::size_t size = 1;
+				while (size < capacity)
+					size <<= 1;
+				cells.reset(new cell[size]);
+				mask = size - 1;
+				for (std::size_t i = 0; i < size; ++i)
+					cells[i].sequence.store(i, std::memory_order_relaxed);
+
+				for (std::size_t i = 0; i < table_size; ++i)
+				{
+					id_counts[i].store(0, std::memory_order_relaxed);
+					id_keys[i].store(0, std::memory_order_relaxed);
+				}
+			}
+
+			~gl_debug_sink()
+			{
+				stop();
+			}
+
+			// No copy constructor or assignment
+			gl_debug_sink(const gl_debug_sink &) = delete;
+			gl_debug_sink &operator=(const gl_debug_sink &) = delete;
+
+			// Hooks the callback into the current context and starts printing. Returns false
+			// where KHR_debug is unavailable (e.g. macOS).
+			bool install()
+			{
+#ifdef __APPLE__
+				return false;
+#else
+				if (!running.exchange(true))
+					printer = std::thread(&gl_debug_sink::printer_main, this);
+
+				glDebugMessageCallback(&gl_debug_sink::callback, this);
+				glEnable(GL_DEBUG_OUTPUT);
+				glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+				return true;
+#endif
+			}
+
+			// Unhooks the callback; call while the context is still current.
+			void uninstall()
+			{
+#ifndef __APPLE__
+				if (running)
+					glDebugMessageCallback(nullptr, nullptr);
+#endif
+				stop();
+			}
+
+			// Prints what is still queued and stops the printer thread.
+			void stop()
+			{
+				if (running.exchange(false))
+					printer.join();
+			}
+
+			// Lets the driver drop messages below min_severity before they reach the callback.
+			void set_min_severity(GLenum min_severity)
+			{
+#ifndef __APPLE__
+				const GLenum ordered[] = { GL_DEBUG_SEVERITY_NOTIFICATION, GL_DEBUG_SEVERITY_LOW,
+					GL_DEBUG_SEVERITY_MEDIUM, GL_DEBUG_SEVERITY_HIGH };
+				bool enabled = false;
+				for (GLenum severity : ordered)
+				{
+					enabled = enabled || severity == min_severity;
+					glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, severity, 0, nullptr, enabled ? GL_TRUE : GL_FALSE);
+				}
+#endif
+			}
+
+			// Enables or disables every message from one source (GL_DEBUG_SOURCE_*), or of one
+			// type (GL_DEBUG_TYPE_*) when source is GL_DONT_CARE.
+			void set_enabled(GLenum source, GLenum type, bool enabled)
+			{
+#ifndef __APPLE__
+				glDebugMessageControl(source, type, GL_DONT_CARE, 0, nullptr, enabled ? GL_TRUE : GL_FALSE);
+#endif
+			}
+
+			// Ids known to be noise, e.g. buffer placement notes.
+			void ignore_ids(GLenum source, GLenum type, const GLuint *ids, GLsizei count)
+			{
+#ifndef __APPLE__
+				glDebugMessageControl(source, type, GL_DONT_CARE, count, ids, GL_FALSE);
+#endif
+			}
+
+			// Messages arrive on the thread that caused them, for breaking in a debugger. Costly.
+			void set_synchronous(bool synchronous)
+			{
+#ifndef __APPLE__
+				if (synchronous)
+					glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+				else
+					glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+#endif
+			}
+
+			gl_debug_stats get_stats() const
+			{
+				gl_debug_stats s;
+				s.received = received.load(std::memory_order_relaxed);
+				s.printed = printed.load(std::memory_order_relaxed);
+				s.suppressed = suppressed.load(std::memory_order_relaxed);
+				s.dropped = dropped.load(std::memory_order_relaxed);
+				return s;
+			}
+		};
+	}
+}
+
+#endif // !KNU_GL_DEBUG_HPP
@@ -11,12 +11,25 @@
 #include <GL/glew.h>
 #endif
 
+#ifdef __linux__
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/glcorearb.h>
+#endif
+
 #include <knu/mathlibrary6.hpp>
+#include <knu/quantization.hpp>
+#include <knu/profiler.hpp>
 #include <vector>
 #include <map>
 #include <string>
 #include <fstream>
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <unordered_map>
 #include <iostream>
 #include <stdexcept>
@@ -233,6 +246,7 @@ namespace knu
             
             void build()
             {
+                KNU_PROFILE_ZONE("program::build");
                 build_program();
                 resolve_uniforms();
             }
@@ -300,6 +314,7 @@ namespace knu
             
             buffer(GLenum target, unsigned int count, t* data, GLenum usage):id(0), target(target), usage(usage)
             {
+                KNU_PROFILE_ZONE("buffer::upload");
                 glGenBuffers(1, &id);
                 
                 glBindBuffer(target, id);
@@ -338,6 +353,7 @@ namespace knu
             
             void allocate(std::vector<t> &v)
             {
+                KNU_PROFILE_ZONE("buffer::upload");
                 if(!id)
                 {
                     glGenBuffers(1, &id);
@@ -347,18 +363,41 @@ namespace knu
                 glBufferData(target, sizeof(t) * v.size(), v.data(), usage);
             }
             
+            // From memory that isn't a vector, e.g. a mesh_file section, without a copy
+            void allocate(const t *data, std::size_t count)
+            {
+                KNU_PROFILE_ZONE("buffer::upload");
+                if(!id)
+                {
+                    glGenBuffers(1, &id);
+                }
+                
+                bind();
+                glBufferData(target, sizeof(t) * count, data, usage);
+            }
+            
             void insert(GLintptr offset, GLsizeiptr byte_size ,t* array)
             {
+                KNU_PROFILE_ZONE("buffer::insert");
                 bind();
                 glBufferSubData(target, offset, byte_size, array);
             }
             
             void insert(std::vector<t> &v)
             {
+                KNU_PROFILE_ZONE("buffer::insert");
                 bind();
                 glBufferSubData(target, 0, v.size() * sizeof(t), v.data());
             }
             
+            // count elements from data, starting at element first of the buffer
+            void insert(const t *data, std::size_t count, std::size_t first = 0)
+            {
+                KNU_PROFILE_ZONE("buffer::insert");
+                bind();
+                glBufferSubData(target, first * sizeof(t), count * sizeof(t), data);
+            }
+            
             void set_target(GLenum target, GLenum usage)
             {
                 this->target = target;
@@ -369,99 +408,401 @@ namespace knu
             inline void unmap() {glUnmapBuffer(target);}
         };
         
-		// For now, to silence the warning, disable class vertex_array_object
-        /*enum class vao
-        {
-            vertex, vertex_texture, vertex_texture_normal, vertex_normal, vertex_color
-        };
-        
-        class vertex_array_object
-        {
-        private:
-            std::vector<GLuint> ids;
-            
-        public:
-            vertex_array_object():ids() {}
-            
-            ~vertex_array_object()
-            {
-                if(!ids.empty())
-                    glDeleteVertexArrays((GLsizei)ids.size(), &ids[0]);
-            }
-            
-            // No copy constructor or assignment
-            vertex_array_object(const vertex_array_object &) = delete;
-            vertex_array_object &operator=(const vertex_array_object &) = delete;
-            
-            template<typename ... offsets>
-            void set(vao type, GLsizei stride, std::tuple<offsets...> at)
-            {
-                if(ids.empty())
-                {
-                    ids.push_back(0);
-                    glGenVertexArrays(1, &ids[0]);
-                }
-                
-                switch(type)
-                {
-                    case vao::vertex:
-                    {
-                        
-                    }break;
-                        
-                    case vao::vertex_texture:
-                    {
-                        
-                        bind();
-                        
-                        GLsizei vertex_offset, texture_offset;
-                        
-                        std::tie(vertex_offset, texture_offset) = at;
-                        
-                        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(vertex_offset));
-                        glEnableVertexAttribArray(0);
-                        
-                        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(texture_offset));
-                        glEnableVertexAttribArray(1);
-                        unbind();
-                    }break;
-                        
-                    case vao::vertex_texture_normal:
-                    {
-                        
-                    }break;
-                        
-                    case vao::vertex_normal:
-                    {
-                        
-                    }break;
-                        
-                    case vao::vertex_color:
-                    {
-                        bind();
-                        
-                        GLsizei vertex_offset, color_offset;
-                        std::tie(vertex_offset, color_offset) = at;
-                        
-                        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(vertex_offset));
-                        glEnableVertexAttribArray(0);
-                        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(color_offset));
-                        glEnableVertexAttribArray(4);
-                        unbind();
-                    }
-                }
-            }
-            
-            void bind()
-            {
-                glBindVertexArray(ids[0]);
-            }
-            
-            void unbind()
-            {
-                glBindVertexArray(0);
-            }
-        }; */ //class vao
+		// Format of one vertex attribute as GL sees it. offset is relative to the vertex.
+		struct attribute_desc
+		{
+			GLuint location;
+			GLint components;
+			GLenum type;
+			bool normalized;
+			bool integer;		// read as ivec/uvec in the shader instead of converted to float
+			GLuint offset;
+		};
+
+		// How a member type is fed to GL. Specialize for packed or quantized types.
+		template<typename t> struct attribute_traits;
+
+		template<typename t, GLint components_, GLenum type_, bool normalized_ = false, bool integer_ = false>
+		struct attribute_traits_base
+		{
+			static constexpr GLint components = components_;
+			static constexpr GLenum type = type_;
+			static constexpr bool normalized = normalized_;
+			static constexpr bool integer = integer_;
+		};
+
+		template<> struct attribute_traits<float> : attribute_traits_base<float, 1, GL_FLOAT> {};
+		template<> struct attribute_traits<knu::math::vector2f> : attribute_traits_base<knu::math::vector2f, 2, GL_FLOAT> {};
+		template<> struct attribute_traits<knu::math::vector3f> : attribute_traits_base<knu::math::vector3f, 3, GL_FLOAT> {};
+		template<> struct attribute_traits<knu::math::vector4f> : attribute_traits_base<knu::math::vector4f, 4, GL_FLOAT> {};
+		template<> struct attribute_traits<std::int32_t> : attribute_traits_base<std::int32_t, 1, GL_INT, false, true> {};
+		template<> struct attribute_traits<std::uint32_t> : attribute_traits_base<std::uint32_t, 1, GL_UNSIGNED_INT, false, true> {};
+		template<> struct attribute_traits<knu::math::vector2i> : attribute_traits_base<knu::math::vector2i, 2, GL_INT, false, true> {};
+		template<> struct attribute_traits<knu::math::vector3i> : attribute_traits_base<knu::math::vector3i, 3, GL_INT, false, true> {};
+		template<> struct attribute_traits<knu::math::vector4i> : attribute_traits_base<knu::math::vector4i, 4, GL_INT, false, true> {};
+
+		// packed types from quantization.hpp
+		template<> struct attribute_traits<knu::math::half2> : attribute_traits_base<knu::math::half2, 2, GL_HALF_FLOAT> {};
+		template<> struct attribute_traits<knu::math::half4> : attribute_traits_base<knu::math::half4, 4, GL_HALF_FLOAT> {};
+		template<> struct attribute_traits<knu::math::unorm16x2> : attribute_traits_base<knu::math::unorm16x2, 2, GL_UNSIGNED_SHORT, true> {};
+		template<> struct attribute_traits<knu::math::unorm16x3> : attribute_traits_base<knu::math::unorm16x3, 3, GL_UNSIGNED_SHORT, true> {};
+		template<> struct attribute_traits<knu::math::snorm16x3> : attribute_traits_base<knu::math::snorm16x3, 3, GL_SHORT, true> {};
+		template<> struct attribute_traits<knu::math::octahedral16> : attribute_traits_base<knu::math::octahedral16, 2, GL_SHORT, true> {};
+		template<> struct attribute_traits<knu::math::packed_snorm_1010102> : attribute_traits_base<knu::math::packed_snorm_1010102, 4, GL_INT_2_10_10_10_REV, true> {};
+		template<> struct attribute_traits<knu::math::packed_unorm_1010102> : attribute_traits_base<knu::math::packed_unorm_1010102, 4, GL_UNSIGNED_INT_2_10_10_10_REV, true> {};
+
+		// One attribute, everything known at compile time. Usually written through
+		// KNU_VERTEX_ATTRIBUTE so the type and offset come from the struct itself.
+		template<GLuint location_, typename t, std::size_t offset_, typename traits = attribute_traits<t>>
+		struct attribute
+		{
+			static constexpr GLuint location = location_;
+			static constexpr std::size_t offset = offset_;
+			static constexpr std::size_t size = sizeof(t);
+
+			static attribute_desc describe()
+			{
+				return { location_, traits::components, traits::type, traits::normalized, traits::integer, static_cast<GLuint>(offset_) };
+			}
+
+#ifndef __APPLE__
+			// format of the currently bound vertex array, sourced from binding
+			static void apply(GLuint binding)
+			{
+				glEnableVertexAttribArray(location_);
+				if (traits::integer)
+					glVertexAttribIFormat(location_, traits::components, traits::type, static_cast<GLuint>(offset_));
+				else
+					glVertexAttribFormat(location_, traits::components, traits::type, traits::normalized ? GL_TRUE : GL_FALSE, static_cast<GLuint>(offset_));
+				glVertexAttribBinding(location_, binding);
+			}
+#endif
+
+			// OpenGL 4.1 has no separate attribute formats, the pointer has to be set again
+			// for every buffer. Needs the buffer bound to GL_ARRAY_BUFFER.
+			static void apply_pointer(GLsizei stride, GLintptr base)
+			{
+				glEnableVertexAttribArray(location_);
+				const GLvoid *p = reinterpret_cast<const GLvoid *>(base + offset_);
+				if (traits::integer)
+					glVertexAttribIPointer(location_, traits::components, traits::type, stride, p);
+				else
+					glVertexAttribPointer(location_, traits::components, traits::type, traits::normalized ? GL_TRUE : GL_FALSE, stride, p);
+			}
+		};
+
+#define KNU_VERTEX_ATTRIBUTE(vertex, member, location) \
+	knu::graphics::attribute<location, decltype(vertex::member), offsetof(vertex, member)>
+
+		namespace detail
+		{
+			constexpr bool unique_locations()
+			{
+				return true;
+			}
+
+			constexpr bool contains(GLuint)
+			{
+				return false;
+			}
+
+			template<typename ... rest>
+			constexpr bool contains(GLuint location, GLuint first, rest ... others)
+			{
+				return location == first || contains(location, others...);
+			}
+
+			template<typename ... rest>
+			constexpr bool unique_locations(GLuint first, rest ... others)
+			{
+				return !contains(first, others...) && unique_locations(others...);
+			}
+		}
+
+		// Describes a vertex struct once, e.g.
+		//
+		//	struct textured_vertex { vector3f position; vector2f uv; };
+		//	using textured_layout = vertex_layout<textured_vertex,
+		//		KNU_VERTEX_ATTRIBUTE(textured_vertex, position, 0),
+		//		KNU_VERTEX_ATTRIBUTE(textured_vertex, uv, 1)>;
+		//
+		// and the attribute setup is a fixed sequence of calls with constant arguments.
+		template<typename vertex_, typename ... attributes>
+		struct vertex_layout
+		{
+			using vertex = vertex_;
+			static constexpr GLsizei stride = sizeof(vertex_);
+			static constexpr std::size_t attribute_count = sizeof...(attributes);
+
+			static_assert(sizeof...(attributes) > 0, "a vertex layout needs at least one attribute");
+			static_assert(detail::unique_locations(attributes::location...), "two attributes share a location");
+
+			static std::vector<attribute_desc> describe()
+			{
+				return { attributes::describe()... };
+			}
+
+#ifndef __APPLE__
+			static void apply(GLuint binding)
+			{
+				int expand[] = { 0, (attributes::apply(binding), 0)... };
+				(void)expand;
+			}
+#endif
+
+			static void apply_pointers(GLintptr base)
+			{
+				int expand[] = { 0, (attributes::apply_pointer(stride, base), 0)... };
+				(void)expand;
+			}
+
+		private:
+			template<typename a>
+			static constexpr bool fits()
+			{
+				return a::offset + a::size <= sizeof(vertex_);
+			}
+
+			template<typename a, typename b, typename ... rest>
+			static constexpr bool fits()
+			{
+				return fits<a>() && fits<b, rest...>();
+			}
+
+			static_assert(fits<attributes...>(), "attribute outside the vertex");
+		};
+
+		// Position in its quantization box (decode as box.offset + value * box.scale), octahedral
+		// normal, half uv and octahedral tangent with the bitangent sign in w.
+		using quantized_vertex_layout = vertex_layout<knu::math::quantized_vertex,
+			KNU_VERTEX_ATTRIBUTE(knu::math::quantized_vertex, position, 0),
+			KNU_VERTEX_ATTRIBUTE(knu::math::quantized_vertex, normal, 1),
+			KNU_VERTEX_ATTRIBUTE(knu::math::quantized_vertex, uv, 2),
+			KNU_VERTEX_ATTRIBUTE(knu::math::quantized_vertex, tangent, 3)>;
+
+		class vertex_array_object
+		{
+			GLuint id;
+
+		public:
+			vertex_array_object() : id(0) {}
+
+			~vertex_array_object()
+			{
+				if (id)
+					glDeleteVertexArrays(1, &id);
+			}
+
+			// No copy constructor or assignment
+			vertex_array_object(const vertex_array_object &) = delete;
+			vertex_array_object &operator=(const vertex_array_object &) = delete;
+
+			// Records the layout's attribute formats, sourced from binding. On macOS the formats
+			// are set with each bind_vertex_buffer() instead.
+			template<typename layout>
+			void set(GLuint binding = 0)
+			{
+				if (!id)
+					glGenVertexArrays(1, &id);
+#ifndef __APPLE__
+				bind();
+				layout::apply(binding);
+				unbind();
+#endif
+			}
+
+			// The array has to be bound.
+			template<typename layout>
+			void bind_vertex_buffer(GLuint buffer, GLintptr offset = 0, GLuint binding = 0)
+			{
+#ifdef __APPLE__
+				glBindBuffer(GL_ARRAY_BUFFER, buffer);
+				layout::apply_pointers(offset);
+#else
+				glBindVertexBuffer(binding, buffer, offset, layout::stride);
+#endif
+			}
+
+			// The array has to be bound, it remembers the index buffer.
+			void bind_index_buffer(GLuint buffer)
+			{
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+			}
+
+			void bind()
+			{
+				glBindVertexArray(id);
+			}
+
+			void unbind()
+			{
+				glBindVertexArray(0);
+			}
+
+			inline GLuint obj() const
+			{
+				return id;
+			}
+		};
+
+		struct vertex_array_stats
+		{
+			std::uint64_t layouts;			// distinct layout types seen
+			std::uint64_t arrays;			// vertex arrays created, after deduplication
+			std::uint64_t array_binds;
+			std::uint64_t buffer_binds;
+			std::uint64_t redundant;		// binds skipped because nothing changed
+		};
+
+		// One vertex array per distinct attribute format, shared by every layout type that
+		// describes the same format. Switching between meshes of one format then only changes
+		// the vertex and index buffers, and binds that would change nothing are skipped.
+		// Assumes nothing else binds vertex arrays in between; call invalidate() if it does.
+		class vertex_array_cache
+		{
+			struct entry
+			{
+				std::unique_ptr<vertex_array_object> vao;
+				GLuint vertex_buffer;
+				GLintptr offset;
+				GLsizei stride;
+				GLuint index_buffer;
+			};
+
+			std::vector<std::size_t> by_type;		// layout type slot -> entry + 1, 0 if not seen
+			std::map<std::vector<GLuint>, std::size_t> by_format;
+			std::vector<entry> entries;
+			std::size_t bound;						// entry + 1, 0 if unknown
+			vertex_array_stats stats;
+
+		private:
+			static std::size_t next_type_slot()
+			{
+				static std::atomic<std::size_t> next(0);
+				return next++;
+			}
+
+			template<typename layout>
+			static std::size_t type_slot()
+			{
+				static const std::size_t slot = next_type_slot();
+				return slot;
+			}
+
+			template<typename layout>
+			std::size_t find()
+			{
+				std::size_t slot = type_slot<layout>();
+				if (slot < by_type.size() && by_type[slot])
+					return by_type[slot] - 1;
+
+				++stats.layouts;
+				std::vector<GLuint> key;
+#ifdef __APPLE__
+				key.push_back(layout::stride);		// baked into the pointers
+#endif
+				for (const attribute_desc &a : layout::describe())
+					key.insert(key.end(), { a.location, static_cast<GLuint>(a.components), a.type, a.normalized, a.integer, a.offset });
+
+				auto i = by_format.find(key);
+				std::size_t index;
+				if (i != by_format.end())
+					index = i->second;
+				else
+				{
+					entry e = { std::unique_ptr<vertex_array_object>(new vertex_array_object), 0, 0, 0, 0 };
+					e.vao->set<layout>();
+					index = entries.size();
+					entries.push_back(std::move(e));
+					by_format[key] = index;
+					++stats.arrays;
+					bound = 0;		// set() unbinds
+				}
+
+				if (slot >= by_type.size())
+					by_type.resize(slot + 1, 0);
+				by_type[slot] = index + 1;
+				return index;
+			}
+
+		public:
+			vertex_array_cache() :
+				bound(0),
+				stats()
+			{
+			}
+
+			// No copy constructor or assignment
+			vertex_array_cache(const vertex_array_cache &) = delete;
+			vertex_array_cache &operator=(const vertex_array_cache &) = delete;
+
+			// The vertex array for a layout, created on first use.
+			template<typename layout>
+			GLuint get()
+			{
+				return entries[find<layout>()].vao->obj();
+			}
+
+			// Binds the layout's vertex array with vertex_buffer (and index_buffer if not 0) as
+			// its source, only issuing the calls that change something.
+			template<typename layout>
+			void bind(GLuint vertex_buffer, GLuint index_buffer = 0, GLintptr offset = 0)
+			{
+				std::size_t index = find<layout>();
+				entry &e = entries[index];
+
+				if (bound != index + 1)
+				{
+					e.vao->bind();
+					bound = index + 1;
+					++stats.array_binds;
+				}
+				else
+					++stats.redundant;
+
+				if (e.vertex_buffer != vertex_buffer || e.offset != offset || e.stride != layout::stride)
+				{
+					e.vao->bind_vertex_buffer<layout>(vertex_buffer, offset);
+					e.vertex_buffer = vertex_buffer;
+					e.offset = offset;
+					e.stride = layout::stride;
+					++stats.buffer_binds;
+				}
+				else
+					++stats.redundant;
+
+				if (index_buffer && e.index_buffer != index_buffer)
+				{
+					e.vao->bind_index_buffer(index_buffer);
+					e.index_buffer = index_buffer;
+					++stats.buffer_binds;
+				}
+			}
+
+			// Forget what is bound, after code outside the cache bound a vertex array.
+			void invalidate()
+			{
+				bound = 0;
+			}
+
+			void unbind()
+			{
+				glBindVertexArray(0);
+				bound = 0;
+			}
+
+			// Deletes every vertex array, on the gl thread.
+			void release()
+			{
+				entries.clear();
+				by_format.clear();
+				by_type.clear();
+				bound = 0;
+			}
+
+			std::size_t size() const { return entries.size(); }
+			const vertex_array_stats &get_stats() const { return stats; }
+		};
         
         
     }
@@ -0,0 +1,317 @@
+#ifndef KNU_HEADLESS_CONTEXT_HPP
+#define KNU_HEADLESS_CONTEXT_HPP
+
+// Link with -lEGL -lOpenGL, and -lOSMesa when KNU_USE_OSMESA is defined.
+#ifdef __linux__
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/glcorearb.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) && defined(KNU_USE_OSMESA)
+// The few OSMesa entry points used, declared here because osmesa.h drags in the
+// compatibility gl.h, which clashes with glcorearb.h.
+typedef struct osmesa_context *OSMesaContext;
+extern "C" OSMesaContext OSMesaCreateContextAttribs(const int *attribList, OSMesaContext sharelist);
+extern "C" GLboolean OSMesaMakeCurrent(OSMesaContext ctx, void *buffer, GLenum type, GLsizei width, GLsizei height);
+extern "C" void OSMesaDestroyContext(OSMesaContext ctx);
+#endif
+
+namespace knu
+{
+	namespace graphics
+	{
+		enum class headless_backend
+		{
+			none,
+			egl_device,			// a gpu picked through EGL_EXT_platform_device
+			egl_surfaceless,	// Mesa's surfaceless platform, llvmpipe when there is no gpu
+			egl_default,		// whatever the default display offers
+			osmesa				// Mesa software rendering into client memory
+		};
+
+		inline const char *backend_name(headless_backend b)
+		{
+			switch (b)
+			{
+			case headless_backend::egl_device: return "egl device";
+			case headless_backend::egl_surfaceless: return "egl surfaceless";
+			case headless_backend::egl_default: return "egl default display";
+			case headless_backend::osmesa: return "osmesa";
+			default: return "none";
+			}
+		}
+
+		// Core profile context without a window, for render nodes and ci machines. There is
+		// no default framebuffer worth drawing to; render into a framebuffer object.
+		class headless_context
+		{
+			headless_backend backend;
+			int width;
+			int height;
+
+#ifdef __linux__
+			EGLDisplay display;
+			EGLContext context;
+			EGLSurface surface;
+#ifdef KNU_USE_OSMESA
+			OSMesaContext osmesa;
+			std::vector<unsigned char> osmesa_buffer;
+#endif
+#endif
+
+		private:
+#ifdef __linux__
+			static bool has_extension(const char *list, const char *name)
+			{
+				if (!list)
+					return false;
+				std::size_t n = std::strlen(name);
+				for (const char *p = std::strstr(list, name); p; p = std::strstr(p + n, name))
+					if ((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == '\0'))
+						return true;
+				return false;
+			}
+
+			// Initializes display and makes a context current on it, or cleans up and fails.
+			bool try_display(EGLDisplay d, int major, int minor, bool debug)
+			{
+				if (d == EGL_NO_DISPLAY)
+					return false;
+
+				EGLint egl_major, egl_minor;
+				if (!eglInitialize(d, &egl_major, &egl_minor))
+					return false;
+
+				if (!eglBindAPI(EGL_OPENGL_API))
+				{
+					eglTerminate(d);
+					return false;
+				}
+
+				bool surfaceless = has_extension(eglQueryString(d, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+
+				EGLint config_attribs[] = {
+					EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+					EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+					EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+					EGL_DEPTH_SIZE, 24,
+					EGL_NONE
+				};
+				EGLConfig config;
+				EGLint count = 0;
+				if (!eglChooseConfig(d, config_attribs, &config, 1, &count) || count == 0)
+				{
+					eglTerminate(d);
+					return false;
+				}
+
+				EGLint context_attribs[] = {
+					EGL_CONTEXT_MAJOR_VERSION, major,
+					EGL_CONTEXT_MINOR_VERSION, minor,
+					EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+					EGL_CONTEXT_OPENGL_DEBUG, debug ? EGL_TRUE : EGL_FALSE,
+					EGL_NONE
+				};
+				EGLContext c = eglCreateContext(d, config, EGL_NO_CONTEXT, context_attribs);
+				if (c == EGL_NO_CONTEXT)
+				{
+					eglTerminate(d);
+					return false;
+				}
+
+				EGLSurface s = EGL_NO_SURFACE;
+				if (!surfaceless)
+				{
+					EGLint pbuffer_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+					s = eglCreatePbufferSurface(d, config, pbuffer_attribs);
+				}
+
+				if ((!surfaceless && s == EGL_NO_SURFACE) || !eglMakeCurrent(d, s, s, c))
+				{
+					if (s != EGL_NO_SURFACE)
+						eglDestroySurface(d, s);
+					eglDestroyContext(d, c);
+					eglTerminate(d);
+					return false;
+				}
+
+				display = d;
+				context = c;
+				surface = s;
+				return true;
+			}
+
+			bool try_devices(int major, int minor, bool debug)
+			{
+				auto query_devices = reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC>(eglGetProcAddress("eglQueryDevicesEXT"));
+				auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+				if (!query_devices || !get_platform_display)
+					return false;
+
+				EGLDeviceEXT devices[16];
+				EGLint count = 0;
+				if (!query_devices(16, devices, &count))
+					return false;
+
+				for (EGLint i = 0; i < count; ++i)
+					if (try_display(get_platform_display(EGL_PLATFORM_DEVICE_EXT, devices[i], nullptr), major, minor, debug))
+						return true;
+				return false;
+			}
+
+			bool try_surfaceless(int major, int minor, bool debug)
+			{
+				auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+				if (!get_platform_display || !has_extension(eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS), "EGL_MESA_platform_surfaceless"))
+					return false;
+				return try_display(get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr), major, minor, debug);
+			}
+
+#ifdef KNU_USE_OSMESA
+			bool try_osmesa(int major, int minor)
+			{
+				const int attribs[] = {
+					0x22, 0x1908,		// OSMESA_FORMAT, OSMESA_RGBA
+					0x30, 24,			// OSMESA_DEPTH_BITS
+					0x33, 0x34,			// OSMESA_PROFILE, OSMESA_CORE_PROFILE
+					0x36, major,		// OSMESA_CONTEXT_MAJOR_VERSION
+					0x37, minor,		// OSMESA_CONTEXT_MINOR_VERSION
+					0
+				};
+				osmesa = OSMesaCreateContextAttribs(attribs, nullptr);
+				if (!osmesa)
+					return false;
+
+				osmesa_buffer.resize(static_cast<std::size_t>(width) * height * 4);
+				if (!OSMesaMakeCurrent(osmesa, osmesa_buffer.data(), GL_UNSIGNED_BYTE, width, height))
+				{
+					OSMesaDestroyContext(osmesa);
+					osmesa = nullptr;
+					return false;
+				}
+				return true;
+			}
+#endif
+#endif
+
+		public:
+			headless_context() :
+				backend(headless_backend::none),
+				width(0),
+				height(0)
+#ifdef __linux__
+				, display(EGL_NO_DISPLAY),
+				context(EGL_NO_CONTEXT),
+				surface(EGL_NO_SURFACE)
+#ifdef KNU_USE_OSMESA
+				, osmesa(nullptr)
+#endif
+#endif
+			{
+			}
+
+			~headless_context()
+			{
+				destroy();
+			}
+
+			// No copy constructor or assignment
+			headless_context(const headless_context &) = delete;
+			headless_context &operator=(const headless_context &) = delete;
+
+			// Tries a gpu device, then Mesa surfaceless, then the default display, then OSMesa,
+			// and leaves the first context that works current on this thread.
+			void create(int width_, int height_, int major, int minor, bool debug)
+			{
+				destroy();
+				width = width_;
+				height = height_;
+
+#ifdef __linux__
+				if (try_devices(major, minor, debug))
+					backend = headless_backend::egl_device;
+				else if (try_surfaceless(major, minor, debug))
+					backend = headless_backend::egl_surfaceless;
+				else if (try_display(eglGetDisplay(EGL_DEFAULT_DISPLAY), major, minor, debug))
+					backend = headless_backend::egl_default;
+#ifdef KNU_USE_OSMESA
+				else if (try_osmesa(major, minor))
+					backend = headless_backend::osmesa;
+#endif
+#endif
+				if (backend == headless_backend::none)
+					throw std::runtime_error("Unable to create a headless OpenGL " + std::to_string(major) + "."
+						+ std::to_string(minor) + " context");
+			}
+
+			void destroy()
+			{
+#ifdef __linux__
+				if (display != EGL_NO_DISPLAY)
+				{
+					eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+					if (surface != EGL_NO_SURFACE)
+						eglDestroySurface(display, surface);
+					if (context != EGL_NO_CONTEXT)
+						eglDestroyContext(display, context);
+					eglTerminate(display);
+				}
+				display = EGL_NO_DISPLAY;
+				context = EGL_NO_CONTEXT;
+				surface = EGL_NO_SURFACE;
+#ifdef KNU_USE_OSMESA
+				if (osmesa)
+					OSMesaDestroyContext(osmesa);
+				osmesa = nullptr;
+#endif
+#endif
+				backend = headless_backend::none;
+			}
+
+			void make_current()
+			{
+#ifdef __linux__
+				if (display != EGL_NO_DISPLAY)
+					eglMakeCurrent(display, surface, surface, context);
+#ifdef KNU_USE_OSMESA
+				if (osmesa)
+					OSMesaMakeCurrent(osmesa, osmesa_buffer.data(), GL_UNSIGNED_BYTE, width, height);
+#endif
+#endif
+			}
+
+			void release()
+			{
+#ifdef __linux__
+				if (display != EGL_NO_DISPLAY)
+					eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+				// OSMesa contexts cannot be released, they stay current on the creating thread
+#endif
+			}
+
+			void resize(int width_, int height_)
+			{
+				width = width_;
+				height = height_;
+			}
+
+			bool is_valid() const { return backend != headless_backend::none; }
+			// false when the context cannot move to another thread
+			bool can_release() const { return backend != headless_backend::osmesa; }
+			headless_backend get_backend() const { return backend; }
+			int get_width() const { return width; }
+			int get_height() const { return height; }
+		};
+	}
+}
+
+#endif // !KNU_HEADLESS_CONTEXT_HPP
@@ -17,6 +17,11 @@
 #include <SDL2_image/SDL_image.h>
 #endif
 
+#ifdef __linux__
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#endif
+
 #ifdef _WIN32
 #include <SDL_image.h>
 #pragma comment(lib, "sdl2_image.lib")
@@ -118,13 +123,30 @@ namespace knu
                 SDL_UnlockSurface(surface.get());
             }
             
+            // Adopts pixels produced in memory (atlas pages, captures, ...) instead of a file.
+            void create(std::string name_, int width_, int height_, int bytesPerPixel_, unsigned int format_,
+                unsigned int internalFormat_, std::unique_ptr<unsigned char[]> data_)
+            {
+                image_name = name_;
+                width = width_;
+                height = height_;
+                bytesPerPixel = bytesPerPixel_;
+                bitsPerPixel = bytesPerPixel_ * 8;
+                format = format_;
+                internalFormat = internalFormat_;
+                imageSize = width_ * height_ * bytesPerPixel_;
+                imageData = std::move(data_);
+            }
+            
 			std::string get_image_name() const { return image_name; }
             int get_width() const {return width;}
             int get_height() const {return height;}
             unsigned int get_format() const {return format;}
             unsigned int get_internal_format() const {return internalFormat;}
             int get_size() const {return imageSize;}
+            int get_bytes_per_pixel() const {return bytesPerPixel;}
             unsigned char *get_data() { return imageData.get();}
+            const unsigned char *get_data() const { return imageData.get();}
         };
     }
 }
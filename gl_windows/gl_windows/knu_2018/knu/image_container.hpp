@@ -0,0 +1,481 @@
+#ifndef KNU_IMAGE_CONTAINER_HPP
+#define KNU_IMAGE_CONTAINER_HPP
+
+#include <knu/mapped_file.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Describes how an internal format is laid out in memory. The gl enums are spelled
+		// out as values (like image4.hpp does) so this header works without a gl loader.
+		struct pixel_format
+		{
+			unsigned int internal_format;
+			unsigned int format;		// 0 for compressed formats
+			unsigned int type;			// 0 for compressed formats
+			int block_width;			// 1 for uncompressed formats
+			int block_height;
+			int block_bytes;			// bytes per block, or bytes per pixel when uncompressed
+			bool compressed;
+
+			std::size_t level_size(int w, int h, int d) const
+			{
+				std::size_t bw = static_cast<std::size_t>((w + block_width - 1) / block_width);
+				std::size_t bh = static_cast<std::size_t>((h + block_height - 1) / block_height);
+				return bw * bh * static_cast<std::size_t>(d) * static_cast<std::size_t>(block_bytes);
+			}
+		};
+
+		static const pixel_format known_pixel_formats[] =
+		{
+			{ 0x8058, 0x1908, 0x1401, 1, 1, 4, false },	// GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE
+			{ 0x8C43, 0x1908, 0x1401, 1, 1, 4, false },	// GL_SRGB8_ALPHA8
+			{ 0x8051, 0x1907, 0x1401, 1, 1, 3, false },	// GL_RGB8, GL_RGB
+			{ 0x8229, 0x1903, 0x1401, 1, 1, 1, false },	// GL_R8, GL_RED
+			{ 0x822B, 0x8227, 0x1401, 1, 1, 2, false },	// GL_RG8, GL_RG
+			{ 0x881A, 0x1908, 0x140B, 1, 1, 8, false },	// GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT
+			{ 0x8814, 0x1908, 0x1406, 1, 1, 16, false },	// GL_RGBA32F, GL_RGBA, GL_FLOAT
+			{ 0x83F0, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+			{ 0x83F1, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+			{ 0x83F2, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGBA_S3TC_DXT3_EXT
+			{ 0x83F3, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+			{ 0x8C4C, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+			{ 0x8C4D, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT
+			{ 0x8C4E, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT
+			{ 0x8C4F, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT
+			{ 0x8DBB, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_RED_RGTC1
+			{ 0x8DBC, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_SIGNED_RED_RGTC1
+			{ 0x8DBD, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RG_RGTC2
+			{ 0x8DBE, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_SIGNED_RG_RGTC2
+			{ 0x8E8C, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGBA_BPTC_UNORM
+			{ 0x8E8D, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM
+			{ 0x8E8E, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT
+			{ 0x8E8F, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT
+			{ 0x9274, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_RGB8_ETC2
+			{ 0x9275, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_SRGB8_ETC2
+			{ 0x9276, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2
+			{ 0x9277, 0, 0, 4, 4, 8, true },			// GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2
+			{ 0x9278, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_RGBA8_ETC2_EAC
+			{ 0x9279, 0, 0, 4, 4, 16, true },			// GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC
+		};
+
+		inline const pixel_format *find_pixel_format(unsigned int internal_format)
+		{
+			for (const auto &f : known_pixel_formats)
+				if (f.internal_format == internal_format)
+					return &f;
+			return nullptr;
+		}
+
+		// BGRA data is stored with an RGBA8 internal format, only the client format differs
+		inline pixel_format make_bgra8_format()
+		{
+			pixel_format f = *find_pixel_format(0x8058);
+			f.format = 0x80E1; // GL_BGRA
+			return f;
+		}
+
+		enum class container_target
+		{
+			texture_2d, texture_2d_array, texture_cube, texture_cube_array, texture_3d
+		};
+
+		// One mip level of one layer/face. data points straight into the file mapping.
+		struct image_span
+		{
+			int level;
+			int layer;
+			int face;
+			int width;
+			int height;
+			int depth;
+			const unsigned char *data;
+			std::size_t size;
+		};
+
+		// Pre-mipped, optionally pre-compressed images in KTX2 or DDS containers. Nothing is
+		// decoded or copied; the spans can be handed to glCompressedTexSubImage* as is.
+		class image_container
+		{
+			mapped_file file;
+			container_target target;
+			pixel_format format;
+			int width;
+			int height;
+			int depth;
+			int levels;
+			int layers;
+			int faces;
+			std::vector<image_span> spans;
+
+		private:
+			template<typename t>
+			t read(std::size_t offset) const
+			{
+				if (offset + sizeof(t) > file.size())
+					throw std::runtime_error("Truncated image container: " + file.get_file_name());
+
+				t value;
+				memcpy(&value, file.data() + offset, sizeof(t));
+				return value;
+			}
+
+			static int mip_dimension(int base, int level)
+			{
+				int d = level < 31 ? base >> level : 0;
+				return d < 1 ? 1 : d;
+			}
+
+			void truncated() const
+			{
+				throw std::runtime_error("Truncated image container: " + file.get_file_name());
+			}
+
+			// Everything below comes from the file, so sizes are checked before any offset or
+			// loop trusts them: each dimension is at most 65536, the mip chain no longer than
+			// the largest dimension allows, and every layer and face needs at least a byte.
+			void validate_layout(std::uint32_t w, std::uint32_t h, std::uint32_t d, std::uint32_t level_count, std::uint64_t layer_faces)
+			{
+				const std::uint32_t max_dimension = 1u << 16;
+				if (w == 0 || h == 0 || d == 0 || w > max_dimension || h > max_dimension || d > max_dimension)
+					throw std::runtime_error("Invalid image container size: " + file.get_file_name());
+
+				std::uint32_t largest = (std::max)(w, (std::max)(h, d));
+				std::uint32_t max_levels = 1;
+				while (largest >>= 1)
+					++max_levels;
+				if (level_count > max_levels)
+					throw std::runtime_error("Invalid image container mip count: " + file.get_file_name());
+
+				if (layer_faces == 0 || layer_faces > file.size())
+					truncated();
+			}
+
+			// base + index * size, throwing instead of wrapping around
+			std::uint64_t span_offset(std::uint64_t base, std::uint64_t index, std::uint64_t size) const
+			{
+				if (base > file.size() || (size && index > (file.size() - base) / size))
+					truncated();
+				return base + index * size;
+			}
+
+			void add_span(int level, int layer, int face, std::uint64_t offset)
+			{
+				image_span s;
+				s.level = level;
+				s.layer = layer;
+				s.face = face;
+				s.width = mip_dimension(width, level);
+				s.height = mip_dimension(height, level);
+				s.depth = mip_dimension(depth, level);
+				s.size = format.level_size(s.width, s.height, s.depth);
+
+				if (s.size > file.size() || offset > file.size() - s.size)
+					truncated();
+
+				s.data = file.data() + static_cast<std::size_t>(offset);
+				spans.push_back(s);
+			}
+
+			void set_target(bool array)
+			{
+				if (depth > 1)
+					target = container_target::texture_3d;
+				else if (faces == 6)
+					target = array ? container_target::texture_cube_array : container_target::texture_cube;
+				else
+					target = array ? container_target::texture_2d_array : container_target::texture_2d;
+			}
+
+			static const pixel_format &vk_format(std::uint32_t vk)
+			{
+				unsigned int internal_format = 0;
+				switch (vk)
+				{
+				case 37: internal_format = 0x8058; break;	// VK_FORMAT_R8G8B8A8_UNORM
+				case 43: internal_format = 0x8C43; break;	// VK_FORMAT_R8G8B8A8_SRGB
+				case 23: internal_format = 0x8051; break;	// VK_FORMAT_R8G8B8_UNORM
+				case 9: internal_format = 0x8229; break;	// VK_FORMAT_R8_UNORM
+				case 16: internal_format = 0x822B; break;	// VK_FORMAT_R8G8_UNORM
+				case 97: internal_format = 0x881A; break;	// VK_FORMAT_R16G16B16A16_SFLOAT
+				case 109: internal_format = 0x8814; break;	// VK_FORMAT_R32G32B32A32_SFLOAT
+				case 131: internal_format = 0x83F0; break;	// VK_FORMAT_BC1_RGB_UNORM_BLOCK
+				case 132: internal_format = 0x8C4C; break;	// VK_FORMAT_BC1_RGB_SRGB_BLOCK
+				case 133: internal_format = 0x83F1; break;	// VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+				case 134: internal_format = 0x8C4D; break;	// VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+				case 135: internal_format = 0x83F2; break;	// VK_FORMAT_BC2_UNORM_BLOCK
+				case 136: internal_format = 0x8C4E; break;	// VK_FORMAT_BC2_SRGB_BLOCK
+				case 137: internal_format = 0x83F3; break;	// VK_FORMAT_BC3_UNORM_BLOCK
+				case 138: internal_format = 0x8C4F; break;	// VK_FORMAT_BC3_SRGB_BLOCK
+				case 139: internal_format = 0x8DBB; break;	// VK_FORMAT_BC4_UNORM_BLOCK
+				case 140: internal_format = 0x8DBC; break;	// VK_FORMAT_BC4_SNORM_BLOCK
+				case 141: internal_format = 0x8DBD; break;	// VK_FORMAT_BC5_UNORM_BLOCK
+				case 142: internal_format = 0x8DBE; break;	// VK_FORMAT_BC5_SNORM_BLOCK
+				case 143: internal_format = 0x8E8F; break;	// VK_FORMAT_BC6H_UFLOAT_BLOCK
+				case 144: internal_format = 0x8E8E; break;	// VK_FORMAT_BC6H_SFLOAT_BLOCK
+				case 145: internal_format = 0x8E8C; break;	// VK_FORMAT_BC7_UNORM_BLOCK
+				case 146: internal_format = 0x8E8D; break;	// VK_FORMAT_BC7_SRGB_BLOCK
+				case 147: internal_format = 0x9274; break;	// VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK
+				case 148: internal_format = 0x9275; break;	// VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK
+				case 149: internal_format = 0x9276; break;	// VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK
+				case 150: internal_format = 0x9277; break;	// VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK
+				case 151: internal_format = 0x9278; break;	// VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK
+				case 152: internal_format = 0x9279; break;	// VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK
+				}
+
+				const pixel_format *f = find_pixel_format(internal_format);
+				if (!f)
+					throw std::runtime_error("Unsupported KTX2 vkFormat: " + std::to_string(vk));
+				return *f;
+			}
+
+			static pixel_format dxgi_format(std::uint32_t dxgi)
+			{
+				unsigned int internal_format = 0;
+				switch (dxgi)
+				{
+				case 28: internal_format = 0x8058; break;	// DXGI_FORMAT_R8G8B8A8_UNORM
+				case 29: internal_format = 0x8C43; break;	// DXGI_FORMAT_R8G8B8A8_UNORM_SRGB
+				case 87: return make_bgra8_format();		// DXGI_FORMAT_B8G8R8A8_UNORM
+				case 61: internal_format = 0x8229; break;	// DXGI_FORMAT_R8_UNORM
+				case 49: internal_format = 0x822B; break;	// DXGI_FORMAT_R8G8_UNORM
+				case 10: internal_format = 0x881A; break;	// DXGI_FORMAT_R16G16B16A16_FLOAT
+				case 2: internal_format = 0x8814; break;	// DXGI_FORMAT_R32G32B32A32_FLOAT
+				case 71: internal_format = 0x83F1; break;	// DXGI_FORMAT_BC1_UNORM
+				case 72: internal_format = 0x8C4D; break;	// DXGI_FORMAT_BC1_UNORM_SRGB
+				case 74: internal_format = 0x83F2; break;	// DXGI_FORMAT_BC2_UNORM
+				case 75: internal_format = 0x8C4E; break;	// DXGI_FORMAT_BC2_UNORM_SRGB
+				case 77: internal_format = 0x83F3; break;	// DXGI_FORMAT_BC3_UNORM
+				case 78: internal_format = 0x8C4F; break;	// DXGI_FORMAT_BC3_UNORM_SRGB
+				case 80: internal_format = 0x8DBB; break;	// DXGI_FORMAT_BC4_UNORM
+				case 81: internal_format = 0x8DBC; break;	// DXGI_FORMAT_BC4_SNORM
+				case 83: internal_format = 0x8DBD; break;	// DXGI_FORMAT_BC5_UNORM
+				case 84: internal_format = 0x8DBE; break;	// DXGI_FORMAT_BC5_SNORM
+				case 95: internal_format = 0x8E8F; break;	// DXGI_FORMAT_BC6H_UF16
+				case 96: internal_format = 0x8E8E; break;	// DXGI_FORMAT_BC6H_SF16
+				case 98: internal_format = 0x8E8C; break;	// DXGI_FORMAT_BC7_UNORM
+				case 99: internal_format = 0x8E8D; break;	// DXGI_FORMAT_BC7_UNORM_SRGB
+				}
+
+				const pixel_format *f = find_pixel_format(internal_format);
+				if (!f)
+					throw std::runtime_error("Unsupported DDS dxgi format: " + std::to_string(dxgi));
+				return *f;
+			}
+
+			static std::uint32_t four_cc(char a, char b, char c, char d)
+			{
+				return static_cast<std::uint32_t>(static_cast<unsigned char>(a)) |
+					(static_cast<std::uint32_t>(static_cast<unsigned char>(b)) << 8) |
+					(static_cast<std::uint32_t>(static_cast<unsigned char>(c)) << 16) |
+					(static_cast<std::uint32_t>(static_cast<unsigned char>(d)) << 24);
+			}
+
+			bool is_ktx2() const
+			{
+				static const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+				return file.size() >= sizeof(identifier) && 0 == memcmp(file.data(), identifier, sizeof(identifier));
+			}
+
+			bool is_dds() const
+			{
+				return file.size() >= 4 && read<std::uint32_t>(0) == four_cc('D', 'D', 'S', ' ');
+			}
+
+			void parse_ktx2()
+			{
+				std::uint32_t vk = read<std::uint32_t>(12);
+				std::uint32_t pixel_width = read<std::uint32_t>(20);
+				std::uint32_t pixel_height = read<std::uint32_t>(24);
+				std::uint32_t pixel_depth = read<std::uint32_t>(28);
+				std::uint32_t layer_count = read<std::uint32_t>(32);
+				std::uint32_t face_count = read<std::uint32_t>(36);
+				std::uint32_t level_count = read<std::uint32_t>(40);
+				std::uint32_t supercompression = read<std::uint32_t>(44);
+
+				if (supercompression != 0)
+					throw std::runtime_error("Supercompressed KTX2 files need a transcoder: " + file.get_file_name());
+
+				format = vk_format(vk);
+				if (face_count != 1 && face_count != 6)
+					throw std::runtime_error("Invalid KTX2 face count: " + file.get_file_name());
+				validate_layout(pixel_width, pixel_height ? pixel_height : 1, pixel_depth ? pixel_depth : 1,
+					level_count ? level_count : 1, std::uint64_t(layer_count ? layer_count : 1) * face_count);
+
+				width = static_cast<int>(pixel_width);
+				height = pixel_height ? static_cast<int>(pixel_height) : 1;
+				depth = pixel_depth ? static_cast<int>(pixel_depth) : 1;
+				layers = layer_count ? static_cast<int>(layer_count) : 1;
+				faces = static_cast<int>(face_count);
+				levels = level_count ? static_cast<int>(level_count) : 1;
+				set_target(layer_count != 0);
+
+				// level index follows the 80 byte header, level 0 first
+				const std::size_t level_index = 80;
+				for (int level = 0; level < levels; ++level)
+				{
+					std::uint64_t byte_offset = read<std::uint64_t>(level_index + level * 24);
+					std::size_t image_size = format.level_size(mip_dimension(width, level), mip_dimension(height, level), mip_dimension(depth, level));
+
+					// layers, then faces, are tightly packed inside a level
+					for (int layer = 0; layer < layers; ++layer)
+						for (int face = 0; face < faces; ++face)
+							add_span(level, layer, face, span_offset(byte_offset, std::uint64_t(layer) * faces + face, image_size));
+				}
+			}
+
+			void parse_dds()
+			{
+				const std::uint32_t DDSD_DEPTH = 0x800000;
+				const std::uint32_t DDPF_FOURCC = 0x4;
+				const std::uint32_t DDPF_RGB = 0x40;
+				const std::uint32_t DDSCAPS2_CUBEMAP = 0x200;
+				const std::uint32_t DDS_RESOURCE_MISC_TEXTURECUBE = 0x4;
+
+				// header is 124 bytes of dwords after the magic
+				auto header = [this](int dword) { return read<std::uint32_t>(4 + dword * 4); };
+
+				std::uint32_t flags = header(1);
+				std::uint32_t pixel_height = header(2);
+				std::uint32_t pixel_width = header(3);
+				std::uint32_t pixel_depth = (flags & DDSD_DEPTH) && header(5) ? header(5) : 1;
+				std::uint32_t level_count = header(6) ? header(6) : 1;
+
+				std::uint32_t pf_flags = header(19);
+				std::uint32_t pf_four_cc = header(20);
+				std::uint32_t caps2 = header(27);
+
+				std::size_t data_offset = 128;
+				bool array = false;
+				std::uint32_t layer_count = 1;
+				faces = (caps2 & DDSCAPS2_CUBEMAP) ? 6 : 1;
+
+				if ((pf_flags & DDPF_FOURCC) && pf_four_cc == four_cc('D', 'X', '1', '0'))
+				{
+					format = dxgi_format(read<std::uint32_t>(128));
+					std::uint32_t misc = read<std::uint32_t>(136);
+					std::uint32_t array_size = read<std::uint32_t>(140);
+
+					faces = (misc & DDS_RESOURCE_MISC_TEXTURECUBE) ? 6 : 1;
+					layer_count = array_size ? array_size : 1;
+					array = layer_count > 1;
+					data_offset = 148;
+				}
+				else if (pf_flags & DDPF_FOURCC)
+				{
+					unsigned int internal_format = 0;
+					if (pf_four_cc == four_cc('D', 'X', 'T', '1')) internal_format = 0x83F1;
+					else if (pf_four_cc == four_cc('D', 'X', 'T', '3')) internal_format = 0x83F2;
+					else if (pf_four_cc == four_cc('D', 'X', 'T', '5')) internal_format = 0x83F3;
+					else if (pf_four_cc == four_cc('A', 'T', 'I', '1') || pf_four_cc == four_cc('B', 'C', '4', 'U')) internal_format = 0x8DBB;
+					else if (pf_four_cc == four_cc('A', 'T', 'I', '2') || pf_four_cc == four_cc('B', 'C', '5', 'U')) internal_format = 0x8DBD;
+
+					const pixel_format *f = find_pixel_format(internal_format);
+					if (!f)
+						throw std::runtime_error("Unsupported DDS four cc: " + file.get_file_name());
+					format = *f;
+				}
+				else if ((pf_flags & DDPF_RGB) && header(21) == 32)
+				{
+					// legacy uncompressed, red in the low byte is RGBA otherwise BGRA
+					format = header(22) == 0x000000ff ? *find_pixel_format(0x8058) : make_bgra8_format();
+				}
+				else
+					throw std::runtime_error("Unsupported DDS pixel format: " + file.get_file_name());
+
+				validate_layout(pixel_width, pixel_height, pixel_depth, level_count, std::uint64_t(layer_count) * faces);
+				width = static_cast<int>(pixel_width);
+				height = static_cast<int>(pixel_height);
+				depth = static_cast<int>(pixel_depth);
+				levels = static_cast<int>(level_count);
+				layers = static_cast<int>(layer_count);
+				set_target(array);
+
+				// every layer/face stores its whole mip chain before the next one starts
+				std::uint64_t offset = data_offset;
+				for (int layer = 0; layer < layers; ++layer)
+				{
+					for (int face = 0; face < faces; ++face)
+					{
+						for (int level = 0; level < levels; ++level)
+						{
+							add_span(level, layer, face, offset);
+							offset += spans.back().size;
+						}
+					}
+				}
+			}
+
+		public:
+			image_container() :
+				target(container_target::texture_2d),
+				format(),
+				width(0),
+				height(0),
+				depth(0),
+				levels(0),
+				layers(0),
+				faces(0)
+			{
+			}
+
+			explicit image_container(std::string name_) :
+				image_container()
+			{
+				load(name_);
+			}
+
+			// No copy constructor or assignment
+			image_container(const image_container &) = delete;
+			image_container &operator=(const image_container &) = delete;
+
+			image_container(image_container &&) = default;
+			image_container &operator=(image_container &&) = default;
+
+			void load(std::string name_)
+			{
+				spans.clear();
+				file.open(name_);
+
+				if (is_ktx2())
+					parse_ktx2();
+				else if (is_dds())
+					parse_dds();
+				else
+					throw std::runtime_error("Unknown image container: " + name_);
+			}
+
+			const image_span &get_span(int level, int layer = 0, int face = 0) const
+			{
+				for (const auto &s : spans)
+					if (s.level == level && s.layer == layer && s.face == face)
+						return s;
+
+				throw std::runtime_error("No such level/layer/face in: " + file.get_file_name());
+			}
+
+			std::string get_image_name() const { return file.get_file_name(); }
+			container_target get_target() const { return target; }
+			const pixel_format &get_format() const { return format; }
+			unsigned int get_internal_format() const { return format.internal_format; }
+			bool is_compressed() const { return format.compressed; }
+			int get_width() const { return width; }
+			int get_height() const { return height; }
+			int get_depth() const { return depth; }
+			int get_levels() const { return levels; }
+			int get_layers() const { return layers; }
+			int get_faces() const { return faces; }
+			const std::vector<image_span> &get_spans() const { return spans; }
+			std::size_t get_file_size() const { return file.size(); }
+		};
+	}
+}
+
+#endif // !KNU_IMAGE_CONTAINER_HPP
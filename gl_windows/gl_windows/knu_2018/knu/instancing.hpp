@@ -0,0 +1,485 @@
+#ifndef KNU_INSTANCING_HPP
+#define KNU_INSTANCING_HPP
+
+#include <knu/gl_utility.hpp>
+#include <knu/job_system.hpp>
+#include <knu/render_thread.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#endif
+
+namespace knu
+{
+	namespace graphics
+	{
+		// What the vertex shader reads for each instance, with the default base location:
+		//
+		//	layout(location = 8) in mat4 instance_model;		// 8 to 11
+		//	layout(location = 12) in mat3 instance_normal;		// 12 to 14
+		//
+		// normal is the inverse transpose of the model matrix's upper 3x3, column major.
+		struct instance_data
+		{
+			float model[16];
+			float normal[9];
+		};
+
+		// Instances of one mesh with one material, drawn with a single call.
+		struct instance_batch
+		{
+			std::uint32_t mesh;
+			std::uint32_t material;
+			std::uint32_t first_instance;	// into the instances written for the frame
+			std::uint32_t instance_count;
+		};
+
+		namespace detail
+		{
+			inline void prefetch(const void *p)
+			{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+				_mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+				__builtin_prefetch(p);
+#else
+				(void)p;
+#endif
+			}
+
+			inline void pack_instance(const float *m, instance_data &out)
+			{
+				std::memcpy(out.model, m, sizeof(out.model));
+
+				// the columns of the inverse transpose are the cross products of the other two
+				// columns divided by the determinant
+				const float *c0 = m, *c1 = m + 4, *c2 = m + 8;
+				float *n = out.normal;
+				n[0] = c1[1] * c2[2] - c1[2] * c2[1];
+				n[1] = c1[2] * c2[0] - c1[0] * c2[2];
+				n[2] = c1[0] * c2[1] - c1[1] * c2[0];
+				n[3] = c2[1] * c0[2] - c2[2] * c0[1];
+				n[4] = c2[2] * c0[0] - c2[0] * c0[2];
+				n[5] = c2[0] * c0[1] - c2[1] * c0[0];
+				n[6] = c0[1] * c1[2] - c0[2] * c1[1];
+				n[7] = c0[2] * c1[0] - c0[0] * c1[2];
+				n[8] = c0[0] * c1[1] - c0[1] * c1[0];
+
+				float det = c0[0] * n[0] + c0[1] * n[1] + c0[2] * n[2];
+				float inv = det != 0.0f ? 1.0f / det : 0.0f;
+				for (int i = 0; i < 9; ++i)
+					n[i] *= inv;
+			}
+		}
+
+		// Groups draw items by mesh and material. Batches come out ordered by material, then
+		// mesh, and items keep their submission order within a batch. The items must stay
+		// alive until write() has run.
+		class instance_batcher
+		{
+			std::unordered_map<std::uint64_t, std::uint32_t> lookup;		// mesh << 32 | material -> batch
+			std::vector<instance_batch> batches;
+			std::vector<std::uint32_t> batch_of;		// per item, scratch
+			std::vector<std::uint32_t> order;			// instance -> item
+			const draw_item *items;
+
+		private:
+			// Items are read in batch order, which is random for a mixed scene; fetching a
+			// few ahead keeps this from waiting on memory at every instance.
+			void write_range(instance_data *out, std::size_t first, std::size_t last) const
+			{
+				const std::size_t distance = 16;
+				for (std::size_t j = first; j < last; ++j)
+				{
+					if (j + distance < last)
+					{
+						const draw_item *next = items + order[j + distance];
+						detail::prefetch(next->model);
+						detail::prefetch(next->model + 15);
+					}
+					detail::pack_instance(items[order[j]].model, out[j]);
+				}
+			}
+
+		public:
+			instance_batcher() : items(nullptr) {}
+
+			// No copy constructor or assignment
+			instance_batcher(const instance_batcher &) = delete;
+			instance_batcher &operator=(const instance_batcher &) = delete;
+
+			void build(const draw_item *items_, std::size_t count)
+			{
+				items = items_;
+				lookup.clear();
+				batches.clear();
+				batch_of.resize(count);
+				order.resize(count);
+
+				// neighbouring items usually share a key, so the map is only asked on a change
+				std::uint64_t last_key = 0;
+				std::uint32_t last_batch = 0;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					std::uint64_t key = static_cast<std::uint64_t>(items[i].mesh) << 32 | items[i].material;
+					if (i == 0 || key != last_key)
+					{
+						auto found = lookup.emplace(key, static_cast<std::uint32_t>(batches.size()));
+						if (found.second)
+							batches.push_back(instance_batch{ items[i].mesh, items[i].material, 0, 0 });
+						last_key = key;
+						last_batch = found.first->second;
+					}
+					batch_of[i] = last_batch;
+					++batches[last_batch].instance_count;
+				}
+
+				std::vector<std::uint32_t> sorted(batches.size());
+				for (std::uint32_t b = 0; b < sorted.size(); ++b)
+					sorted[b] = b;
+				std::sort(sorted.begin(), sorted.end(), [&](std::uint32_t a, std::uint32_t b) {
+					const instance_batch &x = batches[a], &y = batches[b];
+					return x.material != y.material ? x.material < y.material : x.mesh < y.mesh;
+				});
+
+				// cursor per original batch, then the batches themselves in draw order
+				std::vector<std::uint32_t> cursor(batches.size());
+				std::vector<instance_batch> ordered(batches.size());
+				std::uint32_t first = 0;
+				for (std::size_t k = 0; k < sorted.size(); ++k)
+				{
+					instance_batch b = batches[sorted[k]];
+					b.first_instance = first;
+					cursor[sorted[k]] = first;
+					first += b.instance_count;
+					ordered[k] = b;
+				}
+				batches.swap(ordered);
+
+				for (std::size_t i = 0; i < count; ++i)
+					order[cursor[batch_of[i]]++] = static_cast<std::uint32_t>(i);
+			}
+
+			// Packs every instance in batch order. Writes are sequential, so out can be
+			// write combined memory.
+			void write(instance_data *out) const
+			{
+				write_range(out, 0, order.size());
+			}
+
+			void write(job_system &jobs, instance_data *out) const
+			{
+				jobs.parallel_for(0, order.size(), 4096, [&](std::size_t first, std::size_t last) {
+					write_range(out, first, last);
+				});
+			}
+
+			const std::vector<instance_batch> &get_batches() const { return batches; }
+			std::size_t instance_count() const { return order.size(); }
+		};
+
+		// How resolve() tells the renderer to draw a batch's mesh. It binds the vertex array
+		// itself, e.g. through a vertex_array_cache, together with the material's state.
+		struct instanced_mesh
+		{
+			GLuint vertex_array;
+			GLenum mode;
+			GLsizei index_count;
+			GLenum index_type;		// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+			GLuint first_index;
+			GLint base_vertex;
+
+			instanced_mesh() :
+				vertex_array(0),
+				mode(GL_TRIANGLES),
+				index_count(0),
+				index_type(GL_UNSIGNED_INT),
+				first_index(0),
+				base_vertex(0)
+			{
+			}
+		};
+
+		struct instancing_stats
+		{
+			std::size_t items;				// draw items submitted last frame
+			std::size_t draw_calls;			// batches drawn last frame
+			std::size_t bytes;				// instance data streamed last frame
+			double build_ms;				// grouping and packing last frame
+			double stall_ms;				// waiting for the gpu to release a slot last frame
+			std::uint64_t reallocations;	// times the ring grew
+			std::uint64_t frames;
+		};
+
+		// Draws every draw item with one glDrawElementsInstancedBaseVertexBaseInstance per mesh
+		// and material instead of one uniform upload and draw call per item. Instance data
+		// streams through a ring of persistently mapped slots guarded by fences, and base
+		// instance picks the slot, so the instance buffer is bound once per vertex array.
+		// macOS has neither buffer storage nor base instance; there the buffer is orphaned
+		// each frame and the instance attributes are pointed at each batch.
+		//
+		// Call submit() then draw() once per frame on the thread owning the context.
+		class instance_renderer
+		{
+			static constexpr GLuint instance_binding = 1;	// vertex_array_cache sources vertices from 0
+
+			GLuint buffer;
+			instance_data *mapped;
+			std::size_t capacity;		// instances per slot
+			int slot_count;
+			int current_slot;
+			std::vector<GLsync> fences;
+			GLuint base_location;
+			std::vector<std::pair<GLuint, GLuint>> attached;	// vertex array, instance buffer it sources
+			instance_batcher batcher;
+			std::vector<instance_data> staging;
+			instancing_stats stats;
+
+		private:
+			void acquire_slot()
+			{
+				GLsync &fence = fences[current_slot];
+				if (!fence)
+					return;
+
+				auto start = std::chrono::steady_clock::now();
+				glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+				std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+				stats.stall_ms += waited.count();
+
+				glDeleteSync(fence);
+				fence = nullptr;
+			}
+
+			void release()
+			{
+				for (GLsync &f : fences)
+				{
+					if (f)
+					{
+						glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+						glDeleteSync(f);
+						f = nullptr;
+					}
+				}
+
+				if (buffer)
+				{
+#ifndef __APPLE__
+					glBindBuffer(GL_ARRAY_BUFFER, buffer);
+					glUnmapBuffer(GL_ARRAY_BUFFER);
+					glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+					glDeleteBuffers(1, &buffer);
+				}
+				buffer = 0;
+				mapped = nullptr;
+				attached.clear();
+			}
+
+			void allocate()
+			{
+				glGenBuffers(1, &buffer);
+				glBindBuffer(GL_ARRAY_BUFFER, buffer);
+#ifdef __APPLE__
+				glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(instance_data), nullptr, GL_STREAM_DRAW);
+#else
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				GLsizeiptr total = static_cast<GLsizeiptr>(capacity * slot_count * sizeof(instance_data));
+				glBufferStorage(GL_ARRAY_BUFFER, total, nullptr, flags);
+				mapped = static_cast<instance_data *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags));
+#endif
+				glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+#ifndef __APPLE__
+				if (!mapped)
+					throw std::runtime_error("Unable to map instance buffer");
+#endif
+			}
+
+			// Only the first frame after a larger submit pays for this, the ring never shrinks.
+			void reserve(std::size_t count)
+			{
+				if (count <= capacity && buffer)
+					return;
+
+				release();
+				while (capacity < count)
+					capacity *= 2;
+				allocate();
+				++stats.reallocations;
+			}
+
+			// The mat4 takes four vec4 locations and the mat3 three vec3 ones after it.
+			void attach(GLuint vertex_array, GLintptr first_instance)
+			{
+#ifdef __APPLE__
+				glBindBuffer(GL_ARRAY_BUFFER, buffer);
+				const GLsizei stride = sizeof(instance_data);
+				GLintptr base = first_instance * stride;
+				for (GLuint c = 0; c < 4; ++c)
+				{
+					glEnableVertexAttribArray(base_location + c);
+					glVertexAttribPointer(base_location + c, 4, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const GLvoid *>(base + offsetof(instance_data, model) + c * 16));
+					glVertexAttribDivisor(base_location + c, 1);
+				}
+				for (GLuint c = 0; c < 3; ++c)
+				{
+					glEnableVertexAttribArray(base_location + 4 + c);
+					glVertexAttribPointer(base_location + 4 + c, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const GLvoid *>(base + offsetof(instance_data, normal) + c * 12));
+					glVertexAttribDivisor(base_location + 4 + c, 1);
+				}
+#else
+				(void)first_instance;
+				for (const auto &a : attached)
+					if (a.first == vertex_array && a.second == buffer)
+						return;
+
+				for (GLuint c = 0; c < 4; ++c)
+				{
+					glEnableVertexAttribArray(base_location + c);
+					glVertexAttribFormat(base_location + c, 4, GL_FLOAT, GL_FALSE, static_cast<GLuint>(offsetof(instance_data, model) + c * 16));
+					glVertexAttribBinding(base_location + c, instance_binding);
+				}
+				for (GLuint c = 0; c < 3; ++c)
+				{
+					glEnableVertexAttribArray(base_location + 4 + c);
+					glVertexAttribFormat(base_location + 4 + c, 3, GL_FLOAT, GL_FALSE, static_cast<GLuint>(offsetof(instance_data, normal) + c * 12));
+					glVertexAttribBinding(base_location + 4 + c, instance_binding);
+				}
+				glVertexBindingDivisor(instance_binding, 1);
+				glBindVertexBuffer(instance_binding, buffer, 0, sizeof(instance_data));
+
+				auto i = std::find_if(attached.begin(), attached.end(), [&](const std::pair<GLuint, GLuint> &a) { return a.first == vertex_array; });
+				if (i != attached.end())
+					i->second = buffer;
+				else
+					attached.emplace_back(vertex_array, buffer);
+#endif
+			}
+
+			template<typename writer>
+			void upload(const draw_item *items, std::size_t count, writer write)
+			{
+				auto start = std::chrono::steady_clock::now();
+				stats.stall_ms = 0.0;
+
+				batcher.build(items, count);
+				reserve(count);
+#ifdef __APPLE__
+				staging.resize(count);
+				write(staging.data());
+				glBindBuffer(GL_ARRAY_BUFFER, buffer);
+				glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(instance_data), nullptr, GL_STREAM_DRAW);
+				glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(instance_data), staging.data());
+				glBindBuffer(GL_ARRAY_BUFFER, 0);
+#else
+				acquire_slot();
+				write(mapped + current_slot * capacity);
+#endif
+
+				std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+				stats.build_ms = elapsed.count() - stats.stall_ms;
+				stats.items = count;
+				stats.bytes = count * sizeof(instance_data);
+			}
+
+		public:
+			// capacity_ is the starting number of instances per slot; base_location_ is the
+			// first of the seven attribute locations the instance data takes.
+			instance_renderer(std::size_t capacity_ = 1 << 14, int slot_count_ = 3, GLuint base_location_ = 8) :
+				buffer(0),
+				mapped(nullptr),
+				capacity((std::max)(capacity_, std::size_t(1))),
+				slot_count(slot_count_),
+				current_slot(0),
+				fences(slot_count_, nullptr),
+				base_location(base_location_),
+				stats()
+			{
+				allocate();
+			}
+
+			~instance_renderer()
+			{
+				release();
+			}
+
+			// No copy constructor or assignment
+			instance_renderer(const instance_renderer &) = delete;
+			instance_renderer &operator=(const instance_renderer &) = delete;
+
+			// Groups the items and streams their instance data into the next slot.
+			void submit(const draw_item *items, std::size_t count)
+			{
+				upload(items, count, [&](instance_data *out) { batcher.write(out); });
+			}
+
+			void submit(job_system &jobs, const draw_item *items, std::size_t count)
+			{
+				upload(items, count, [&](instance_data *out) { batcher.write(jobs, out); });
+			}
+
+			void submit(const frame_packet &packet)
+			{
+				submit(packet.draws.data(), packet.draws.size());
+			}
+
+			// resolve(mesh, material, out) binds what the batch needs and describes the mesh.
+			// The instance attributes are attached to whatever vertex array it names.
+			template<typename function>
+			void draw(function resolve)
+			{
+				const std::vector<instance_batch> &batches = batcher.get_batches();
+#ifdef __APPLE__
+				const GLuint slot_base = 0;
+#else
+				const GLuint slot_base = static_cast<GLuint>(current_slot * capacity);
+#endif
+
+				std::size_t draw_calls = 0;
+				for (const instance_batch &b : batches)
+				{
+					instanced_mesh mesh;
+					resolve(b.mesh, b.material, mesh);
+					if (!mesh.index_count)
+						continue;
+
+					attach(mesh.vertex_array, slot_base + b.first_instance);
+					std::size_t index_size = mesh.index_type == GL_UNSIGNED_SHORT ? 2 : (mesh.index_type == GL_UNSIGNED_BYTE ? 1 : 4);
+					const GLvoid *indices = reinterpret_cast<const GLvoid *>(mesh.first_index * index_size);
+#ifdef __APPLE__
+					glDrawElementsInstancedBaseVertex(mesh.mode, mesh.index_count, mesh.index_type, indices,
+						b.instance_count, mesh.base_vertex);
+#else
+					glDrawElementsInstancedBaseVertexBaseInstance(mesh.mode, mesh.index_count, mesh.index_type, indices,
+						b.instance_count, mesh.base_vertex, slot_base + b.first_instance);
+#endif
+					++draw_calls;
+				}
+
+#ifndef __APPLE__
+				fences[current_slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+				current_slot = (current_slot + 1) % slot_count;
+#endif
+				stats.draw_calls = draw_calls;
+				++stats.frames;
+			}
+
+			const std::vector<instance_batch> &get_batches() const { return batcher.get_batches(); }
+			GLuint get_base_location() const { return base_location; }
+			const instancing_stats &get_stats() const { return stats; }
+		};
+	}
+}
+
+#endif // !KNU_INSTANCING_HPP
@@ -0,0 +1,468 @@
+#ifndef KNU_JOB_SYSTEM_HPP
+#define KNU_JOB_SYSTEM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace knu
+{
+	class job_system;
+
+	// Counts unfinished jobs. Jobs can be chained behind a counter with run_after(), and
+	// wait() keeps the calling thread busy with other jobs until it drops to zero.
+	class job_counter
+	{
+		friend class job_system;
+
+		std::atomic<int> pending;
+		std::atomic<int> finishing;		// jobs past their task that may still touch the counter
+		std::mutex continuation_mutex;
+		std::vector<std::function<void()>> continuations;
+
+	public:
+		job_counter() :
+			pending(0),
+			finishing(0)
+		{
+		}
+
+		// No copy constructor or assignment
+		job_counter(const job_counter &) = delete;
+		job_counter &operator=(const job_counter &) = delete;
+
+		// once true the counter may be destroyed
+		bool is_done() const
+		{
+			return pending.load(std::memory_order_acquire) == 0 && finishing.load(std::memory_order_acquire) == 0;
+		}
+	};
+
+	namespace detail
+	{
+		struct job
+		{
+			std::function<void()> task;
+			job_counter *counter;
+			bool from_heap;
+			std::atomic<bool> busy;
+
+			job() :
+				counter(nullptr),
+				from_heap(false),
+				busy(false)
+			{}
+		};
+
+		// Chase-Lev deque: the owning worker pushes and pops at the bottom, thieves take from
+		// the top. Fixed capacity; push fails when full and the caller runs the job inline.
+		class work_stealing_deque
+		{
+			std::unique_ptr<std::atomic<job *>[]> buffer;
+			std::int64_t mask;
+			// top and bottom on separate cache lines, thieves write one and the owner the other
+			char pad0[64];
+			std::atomic<std::int64_t> top;
+			char pad1[64];
+			std::atomic<std::int64_t> bottom;
+			char pad2[64];
+
+		public:
+			explicit work_stealing_deque(std::int64_t capacity = 4096) :
+				buffer(new std::atomic<job *>[capacity]),
+				mask(capacity - 1),
+				pad0(),
+				top(0),
+				pad1(),
+				bottom(0),
+				pad2()
+			{
+				for (std::int64_t i = 0; i < capacity; ++i)
+					buffer[i].store(nullptr, std::memory_order_relaxed);
+			}
+
+			bool push(job *j)
+			{
+				std::int64_t b = bottom.load(std::memory_order_relaxed);
+				std::int64_t t = top.load(std::memory_order_acquire);
+				if (b - t > mask)
+					return false;
+
+				buffer[b & mask].store(j, std::memory_order_relaxed);
+				bottom.store(b + 1, std::memory_order_release);
+				return true;
+			}
+
+			job *pop()
+			{
+				std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+				bottom.store(b, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::int64_t t = top.load(std::memory_order_relaxed);
+
+				if (t > b)
+				{
+					bottom.store(b + 1, std::memory_order_relaxed);
+					return nullptr;
+				}
+
+				job *j = buffer[b & mask].load(std::memory_order_relaxed);
+				if (t == b)
+				{
+					// last item, race any thief for it
+					if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+						j = nullptr;
+					bottom.store(b + 1, std::memory_order_relaxed);
+				}
+				return j;
+			}
+
+			job *steal()
+			{
+				std::int64_t t = top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::int64_t b = bottom.load(std::memory_order_acquire);
+
+				if (t >= b)
+					return nullptr;
+
+				job *j = buffer[t & mask].load(std::memory_order_relaxed);
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					return nullptr;
+				return j;
+			}
+
+			bool empty() const
+			{
+				return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+			}
+		};
+	}
+
+	// Work-stealing scheduler. The thread that constructs it is worker 0 and takes part in
+	// the work whenever it waits; the other workers are background threads.
+	class job_system
+	{
+		struct worker
+		{
+			detail::work_stealing_deque deque;
+			std::vector<detail::job> pool;
+			std::size_t next_job;
+			std::uint64_t executed;
+			std::uint64_t stolen;
+
+			worker() :
+				pool(4096),
+				next_job(0),
+				executed(0),
+				stolen(0)
+			{}
+		};
+
+		std::vector<std::unique_ptr<worker>> workers;
+		std::vector<std::thread> threads;
+		std::atomic<bool> running;
+
+		// jobs submitted from threads that are not workers (e.g. the render thread)
+		std::mutex injected_mutex;
+		std::deque<detail::job *> injected;
+
+		std::mutex sleep_mutex;
+		std::condition_variable wake;
+		std::atomic<int> sleeping;
+
+	private:
+		int &this_worker()
+		{
+			static thread_local int index = -1;
+			return index;
+		}
+
+		job_system *&this_system()
+		{
+			static thread_local job_system *system = nullptr;
+			return system;
+		}
+
+		int worker_index()
+		{
+			return this_system() == this ? this_worker() : -1;
+		}
+
+		detail::job *allocate(std::function<void()> task, job_counter *counter)
+		{
+			detail::job *j = nullptr;
+			int w = worker_index();
+
+			if (w >= 0)
+			{
+				worker &self = *workers[w];
+				detail::job &candidate = self.pool[self.next_job++ & (self.pool.size() - 1)];
+				if (!candidate.busy.load(std::memory_order_acquire))
+					j = &candidate;
+			}
+
+			// pool slot still in flight, or not on a worker thread
+			if (!j)
+			{
+				j = new detail::job();
+				j->from_heap = true;
+			}
+
+			j->busy.store(true, std::memory_order_relaxed);
+			j->task = std::move(task);
+			j->counter = counter;
+			return j;
+		}
+
+		void finish(detail::job *j)
+		{
+			job_counter *counter = j->counter;
+			j->task = nullptr;
+
+			if (j->from_heap)
+				delete j;
+			else
+				j->busy.store(false, std::memory_order_release);
+
+			if (!counter)
+				return;
+
+			std::vector<std::function<void()>> ready;
+			counter->finishing.fetch_add(1, std::memory_order_acq_rel);
+			if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				std::lock_guard<std::mutex> lock(counter->continuation_mutex);
+				ready.swap(counter->continuations);
+			}
+			// last access, a waiter may destroy the counter from here on
+			counter->finishing.fetch_sub(1, std::memory_order_release);
+
+			for (auto &c : ready)
+				schedule(std::move(c), nullptr);
+		}
+
+		void execute(detail::job *j, int w)
+		{
+			j->task();
+			if (w >= 0)
+				++workers[w]->executed;
+			finish(j);
+		}
+
+		void schedule(std::function<void()> task, job_counter *counter)
+		{
+			detail::job *j = allocate(std::move(task), counter);
+			int w = worker_index();
+
+			if (w >= 0)
+			{
+				if (!workers[w]->deque.push(j))
+				{
+					execute(j, w);
+					return;
+				}
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lock(injected_mutex);
+				injected.push_back(j);
+			}
+
+			if (sleeping.load(std::memory_order_acquire) > 0)
+			{
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				wake.notify_one();
+			}
+		}
+
+		detail::job *find_job(int w, std::minstd_rand &rng)
+		{
+			if (w >= 0)
+				if (detail::job *j = workers[w]->deque.pop())
+					return j;
+
+			{
+				std::lock_guard<std::mutex> lock(injected_mutex);
+				if (!injected.empty())
+				{
+					detail::job *j = injected.front();
+					injected.pop_front();
+					return j;
+				}
+			}
+
+			// start at a random victim so thieves do not all hit the same deque
+			std::size_t count = workers.size();
+			std::size_t start = rng() % count;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				std::size_t victim = (start + i) % count;
+				if (static_cast<int>(victim) == w)
+					continue;
+				if (detail::job *j = workers[victim]->deque.steal())
+				{
+					if (w >= 0)
+						++workers[w]->stolen;
+					return j;
+				}
+			}
+			return nullptr;
+		}
+
+		bool has_work()
+		{
+			for (auto &w : workers)
+				if (!w->deque.empty())
+					return true;
+			std::lock_guard<std::mutex> lock(injected_mutex);
+			return !injected.empty();
+		}
+
+		void worker_main(int index)
+		{
+			this_system() = this;
+			this_worker() = index;
+			std::minstd_rand rng(static_cast<unsigned>(index) + 1);
+			int idle_spins = 0;
+
+			while (running.load(std::memory_order_acquire))
+			{
+				if (detail::job *j = find_job(index, rng))
+				{
+					execute(j, index);
+					idle_spins = 0;
+					continue;
+				}
+
+				if (++idle_spins < 256)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				sleeping.fetch_add(1, std::memory_order_acq_rel);
+				wake.wait_for(lock, std::chrono::milliseconds(2), [this]() { return !running || has_work(); });
+				sleeping.fetch_sub(1, std::memory_order_acq_rel);
+				idle_spins = 0;
+			}
+		}
+
+	public:
+		// thread_count includes the constructing thread; 0 uses every hardware thread
+		explicit job_system(unsigned thread_count = 0) :
+			running(true),
+			sleeping(0)
+		{
+			if (thread_count == 0)
+				thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+
+			for (unsigned i = 0; i < thread_count; ++i)
+				workers.emplace_back(new worker());
+
+			this_system() = this;
+			this_worker() = 0;
+
+			for (unsigned i = 1; i < thread_count; ++i)
+				threads.emplace_back(&job_system::worker_main, this, static_cast<int>(i));
+		}
+
+		// Jobs still queued are not run; wait on their counters first.
+		~job_system()
+		{
+			running.store(false, std::memory_order_release);
+			{
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				wake.notify_all();
+			}
+			for (auto &t : threads)
+				t.join();
+
+			if (this_system() == this)
+				this_system() = nullptr;
+		}
+
+		// No copy constructor or assignment
+		job_system(const job_system &) = delete;
+		job_system &operator=(const job_system &) = delete;
+
+		void run(std::function<void()> task, job_counter *counter = nullptr)
+		{
+			if (counter)
+				counter->pending.fetch_add(1, std::memory_order_acq_rel);
+			schedule(std::move(task), counter);
+		}
+
+		// Starts task once dependency reaches zero, without blocking anybody meanwhile.
+		void run_after(job_counter &dependency, std::function<void()> task, job_counter *counter = nullptr)
+		{
+			if (counter)
+				counter->pending.fetch_add(1, std::memory_order_acq_rel);
+
+			std::function<void()> continuation = [this, task = std::move(task), counter]() { schedule(task, counter); };
+			{
+				std::lock_guard<std::mutex> lock(dependency.continuation_mutex);
+				// continuations are taken under this lock once pending hits zero
+				if (dependency.pending.load(std::memory_order_acquire) != 0)
+				{
+					dependency.continuations.push_back(std::move(continuation));
+					return;
+				}
+			}
+			continuation();
+		}
+
+		// Runs other jobs on this thread until counter reaches zero.
+		void wait(job_counter &counter)
+		{
+			int w = worker_index();
+			std::minstd_rand rng(static_cast<unsigned>(w + 2));
+
+			while (!counter.is_done())
+			{
+				if (detail::job *j = find_job(w, rng))
+					execute(j, w);
+				else
+					std::this_thread::yield();
+			}
+		}
+
+		// Calls fn(first, last) over [begin, end) in chunks of at least grain elements and
+		// returns once every chunk has run.
+		template<typename function>
+		void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, function fn)
+		{
+			if (begin >= end)
+				return;
+
+			std::size_t count = end - begin;
+			std::size_t max_chunks = workers.size() * 4;
+			std::size_t chunk = (std::max)(grain, (count + max_chunks - 1) / max_chunks);
+
+			job_counter counter;
+			for (std::size_t first = begin; first < end; first += chunk)
+			{
+				std::size_t last = (std::min)(first + chunk, end);
+				run([&fn, first, last]() { fn(first, last); }, &counter);
+			}
+			wait(counter);
+		}
+
+		std::size_t get_thread_count() const { return workers.size(); }
+
+		std::uint64_t get_executed(int worker_index_) const { return workers[worker_index_]->executed; }
+		std::uint64_t get_stolen(int worker_index_) const { return workers[worker_index_]->stolen; }
+	};
+}
+
+#endif // !KNU_JOB_SYSTEM_HPP
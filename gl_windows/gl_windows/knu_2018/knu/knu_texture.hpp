@@ -1,13 +1,408 @@
+
 #ifndef KNU_TEXTURE_HPP
 #define KNU_TEXTURE_HPP
 
+#include <knu/gl_utility.hpp>
 #include <knu/image4.hpp>
+#include <knu/image_container.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 namespace knu
 {
 	namespace graphics
 	{
+		struct sampler_state
+		{
+			GLenum min_filter;
+			GLenum mag_filter;
+			GLenum wrap_s;
+			GLenum wrap_t;
+			GLenum wrap_r;
+			float max_anisotropy;
+
+			sampler_state() :
+				min_filter(GL_LINEAR_MIPMAP_LINEAR),
+				mag_filter(GL_LINEAR),
+				wrap_s(GL_REPEAT),
+				wrap_t(GL_REPEAT),
+				wrap_r(GL_REPEAT),
+				max_anisotropy(1.0f)
+			{}
+
+			bool operator==(const sampler_state &s) const
+			{
+				return min_filter == s.min_filter && mag_filter == s.mag_filter &&
+					wrap_s == s.wrap_s && wrap_t == s.wrap_t && wrap_r == s.wrap_r &&
+					max_anisotropy == s.max_anisotropy;
+			}
+		};
+
+		struct sampler_state_hash
+		{
+			std::size_t operator()(const sampler_state &s) const
+			{
+				std::size_t h = std::hash<float>()(s.max_anisotropy);
+				for (GLenum e : { s.min_filter, s.mag_filter, s.wrap_s, s.wrap_t, s.wrap_r })
+					h = h * 31 + e;
+				return h;
+			}
+		};
+
+		class sampler
+		{
+			GLuint id;
+			sampler_state state;
+
+		public:
+			explicit sampler(const sampler_state &s) :
+				id(0),
+				state(s)
+			{
+				glGenSamplers(1, &id);
+				glSamplerParameteri(id, GL_TEXTURE_MIN_FILTER, s.min_filter);
+				glSamplerParameteri(id, GL_TEXTURE_MAG_FILTER, s.mag_filter);
+				glSamplerParameteri(id, GL_TEXTURE_WRAP_S, s.wrap_s);
+				glSamplerParameteri(id, GL_TEXTURE_WRAP_T, s.wrap_t);
+				glSamplerParameteri(id, GL_TEXTURE_WRAP_R, s.wrap_r);
+				if (s.max_anisotropy > 1.0f)
+					glSamplerParameterf(id, 0x84FE /*GL_TEXTURE_MAX_ANISOTROPY*/, s.max_anisotropy);
+			}
+
+			~sampler()
+			{
+				glDeleteSamplers(1, &id);
+			}
+
+			// No copy constructor or assignment
+			sampler(const sampler &) = delete;
+			sampler &operator=(const sampler &) = delete;
+
+			inline void bind(GLuint unit)
+			{
+				glBindSampler(unit, id);
+			}
+
+			inline GLuint obj() const
+			{
+				return id;
+			}
+
+			const sampler_state &get_state() const { return state; }
+
+			// Textures with equal sampler state share one sampler object. The cache only holds
+			// weak references so the gl object goes away with the last texture using it.
+			static std::shared_ptr<sampler> get(const sampler_state &s)
+			{
+				static std::mutex cache_mutex;
+				static std::unordered_map<sampler_state, std::weak_ptr<sampler>, sampler_state_hash> cache;
+
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				auto &entry = cache[s];
+				std::shared_ptr<sampler> shared = entry.lock();
+				if (!shared)
+				{
+					shared = std::make_shared<sampler>(s);
+					entry = shared;
+				}
+				return shared;
+			}
+		};
+
+		enum class texture_type
+		{
+			texture_2d, texture_2d_array, texture_cube
+		};
+
+		// Immutable storage texture. Storage is allocated once by create() and only ever
+		// filled with glTexSubImage*, so the driver never has to revalidate or reallocate.
+		class texture
+		{
+			GLuint id;
+			GLenum target;
+			texture_type type;
+			GLenum internal_format;
+			int width;
+			int height;
+			int layers;
+			int levels;
+			std::size_t bytes;
+			std::shared_ptr<sampler> tex_sampler;
+
+		private:
+			static std::atomic<std::size_t> &total_bytes()
+			{
+				static std::atomic<std::size_t> total(0);
+				return total;
+			}
+
+			static int full_mip_count(int w, int h)
+			{
+				int count = 1;
+				for (int size = (std::max)(w, h); size > 1; size >>= 1)
+					++count;
+				return count;
+			}
+
+			std::size_t compute_bytes() const
+			{
+				const pixel_format *f = find_pixel_format(internal_format);
+				int slices = type == texture_type::texture_cube ? 6 : layers;
+				std::size_t sum = 0;
+
+				for (int level = 0; level < levels; ++level)
+				{
+					int w = (std::max)(1, width >> level);
+					int h = (std::max)(1, height >> level);
+					sum += (f ? f->level_size(w, h, 1) : static_cast<std::size_t>(w) * h * 4) * slices;
+				}
+				return sum;
+			}
+
+			void release()
+			{
+				if (id)
+				{
+					glDeleteTextures(1, &id);
+					total_bytes() -= bytes;
+				}
+				id = 0;
+				bytes = 0;
+			}
+
+			static GLenum target_for(texture_type t)
+			{
+				switch (t)
+				{
+				case texture_type::texture_2d_array: return GL_TEXTURE_2D_ARRAY;
+				case texture_type::texture_cube: return GL_TEXTURE_CUBE_MAP;
+				default: return GL_TEXTURE_2D;
+				}
+			}
+
+			static GLint unpack_alignment(int row_bytes)
+			{
+				if (row_bytes % 8 == 0) return 8;
+				if (row_bytes % 4 == 0) return 4;
+				if (row_bytes % 2 == 0) return 2;
+				return 1;
+			}
+
+		public:
+			texture() :
+				id(0),
+				target(GL_TEXTURE_2D),
+				type(texture_type::texture_2d),
+				internal_format(GL_RGBA8),
+				width(0),
+				height(0),
+				layers(0),
+				levels(0),
+				bytes(0),
+				tex_sampler()
+			{
+			}
+
+			~texture()
+			{
+				release();
+			}
+
+			// No copy constructor or assignment
+			texture(const texture &) = delete;
+			texture &operator=(const texture &) = delete;
+
+			texture(texture &&t) :
+				texture()
+			{
+				swap(t);
+			}
+
+			texture &operator=(texture &&t)
+			{
+				release();
+				swap(t);
+				return *this;
+			}
+
+			void swap(texture &t)
+			{
+				std::swap(id, t.id);
+				std::swap(target, t.target);
+				std::swap(type, t.type);
+				std::swap(internal_format, t.internal_format);
+				std::swap(width, t.width);
+				std::swap(height, t.height);
+				std::swap(layers, t.layers);
+				std::swap(levels, t.levels);
+				std::swap(bytes, t.bytes);
+				std::swap(tex_sampler, t.tex_sampler);
+			}
+
+			// levels_ of 0 allocates the full mip chain. layers_ is ignored unless type_ is an array.
+			void create(texture_type type_, GLenum internal_format_, int width_, int height_, int layers_ = 1, int levels_ = 0)
+			{
+				release();
+
+				type = type_;
+				target = target_for(type_);
+				internal_format = internal_format_;
+				width = width_;
+				height = height_;
+				layers = type_ == texture_type::texture_2d_array ? layers_ : 1;
+				levels = levels_ ? levels_ : full_mip_count(width_, height_);
+
+				glGenTextures(1, &id);
+				glBindTexture(target, id);
+
+				if (type_ == texture_type::texture_2d_array)
+					glTexStorage3D(target, levels, internal_format, width, height, layers);
+				else
+					glTexStorage2D(target, levels, internal_format, width, height);
+
+				glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+				if (!tex_sampler)
+					tex_sampler = sampler::get(sampler_state());
+
+				bytes = compute_bytes();
+				total_bytes() += bytes;
+			}
+
+			// Creates storage to match an image and fills level 0.
+			void create(image &img, bool mipmaps = true)
+			{
+				create(texture_type::texture_2d, img.get_internal_format(), img.get_width(), img.get_height(), 1, mipmaps ? 0 : 1);
+				upload(img);
+				if (mipmaps)
+					generate_mipmaps();
+			}
+
+			// Creates storage to match a container and uploads every span without copying it.
+			void create(const image_container &c)
+			{
+				texture_type t = texture_type::texture_2d;
+				switch (c.get_target())
+				{
+				case container_target::texture_2d: t = texture_type::texture_2d; break;
+				case container_target::texture_2d_array: t = texture_type::texture_2d_array; break;
+				case container_target::texture_cube: t = texture_type::texture_cube; break;
+				default: throw std::runtime_error("Unsupported texture target in: " + c.get_image_name());
+				}
+
+				create(t, c.get_internal_format(), c.get_width(), c.get_height(), c.get_layers(), c.get_levels());
+				upload(c);
+			}
+
+			// layer is the array layer for 2d arrays and the face for cube maps. pixels may also
+			// be an offset into the bound GL_PIXEL_UNPACK_BUFFER.
+			void sub_image(int level, int layer, int x, int y, int w, int h, GLenum format, GLenum type_, const void *pixels)
+			{
+				glBindTexture(target, id);
+
+				switch (type)
+				{
+				case texture_type::texture_2d:
+					glTexSubImage2D(target, level, x, y, w, h, format, type_, pixels);
+					break;
+				case texture_type::texture_2d_array:
+					glTexSubImage3D(target, level, x, y, layer, w, h, 1, format, type_, pixels);
+					break;
+				case texture_type::texture_cube:
+					glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + layer, level, x, y, w, h, format, type_, pixels);
+					break;
+				}
+			}
+
+			void compressed_sub_image(int level, int layer, int w, int h, GLsizei image_size, const void *data)
+			{
+				glBindTexture(target, id);
+
+				switch (type)
+				{
+				case texture_type::texture_2d:
+					glCompressedTexSubImage2D(target, level, 0, 0, w, h, internal_format, image_size, data);
+					break;
+				case texture_type::texture_2d_array:
+					glCompressedTexSubImage3D(target, level, 0, 0, layer, w, h, 1, internal_format, image_size, data);
+					break;
+				case texture_type::texture_cube:
+					glCompressedTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + layer, level, 0, 0, w, h, internal_format, image_size, data);
+					break;
+				}
+			}
+
+			void upload(image &img, int level = 0, int layer = 0)
+			{
+				int bytes_per_pixel = img.get_size() / (img.get_width() * img.get_height());
+				glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment(img.get_width() * bytes_per_pixel));
+				sub_image(level, layer, 0, 0, img.get_width(), img.get_height(), img.get_format(), GL_UNSIGNED_BYTE, img.get_data());
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			}
+
+			void upload(const image_container &c)
+			{
+				const pixel_format &f = c.get_format();
+				int levels_to_upload = (std::min)(levels, c.get_levels());
+
+				for (const auto &s : c.get_spans())
+				{
+					if (s.level >= levels_to_upload)
+						continue;
+
+					int layer = type == texture_type::texture_cube ? s.face : s.layer;
+					if (f.compressed)
+						compressed_sub_image(s.level, layer, s.width, s.height, static_cast<GLsizei>(s.size), s.data);
+					else
+					{
+						glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment(s.width * f.block_bytes));
+						sub_image(s.level, layer, 0, 0, s.width, s.height, f.format, f.type, s.data);
+						glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+					}
+				}
+			}
+
+			void generate_mipmaps()
+			{
+				glBindTexture(target, id);
+				glGenerateMipmap(target);
+			}
+
+			void set_sampler(const sampler_state &s)
+			{
+				tex_sampler = sampler::get(s);
+			}
+
+			inline void bind(GLuint unit)
+			{
+				glActiveTexture(GL_TEXTURE0 + unit);
+				glBindTexture(target, id);
+				tex_sampler->bind(unit);
+			}
+
+			inline GLuint obj() const
+			{
+				return id;
+			}
+
+			GLenum get_target() const { return target; }
+			texture_type get_type() const { return type; }
+			GLenum get_internal_format() const { return internal_format; }
+			int get_width() const { return width; }
+			int get_height() const { return height; }
+			int get_layers() const { return layers; }
+			int get_levels() const { return levels; }
+			std::shared_ptr<sampler> get_sampler() const { return tex_sampler; }
+
+			// bytes of video memory held by this texture including its mip chain
+			std::size_t memory_usage() const { return bytes; }
 
+			// bytes of video memory held by every live texture
+			static std::size_t total_memory_usage() { return total_bytes(); }
+		};
 	}
 }
 
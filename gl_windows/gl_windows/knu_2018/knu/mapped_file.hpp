@@ -0,0 +1,184 @@
+#ifndef KNU_MAPPED_FILE_HPP
+#define KNU_MAPPED_FILE_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace knu
+{
+	// Read only view of a whole file. The pages are owned by the os so nothing is
+	// copied until somebody actually touches the bytes.
+	class mapped_file
+	{
+		std::string file_name;
+		const unsigned char *view;
+		std::size_t view_size;
+#ifdef _WIN32
+		HANDLE file_handle;
+		HANDLE mapping_handle;
+#endif
+
+	public:
+		mapped_file() :
+			view(nullptr),
+			view_size(0)
+#ifdef _WIN32
+			, file_handle(INVALID_HANDLE_VALUE),
+			mapping_handle(nullptr)
+#endif
+		{
+		}
+
+		explicit mapped_file(std::string name_) :
+			mapped_file()
+		{
+			open(name_);
+		}
+
+		~mapped_file()
+		{
+			close();
+		}
+
+		// No copy constructor or assignment
+		mapped_file(const mapped_file &) = delete;
+		mapped_file &operator=(const mapped_file &) = delete;
+
+		mapped_file(mapped_file &&m) :
+			mapped_file()
+		{
+			swap(m);
+		}
+
+		mapped_file &operator=(mapped_file &&m)
+		{
+			close();
+			swap(m);
+			return *this;
+		}
+
+		void swap(mapped_file &m)
+		{
+			std::swap(file_name, m.file_name);
+			std::swap(view, m.view);
+			std::swap(view_size, m.view_size);
+#ifdef _WIN32
+			std::swap(file_handle, m.file_handle);
+			std::swap(mapping_handle, m.mapping_handle);
+#endif
+		}
+
+		void open(std::string name_)
+		{
+			close();
+
+#ifdef _WIN32
+			file_handle = CreateFileA(name_.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file_handle == INVALID_HANDLE_VALUE)
+				throw std::runtime_error("Unable to open file: " + name_);
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file_handle, &size))
+			{
+				close();
+				throw std::runtime_error("Unable to query file size: " + name_);
+			}
+			view_size = static_cast<std::size_t>(size.QuadPart);
+
+			// an empty file cannot be mapped, treat it as an empty view
+			if (view_size)
+			{
+				mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (!mapping_handle)
+				{
+					close();
+					throw std::runtime_error("Unable to map file: " + name_);
+				}
+
+				view = static_cast<const unsigned char *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+				if (!view)
+				{
+					close();
+					throw std::runtime_error("Unable to map file: " + name_);
+				}
+			}
+#else
+			int fd = ::open(name_.c_str(), O_RDONLY);
+			if (fd == -1)
+				throw std::runtime_error("Unable to open file: " + name_);
+
+			struct stat st;
+			if (fstat(fd, &st) != 0)
+			{
+				::close(fd);
+				throw std::runtime_error("Unable to query file size: " + name_);
+			}
+			view_size = static_cast<std::size_t>(st.st_size);
+
+			if (view_size)
+			{
+				void *v = mmap(nullptr, view_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (v == MAP_FAILED)
+				{
+					::close(fd);
+					view_size = 0;
+					throw std::runtime_error("Unable to map file: " + name_);
+				}
+				view = static_cast<const unsigned char *>(v);
+			}
+
+			// the mapping keeps its own reference to the file
+			::close(fd);
+#endif
+			file_name = name_;
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (view)
+				UnmapViewOfFile(view);
+			if (mapping_handle)
+				CloseHandle(mapping_handle);
+			if (file_handle != INVALID_HANDLE_VALUE)
+				CloseHandle(file_handle);
+			mapping_handle = nullptr;
+			file_handle = INVALID_HANDLE_VALUE;
+#else
+			if (view)
+				munmap(const_cast<unsigned char *>(view), view_size);
+#endif
+			view = nullptr;
+			view_size = 0;
+			file_name.clear();
+		}
+
+		// hint that the whole file is about to be read front to back
+		void will_need() const
+		{
+#ifndef _WIN32
+			if (view)
+				madvise(const_cast<unsigned char *>(view), view_size, MADV_WILLNEED);
+#endif
+		}
+
+		bool is_open() const { return view != nullptr; }
+		std::string get_file_name() const { return file_name; }
+		const unsigned char *data() const { return view; }
+		std::size_t size() const { return view_size; }
+	};
+}
+
+#endif // !KNU_MAPPED_FILE_HPP
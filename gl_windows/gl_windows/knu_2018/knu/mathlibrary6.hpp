@@ -1,6 +1,7 @@
 #ifndef KNU_MATHLIBRARY6_HPP
 #define KNU_MATHLIBRARY6_HPP
 
+#include <algorithm>
 #include <array>
 #include <iostream>
 #include <vector>
@@ -2070,6 +2071,31 @@ namespace knu {
 				};
 				return persp;
 			}
+
+			// Projections written straight into 16 column major floats, e.g. a matrix's data(),
+			// so recomputing one never goes through the mat4 move operations.
+			inline void fill_perspective(float *m, float fov_y_degrees, float aspect_ratio, float z_near, float z_far)
+			{
+				float f = 1.0f / tan(degrees_to_radians<float>(fov_y_degrees) / 2.0f);
+				std::fill(m, m + 16, 0.0f);
+				m[0] = f / aspect_ratio;
+				m[5] = f;
+				m[10] = (z_far + z_near) / (z_near - z_far);
+				m[11] = -1.0f;
+				m[14] = (2.0f * z_far * z_near) / (z_near - z_far);
+			}
+
+			inline void fill_ortho(float *m, float left, float right, float bottom, float top, float z_near, float z_far)
+			{
+				std::fill(m, m + 16, 0.0f);
+				m[0] = 2.0f / (right - left);
+				m[5] = 2.0f / (top - bottom);
+				m[10] = 2.0f / (z_near - z_far);
+				m[12] = -(right + left) / (right - left);
+				m[13] = -(top + bottom) / (top - bottom);
+				m[14] = -(z_far + z_near) / (z_far - z_near);
+				m[15] = 1.0f;
+			}
 		} // namespace of v1
 
 		using vector2f = vec2<float>;
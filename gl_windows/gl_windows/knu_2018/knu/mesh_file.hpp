@@ -0,0 +1,380 @@
+#ifndef KNU_MESH_FILE_HPP
+#define KNU_MESH_FILE_HPP
+
+#include <knu/mapped_file.hpp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Baked mesh container (.kmsh). A fixed header, a section table and the sections,
+		// each starting on a multiple of the alignment so it can be handed to the driver
+		// straight out of the file mapping. Little endian, like everything we ship to.
+		struct mesh_file_header
+		{
+			char magic[4];				// "KMSH"
+			std::uint32_t version;
+			std::uint32_t section_count;
+			std::uint32_t alignment;
+			std::uint64_t file_size;
+			float bounds_min[3];
+			float bounds_max[3];
+			std::uint8_t reserved[16];
+		};
+
+		struct mesh_section
+		{
+			std::uint32_t kind;
+			std::uint32_t stride;		// bytes per element
+			std::uint64_t offset;		// from the start of the file
+			std::uint64_t count;		// elements
+		};
+
+		enum class mesh_section_kind : std::uint32_t
+		{
+			vertices = 1, indices = 2, attributes = 3, submeshes = 4, material_names = 5
+		};
+
+		// One vertex attribute as gl sees it; the gl enums are stored as values.
+		struct mesh_attribute
+		{
+			std::uint32_t location;
+			std::uint32_t components;
+			std::uint32_t type;			// e.g. 0x1406 GL_FLOAT
+			std::uint32_t flags;		// mesh_attribute_normalized | mesh_attribute_integer
+			std::uint32_t offset;		// within the vertex
+		};
+
+		const std::uint32_t mesh_attribute_normalized = 1;
+		const std::uint32_t mesh_attribute_integer = 2;
+
+		// A range of the index buffer drawn with one material.
+		struct mesh_submesh
+		{
+			std::uint32_t first_index;
+			std::uint32_t index_count;
+			std::int32_t base_vertex;
+			std::uint32_t material;		// into the material names
+		};
+
+		static_assert(sizeof(mesh_file_header) == 64, "mesh_file_header is part of the file format");
+		static_assert(sizeof(mesh_section) == 24, "mesh_section is part of the file format");
+		static_assert(sizeof(mesh_attribute) == 20, "mesh_attribute is part of the file format");
+		static_assert(sizeof(mesh_submesh) == 16, "mesh_submesh is part of the file format");
+
+		const std::uint32_t mesh_file_version = 1;
+
+		// What write_mesh_file bakes. Nothing here is owned, the pointers only have to live
+		// through the call.
+		struct mesh_file_desc
+		{
+			const void *vertices;
+			std::size_t vertex_count;
+			std::uint32_t vertex_stride;
+			const void *indices;
+			std::size_t index_count;
+			std::uint32_t index_size;		// 2 or 4
+			std::vector<mesh_attribute> attributes;
+			std::vector<mesh_submesh> submeshes;	// empty draws everything with material 0
+			std::vector<std::string> material_names;
+			float bounds_min[3];
+			float bounds_max[3];
+			std::uint32_t alignment;		// a power of two, 4096 keeps every section on its own page
+
+			mesh_file_desc() :
+				vertices(nullptr),
+				vertex_count(0),
+				vertex_stride(0),
+				indices(nullptr),
+				index_count(0),
+				index_size(4),
+				bounds_min{ 0.0f, 0.0f, 0.0f },
+				bounds_max{ 0.0f, 0.0f, 0.0f },
+				alignment(4096)
+			{}
+		};
+
+		inline void write_mesh_file(const std::string &name, const mesh_file_desc &desc)
+		{
+			if (desc.alignment < 16 || (desc.alignment & (desc.alignment - 1)))
+				throw std::runtime_error("Mesh file alignment must be a power of two of at least 16: " + name);
+			if (desc.index_size != 2 && desc.index_size != 4)
+				throw std::runtime_error("Mesh file indices must be 2 or 4 bytes: " + name);
+
+			std::vector<char> names;
+			for (const auto &n : desc.material_names)
+				names.insert(names.end(), n.c_str(), n.c_str() + n.size() + 1);
+
+			std::vector<mesh_submesh> submeshes = desc.submeshes;
+			if (submeshes.empty())
+			{
+				mesh_submesh all = { 0, static_cast<std::uint32_t>(desc.index_count), 0, 0 };
+				submeshes.push_back(all);
+			}
+
+			struct pending
+			{
+				mesh_section_kind kind;
+				std::uint32_t stride;
+				std::size_t count;
+				const void *data;
+			};
+			const pending sections[] =
+			{
+				{ mesh_section_kind::vertices, desc.vertex_stride, desc.vertex_count, desc.vertices },
+				{ mesh_section_kind::indices, desc.index_size, desc.index_count, desc.indices },
+				{ mesh_section_kind::attributes, sizeof(mesh_attribute), desc.attributes.size(), desc.attributes.data() },
+				{ mesh_section_kind::submeshes, sizeof(mesh_submesh), submeshes.size(), submeshes.data() },
+				{ mesh_section_kind::material_names, 1, names.size(), names.data() },
+			};
+			const std::uint32_t section_count = sizeof(sections) / sizeof(sections[0]);
+
+			auto align = [&desc](std::uint64_t offset) { return (offset + desc.alignment - 1) & ~std::uint64_t(desc.alignment - 1); };
+
+			std::vector<mesh_section> table(section_count);
+			std::uint64_t offset = align(sizeof(mesh_file_header) + sizeof(mesh_section) * section_count);
+			for (std::uint32_t i = 0; i < section_count; ++i)
+			{
+				table[i].kind = static_cast<std::uint32_t>(sections[i].kind);
+				table[i].stride = sections[i].stride;
+				table[i].offset = offset;
+				table[i].count = sections[i].count;
+				offset = align(offset + std::uint64_t(sections[i].stride) * sections[i].count);
+			}
+
+			mesh_file_header header;
+			std::memset(&header, 0, sizeof(header));
+			std::memcpy(header.magic, "KMSH", 4);
+			header.version = mesh_file_version;
+			header.section_count = section_count;
+			header.alignment = desc.alignment;
+			header.file_size = offset;
+			std::memcpy(header.bounds_min, desc.bounds_min, sizeof(header.bounds_min));
+			std::memcpy(header.bounds_max, desc.bounds_max, sizeof(header.bounds_max));
+
+			std::ofstream out(name, std::ios::binary | std::ios::trunc);
+			if (!out)
+				throw std::runtime_error("Unable to create mesh file: " + name);
+
+			const std::vector<char> padding(desc.alignment, 0);
+			std::uint64_t written = 0;
+			auto write = [&](const void *data, std::uint64_t size) {
+				out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+				written += size;
+			};
+			auto pad_to = [&](std::uint64_t target) {
+				write(padding.data(), target - written);
+			};
+
+			write(&header, sizeof(header));
+			write(table.data(), sizeof(mesh_section) * table.size());
+			for (std::uint32_t i = 0; i < section_count; ++i)
+			{
+				pad_to(table[i].offset);
+				if (table[i].count)
+					write(sections[i].data, std::uint64_t(table[i].stride) * table[i].count);
+			}
+			pad_to(header.file_size);
+
+			if (!out)
+				throw std::runtime_error("Unable to write mesh file: " + name);
+		}
+
+		// A baked mesh read in place. Opening maps the file and turns the section offsets into
+		// pointers into the mapping; nothing is parsed or copied, and the pages are only read
+		// when the sections are, typically by the driver during the upload:
+		//
+		//	mesh_file mesh("model.kmsh");
+		//	vertex_buffer.allocate(mesh.vertices<vertex>(), mesh.vertex_count());
+		//	index_buffer.allocate(mesh.indices<std::uint32_t>(), mesh.index_count());
+		class mesh_file
+		{
+			struct section_view
+			{
+				const unsigned char *data;
+				std::size_t count;
+				std::uint32_t stride;
+			};
+
+			mapped_file file;
+			const mesh_file_header *header;
+			section_view sections[6];
+			std::vector<std::string> material_names;
+
+		private:
+			const section_view &section(mesh_section_kind kind) const
+			{
+				return sections[static_cast<std::uint32_t>(kind)];
+			}
+
+			void fail(const std::string &why) const
+			{
+				throw std::runtime_error(why + ": " + file.get_file_name());
+			}
+
+			// Element size of the sections with a fixed layout, 0 for the others.
+			static std::uint32_t fixed_stride(mesh_section_kind kind)
+			{
+				switch (kind)
+				{
+				case mesh_section_kind::attributes: return sizeof(mesh_attribute);
+				case mesh_section_kind::submeshes: return sizeof(mesh_submesh);
+				case mesh_section_kind::material_names: return 1;
+				default: return 0;
+				}
+			}
+
+			// Validates the mapped file and records where its sections are.
+			void parse()
+			{
+				if (file.size() < sizeof(mesh_file_header))
+					fail("Truncated mesh file");
+				// the mapping is page aligned, so the header and every aligned section are too
+				header = reinterpret_cast<const mesh_file_header *>(file.data());
+				if (std::memcmp(header->magic, "KMSH", 4) != 0)
+					fail("Not a mesh file");
+				if (header->version != mesh_file_version)
+					fail("Unsupported mesh file version");
+				if (header->file_size > file.size())
+					fail("Truncated mesh file");
+				if (header->alignment == 0 || (header->alignment & (header->alignment - 1)))
+					fail("Corrupt mesh file header");
+
+				std::uint64_t table_end = sizeof(mesh_file_header) + std::uint64_t(sizeof(mesh_section)) * header->section_count;
+				if (table_end > file.size())
+					fail("Truncated mesh file");
+				const mesh_section *table = reinterpret_cast<const mesh_section *>(file.data() + sizeof(mesh_file_header));
+
+				for (std::uint32_t i = 0; i < header->section_count; ++i)
+				{
+					const mesh_section &s = table[i];
+					if (s.kind == 0 || s.kind >= sizeof(sections) / sizeof(sections[0]))
+						continue;		// from a newer writer, skip it
+					if (s.offset % header->alignment || s.offset > file.size() || (s.count && !s.stride) ||
+						(s.stride && s.count > (file.size() - s.offset) / s.stride))
+						fail("Corrupt mesh file section");
+					std::uint32_t expected = fixed_stride(static_cast<mesh_section_kind>(s.kind));
+					if (s.count && expected && s.stride != expected)
+						fail("Corrupt mesh file section");
+
+					section_view &v = sections[s.kind];
+					v.data = file.data() + s.offset;
+					v.count = static_cast<std::size_t>(s.count);
+					v.stride = s.stride;
+				}
+
+				const section_view &indices_ = section(mesh_section_kind::indices);
+				if (indices_.count && indices_.stride != 2 && indices_.stride != 4)
+					fail("Corrupt mesh file indices");
+
+				const section_view &names = section(mesh_section_kind::material_names);
+				const char *c = reinterpret_cast<const char *>(names.data);
+				for (std::size_t i = 0, start = 0; i < names.count; ++i)
+					if (c[i] == '\0')
+					{
+						material_names.emplace_back(c + start, c + i);
+						start = i + 1;
+					}
+			}
+
+		public:
+			mesh_file() :
+				header(nullptr),
+				sections()
+			{
+			}
+
+			explicit mesh_file(const std::string &name) :
+				mesh_file()
+			{
+				open(name);
+			}
+
+			// No copy constructor or assignment
+			mesh_file(const mesh_file &) = delete;
+			mesh_file &operator=(const mesh_file &) = delete;
+
+			void open(const std::string &name)
+			{
+				close();
+				file.open(name);
+
+				// a file that fails validation leaves nothing half parsed behind
+				try
+				{
+					parse();
+				}
+				catch (...)
+				{
+					close();
+					throw;
+				}
+			}
+
+			void close()
+			{
+				file.close();
+				header = nullptr;
+				for (auto &s : sections)
+					s = section_view();
+				material_names.clear();
+			}
+
+			// Typed view of the vertices; t must be exactly one vertex.
+			template<typename t>
+			const t *vertices() const
+			{
+				const section_view &v = section(mesh_section_kind::vertices);
+				if (v.count && v.stride != sizeof(t))
+					fail("Mesh file vertex size does not match");
+				return reinterpret_cast<const t *>(v.data);
+			}
+
+			// std::uint16_t or std::uint32_t, whichever index_size() says.
+			template<typename t>
+			const t *indices() const
+			{
+				const section_view &v = section(mesh_section_kind::indices);
+				if (v.count && v.stride != sizeof(t))
+					fail("Mesh file index size does not match");
+				return reinterpret_cast<const t *>(v.data);
+			}
+
+			const unsigned char *vertex_data() const { return section(mesh_section_kind::vertices).data; }
+			std::size_t vertex_count() const { return section(mesh_section_kind::vertices).count; }
+			std::uint32_t vertex_stride() const { return section(mesh_section_kind::vertices).stride; }
+			std::size_t vertex_bytes() const { return vertex_count() * vertex_stride(); }
+
+			const unsigned char *index_data() const { return section(mesh_section_kind::indices).data; }
+			std::size_t index_count() const { return section(mesh_section_kind::indices).count; }
+			std::uint32_t index_size() const { return section(mesh_section_kind::indices).stride; }
+			std::size_t index_bytes() const { return index_count() * index_size(); }
+			// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+			unsigned int index_type() const { return index_size() == 2 ? 0x1403 : 0x1405; }
+
+			const mesh_attribute *attributes() const { return reinterpret_cast<const mesh_attribute *>(section(mesh_section_kind::attributes).data); }
+			std::size_t attribute_count() const { return section(mesh_section_kind::attributes).count; }
+
+			const mesh_submesh *submeshes() const { return reinterpret_cast<const mesh_submesh *>(section(mesh_section_kind::submeshes).data); }
+			std::size_t submesh_count() const { return section(mesh_section_kind::submeshes).count; }
+
+			const std::vector<std::string> &get_material_names() const { return material_names; }
+			const float *bounds_min() const { return header->bounds_min; }
+			const float *bounds_max() const { return header->bounds_max; }
+
+			// hint that the sections are about to be uploaded
+			void will_need() const { file.will_need(); }
+
+			bool is_open() const { return header != nullptr; }
+			std::string get_file_name() const { return file.get_file_name(); }
+		};
+	}
+}
+
+#endif // !KNU_MESH_FILE_HPP
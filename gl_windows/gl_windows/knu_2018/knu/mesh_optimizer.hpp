@@ -0,0 +1,570 @@
+#ifndef KNU_MESH_OPTIMIZER_HPP
+#define KNU_MESH_OPTIMIZER_HPP
+
+#include <knu/mathlibrary6.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Index buffer and vertex buffer reordering for indexed triangle lists, in the order
+		// they are meant to run:
+		//
+		//	weld_vertices(vertices, indices);
+		//	optimize_vertex_cache(indices, vertices.size());
+		//	optimize_overdraw(indices, positions, 1.05f);
+		//	optimize_vertex_fetch(vertices, indices);
+		//
+		// Each step keeps the work the earlier ones did as far as it can.
+
+		struct vertex_cache_stats
+		{
+			std::size_t misses;
+			double acmr;		// misses per triangle, 0.5 is ideal for a regular grid, 3 the worst
+			double atvr;		// misses per referenced vertex, 1 is ideal
+		};
+
+		// Post-transform cache hit rate under a FIFO cache of cache_size entries.
+		inline vertex_cache_stats analyze_vertex_cache(const std::vector<std::uint32_t> &indices, std::size_t vertex_count, std::size_t cache_size = 16)
+		{
+			// a vertex is still cached if fewer than cache_size misses happened since it was loaded
+			std::vector<std::size_t> loaded_at(vertex_count, 0);
+			std::vector<char> used(vertex_count, 0);
+			std::size_t misses = 0, referenced = 0;
+
+			for (std::uint32_t i : indices)
+			{
+				if (!used[i])
+				{
+					used[i] = 1;
+					++referenced;
+				}
+				if (misses + cache_size - loaded_at[i] >= cache_size || loaded_at[i] == 0)
+				{
+					++misses;
+					loaded_at[i] = misses + cache_size;
+				}
+			}
+
+			vertex_cache_stats s;
+			s.misses = misses;
+			s.acmr = indices.empty() ? 0.0 : static_cast<double>(misses) / (indices.size() / 3);
+			s.atvr = referenced ? static_cast<double>(misses) / referenced : 0.0;
+			return s;
+		}
+
+		// Triangle order for the post-transform cache, after Forsyth's "Linear-speed vertex
+		// cache optimisation": vertices score by their position in a simulated LRU cache plus
+		// a boost for having few triangles left, and the best scoring neighbouring triangle
+		// goes next.
+		inline void optimize_vertex_cache(std::vector<std::uint32_t> &indices, std::size_t vertex_count)
+		{
+			const int cache_size = 32;
+			const std::size_t triangle_count = indices.size() / 3;
+			if (triangle_count < 2)
+				return;
+
+			// vertex -> triangles, compacted as triangles are emitted
+			std::vector<std::uint32_t> remaining(vertex_count, 0);
+			for (std::uint32_t i : indices)
+				++remaining[i];
+			std::vector<std::uint32_t> offsets(vertex_count + 1, 0);
+			for (std::size_t v = 0; v < vertex_count; ++v)
+				offsets[v + 1] = offsets[v] + remaining[v];
+			std::vector<std::uint32_t> adjacency(indices.size());
+			{
+				std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+				for (std::size_t t = 0; t < triangle_count; ++t)
+					for (int k = 0; k < 3; ++k)
+						adjacency[fill[indices[t * 3 + k]]++] = static_cast<std::uint32_t>(t);
+			}
+
+			// score tables: cache position and remaining valence
+			float cache_scores[cache_size];
+			for (int p = 0; p < cache_size; ++p)
+				cache_scores[p] = p < 3 ? 0.75f : std::pow(1.0f - static_cast<float>(p - 3) / (cache_size - 3), 1.5f);
+			const int valence_table = 32;
+			float valence_scores[valence_table];
+			for (int v = 0; v < valence_table; ++v)
+				valence_scores[v] = v ? 2.0f / std::sqrt(static_cast<float>(v)) : 0.0f;
+
+			std::vector<int> cache_position(vertex_count, -1);
+			auto vertex_score = [&](std::uint32_t v) {
+				std::uint32_t r = remaining[v];
+				if (!r)
+					return -1.0f;
+				float s = cache_position[v] >= 0 ? cache_scores[cache_position[v]] : 0.0f;
+				return s + (r < valence_table ? valence_scores[r] : 2.0f / std::sqrt(static_cast<float>(r)));
+			};
+
+			std::vector<float> scores(vertex_count);
+			for (std::size_t v = 0; v < vertex_count; ++v)
+				scores[v] = vertex_score(static_cast<std::uint32_t>(v));
+
+			std::vector<float> triangle_scores(triangle_count);
+			for (std::size_t t = 0; t < triangle_count; ++t)
+				triangle_scores[t] = scores[indices[t * 3]] + scores[indices[t * 3 + 1]] + scores[indices[t * 3 + 2]];
+
+			std::vector<char> emitted(triangle_count, 0);
+			std::vector<std::uint32_t> result;
+			result.reserve(indices.size());
+
+			std::uint32_t cache[cache_size + 3];
+			int cache_count = 0;
+			std::size_t cursor = 0;		// for dead ends, the first triangle that may not be emitted
+
+			std::size_t best = 0;
+			for (std::size_t t = 1; t < triangle_count; ++t)
+				if (triangle_scores[t] > triangle_scores[best])
+					best = t;
+
+			for (std::size_t emitted_count = 0; emitted_count < triangle_count; ++emitted_count)
+			{
+				emitted[best] = 1;
+				const std::uint32_t *tri = &indices[best * 3];
+				result.insert(result.end(), tri, tri + 3);
+
+				// new cache: this triangle's vertices first, then the old contents in order
+				std::uint32_t next_cache[cache_size + 3];
+				int next_count = 0;
+				for (int k = 0; k < 3; ++k)
+					next_cache[next_count++] = tri[k];
+				for (int i = 0; i < cache_count; ++i)
+				{
+					std::uint32_t v = cache[i];
+					if (v != tri[0] && v != tri[1] && v != tri[2])
+						next_cache[next_count++] = v;
+				}
+
+				// drop the triangle from its vertices' lists
+				for (int k = 0; k < 3; ++k)
+				{
+					std::uint32_t v = tri[k];
+					std::uint32_t *list = &adjacency[offsets[v]];
+					for (std::uint32_t i = 0; i < remaining[v]; ++i)
+						if (list[i] == best)
+						{
+							list[i] = list[remaining[v] - 1];
+							break;
+						}
+					--remaining[v];
+				}
+
+				// rescore everything that was or is in the cache
+				for (int i = 0; i < next_count; ++i)
+					cache_position[next_cache[i]] = i < cache_size ? i : -1;
+				for (int i = 0; i < next_count; ++i)
+				{
+					std::uint32_t v = next_cache[i];
+					float s = vertex_score(v);
+					float delta = s - scores[v];
+					scores[v] = s;
+					for (std::uint32_t j = 0; j < remaining[v]; ++j)
+						triangle_scores[adjacency[offsets[v] + j]] += delta;
+				}
+
+				cache_count = next_count < cache_size ? next_count : cache_size;
+				std::copy(next_cache, next_cache + cache_count, cache);
+
+				// best triangle touching the cache
+				float best_score = -1.0f;
+				std::size_t candidate = triangle_count;
+				for (int i = 0; i < cache_count; ++i)
+				{
+					std::uint32_t v = cache[i];
+					for (std::uint32_t j = 0; j < remaining[v]; ++j)
+					{
+						std::uint32_t t = adjacency[offsets[v] + j];
+						if (triangle_scores[t] > best_score)
+						{
+							best_score = triangle_scores[t];
+							candidate = t;
+						}
+					}
+				}
+
+				// dead end, start over somewhere else
+				if (candidate == triangle_count)
+				{
+					while (cursor < triangle_count && emitted[cursor])
+						++cursor;
+					candidate = cursor;
+				}
+				best = candidate;
+			}
+
+			indices.swap(result);
+		}
+
+		struct overdraw_stats
+		{
+			std::uint64_t covered;		// pixels covered in the end
+			std::uint64_t shaded;		// fragments that passed the depth test
+			double overdraw;			// shaded / covered, 1 is ideal
+		};
+
+		// Rasterizes the front faces in index order from the six axis directions with a
+		// depth test and counts how often covered pixels were shaded.
+		inline overdraw_stats analyze_overdraw(const std::vector<std::uint32_t> &indices, const std::vector<knu::math::vector3f> &positions, int resolution = 256)
+		{
+			overdraw_stats s = { 0, 0, 0.0 };
+			if (positions.empty() || indices.empty())
+				return s;
+
+			float lo[3] = { positions[0].x, positions[0].y, positions[0].z }, hi[3] = { lo[0], lo[1], lo[2] };
+			for (const auto &p : positions)
+			{
+				const float c[3] = { p.x, p.y, p.z };
+				for (int k = 0; k < 3; ++k)
+				{
+					lo[k] = c[k] < lo[k] ? c[k] : lo[k];
+					hi[k] = c[k] > hi[k] ? c[k] : hi[k];
+				}
+			}
+			float extent = (std::max)((std::max)(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+			float scale = extent > 0.0f ? (resolution - 1) / extent : 1.0f;
+
+			std::vector<float> depth(static_cast<std::size_t>(resolution) * resolution);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				int ua = (axis + 1) % 3, va = (axis + 2) % 3;
+				for (int direction = -1; direction <= 1; direction += 2)
+				{
+					std::fill(depth.begin(), depth.end(), (std::numeric_limits<float>::max)());
+					for (std::size_t t = 0; t + 2 < indices.size(); t += 3)
+					{
+						float p[3][3];
+						for (int k = 0; k < 3; ++k)
+						{
+							const auto &v = positions[indices[t + k]];
+							p[k][0] = v.x;
+							p[k][1] = v.y;
+							p[k][2] = v.z;
+						}
+
+						// the camera looks along direction * axis, so it sees faces pointing back at it
+						float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+						float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+						float n = e1[ua] * e2[va] - e1[va] * e2[ua];
+						if (n * direction >= 0.0f)
+							continue;
+
+						float x[3], y[3], z[3];
+						for (int k = 0; k < 3; ++k)
+						{
+							x[k] = (p[k][ua] - lo[ua]) * scale;
+							y[k] = (p[k][va] - lo[va]) * scale;
+							z[k] = p[k][axis] * direction;
+						}
+						float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+						if (area == 0.0f)
+							continue;
+
+						int min_x = (std::max)(0, static_cast<int>(std::floor((std::min)((std::min)(x[0], x[1]), x[2]))));
+						int max_x = (std::min)(resolution - 1, static_cast<int>(std::ceil((std::max)((std::max)(x[0], x[1]), x[2]))));
+						int min_y = (std::max)(0, static_cast<int>(std::floor((std::min)((std::min)(y[0], y[1]), y[2]))));
+						int max_y = (std::min)(resolution - 1, static_cast<int>(std::ceil((std::max)((std::max)(y[0], y[1]), y[2]))));
+
+						for (int py = min_y; py <= max_y; ++py)
+							for (int px = min_x; px <= max_x; ++px)
+							{
+								float cx = px + 0.5f, cy = py + 0.5f;
+								float w0 = ((x[1] - cx) * (y[2] - cy) - (x[2] - cx) * (y[1] - cy)) / area;
+								float w1 = ((x[2] - cx) * (y[0] - cy) - (x[0] - cx) * (y[2] - cy)) / area;
+								float w2 = 1.0f - w0 - w1;
+								if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+									continue;
+								float d = w0 * z[0] + w1 * z[1] + w2 * z[2];
+								float &stored = depth[static_cast<std::size_t>(py) * resolution + px];
+								if (d < stored)
+								{
+									stored = d;
+									++s.shaded;
+								}
+							}
+					}
+					for (float d : depth)
+						s.covered += d != (std::numeric_limits<float>::max)();
+				}
+			}
+			s.overdraw = s.covered ? static_cast<double>(s.shaded) / s.covered : 0.0;
+			return s;
+		}
+
+		// Sorts clusters of triangles so those facing away from the mesh center come first,
+		// after Sander et al. "Fast triangle reordering for vertex locality and reduced
+		// overdraw". Clusters break where the cache order already restarts, and within those
+		// wherever the cache efficiency so far is within threshold of the whole cluster's, so
+		// the vertex cache gets at most threshold times worse. Run optimize_vertex_cache first.
+		inline void optimize_overdraw(std::vector<std::uint32_t> &indices, const std::vector<knu::math::vector3f> &positions, float threshold = 1.05f)
+		{
+			const std::size_t triangle_count = indices.size() / 3;
+			if (triangle_count < 2)
+				return;
+			const std::size_t cache_size = 16;
+
+			// cache misses per triangle under the same FIFO model as analyze_vertex_cache
+			std::vector<std::size_t> loaded_at(positions.size(), 0);
+			std::vector<unsigned char> triangle_misses(triangle_count);
+			std::size_t misses = 0;
+			for (std::size_t t = 0; t < triangle_count; ++t)
+			{
+				unsigned char m = 0;
+				for (int k = 0; k < 3; ++k)
+				{
+					std::uint32_t v = indices[t * 3 + k];
+					if (loaded_at[v] == 0 || misses + cache_size - loaded_at[v] >= cache_size)
+					{
+						++misses;
+						++m;
+						loaded_at[v] = misses + cache_size;
+					}
+				}
+				triangle_misses[t] = m;
+			}
+
+			// hard boundaries where every vertex missed, i.e. the cache order started over
+			std::vector<std::size_t> hard;
+			for (std::size_t t = 0; t < triangle_count; ++t)
+				if (t == 0 || triangle_misses[t] == 3)
+					hard.push_back(t);
+			hard.push_back(triangle_count);
+
+			// soft boundaries: replay each cluster from a cold cache and cut as soon as that is
+			// within threshold of the hard cluster's cache efficiency
+			std::vector<std::size_t> clusters;
+			std::vector<std::size_t> cold_loaded(positions.size(), 0);
+			std::size_t cold_misses = 0, epoch = 0;		// stamps up to epoch count as evicted
+			for (std::size_t h = 0; h + 1 < hard.size(); ++h)
+			{
+				std::size_t begin = hard[h], end = hard[h + 1];
+				std::size_t cluster_misses = 0;
+				for (std::size_t t = begin; t < end; ++t)
+					cluster_misses += triangle_misses[t];
+				double cluster_acmr = static_cast<double>(cluster_misses) / (end - begin);
+
+				std::size_t start = begin, running = 0;
+				epoch = cold_misses + cache_size;
+				clusters.push_back(begin);
+				for (std::size_t t = begin; t < end; ++t)
+				{
+					for (int k = 0; k < 3; ++k)
+					{
+						std::uint32_t v = indices[t * 3 + k];
+						if (cold_loaded[v] <= epoch || cold_misses + cache_size - cold_loaded[v] >= cache_size)
+						{
+							++cold_misses;
+							++running;
+							cold_loaded[v] = cold_misses + cache_size;
+						}
+					}
+					if (t + 1 < end && static_cast<double>(running) / (t - start + 1) <= cluster_acmr * threshold)
+					{
+						start = t + 1;
+						running = 0;
+						epoch = cold_misses + cache_size;
+						clusters.push_back(start);
+					}
+				}
+			}
+			clusters.push_back(triangle_count);
+
+			// mesh centroid, then area weighted centroid and normal per cluster
+			double center[3] = { 0.0, 0.0, 0.0 };
+			for (const auto &p : positions)
+			{
+				center[0] += p.x;
+				center[1] += p.y;
+				center[2] += p.z;
+			}
+			for (double &c : center)
+				c /= positions.empty() ? 1.0 : positions.size();
+
+			std::size_t cluster_count = clusters.size() - 1;
+			std::vector<float> sort_keys(cluster_count);
+			for (std::size_t c = 0; c < cluster_count; ++c)
+			{
+				double centroid[3] = { 0.0, 0.0, 0.0 }, normal[3] = { 0.0, 0.0, 0.0 }, area_sum = 0.0;
+				for (std::size_t t = clusters[c]; t < clusters[c + 1]; ++t)
+				{
+					const auto &a = positions[indices[t * 3]];
+					const auto &b = positions[indices[t * 3 + 1]];
+					const auto &d = positions[indices[t * 3 + 2]];
+					double e1[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+					double e2[3] = { d.x - a.x, d.y - a.y, d.z - a.z };
+					double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+					double area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+					centroid[0] += (a.x + b.x + d.x) / 3.0 * area;
+					centroid[1] += (a.y + b.y + d.y) / 3.0 * area;
+					centroid[2] += (a.z + b.z + d.z) / 3.0 * area;
+					for (int k = 0; k < 3; ++k)
+						normal[k] += n[k];
+					area_sum += area;
+				}
+
+				double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+				double key = 0.0;
+				if (area_sum > 0.0 && length > 0.0)
+					for (int k = 0; k < 3; ++k)
+						key += (centroid[k] / area_sum - center[k]) * normal[k] / length;
+				sort_keys[c] = static_cast<float>(key);
+			}
+
+			std::vector<std::size_t> order(cluster_count);
+			std::iota(order.begin(), order.end(), std::size_t(0));
+			std::stable_sort(order.begin(), order.end(), [&sort_keys](std::size_t a, std::size_t b) { return sort_keys[a] > sort_keys[b]; });
+
+			std::vector<std::uint32_t> result;
+			result.reserve(indices.size());
+			for (std::size_t c : order)
+				result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+			indices.swap(result);
+		}
+
+		struct vertex_fetch_stats
+		{
+			std::size_t bytes_fetched;
+			double overfetch;		// bytes fetched / bytes of referenced vertices, 1 is ideal
+		};
+
+		// Memory traffic for the vertex fetches, through a direct mapped cache of 64 byte lines.
+		inline vertex_fetch_stats analyze_vertex_fetch(const std::vector<std::uint32_t> &indices, std::size_t vertex_count, std::size_t vertex_size)
+		{
+			const std::size_t line_size = 64, line_count = 1024;
+			std::vector<std::size_t> lines(line_count, (std::numeric_limits<std::size_t>::max)());
+			std::vector<char> used(vertex_count, 0);
+			std::size_t fetched = 0, referenced = 0;
+
+			for (std::uint32_t i : indices)
+			{
+				if (!used[i])
+				{
+					used[i] = 1;
+					++referenced;
+				}
+				std::size_t first = i * vertex_size / line_size, last = ((i + 1) * vertex_size - 1) / line_size;
+				for (std::size_t line = first; line <= last; ++line)
+				{
+					std::size_t &slot = lines[line % line_count];
+					if (slot != line)
+					{
+						slot = line;
+						fetched += line_size;
+					}
+				}
+			}
+
+			vertex_fetch_stats s;
+			s.bytes_fetched = fetched;
+			s.overfetch = referenced ? static_cast<double>(fetched) / (referenced * vertex_size) : 0.0;
+			return s;
+		}
+
+		// New vertex order: order of first use in the index buffer. Unreferenced vertices
+		// get ~0u. Returns the number of vertices kept.
+		inline std::size_t generate_fetch_remap(const std::vector<std::uint32_t> &indices, std::size_t vertex_count, std::vector<std::uint32_t> &remap)
+		{
+			remap.assign(vertex_count, ~0u);
+			std::uint32_t next = 0;
+			for (std::uint32_t i : indices)
+				if (remap[i] == ~0u)
+					remap[i] = next++;
+			return next;
+		}
+
+		// Vertices that compare equal byte for byte share one index, found through a hash
+		// table over the raw bytes. Padding inside vertex has to be zeroed for this to work.
+		// Returns the number of unique vertices.
+		template<typename vertex>
+		std::size_t generate_weld_remap(const std::vector<vertex> &vertices, std::vector<std::uint32_t> &remap)
+		{
+			auto hash = [](const vertex &v) {
+				const unsigned char *p = reinterpret_cast<const unsigned char *>(&v);
+				std::uint64_t h = 14695981039346656037ull;
+				for (std::size_t i = 0; i < sizeof(vertex); ++i)
+					h = (h ^ p[i]) * 1099511628211ull;
+				return h ^ (h >> 29);
+			};
+
+			std::size_t buckets = 1;
+			while (buckets < vertices.size() * 2)
+				buckets <<= 1;
+			std::vector<std::uint32_t> table(buckets, ~0u);		// original index of the first copy
+
+			remap.assign(vertices.size(), ~0u);
+			std::uint32_t next = 0;
+			for (std::size_t i = 0; i < vertices.size(); ++i)
+			{
+				std::size_t slot = static_cast<std::size_t>(hash(vertices[i])) & (buckets - 1);
+				for (;;)
+				{
+					std::uint32_t other = table[slot];
+					if (other == ~0u)
+					{
+						table[slot] = static_cast<std::uint32_t>(i);
+						remap[i] = next++;
+						break;
+					}
+					if (std::memcmp(&vertices[other], &vertices[i], sizeof(vertex)) == 0)
+					{
+						remap[i] = remap[other];
+						break;
+					}
+					slot = (slot + 1) & (buckets - 1);
+				}
+			}
+			return next;
+		}
+
+		// Applies a remap from generate_weld_remap or generate_fetch_remap to both buffers.
+		template<typename vertex>
+		void remap_mesh(std::vector<vertex> &vertices, std::vector<std::uint32_t> &indices, const std::vector<std::uint32_t> &remap, std::size_t unique_count)
+		{
+			std::vector<vertex> result(unique_count);
+			for (std::size_t i = 0; i < vertices.size(); ++i)
+				if (remap[i] != ~0u)
+					result[remap[i]] = vertices[i];
+			vertices.swap(result);
+
+			for (std::uint32_t &i : indices)
+				i = remap[i];
+		}
+
+		// Merges identical vertices. An empty index buffer means an unindexed triangle list
+		// and is filled in. Returns how many vertices were removed.
+		template<typename vertex>
+		std::size_t weld_vertices(std::vector<vertex> &vertices, std::vector<std::uint32_t> &indices)
+		{
+			if (indices.empty())
+			{
+				indices.resize(vertices.size());
+				std::iota(indices.begin(), indices.end(), 0u);
+			}
+
+			std::vector<std::uint32_t> remap;
+			std::size_t before = vertices.size();
+			std::size_t unique = generate_weld_remap(vertices, remap);
+			remap_mesh(vertices, indices, remap, unique);
+			return before - unique;
+		}
+
+		// Stores vertices in the order the index buffer first uses them and drops unused ones.
+		template<typename vertex>
+		std::size_t optimize_vertex_fetch(std::vector<vertex> &vertices, std::vector<std::uint32_t> &indices)
+		{
+			std::vector<std::uint32_t> remap;
+			std::size_t unique = generate_fetch_remap(indices, vertices.size(), remap);
+			remap_mesh(vertices, indices, remap, unique);
+			return unique;
+		}
+	}
+}
+
+#endif // !KNU_MESH_OPTIMIZER_HPP
@@ -0,0 +1,530 @@
+#ifndef KNU_MESH_SIMPLIFIER_HPP
+#define KNU_MESH_SIMPLIFIER_HPP
+
+#include <knu/job_system.hpp>
+#include <knu/mathlibrary6.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct simplify_settings
+		{
+			std::size_t target_index_count;
+			float target_error;						// relative to the mesh extent, 0.01 is 1%
+			bool lock_border;						// keep open edges exactly where they are
+			std::vector<float> attribute_weights;	// one per float of per-vertex attributes
+
+			simplify_settings() :
+				target_index_count(0),
+				target_error(0.01f),
+				lock_border(false)
+			{}
+		};
+
+		namespace detail
+		{
+			// Garland and Heckbert's generalized quadrics: the squared distance of a point in
+			// position + attribute space to the plane of a triangle in that space. The
+			// symmetric n x n part is stored packed, followed by b (n), c and the summed weight;
+			// error over weight is a mean squared distance.
+			class quadric_set
+			{
+				std::size_t n;
+				std::size_t stride;
+				std::vector<double> data;
+
+				std::size_t packed() const { return n * (n + 1) / 2; }
+
+			public:
+				quadric_set(std::size_t vertex_count, std::size_t dimensions) :
+					n(dimensions),
+					stride(dimensions * (dimensions + 1) / 2 + dimensions + 2),
+					data(vertex_count * stride, 0.0)
+				{
+				}
+
+				// adds the quadric of triangle p0 p1 p2 to each of its three vertices
+				void add_triangle(const std::uint32_t *vertices, const double *p0, const double *p1, const double *p2, double weight)
+				{
+					std::vector<double> e1(n), e2(n);
+					double l1 = 0.0;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						e1[i] = p1[i] - p0[i];
+						l1 += e1[i] * e1[i];
+					}
+					if (l1 <= 0.0)
+						return;
+					l1 = std::sqrt(l1);
+					double projection = 0.0;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						e1[i] /= l1;
+						projection += (p2[i] - p0[i]) * e1[i];
+					}
+					double l2 = 0.0;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						e2[i] = p2[i] - p0[i] - projection * e1[i];
+						l2 += e2[i] * e2[i];
+					}
+					if (l2 <= 1e-24)
+						return;
+					l2 = std::sqrt(l2);
+					for (std::size_t i = 0; i < n; ++i)
+						e2[i] /= l2;
+
+					// A = I - e1 e1' - e2 e2', b = (p0.e1) e1 + (p0.e2) e2 - p0, c = p0.p0 - (p0.e1)^2 - (p0.e2)^2
+					double d1 = 0.0, d2 = 0.0, pp = 0.0;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						d1 += p0[i] * e1[i];
+						d2 += p0[i] * e2[i];
+						pp += p0[i] * p0[i];
+					}
+
+					std::vector<double> t(stride);
+					std::size_t k = 0;
+					for (std::size_t i = 0; i < n; ++i)
+						for (std::size_t j = i; j < n; ++j, ++k)
+							t[k] = weight * ((i == j ? 1.0 : 0.0) - e1[i] * e1[j] - e2[i] * e2[j]);
+					for (std::size_t i = 0; i < n; ++i)
+						t[k + i] = weight * (d1 * e1[i] + d2 * e2[i] - p0[i]);
+					t[k + n] = weight * (pp - d1 * d1 - d2 * d2);
+					t[k + n + 1] = weight;
+
+					for (int v = 0; v < 3; ++v)
+					{
+						double *q = &data[vertices[v] * stride];
+						for (std::size_t i = 0; i < stride; ++i)
+							q[i] += t[i];
+					}
+				}
+
+				// plane through point with unit normal, positions only
+				void add_plane(std::size_t vertex, const double *point, const double *normal, double weight)
+				{
+					double d = -(normal[0] * point[0] + normal[1] * point[1] + normal[2] * point[2]);
+					double *q = &data[vertex * stride];
+					for (std::size_t i = 0; i < 3; ++i)
+					{
+						std::size_t row = i * n - i * (i - 1) / 2;		// packed offset of (i, i)
+						for (std::size_t j = i; j < 3; ++j)
+							q[row + j - i] += weight * normal[i] * normal[j];
+					}
+					for (std::size_t i = 0; i < 3; ++i)
+						q[packed() + i] += weight * d * normal[i];
+					q[packed() + n] += weight * d * d;
+					q[packed() + n + 1] += weight;
+				}
+
+				void merge(std::size_t into, std::size_t from)
+				{
+					double *a = &data[into * stride];
+					const double *b = &data[from * stride];
+					for (std::size_t i = 0; i < stride; ++i)
+						a[i] += b[i];
+				}
+
+				double evaluate(std::size_t vertex, const double *v) const
+				{
+					const double *q = &data[vertex * stride];
+					double e = 0.0;
+					std::size_t k = 0;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						e += q[k++] * v[i] * v[i];
+						for (std::size_t j = i + 1; j < n; ++j)
+							e += 2.0 * q[k++] * v[i] * v[j];
+					}
+					for (std::size_t i = 0; i < n; ++i)
+						e += 2.0 * q[k + i] * v[i];
+					return e + q[k + n];
+				}
+
+				double weight(std::size_t vertex) const
+				{
+					return data[vertex * stride + stride - 1];
+				}
+			};
+
+			inline void triangle_normal(const double *a, const double *b, const double *c, double *n)
+			{
+				double e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				double e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+				n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+				n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+			}
+		}
+
+		// Quadric error edge collapse. Vertices never move, a collapse folds one vertex into a
+		// neighbour, so the result indexes the same vertex buffer and every LOD can share it.
+		// Attributes (e.g. normal and uv, attribute_weights.size() floats per vertex) join the
+		// positions in the error metric so collapses that smear them cost more. Open edges can
+		// only collapse along themselves, or not at all with lock_border; vertices split on
+		// attribute seams and around non-manifold edges stay put.
+		// Stops at target_index_count or when the next collapse would exceed target_error, and
+		// returns the error reached, relative to the mesh extent. The error is the quadric
+		// estimate, the mean distance to the planes that met at a vertex, not a strict bound.
+		inline float simplify(const std::vector<std::uint32_t> &indices, const std::vector<knu::math::vector3f> &positions, const std::vector<float> &attributes,
+			const simplify_settings &settings, std::vector<std::uint32_t> &result)
+		{
+			const std::size_t vertex_count = positions.size();
+			const std::size_t attribute_count = settings.attribute_weights.size();
+			if (attributes.size() != vertex_count * attribute_count)
+				throw std::runtime_error("simplify: attributes don't match the attribute weights");
+
+			result.assign(indices.begin(), indices.end() - indices.size() % 3);
+			if (result.size() <= settings.target_index_count || vertex_count == 0)
+				return 0.0f;
+
+			// positions scaled into the unit cube so the error is relative
+			float lo[3] = { positions[0].x, positions[0].y, positions[0].z }, hi[3] = { lo[0], lo[1], lo[2] };
+			for (const auto &p : positions)
+			{
+				const float c[3] = { p.x, p.y, p.z };
+				for (int k = 0; k < 3; ++k)
+				{
+					lo[k] = (std::min)(lo[k], c[k]);
+					hi[k] = (std::max)(hi[k], c[k]);
+				}
+			}
+			float extent = (std::max)((std::max)(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+			double scale = extent > 0.0f ? 1.0 / extent : 1.0;
+
+			const std::size_t n = 3 + attribute_count;
+			std::vector<double> points(vertex_count * n);
+			for (std::size_t v = 0; v < vertex_count; ++v)
+			{
+				double *p = &points[v * n];
+				p[0] = (positions[v].x - lo[0]) * scale;
+				p[1] = (positions[v].y - lo[1]) * scale;
+				p[2] = (positions[v].z - lo[2]) * scale;
+				for (std::size_t a = 0; a < attribute_count; ++a)
+					p[3 + a] = attributes[v * attribute_count + a] * settings.attribute_weights[a];
+			}
+
+			// edges: how many triangles use each, and one triangle for the open ones
+			enum : unsigned char { interior, border, locked };
+			std::vector<unsigned char> kind(vertex_count, interior);
+			std::unordered_map<std::uint64_t, std::uint32_t> edge_use;
+			auto edge_key = [](std::uint32_t a, std::uint32_t b) {
+				return a < b ? (std::uint64_t(a) << 32 | b) : (std::uint64_t(b) << 32 | a);
+			};
+			edge_use.reserve(result.size());
+			for (std::size_t i = 0; i < result.size(); i += 3)
+				for (int k = 0; k < 3; ++k)
+					++edge_use[edge_key(result[i + k], result[i + (k + 1) % 3])];
+
+			detail::quadric_set quadrics(vertex_count, n);
+			for (std::size_t i = 0; i < result.size(); i += 3)
+			{
+				const std::uint32_t t[3] = { result[i], result[i + 1], result[i + 2] };
+				double normal[3];
+				detail::triangle_normal(&points[t[0] * n], &points[t[1] * n], &points[t[2] * n], normal);
+				double area = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+				quadrics.add_triangle(t, &points[t[0] * n], &points[t[1] * n], &points[t[2] * n], area * 0.5);
+
+				for (int k = 0; k < 3; ++k)
+				{
+					std::uint32_t a = t[k], b = t[(k + 1) % 3];
+					std::uint32_t use = edge_use[edge_key(a, b)];
+					if (use > 2)
+						kind[a] = kind[b] = locked;
+					else if (use == 1)
+					{
+						for (std::uint32_t v : { a, b })
+							if (kind[v] == interior)
+								kind[v] = settings.lock_border ? locked : border;
+
+						// keep the open edge in place with a plane through it, upright on the triangle
+						const double *pa = &points[a * n], *pb = &points[b * n];
+						double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+						double side[3] = { e[1] * normal[2] - e[2] * normal[1], e[2] * normal[0] - e[0] * normal[2], e[0] * normal[1] - e[1] * normal[0] };
+						double length = std::sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+						if (length > 0.0)
+						{
+							for (double &s : side)
+								s /= length;
+							double weight = (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * 10.0;
+							quadrics.add_plane(a, pa, side, weight);
+							quadrics.add_plane(b, pa, side, weight);
+						}
+					}
+				}
+			}
+
+			// vertices sharing a position with another one sit on an attribute seam
+			{
+				std::vector<std::uint32_t> order(vertex_count);
+				std::iota(order.begin(), order.end(), 0u);
+				auto same = [&](std::uint32_t a, std::uint32_t b) {
+					return positions[a].x == positions[b].x && positions[a].y == positions[b].y && positions[a].z == positions[b].z;
+				};
+				std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+					if (positions[a].x != positions[b].x)
+						return positions[a].x < positions[b].x;
+					if (positions[a].y != positions[b].y)
+						return positions[a].y < positions[b].y;
+					return positions[a].z < positions[b].z;
+				});
+				for (std::size_t i = 1; i < vertex_count; ++i)
+					if (same(order[i - 1], order[i]))
+						kind[order[i - 1]] = kind[order[i]] = locked;
+			}
+
+			struct collapse
+			{
+				std::uint32_t from, to;
+				double cost;
+			};
+
+			const double error_limit = static_cast<double>(settings.target_error) * settings.target_error;
+			const std::size_t target_triangles = settings.target_index_count / 3;
+			double reached = 0.0;
+
+			std::vector<collapse> candidates;
+			std::vector<std::uint32_t> remap(vertex_count), offsets(vertex_count + 1), adjacency;
+			std::vector<char> touched(vertex_count);
+
+			for (;;)
+			{
+				std::size_t triangle_count = result.size() / 3;
+				if (triangle_count <= target_triangles)
+					break;
+
+				// vertex -> triangles for the flip test
+				std::fill(offsets.begin(), offsets.end(), 0u);
+				for (std::uint32_t i : result)
+					++offsets[i + 1];
+				for (std::size_t v = 0; v < vertex_count; ++v)
+					offsets[v + 1] += offsets[v];
+				adjacency.resize(result.size());
+				{
+					std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+					for (std::size_t i = 0; i < result.size(); ++i)
+						adjacency[fill[result[i]]++] = static_cast<std::uint32_t>(i / 3);
+				}
+
+				// collapses along open edges make new ones, count again
+				edge_use.clear();
+				for (std::size_t i = 0; i < result.size(); i += 3)
+					for (int k = 0; k < 3; ++k)
+						++edge_use[edge_key(result[i + k], result[i + (k + 1) % 3])];
+
+				candidates.clear();
+				for (std::size_t i = 0; i < result.size(); i += 3)
+					for (int k = 0; k < 3; ++k)
+					{
+						std::uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+						bool open = edge_use[edge_key(a, b)] == 1;
+						if (a > b && !open)
+							continue;		// the neighbour triangle has it the other way around
+						for (int direction = 0; direction < 2; ++direction)
+						{
+							std::uint32_t from = direction ? b : a, to = direction ? a : b;
+							if (kind[from] == locked || (kind[from] == border && !open))
+								continue;
+							double weight = quadrics.weight(from) + quadrics.weight(to);
+							double error = quadrics.evaluate(from, &points[to * n]) + quadrics.evaluate(to, &points[to * n]);
+							collapse c = { from, to, weight > 0.0 && error > 0.0 ? error / weight : 0.0 };
+							candidates.push_back(c);
+						}
+					}
+				if (candidates.empty())
+					break;
+
+				std::sort(candidates.begin(), candidates.end(), [](const collapse &a, const collapse &b) { return a.cost < b.cost; });
+
+				// a pass takes the cheapest collapses that don't touch each other, about as many
+				// as are still missing and not much costlier than the last of that many
+				std::size_t goal = (std::max)(std::size_t(1), (triangle_count - target_triangles) / 2);
+				double pass_limit = candidates[(std::min)(goal, candidates.size() - 1)].cost * 1.5;
+
+				std::iota(remap.begin(), remap.end(), 0u);
+				std::fill(touched.begin(), touched.end(), 0);
+				std::size_t removed = 0, applied = 0;
+
+				for (const collapse &c : candidates)
+				{
+					if (c.cost > error_limit || (applied && c.cost > pass_limit) || triangle_count - removed <= target_triangles)
+						break;
+					if (touched[c.from] || touched[c.to])
+						continue;
+
+					// moving from onto to must not turn any remaining triangle over
+					bool flips = false;
+					std::size_t dropped = 0;
+					for (std::uint32_t j = offsets[c.from]; j < offsets[c.from + 1] && !flips; ++j)
+					{
+						const std::uint32_t *t = &result[adjacency[j] * 3];
+						if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+						{
+							++dropped;
+							continue;
+						}
+						const double *before[3], *after[3];
+						for (int k = 0; k < 3; ++k)
+						{
+							before[k] = &points[t[k] * n];
+							after[k] = t[k] == c.from ? &points[c.to * n] : before[k];
+						}
+						double n0[3], n1[3];
+						detail::triangle_normal(before[0], before[1], before[2], n0);
+						detail::triangle_normal(after[0], after[1], after[2], n1);
+						double dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+						double lengths = std::sqrt((n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]) * (n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]));
+						flips = dot <= 0.25 * lengths;
+					}
+					if (flips)
+						continue;
+
+					remap[c.from] = c.to;
+					quadrics.merge(c.to, c.from);
+					reached = (std::max)(reached, c.cost);
+					removed += dropped;
+					++applied;
+
+					// only triangles around from changed, leave their vertices (to among them)
+					// alone until the next pass so the flip tests above stay valid
+					for (std::uint32_t j = offsets[c.from]; j < offsets[c.from + 1]; ++j)
+						for (int k = 0; k < 3; ++k)
+							touched[result[adjacency[j] * 3 + k]] = 1;
+				}
+				if (!applied)
+					break;
+
+				std::size_t write = 0;
+				for (std::size_t i = 0; i < result.size(); i += 3)
+				{
+					std::uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+					if (a == b || b == c || a == c)
+						continue;
+					result[write++] = a;
+					result[write++] = b;
+					result[write++] = c;
+				}
+				result.resize(write);
+			}
+
+			return static_cast<float>(std::sqrt(reached));
+		}
+
+		struct lod_level
+		{
+			std::vector<std::uint32_t> indices;		// into the mesh's own vertex buffer
+			float error;							// object space distance
+		};
+
+		struct lod_settings
+		{
+			std::size_t levels;			// including the full detail one
+			float reduction;			// triangles kept per level
+			float max_error;			// relative to the mesh extent, no level goes past it
+			bool lock_border;
+			std::vector<float> attribute_weights;
+
+			lod_settings() :
+				levels(4),
+				reduction(0.5f),
+				max_error(0.05f),
+				lock_border(false)
+			{}
+		};
+
+		struct lod_mesh
+		{
+			std::vector<std::uint32_t> indices;
+			std::vector<knu::math::vector3f> positions;
+			std::vector<float> attributes;		// settings.attribute_weights.size() per vertex
+			std::vector<lod_level> levels;		// filled in by build_lods, finest first
+		};
+
+		// Each level simplifies the one before and adds its error to the errors before it, so
+		// the errors keep growing with the distance from the original. The chain ends early once
+		// a level would not be at least 10% smaller than the last or max_error is used up.
+		inline void build_lods(lod_mesh &mesh, const lod_settings &settings)
+		{
+			mesh.levels.clear();
+			lod_level full;
+			full.indices = mesh.indices;
+			full.error = 0.0f;
+			mesh.levels.push_back(std::move(full));
+
+			if (mesh.positions.empty())
+				return;
+			float lo[3] = { mesh.positions[0].x, mesh.positions[0].y, mesh.positions[0].z }, hi[3] = { lo[0], lo[1], lo[2] };
+			for (const auto &p : mesh.positions)
+			{
+				const float c[3] = { p.x, p.y, p.z };
+				for (int k = 0; k < 3; ++k)
+				{
+					lo[k] = (std::min)(lo[k], c[k]);
+					hi[k] = (std::max)(hi[k], c[k]);
+				}
+			}
+			float extent = (std::max)((std::max)(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+
+			simplify_settings s;
+			s.lock_border = settings.lock_border;
+			s.attribute_weights = settings.attribute_weights;
+
+			double target = static_cast<double>(mesh.indices.size() / 3);
+			for (std::size_t level = 1; level < settings.levels; ++level)
+			{
+				target *= settings.reduction;
+				s.target_index_count = static_cast<std::size_t>(target) * 3;
+
+				const lod_level &previous = mesh.levels.back();
+				s.target_error = settings.max_error - previous.error / extent;
+				if (s.target_error <= 0.0f)
+					break;
+
+				lod_level l;
+				l.error = previous.error + simplify(previous.indices, mesh.positions, mesh.attributes, s, l.indices) * extent;
+				if (l.indices.size() > previous.indices.size() * 9 / 10)
+					break;
+				mesh.levels.push_back(std::move(l));
+			}
+		}
+
+		// One job per mesh; returns once all of them are done.
+		inline void build_lods(job_system &jobs, std::vector<lod_mesh> &meshes, const lod_settings &settings)
+		{
+			job_counter counter;
+			for (auto &mesh : meshes)
+				jobs.run([&mesh, &settings]() { build_lods(mesh, settings); }, &counter);
+			jobs.wait(counter);
+		}
+
+		// Size on screen, in pixels, of an object space error at the given view distance.
+		// projection is 16 column major floats, e.g. perspective_matrix.data().
+		inline float projected_error(float error, float distance, const float *projection, float viewport_height)
+		{
+			float pixels_per_unit = projection[5] * viewport_height * 0.5f;
+			if (projection[11] != 0.0f)		// perspective: shrinks with distance
+				pixels_per_unit /= (std::max)(distance, 1e-4f);
+			return error * pixels_per_unit;
+		}
+
+		// Coarsest level whose error stays under max_pixels on screen.
+		inline std::size_t select_lod(const std::vector<lod_level> &levels, float distance, const float *projection, float viewport_height, float max_pixels = 1.0f)
+		{
+			for (std::size_t i = levels.size(); i-- > 1;)
+				if (projected_error(levels[i].error, distance, projection, viewport_height) <= max_pixels)
+					return i;
+			return 0;
+		}
+	}
+}
+
+#endif // !KNU_MESH_SIMPLIFIER_HPP
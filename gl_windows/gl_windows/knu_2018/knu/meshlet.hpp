@@ -0,0 +1,450 @@
+#ifndef KNU_MESHLET_HPP
+#define KNU_MESHLET_HPP
+
+#include <knu/job_system.hpp>
+#include <knu/mathlibrary6.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Layout of one glMultiDrawElementsIndirect record.
+		struct draw_elements_indirect_command
+		{
+			std::uint32_t count;
+			std::uint32_t instance_count;
+			std::uint32_t first_index;
+			std::int32_t base_vertex;
+			std::uint32_t base_instance;
+		};
+
+		struct meshlet
+		{
+			std::uint32_t first_index;		// into meshlet_data::indices
+			std::uint32_t triangle_count;
+			std::uint32_t vertex_count;		// unique vertices referenced
+		};
+
+		// A meshlet is invisible if its sphere is outside the frustum, or if
+		//	dot(center - eye, cone_axis) >= cone_cutoff * length(center - eye) + radius
+		// which means every triangle in it faces away from the eye.
+		struct meshlet_bounds
+		{
+			knu::math::vector3f center;
+			float radius;
+			knu::math::vector3f cone_axis;
+			float cone_cutoff;				// 1 when the normals spread too far to ever cull
+		};
+
+		struct meshlet_data
+		{
+			std::vector<meshlet> meshlets;
+			std::vector<meshlet_bounds> bounds;
+			std::vector<std::uint32_t> indices;	// the mesh's index buffer, meshlet after meshlet
+		};
+
+		namespace detail
+		{
+			inline void meshlet_bounds_of(const std::uint32_t *indices, std::size_t triangle_count, const std::vector<knu::math::vector3f> &positions, meshlet_bounds &b)
+			{
+				// Ritter's sphere: start from the most distant pair of axis extremes, then grow
+				const std::size_t index_count = triangle_count * 3;
+				std::size_t extremes[6] = { 0, 0, 0, 0, 0, 0 };
+				for (std::size_t i = 0; i < index_count; ++i)
+				{
+					const auto &p = positions[indices[i]];
+					const float c[3] = { p.x, p.y, p.z };
+					for (int k = 0; k < 3; ++k)
+					{
+						const auto &lo = positions[indices[extremes[k * 2]]];
+						const auto &hi = positions[indices[extremes[k * 2 + 1]]];
+						const float l[3] = { lo.x, lo.y, lo.z }, h[3] = { hi.x, hi.y, hi.z };
+						if (c[k] < l[k])
+							extremes[k * 2] = i;
+						if (c[k] > h[k])
+							extremes[k * 2 + 1] = i;
+					}
+				}
+
+				float center[3] = { 0.0f, 0.0f, 0.0f }, radius_squared = -1.0f;
+				for (int k = 0; k < 3; ++k)
+				{
+					const auto &a = positions[indices[extremes[k * 2]]];
+					const auto &d = positions[indices[extremes[k * 2 + 1]]];
+					float dx = d.x - a.x, dy = d.y - a.y, dz = d.z - a.z;
+					float span = dx * dx + dy * dy + dz * dz;
+					if (span > radius_squared)
+					{
+						radius_squared = span;
+						center[0] = (a.x + d.x) * 0.5f;
+						center[1] = (a.y + d.y) * 0.5f;
+						center[2] = (a.z + d.z) * 0.5f;
+					}
+				}
+				float radius = std::sqrt(radius_squared) * 0.5f;
+
+				for (std::size_t i = 0; i < index_count; ++i)
+				{
+					const auto &p = positions[indices[i]];
+					float dx = p.x - center[0], dy = p.y - center[1], dz = p.z - center[2];
+					float distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+					if (distance > radius)
+					{
+						float grow = (distance - radius) * 0.5f;
+						radius += grow;
+						center[0] += dx / distance * grow;
+						center[1] += dy / distance * grow;
+						center[2] += dz / distance * grow;
+					}
+				}
+
+				b.center.x = center[0];
+				b.center.y = center[1];
+				b.center.z = center[2];
+				b.radius = radius;
+
+				// normal cone: average of the unit normals, opened up to the widest of them
+				std::vector<float> normals;
+				normals.reserve(triangle_count * 3);
+				float axis[3] = { 0.0f, 0.0f, 0.0f };
+				for (std::size_t t = 0; t < triangle_count; ++t)
+				{
+					const auto &a = positions[indices[t * 3]];
+					const auto &d = positions[indices[t * 3 + 1]];
+					const auto &e = positions[indices[t * 3 + 2]];
+					float e1[3] = { d.x - a.x, d.y - a.y, d.z - a.z };
+					float e2[3] = { e.x - a.x, e.y - a.y, e.z - a.z };
+					float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+					float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+					if (length == 0.0f)
+						continue;
+					for (int k = 0; k < 3; ++k)
+					{
+						normals.push_back(n[k] / length);
+						axis[k] += n[k] / length;
+					}
+				}
+
+				b.cone_axis.x = 0.0f;
+				b.cone_axis.y = 0.0f;
+				b.cone_axis.z = 0.0f;
+				b.cone_cutoff = 1.0f;
+
+				float axis_length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+				if (axis_length == 0.0f)
+					return;
+				for (float &a : axis)
+					a /= axis_length;
+
+				float min_dot = 1.0f;
+				for (std::size_t i = 0; i < normals.size(); i += 3)
+					min_dot = (std::min)(min_dot, normals[i] * axis[0] + normals[i + 1] * axis[1] + normals[i + 2] * axis[2]);
+
+				b.cone_axis.x = axis[0];
+				b.cone_axis.y = axis[1];
+				b.cone_axis.z = axis[2];
+				// past 90 degrees some triangle faces every direction the cone could be seen from
+				if (min_dot > 0.0f)
+					b.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+			}
+		}
+
+		// Splits an indexed triangle list into meshlets of at most max_vertices unique vertices
+		// and max_triangles triangles. Each meshlet grows greedily through shared edges, taking
+		// the triangle that adds the fewest new vertices, with cone_weight trading some of that
+		// for normals close to the meshlet's so its cone stays narrow. Running
+		// optimize_vertex_cache first gives spatially coherent seeds.
+		inline void build_meshlets(const std::vector<std::uint32_t> &indices, const std::vector<knu::math::vector3f> &positions, meshlet_data &out,
+			std::size_t max_vertices = 64, std::size_t max_triangles = 124, float cone_weight = 0.25f)
+		{
+			if (max_vertices < 3 || max_triangles < 1)
+				throw std::runtime_error("meshlet needs room for at least one triangle");
+
+			out.meshlets.clear();
+			out.bounds.clear();
+			out.indices.clear();
+			out.indices.reserve(indices.size());
+
+			const std::size_t triangle_count = indices.size() / 3;
+			const std::size_t vertex_count = positions.size();
+
+			// vertex -> live triangles
+			std::vector<std::uint32_t> live(vertex_count, 0);
+			for (std::size_t i = 0; i < triangle_count * 3; ++i)
+				++live[indices[i]];
+			std::vector<std::uint32_t> offsets(vertex_count + 1, 0);
+			for (std::size_t v = 0; v < vertex_count; ++v)
+				offsets[v + 1] = offsets[v] + live[v];
+			std::vector<std::uint32_t> adjacency(triangle_count * 3);
+			{
+				std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+				for (std::size_t t = 0; t < triangle_count; ++t)
+					for (int k = 0; k < 3; ++k)
+						adjacency[fill[indices[t * 3 + k]]++] = static_cast<std::uint32_t>(t);
+			}
+
+			std::vector<float> normals(triangle_count * 3, 0.0f);
+			for (std::size_t t = 0; t < triangle_count; ++t)
+			{
+				const auto &a = positions[indices[t * 3]];
+				const auto &b = positions[indices[t * 3 + 1]];
+				const auto &c = positions[indices[t * 3 + 2]];
+				float e1[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+				float e2[3] = { c.x - a.x, c.y - a.y, c.z - a.z };
+				float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+				float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length > 0.0f)
+					for (int k = 0; k < 3; ++k)
+						normals[t * 3 + k] = n[k] / length;
+			}
+
+			std::vector<char> emitted(triangle_count, 0);
+			std::vector<std::uint32_t> owner(vertex_count, ~0u);	// meshlet that last took the vertex
+			std::vector<std::uint32_t> members;						// vertices of the open meshlet
+			std::size_t cursor = 0, open_first = 0, open_triangles = 0;
+			float cone[3] = { 0.0f, 0.0f, 0.0f };
+
+			auto close = [&]() {
+				if (!open_triangles)
+					return;
+				meshlet m;
+				m.first_index = static_cast<std::uint32_t>(open_first);
+				m.triangle_count = static_cast<std::uint32_t>(open_triangles);
+				m.vertex_count = static_cast<std::uint32_t>(members.size());
+				out.meshlets.push_back(m);
+
+				meshlet_bounds b;
+				detail::meshlet_bounds_of(&out.indices[open_first], open_triangles, positions, b);
+				out.bounds.push_back(b);
+
+				open_first = out.indices.size();
+				open_triangles = 0;
+				members.clear();
+				cone[0] = cone[1] = cone[2] = 0.0f;
+			};
+
+			for (std::size_t done = 0; done < triangle_count; ++done)
+			{
+				const std::uint32_t id = static_cast<std::uint32_t>(out.meshlets.size());
+
+				// best triangle sharing a vertex with the open meshlet
+				std::size_t best = triangle_count;
+				float best_score = 0.0f;
+				if (open_triangles && open_triangles < max_triangles)
+				{
+					float length = std::sqrt(cone[0] * cone[0] + cone[1] * cone[1] + cone[2] * cone[2]);
+					float inverse = length > 0.0f ? 1.0f / length : 0.0f;
+
+					for (std::uint32_t v : members)
+						for (std::uint32_t j = 0; j < live[v]; ++j)
+						{
+							std::uint32_t t = adjacency[offsets[v] + j];
+							int added = 0;
+							for (int k = 0; k < 3; ++k)
+								added += owner[indices[t * 3 + k]] != id;
+							if (members.size() + added > max_vertices)
+								continue;
+
+							const float *n = &normals[t * 3];
+							float spread = 1.0f - (n[0] * cone[0] + n[1] * cone[1] + n[2] * cone[2]) * inverse;
+							float score = added + cone_weight * spread;
+							if (best == triangle_count || score < best_score)
+							{
+								best = t;
+								best_score = score;
+							}
+						}
+				}
+
+				// nothing fits, start a new meshlet at the next triangle in input order
+				if (best == triangle_count)
+				{
+					close();
+					while (emitted[cursor])
+						++cursor;
+					best = cursor;
+				}
+
+				const std::uint32_t current = static_cast<std::uint32_t>(out.meshlets.size());
+				emitted[best] = 1;
+				for (int k = 0; k < 3; ++k)
+				{
+					std::uint32_t v = indices[best * 3 + k];
+					out.indices.push_back(v);
+					if (owner[v] != current)
+					{
+						owner[v] = current;
+						members.push_back(v);
+					}
+
+					std::uint32_t *list = &adjacency[offsets[v]];
+					for (std::uint32_t j = 0; j < live[v]; ++j)
+						if (list[j] == best)
+						{
+							list[j] = list[live[v] - 1];
+							break;
+						}
+					--live[v];
+				}
+				for (int k = 0; k < 3; ++k)
+					cone[k] += normals[best * 3 + k];
+				++open_triangles;
+			}
+			close();
+		}
+
+		// What the culling pass sees: frustum planes and the eye in the same space as the
+		// meshlet bounds, so pass the model-view-projection and the eye in model space.
+		struct meshlet_view
+		{
+			float planes[6][4];
+			knu::math::vector3f eye;
+		};
+
+		// view_projection is 16 column major floats, e.g. a matrix4f's data().
+		inline void make_meshlet_view(meshlet_view &view, const float *view_projection, float eye_x, float eye_y, float eye_z)
+		{
+			const float *m = view_projection;
+			for (int i = 0; i < 3; ++i)
+				for (int side = 0; side < 2; ++side)
+				{
+					float sign = side ? -1.0f : 1.0f;
+					float *p = view.planes[i * 2 + side];
+					for (int c = 0; c < 4; ++c)
+						p[c] = m[c * 4 + 3] + sign * m[c * 4 + i];
+					float length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+					if (length > 0.0f)
+						for (int c = 0; c < 4; ++c)
+							p[c] /= length;
+				}
+			view.eye.x = eye_x;
+			view.eye.y = eye_y;
+			view.eye.z = eye_z;
+		}
+
+		struct meshlet_cull_stats
+		{
+			std::size_t meshlets;
+			std::size_t frustum_culled;
+			std::size_t cone_culled;
+			std::size_t triangles;
+			std::size_t triangles_visible;
+			std::size_t commands;		// after merging neighbouring survivors
+		};
+
+		// Tests meshlet bounds against a view in batches and appends one indirect command per
+		// run of neighbouring survivors, so a mostly visible mesh still costs few draws.
+		class meshlet_culler
+		{
+			enum : unsigned char { visible, outside, backfacing };
+
+			std::vector<unsigned char> results;
+			meshlet_cull_stats stats;
+			std::size_t batch_size;
+
+		private:
+			static unsigned char test(const meshlet_bounds &b, const meshlet_view &view)
+			{
+				for (int p = 0; p < 6; ++p)
+				{
+					const float *plane = view.planes[p];
+					if (plane[0] * b.center.x + plane[1] * b.center.y + plane[2] * b.center.z + plane[3] < -b.radius)
+						return outside;
+				}
+
+				float dx = b.center.x - view.eye.x, dy = b.center.y - view.eye.y, dz = b.center.z - view.eye.z;
+				float along = dx * b.cone_axis.x + dy * b.cone_axis.y + dz * b.cone_axis.z;
+				if (along >= b.cone_cutoff * std::sqrt(dx * dx + dy * dy + dz * dz) + b.radius)
+					return backfacing;
+				return visible;
+			}
+
+			void test_range(const meshlet_data &data, const meshlet_view &view, std::size_t first, std::size_t last)
+			{
+				for (std::size_t i = first; i < last; ++i)
+					results[i] = test(data.bounds[i], view);
+			}
+
+			void emit(const meshlet_data &data, std::vector<draw_elements_indirect_command> &commands, std::int32_t base_vertex, std::uint32_t base_instance)
+			{
+				stats = meshlet_cull_stats();
+				stats.meshlets = data.meshlets.size();
+
+				bool open = false;
+				for (std::size_t i = 0; i < data.meshlets.size(); ++i)
+				{
+					const meshlet &m = data.meshlets[i];
+					stats.triangles += m.triangle_count;
+					if (results[i] != visible)
+					{
+						stats.frustum_culled += results[i] == outside;
+						stats.cone_culled += results[i] == backfacing;
+						open = false;
+						continue;
+					}
+
+					stats.triangles_visible += m.triangle_count;
+					if (open)
+					{
+						commands.back().count += m.triangle_count * 3;
+						continue;
+					}
+
+					draw_elements_indirect_command c;
+					c.count = m.triangle_count * 3;
+					c.instance_count = 1;
+					c.first_index = m.first_index;
+					c.base_vertex = base_vertex;
+					c.base_instance = base_instance;
+					commands.push_back(c);
+					++stats.commands;
+					open = true;
+				}
+			}
+
+		public:
+			explicit meshlet_culler(std::size_t batch_size = 256) :
+				stats(),
+				batch_size(batch_size)
+			{
+			}
+
+			// No copy constructor or assignment
+			meshlet_culler(const meshlet_culler &) = delete;
+			meshlet_culler &operator=(const meshlet_culler &) = delete;
+
+			// Appends to commands, so several meshes can share one indirect buffer; base_vertex
+			// and base_instance say where this mesh's data lives in the shared buffers.
+			void cull(const meshlet_data &data, const meshlet_view &view, std::vector<draw_elements_indirect_command> &commands,
+				std::int32_t base_vertex = 0, std::uint32_t base_instance = 0)
+			{
+				results.resize(data.meshlets.size());
+				for (std::size_t first = 0; first < data.meshlets.size(); first += batch_size)
+					test_range(data, view, first, (std::min)(first + batch_size, data.meshlets.size()));
+				emit(data, commands, base_vertex, base_instance);
+			}
+
+			// Same, with the batches spread over the job system. The commands come out in the
+			// same order either way.
+			void cull(job_system &jobs, const meshlet_data &data, const meshlet_view &view, std::vector<draw_elements_indirect_command> &commands,
+				std::int32_t base_vertex = 0, std::uint32_t base_instance = 0)
+			{
+				results.resize(data.meshlets.size());
+				jobs.parallel_for(0, data.meshlets.size(), batch_size, [&](std::size_t first, std::size_t last) {
+					test_range(data, view, first, last);
+				});
+				emit(data, commands, base_vertex, base_instance);
+			}
+
+			// Of the last cull call.
+			meshlet_cull_stats get_stats() const { return stats; }
+		};
+	}
+}
+
+#endif // !KNU_MESHLET_HPP
@@ -0,0 +1,450 @@
+#ifndef KNU_OBJ_CONVERTER_HPP
+#define KNU_OBJ_CONVERTER_HPP
+
+#include <knu/job_system.hpp>
+#include <knu/mapped_file.hpp>
+#include <knu/mesh_file.hpp>
+#include <knu/mesh_optimizer.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Vertex layout of converted meshes: locations 0 position, 1 normal, 2 uv.
+		struct obj_vertex
+		{
+			float position[3];
+			float normal[3];
+			float uv[2];
+		};
+
+		struct obj_mesh
+		{
+			std::vector<obj_vertex> vertices;
+			std::vector<std::uint32_t> indices;
+			std::vector<mesh_submesh> submeshes;	// one per material, in first use order
+			std::vector<std::string> materials;
+			float bounds_min[3];
+			float bounds_max[3];
+		};
+
+		namespace detail
+		{
+			// Everything one slice of the file declares. Face corners keep the OBJ numbering
+			// resolved as far as the slice can: absolute indices as is, relative ones against
+			// the slice's own counts plus obj_relative, fixed up once earlier slices are counted.
+			struct obj_chunk
+			{
+				std::vector<float> positions, uvs, normals;
+				std::vector<std::int64_t> corners;		// position, uv, normal per corner, -1 when missing
+				struct run
+				{
+					std::int32_t material;				// into names
+					std::size_t first_corner;
+				};
+				std::vector<run> runs;					// where usemtl switched materials
+				std::vector<std::string> names;
+			};
+
+			const std::int64_t obj_relative = std::int64_t(1) << 40;
+
+			inline bool obj_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+			inline const char *obj_skip(const char *p, const char *end)
+			{
+				while (p < end && obj_space(*p))
+					++p;
+				return p;
+			}
+
+			// Plain decimal floats, enough for OBJ and a lot faster than strtof.
+			inline const char *obj_float(const char *p, const char *end, float &value)
+			{
+				static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+				p = obj_skip(p, end);
+				bool negative = false;
+				if (p < end && (*p == '-' || *p == '+'))
+					negative = *p++ == '-';
+
+				double mantissa = 0.0;
+				int exponent = 0;
+				while (p < end && *p >= '0' && *p <= '9')
+					mantissa = mantissa * 10.0 + (*p++ - '0');
+				if (p < end && *p == '.')
+				{
+					++p;
+					while (p < end && *p >= '0' && *p <= '9')
+					{
+						mantissa = mantissa * 10.0 + (*p++ - '0');
+						--exponent;
+					}
+				}
+				if (p < end && (*p == 'e' || *p == 'E'))
+				{
+					++p;
+					bool negative_exponent = false;
+					if (p < end && (*p == '-' || *p == '+'))
+						negative_exponent = *p++ == '-';
+					int e = 0;
+					while (p < end && *p >= '0' && *p <= '9')
+						e = e * 10 + (*p++ - '0');
+					exponent += negative_exponent ? -e : e;
+				}
+
+				double scaled = mantissa;
+				if (exponent < 0)
+					scaled = -exponent <= 18 ? mantissa / powers[-exponent] : mantissa * std::pow(10.0, exponent);
+				else if (exponent > 0)
+					scaled = exponent <= 18 ? mantissa * powers[exponent] : mantissa * std::pow(10.0, exponent);
+				value = static_cast<float>(negative ? -scaled : scaled);
+				return p;
+			}
+
+			// One corner index; count is how many of that kind the slice has seen so far.
+			inline const char *obj_index(const char *p, const char *end, std::size_t count, std::int64_t &index)
+			{
+				bool negative = false;
+				if (p < end && *p == '-')
+				{
+					negative = true;
+					++p;
+				}
+				std::int64_t i = 0;
+				bool digits = false;
+				while (p < end && *p >= '0' && *p <= '9')
+				{
+					i = i * 10 + (*p++ - '0');
+					digits = true;
+				}
+				if (!digits)
+					index = -1;
+				else if (negative)
+					index = obj_relative + static_cast<std::int64_t>(count) - i;
+				else
+					index = i - 1;
+				return p;
+			}
+
+			inline void parse_obj_chunk(const char *p, const char *end, obj_chunk &chunk)
+			{
+				std::vector<std::int64_t> face;
+				while (p < end)
+				{
+					const char *line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+					if (!line_end)
+						line_end = end;
+					p = obj_skip(p, line_end);
+
+					if (line_end - p > 2 && p[0] == 'v' && obj_space(p[1]))
+					{
+						float x, y, z;
+						p = obj_float(p + 2, line_end, x);
+						p = obj_float(p, line_end, y);
+						obj_float(p, line_end, z);
+						chunk.positions.insert(chunk.positions.end(), { x, y, z });
+					}
+					else if (line_end - p > 3 && p[0] == 'v' && p[1] == 't' && obj_space(p[2]))
+					{
+						float u, v;
+						p = obj_float(p + 3, line_end, u);
+						obj_float(p, line_end, v);
+						chunk.uvs.insert(chunk.uvs.end(), { u, v });
+					}
+					else if (line_end - p > 3 && p[0] == 'v' && p[1] == 'n' && obj_space(p[2]))
+					{
+						float x, y, z;
+						p = obj_float(p + 3, line_end, x);
+						p = obj_float(p, line_end, y);
+						obj_float(p, line_end, z);
+						chunk.normals.insert(chunk.normals.end(), { x, y, z });
+					}
+					else if (line_end - p > 2 && p[0] == 'f' && obj_space(p[1]))
+					{
+						face.clear();
+						p = obj_skip(p + 2, line_end);
+						while (p < line_end)
+						{
+							std::int64_t v, t = -1, n = -1;
+							p = obj_index(p, line_end, chunk.positions.size() / 3, v);
+							if (p < line_end && *p == '/')
+							{
+								p = obj_index(p + 1, line_end, chunk.uvs.size() / 2, t);
+								if (p < line_end && *p == '/')
+									p = obj_index(p + 1, line_end, chunk.normals.size() / 3, n);
+							}
+							if (v == -1)
+								break;
+							face.insert(face.end(), { v, t, n });
+							p = obj_skip(p, line_end);
+						}
+
+						// fan out polygons
+						for (std::size_t k = 2; k < face.size() / 3; ++k)
+						{
+							chunk.corners.insert(chunk.corners.end(), face.begin(), face.begin() + 3);
+							chunk.corners.insert(chunk.corners.end(), face.begin() + (k - 1) * 3, face.begin() + (k + 1) * 3);
+						}
+					}
+					else if (line_end - p > 7 && std::strncmp(p, "usemtl", 6) == 0 && obj_space(p[6]))
+					{
+						const char *name = obj_skip(p + 7, line_end), *name_end = line_end;
+						while (name_end > name && obj_space(name_end[-1]))
+							--name_end;
+						obj_chunk::run r = { static_cast<std::int32_t>(chunk.names.size()), chunk.corners.size() };
+						chunk.names.emplace_back(name, name_end);
+						chunk.runs.push_back(r);
+					}
+
+					p = line_end + 1;
+				}
+			}
+
+			template<typename for_each_chunk>
+			void parse_obj(const std::string &name, obj_mesh &out, std::size_t chunk_count, for_each_chunk run_chunks)
+			{
+				mapped_file file(name);
+				file.will_need();
+				const char *begin = reinterpret_cast<const char *>(file.data()), *end = begin + file.size();
+
+				// slices end on line breaks
+				std::vector<const char *> cuts(1, begin);
+				for (std::size_t c = 1; c < chunk_count; ++c)
+				{
+					const char *cut = begin + file.size() * c / chunk_count;
+					if (cut <= cuts.back())
+						continue;
+					const char *line = static_cast<const char *>(std::memchr(cut, '\n', end - cut));
+					if (!line)
+						break;
+					if (line + 1 > cuts.back())
+						cuts.push_back(line + 1);
+				}
+				cuts.push_back(end);
+
+				std::vector<obj_chunk> chunks(cuts.size() - 1);
+				run_chunks(chunks.size(), [&](std::size_t c) { parse_obj_chunk(cuts[c], cuts[c + 1], chunks[c]); });
+
+				// everything in one list, relative indices made absolute
+				std::vector<float> positions, uvs, normals;
+				std::vector<std::int64_t> corners;
+				std::vector<std::int32_t> corner_material;	// per triangle
+				std::map<std::string, std::int32_t> material_ids;
+				out.materials.clear();
+				std::int32_t material = -1;
+				for (auto &chunk : chunks)
+				{
+					const std::int64_t bases[3] = {
+						static_cast<std::int64_t>(positions.size() / 3),
+						static_cast<std::int64_t>(uvs.size() / 2),
+						static_cast<std::int64_t>(normals.size() / 3) };
+					positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+					uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+					normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+
+					std::size_t run = 0;
+					auto switch_material = [&]() {
+						const std::string &n = chunk.names[chunk.runs[run++].material];
+						auto found = material_ids.find(n);
+						if (found == material_ids.end())
+						{
+							found = material_ids.emplace(n, static_cast<std::int32_t>(out.materials.size())).first;
+							out.materials.push_back(n);
+						}
+						material = found->second;
+					};
+					for (std::size_t i = 0; i < chunk.corners.size(); i += 9)
+					{
+						while (run < chunk.runs.size() && chunk.runs[run].first_corner <= i)
+							switch_material();
+						corner_material.push_back(material);
+					}
+					// a usemtl after the slice's last face still holds for the next slice
+					while (run < chunk.runs.size())
+						switch_material();
+
+					for (std::size_t i = 0; i < chunk.corners.size(); ++i)
+					{
+						std::int64_t c = chunk.corners[i];
+						if (c >= obj_relative / 2)
+							c = bases[i % 3] + c - obj_relative;
+						corners.push_back(c);
+					}
+					chunk = obj_chunk();
+				}
+
+				// faces before any usemtl, if some material came later, get a nameless one
+				bool unnamed = std::find(corner_material.begin(), corner_material.end(), -1) != corner_material.end();
+				if (unnamed)
+				{
+					for (auto &m : corner_material)
+						++m;
+					out.materials.insert(out.materials.begin(), std::string());
+				}
+
+				// smooth normals for corners that came without one
+				const std::size_t position_count = positions.size() / 3;
+				std::vector<float> smooth;
+				for (std::size_t i = 0; i < corners.size(); i += 9)
+				{
+					if (corners[i + 2] >= 0 && corners[i + 5] >= 0 && corners[i + 8] >= 0)
+						continue;
+					if (smooth.empty())
+						smooth.assign(position_count * 3, 0.0f);
+					const std::int64_t v[3] = { corners[i], corners[i + 3], corners[i + 6] };
+					if (v[0] < 0 || v[1] < 0 || v[2] < 0 || v[0] >= std::int64_t(position_count) || v[1] >= std::int64_t(position_count) || v[2] >= std::int64_t(position_count))
+						continue;
+					const float *a = &positions[v[0] * 3], *b = &positions[v[1] * 3], *c = &positions[v[2] * 3];
+					float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] }, e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+					float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+					for (int k = 0; k < 3; ++k)
+						for (int j = 0; j < 3; ++j)
+							smooth[v[k] * 3 + j] += n[j];
+				}
+				for (std::size_t v = 0; v < smooth.size(); v += 3)
+				{
+					float length = std::sqrt(smooth[v] * smooth[v] + smooth[v + 1] * smooth[v + 1] + smooth[v + 2] * smooth[v + 2]);
+					if (length > 0.0f)
+						for (int j = 0; j < 3; ++j)
+							smooth[v + j] /= length;
+				}
+
+				// triangles grouped by material, one unwelded vertex per corner
+				const std::size_t triangle_count = corner_material.size();
+				std::vector<std::uint32_t> order(triangle_count);
+				for (std::size_t t = 0; t < triangle_count; ++t)
+					order[t] = static_cast<std::uint32_t>(t);
+				std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) { return corner_material[a] < corner_material[b]; });
+
+				out.vertices.clear();
+				out.vertices.reserve(triangle_count * 3);
+				out.submeshes.clear();
+				for (std::size_t i = 0; i < triangle_count; ++i)
+				{
+					std::uint32_t t = order[i];
+					if (out.submeshes.empty() || out.submeshes.back().material != static_cast<std::uint32_t>(corner_material[t]))
+					{
+						mesh_submesh s = { static_cast<std::uint32_t>(i * 3), 0, 0, static_cast<std::uint32_t>(corner_material[t]) };
+						out.submeshes.push_back(s);
+					}
+					out.submeshes.back().index_count += 3;
+
+					for (int k = 0; k < 3; ++k)
+					{
+						const std::int64_t *c = &corners[t * 9 + k * 3];
+						if (c[0] < 0 || c[0] >= std::int64_t(position_count) || c[1] >= std::int64_t(uvs.size() / 2) || c[2] >= std::int64_t(normals.size() / 3))
+							throw std::runtime_error("OBJ face index out of range: " + name);
+
+						obj_vertex v;
+						std::memcpy(v.position, &positions[c[0] * 3], sizeof(v.position));
+						if (c[2] >= 0)
+							std::memcpy(v.normal, &normals[c[2] * 3], sizeof(v.normal));
+						else
+							std::memcpy(v.normal, &smooth[c[0] * 3], sizeof(v.normal));
+						if (c[1] >= 0)
+							std::memcpy(v.uv, &uvs[c[1] * 2], sizeof(v.uv));
+						else
+							v.uv[0] = v.uv[1] = 0.0f;
+						out.vertices.push_back(v);
+					}
+				}
+
+				for (int k = 0; k < 3; ++k)
+				{
+					out.bounds_min[k] = position_count ? positions[k] : 0.0f;
+					out.bounds_max[k] = out.bounds_min[k];
+				}
+				for (std::size_t v = 0; v < position_count; ++v)
+					for (int k = 0; k < 3; ++k)
+					{
+						out.bounds_min[k] = (std::min)(out.bounds_min[k], positions[v * 3 + k]);
+						out.bounds_max[k] = (std::max)(out.bounds_max[k], positions[v * 3 + k]);
+					}
+
+				out.indices.clear();
+				weld_vertices(out.vertices, out.indices);
+			}
+		}
+
+		// Reads an OBJ (v, vt, vn, f with any polygon size and negative indices, usemtl)
+		// into an indexed mesh. The file is mapped and read in slices; corners sharing
+		// position, uv and normal become one vertex and missing normals are smoothed.
+		inline void parse_obj(const std::string &name, obj_mesh &out)
+		{
+			detail::parse_obj(name, out, 1, [](std::size_t count, const std::function<void(std::size_t)> &fn) {
+				for (std::size_t c = 0; c < count; ++c)
+					fn(c);
+			});
+		}
+
+		// Same, with the slices parsed in parallel on the job system.
+		inline void parse_obj(job_system &jobs, const std::string &name, obj_mesh &out)
+		{
+			detail::parse_obj(name, out, jobs.get_thread_count() * 4, [&jobs](std::size_t count, const std::function<void(std::size_t)> &fn) {
+				jobs.parallel_for(0, count, 1, [&fn](std::size_t first, std::size_t last) {
+					for (std::size_t c = first; c < last; ++c)
+						fn(c);
+				});
+			});
+		}
+
+		// Bakes a parsed mesh: triangles reordered for the vertex cache within each submesh,
+		// vertices in fetch order, 16 bit indices when they fit.
+		inline void write_obj_mesh(const std::string &name, obj_mesh &mesh)
+		{
+			for (const auto &s : mesh.submeshes)
+			{
+				std::vector<std::uint32_t> range(mesh.indices.begin() + s.first_index, mesh.indices.begin() + s.first_index + s.index_count);
+				optimize_vertex_cache(range, mesh.vertices.size());
+				std::copy(range.begin(), range.end(), mesh.indices.begin() + s.first_index);
+			}
+			optimize_vertex_fetch(mesh.vertices, mesh.indices);
+
+			mesh_file_desc desc;
+			desc.vertices = mesh.vertices.data();
+			desc.vertex_count = mesh.vertices.size();
+			desc.vertex_stride = sizeof(obj_vertex);
+			desc.attributes = {
+				{ 0, 3, 0x1406, 0, 0 },		// GL_FLOAT
+				{ 1, 3, 0x1406, 0, 12 },
+				{ 2, 2, 0x1406, 0, 24 },
+			};
+			desc.submeshes = mesh.submeshes;
+			desc.material_names = mesh.materials;
+			std::memcpy(desc.bounds_min, mesh.bounds_min, sizeof(desc.bounds_min));
+			std::memcpy(desc.bounds_max, mesh.bounds_max, sizeof(desc.bounds_max));
+
+			std::vector<std::uint16_t> short_indices;
+			desc.index_count = mesh.indices.size();
+			if (mesh.vertices.size() <= 0x10000)
+			{
+				short_indices.assign(mesh.indices.begin(), mesh.indices.end());
+				desc.indices = short_indices.data();
+				desc.index_size = 2;
+			}
+			else
+			{
+				desc.indices = mesh.indices.data();
+				desc.index_size = 4;
+			}
+			write_mesh_file(name, desc);
+		}
+
+		inline void convert_obj(job_system &jobs, const std::string &obj_name, const std::string &mesh_name)
+		{
+			obj_mesh mesh;
+			parse_obj(jobs, obj_name, mesh);
+			write_obj_mesh(mesh_name, mesh);
+		}
+	}
+}
+
+#endif // !KNU_OBJ_CONVERTER_HPP
@@ -0,0 +1,572 @@
+#ifndef KNU_PROFILER_HPP
+#define KNU_PROFILER_HPP
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#include <OpenGL/gl3ext.h>
+#endif
+
+#ifdef WIN32
+#include <Windows.h>
+#include <GL/glew.h>
+#endif
+
+#ifdef __linux__
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+#include <GL/glcorearb.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define KNU_PROFILER_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define KNU_PROFILER_TSC
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// KNU_PROFILE_ZONE("name") times the enclosing scope on the cpu, KNU_PROFILE_GPU_ZONE("name")
+// brackets the gl commands issued in it with timestamp queries (gl thread only). Names must
+// be string literals or otherwise outlive the profiler. Define KNU_DISABLE_PROFILER to
+// compile both out.
+#define KNU_PROFILE_CONCAT_INNER(a, b) a##b
+#define KNU_PROFILE_CONCAT(a, b) KNU_PROFILE_CONCAT_INNER(a, b)
+
+#ifdef KNU_DISABLE_PROFILER
+#define KNU_PROFILE_ZONE(name)
+#define KNU_PROFILE_GPU_ZONE(name)
+#else
+#define KNU_PROFILE_ZONE(name) knu::profile_zone KNU_PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#define KNU_PROFILE_GPU_ZONE(name) knu::gpu_profile_zone KNU_PROFILE_CONCAT(gpu_profile_zone_, __LINE__)(name)
+#endif
+
+namespace knu
+{
+	// One finished zone as stored in the rings. Times are profiler ticks (the cpu timestamp
+	// counter where there is one); gpu zones are shifted onto the same timeline.
+	struct zone_record
+	{
+		const char *name;
+		std::uint64_t start_ticks;
+		std::uint64_t end_ticks;
+		std::uint32_t thread;
+		std::uint32_t depth;
+	};
+
+	// Zones copied out of the rings, with names interned so the capture can be saved and
+	// loaded again.
+	struct profile_capture
+	{
+		// times in steady_clock nanoseconds
+		struct zone
+		{
+			std::uint32_t name;			// index into names
+			std::uint32_t thread;		// index into threads
+			std::uint32_t depth;
+			std::uint64_t start_ns;
+			std::uint64_t end_ns;
+		};
+
+		std::vector<std::string> names;
+		std::vector<std::string> threads;
+		std::vector<zone> zones;
+	};
+
+	// Fixed size ring written by exactly one thread. Readers copy a range and then discard
+	// whatever the writer may have lapped while they were copying.
+	class zone_ring
+	{
+	public:
+		static const std::size_t capacity = 1 << 14;
+
+	private:
+		std::array<zone_record, capacity> records;
+		std::atomic<std::uint64_t> head;
+		std::uint32_t thread_index;
+		std::string thread_name;
+
+	public:
+		zone_ring(std::uint32_t index, const std::string &name) :
+			head(0),
+			thread_index(index),
+			thread_name(name)
+		{
+		}
+
+		void push(const char *name, std::uint64_t start_ticks, std::uint64_t end_ticks, std::uint32_t depth)
+		{
+			std::uint64_t h = head.load(std::memory_order_relaxed);
+			zone_record &r = records[h & (capacity - 1)];
+			r.name = name;
+			r.start_ticks = start_ticks;
+			r.end_ticks = end_ticks;
+			r.thread = thread_index;
+			r.depth = depth;
+			head.store(h + 1, std::memory_order_release);
+		}
+
+		// appends every record that ended at or after since_ticks
+		void read(std::uint64_t since_ticks, std::vector<zone_record> &out) const
+		{
+			std::uint64_t end = head.load(std::memory_order_acquire);
+			std::uint64_t begin = end > capacity ? end - capacity : 0;
+			std::size_t first = out.size();
+
+			for (std::uint64_t i = begin; i < end; ++i)
+				out.push_back(records[i & (capacity - 1)]);
+
+			// anything below the new head minus capacity may have been overwritten meanwhile
+			std::uint64_t lapped = head.load(std::memory_order_acquire);
+			std::uint64_t valid = lapped > capacity ? lapped - capacity : 0;
+			std::size_t skip = valid > begin ? static_cast<std::size_t>(valid - begin) : 0;
+			skip = skip < out.size() - first ? skip : out.size() - first;
+			out.erase(out.begin() + first, out.begin() + first + skip);
+
+			out.erase(std::remove_if(out.begin() + first, out.end(),
+				[since_ticks](const zone_record &r) { return r.end_ticks < since_ticks; }), out.end());
+		}
+
+		void set_name(const std::string &name) { thread_name = name; }
+		const std::string &get_name() const { return thread_name; }
+		std::uint32_t get_index() const { return thread_index; }
+	};
+
+	// Process wide collector. Every thread lazily gets its own ring the first time it
+	// closes a zone; the gpu gets one more, written by whichever thread calls resolve_gpu().
+	class profiler
+	{
+		struct gpu_query
+		{
+			const char *name;
+			GLuint begin;
+			GLuint end;
+			std::uint32_t depth;
+		};
+
+		std::atomic<bool> enabled;
+		std::mutex rings_mutex;
+		std::vector<std::shared_ptr<zone_ring>> rings;
+
+		// gl thread only
+		std::shared_ptr<zone_ring> gpu_ring;
+		std::vector<GLuint> free_queries;
+		std::vector<GLuint> all_queries;
+		std::deque<gpu_query> in_flight;
+		std::uint64_t in_flight_base;		// sequence number of in_flight.front()
+		std::uint32_t gpu_depth;
+		std::int64_t gpu_offset_ns;			// cpu time minus gpu time
+		std::uint64_t last_calibration_ns;
+
+		// ticks and nanoseconds sampled together at startup, the tick rate is measured
+		// against this pair whenever times are converted
+		std::uint64_t base_ticks;
+		std::uint64_t base_ns;
+
+	private:
+		profiler() :
+			enabled(true),
+			in_flight_base(0),
+			gpu_depth(0),
+			gpu_offset_ns(0),
+			last_calibration_ns(0),
+			base_ticks(now_ticks()),
+			base_ns(now_ns())
+		{
+		}
+
+		double ns_per_tick() const
+		{
+#ifdef KNU_PROFILER_TSC
+			std::uint64_t ticks = now_ticks();
+			std::uint64_t ns = now_ns();
+			return ticks > base_ticks && ns > base_ns ? double(ns - base_ns) / double(ticks - base_ticks) : 1.0;
+#else
+			return 1.0;
+#endif
+		}
+
+		zone_ring &register_thread()
+		{
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			rings.push_back(std::make_shared<zone_ring>(static_cast<std::uint32_t>(rings.size()),
+				"thread " + std::to_string(rings.size())));
+			return *rings.back();
+		}
+
+		GLuint acquire_query()
+		{
+			if (free_queries.empty())
+			{
+				GLuint q[16];
+				glGenQueries(16, q);
+				free_queries.insert(free_queries.end(), q, q + 16);
+				all_queries.insert(all_queries.end(), q, q + 16);
+			}
+			GLuint q = free_queries.back();
+			free_queries.pop_back();
+			return q;
+		}
+
+		void calibrate_gpu()
+		{
+			GLint64 gpu_now = 0;
+			glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+			std::uint64_t cpu_now = now_ns();
+			gpu_offset_ns = static_cast<std::int64_t>(cpu_now) - static_cast<std::int64_t>(gpu_now);
+			last_calibration_ns = cpu_now;
+		}
+
+	public:
+		// No copy constructor or assignment
+		profiler(const profiler &) = delete;
+		profiler &operator=(const profiler &) = delete;
+
+		static profiler &get()
+		{
+			static profiler instance;
+			return instance;
+		}
+
+		static std::uint64_t now_ns()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		// Cheap timestamp for zones; the invariant tsc on x86, steady_clock elsewhere.
+		static std::uint64_t now_ticks()
+		{
+#ifdef KNU_PROFILER_TSC
+			return __rdtsc();
+#else
+			return now_ns();
+#endif
+		}
+
+		std::uint64_t ticks_to_ns(std::uint64_t ticks, double ratio) const
+		{
+			return base_ns + static_cast<std::uint64_t>(static_cast<std::int64_t>(ticks - base_ticks) * ratio);
+		}
+
+		std::uint64_t ns_to_ticks(std::uint64_t ns, double ratio) const
+		{
+			return base_ticks + static_cast<std::uint64_t>(static_cast<std::int64_t>(ns - base_ns) / ratio);
+		}
+
+		static std::uint32_t &zone_depth()
+		{
+			static thread_local std::uint32_t depth = 0;
+			return depth;
+		}
+
+		zone_ring &this_thread_ring()
+		{
+			static thread_local zone_ring *ring = nullptr;
+			if (!ring)
+				ring = &register_thread();
+			return *ring;
+		}
+
+		void set_enabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+		bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+		// Shows up as the track name in exported traces.
+		void set_thread_name(const std::string &name)
+		{
+			zone_ring &ring = this_thread_ring();
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			ring.set_name(name);
+		}
+
+		// gl thread only. Returns a handle for gpu_end().
+		std::uint64_t gpu_begin(const char *name)
+		{
+			gpu_query q = { name, acquire_query(), 0, gpu_depth++ };
+			glQueryCounter(q.begin, GL_TIMESTAMP);
+			in_flight.push_back(q);
+			return in_flight_base + in_flight.size() - 1;
+		}
+
+		void gpu_end(std::uint64_t handle)
+		{
+			gpu_query &q = in_flight[static_cast<std::size_t>(handle - in_flight_base)];
+			q.end = acquire_query();
+			glQueryCounter(q.end, GL_TIMESTAMP);
+			--gpu_depth;
+		}
+
+		// Reads back the gpu zones whose results are available without stalling. Call once a
+		// frame on the gl thread; results usually arrive a frame or two late.
+		void resolve_gpu()
+		{
+			if (!gpu_ring)
+			{
+				std::lock_guard<std::mutex> lock(rings_mutex);
+				rings.push_back(std::make_shared<zone_ring>(static_cast<std::uint32_t>(rings.size()), "gpu"));
+				gpu_ring = rings.back();
+			}
+
+			// clocks drift apart slowly, once a second is plenty
+			if (now_ns() - last_calibration_ns > 1000000000ull)
+				calibrate_gpu();
+
+			double ratio = ns_per_tick();
+			while (!in_flight.empty() && in_flight.front().end)
+			{
+				gpu_query &q = in_flight.front();
+				GLint available = 0;
+				glGetQueryObjectiv(q.end, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					break;
+
+				GLuint64 begin_ns = 0, end_ns = 0;
+				glGetQueryObjectui64v(q.begin, GL_QUERY_RESULT, &begin_ns);
+				glGetQueryObjectui64v(q.end, GL_QUERY_RESULT, &end_ns);
+				gpu_ring->push(q.name, ns_to_ticks(static_cast<std::uint64_t>(static_cast<std::int64_t>(begin_ns) + gpu_offset_ns), ratio),
+					ns_to_ticks(static_cast<std::uint64_t>(static_cast<std::int64_t>(end_ns) + gpu_offset_ns), ratio), q.depth);
+
+				free_queries.push_back(q.begin);
+				free_queries.push_back(q.end);
+				in_flight.pop_front();
+				++in_flight_base;
+			}
+		}
+
+		// gl thread only, before the context goes away
+		void release_gpu()
+		{
+			if (!all_queries.empty())
+				glDeleteQueries(static_cast<GLsizei>(all_queries.size()), all_queries.data());
+			all_queries.clear();
+			free_queries.clear();
+			in_flight_base += in_flight.size();
+			in_flight.clear();
+		}
+
+		// Copies every zone that ended at or after since_ns out of all rings.
+		profile_capture capture(std::uint64_t since_ns = 0)
+		{
+			double ratio = ns_per_tick();
+			std::uint64_t since_ticks = since_ns > base_ns ? ns_to_ticks(since_ns, ratio) : 0;
+			std::vector<zone_record> records;
+			profile_capture result;
+			{
+				std::lock_guard<std::mutex> lock(rings_mutex);
+				for (auto &r : rings)
+				{
+					r->read(since_ticks, records);
+					result.threads.push_back(r->get_name());
+				}
+			}
+
+			std::unordered_map<const char *, std::uint32_t> name_index;
+			result.zones.reserve(records.size());
+			for (const auto &r : records)
+			{
+				auto n = name_index.find(r.name);
+				if (n == name_index.end())
+				{
+					n = name_index.emplace(r.name, static_cast<std::uint32_t>(result.names.size())).first;
+					result.names.push_back(r.name);
+				}
+				result.zones.push_back(profile_capture::zone{ n->second, r.thread, r.depth,
+					ticks_to_ns(r.start_ticks, ratio), ticks_to_ns(r.end_ticks, ratio) });
+			}
+
+			std::sort(result.zones.begin(), result.zones.end(),
+				[](const profile_capture::zone &a, const profile_capture::zone &b) { return a.start_ns < b.start_ns; });
+			return result;
+		}
+	};
+
+	class profile_zone
+	{
+		const char *name;
+		std::uint64_t start_ticks;
+		bool active;
+
+	public:
+		explicit profile_zone(const char *name_) :
+			name(name_),
+			start_ticks(0),
+			active(profiler::get().is_enabled())
+		{
+			if (active)
+			{
+				++profiler::zone_depth();
+				start_ticks = profiler::now_ticks();
+			}
+		}
+
+		~profile_zone()
+		{
+			if (active)
+			{
+				std::uint64_t end_ticks = profiler::now_ticks();
+				std::uint32_t depth = --profiler::zone_depth();
+				profiler::get().this_thread_ring().push(name, start_ticks, end_ticks, depth);
+			}
+		}
+
+		// No copy constructor or assignment
+		profile_zone(const profile_zone &) = delete;
+		profile_zone &operator=(const profile_zone &) = delete;
+	};
+
+	class gpu_profile_zone
+	{
+		std::uint64_t handle;
+		bool active;
+
+	public:
+		explicit gpu_profile_zone(const char *name) :
+			handle(0),
+			active(profiler::get().is_enabled())
+		{
+			if (active)
+				handle = profiler::get().gpu_begin(name);
+		}
+
+		~gpu_profile_zone()
+		{
+			if (active)
+				profiler::get().gpu_end(handle);
+		}
+
+		// No copy constructor or assignment
+		gpu_profile_zone(const gpu_profile_zone &) = delete;
+		gpu_profile_zone &operator=(const gpu_profile_zone &) = delete;
+	};
+
+	// chrome://tracing and Perfetto load this directly
+	inline void write_chrome_trace(const std::string &file_name, const profile_capture &c)
+	{
+		std::ofstream out(file_name, std::ios::binary);
+		if (!out)
+			throw std::runtime_error("Unable to write file: " + file_name);
+
+		auto escaped = [](const std::string &s) {
+			std::string e;
+			for (char ch : s)
+			{
+				if (ch == '"' || ch == '\\')
+					e += '\\';
+				e += ch;
+			}
+			return e;
+		};
+
+		std::uint64_t origin = c.zones.empty() ? 0 : c.zones.front().start_ns;
+		out << "{\"traceEvents\":[\n";
+
+		for (std::size_t t = 0; t < c.threads.size(); ++t)
+			out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+				<< ",\"args\":{\"name\":\"" << escaped(c.threads[t]) << "\"}},\n";
+
+		out.precision(3);
+		out << std::fixed;
+		for (std::size_t i = 0; i < c.zones.size(); ++i)
+		{
+			const profile_capture::zone &z = c.zones[i];
+			out << "{\"name\":\"" << escaped(c.names[z.name]) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << z.thread
+				<< ",\"ts\":" << (z.start_ns - origin) / 1000.0 << ",\"dur\":" << (z.end_ns - z.start_ns) / 1000.0 << "}"
+				<< (i + 1 < c.zones.size() ? ",\n" : "\n");
+		}
+		out << "]}\n";
+	}
+
+	// Compact binary capture, little endian:
+	//	"KPRF" u32 version
+	//	u32 name count, per name u32 length + bytes
+	//	u32 thread count, per thread u32 length + bytes
+	//	u32 zone count, per zone u32 name, u32 thread, u32 depth, u64 start_ns, u64 duration_ns
+	inline void write_profile_binary(const std::string &file_name, const profile_capture &c)
+	{
+		std::ofstream out(file_name, std::ios::binary);
+		if (!out)
+			throw std::runtime_error("Unable to write file: " + file_name);
+
+		auto write_u32 = [&out](std::uint32_t v) { out.write(reinterpret_cast<const char *>(&v), 4); };
+		auto write_u64 = [&out](std::uint64_t v) { out.write(reinterpret_cast<const char *>(&v), 8); };
+		auto write_strings = [&](const std::vector<std::string> &strings) {
+			write_u32(static_cast<std::uint32_t>(strings.size()));
+			for (const auto &s : strings)
+			{
+				write_u32(static_cast<std::uint32_t>(s.size()));
+				out.write(s.data(), s.size());
+			}
+		};
+
+		out.write("KPRF", 4);
+		write_u32(1);
+		write_strings(c.names);
+		write_strings(c.threads);
+		write_u32(static_cast<std::uint32_t>(c.zones.size()));
+		for (const auto &z : c.zones)
+		{
+			write_u32(z.name);
+			write_u32(z.thread);
+			write_u32(z.depth);
+			write_u64(z.start_ns);
+			write_u64(z.end_ns - z.start_ns);
+		}
+	}
+
+	inline profile_capture read_profile_binary(const std::string &file_name)
+	{
+		std::ifstream in(file_name, std::ios::binary);
+		if (!in)
+			throw std::runtime_error("Unable to open file: " + file_name);
+
+		auto read_u32 = [&in]() { std::uint32_t v = 0; in.read(reinterpret_cast<char *>(&v), 4); return v; };
+		auto read_u64 = [&in]() { std::uint64_t v = 0; in.read(reinterpret_cast<char *>(&v), 8); return v; };
+		auto read_strings = [&](std::vector<std::string> &strings) {
+			strings.resize(read_u32());
+			for (auto &s : strings)
+			{
+				s.resize(read_u32());
+				in.read(&s[0], s.size());
+			}
+		};
+
+		char magic[4];
+		in.read(magic, 4);
+		if (!in || std::memcmp(magic, "KPRF", 4) != 0 || read_u32() != 1)
+			throw std::runtime_error("Not a profile capture: " + file_name);
+
+		profile_capture c;
+		read_strings(c.names);
+		read_strings(c.threads);
+		c.zones.resize(read_u32());
+		for (auto &z : c.zones)
+		{
+			z.name = read_u32();
+			z.thread = read_u32();
+			z.depth = read_u32();
+			z.start_ns = read_u64();
+			z.end_ns = z.start_ns + read_u64();
+		}
+
+		if (!in)
+			throw std::runtime_error("Truncated profile capture: " + file_name);
+		return c;
+	}
+}
+
+#endif // !KNU_PROFILER_HPP
@@ -0,0 +1,526 @@
+#ifndef KNU_QUANTIZATION_HPP
+#define KNU_QUANTIZATION_HPP
+
+#include <knu/mathlibrary6.hpp>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace knu
+{
+	namespace math
+	{
+		// Packed attribute types. Layouts are what GL reads, see the attribute_traits
+		// specializations in gl_utility.hpp.
+		struct half2 { std::uint16_t v[2]; };
+		struct half4 { std::uint16_t v[4]; };
+		struct unorm16x2 { std::uint16_t v[2]; };
+		struct unorm16x3 { std::uint16_t v[3]; std::uint16_t pad; };	// padded to keep vertices 4 byte aligned
+		struct snorm16x3 { std::int16_t v[3]; std::int16_t pad; };
+		struct octahedral16 { std::int16_t v[2]; };						// unit vector, snorm16 octahedral coordinates
+		struct packed_snorm_1010102 { std::uint32_t bits; };			// GL_INT_2_10_10_10_REV
+		struct packed_unorm_1010102 { std::uint32_t bits; };			// GL_UNSIGNED_INT_2_10_10_10_REV
+
+		// IEEE half precision, round to nearest even. Overflow becomes infinity.
+		inline std::uint16_t float_to_half(float f)
+		{
+			std::uint32_t x;
+			std::memcpy(&x, &f, 4);
+			std::uint32_t sign = (x >> 16) & 0x8000u;
+			std::uint32_t exponent = (x >> 23) & 0xffu;
+			std::uint32_t mantissa = x & 0x7fffffu;
+
+			if (exponent == 0xff)
+				return static_cast<std::uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+
+			int e = static_cast<int>(exponent) - 127 + 15;
+			if (e >= 31)
+				return static_cast<std::uint16_t>(sign | 0x7c00u);
+
+			if (e <= 0)
+			{
+				// subnormal half
+				if (e < -10)
+					return static_cast<std::uint16_t>(sign);
+				mantissa |= 0x800000u;
+				std::uint32_t shift = static_cast<std::uint32_t>(14 - e);
+				std::uint32_t h = mantissa >> shift;
+				std::uint32_t rest = mantissa & ((1u << shift) - 1);
+				std::uint32_t halfway = 1u << (shift - 1);
+				if (rest > halfway || (rest == halfway && (h & 1)))
+					++h;
+				return static_cast<std::uint16_t>(sign | h);
+			}
+
+			// a carry out of the mantissa correctly bumps the exponent, up to infinity
+			std::uint32_t h = static_cast<std::uint32_t>(e) << 10 | mantissa >> 13;
+			std::uint32_t rest = mantissa & 0x1fffu;
+			if (rest > 0x1000u || (rest == 0x1000u && (h & 1)))
+				++h;
+			return static_cast<std::uint16_t>(sign | h);
+		}
+
+		inline float half_to_float(std::uint16_t h)
+		{
+			std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000u) << 16;
+			std::uint32_t exponent = (h >> 10) & 0x1fu;
+			std::uint32_t mantissa = h & 0x3ffu;
+			std::uint32_t x;
+
+			if (exponent == 0)
+			{
+				if (!mantissa)
+					x = sign;
+				else
+				{
+					int e = -1;
+					do
+					{
+						mantissa <<= 1;
+						++e;
+					} while (!(mantissa & 0x400u));
+					x = sign | static_cast<std::uint32_t>(127 - 15 - e) << 23 | (mantissa & 0x3ffu) << 13;
+				}
+			}
+			else if (exponent == 31)
+				x = sign | 0x7f800000u | mantissa << 13;
+			else
+				x = sign | (exponent + 112) << 23 | mantissa << 13;
+
+			float f;
+			std::memcpy(&f, &x, 4);
+			return f;
+		}
+
+		// Normalized integers, converted back the way GL does it.
+		inline std::int32_t quantize_snorm(float v, int bits)
+		{
+			float scale = static_cast<float>((1 << (bits - 1)) - 1);
+			v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+			return static_cast<std::int32_t>(std::floor(v * scale + 0.5f));
+		}
+
+		inline float dequantize_snorm(std::int32_t q, int bits)
+		{
+			float v = static_cast<float>(q) / static_cast<float>((1 << (bits - 1)) - 1);
+			return v < -1.0f ? -1.0f : v;
+		}
+
+		inline std::uint32_t quantize_unorm(float v, int bits)
+		{
+			float scale = static_cast<float>((1u << bits) - 1);
+			v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+			return static_cast<std::uint32_t>(v * scale + 0.5f);
+		}
+
+		inline float dequantize_unorm(std::uint32_t q, int bits)
+		{
+			return static_cast<float>(q) / static_cast<float>((1u << bits) - 1);
+		}
+
+		// Octahedral mapping of a unit vector to [-1, 1]^2.
+		inline void octahedral_encode(float x, float y, float z, float &u, float &v)
+		{
+			float l1 = std::fabs(x) + std::fabs(y) + std::fabs(z);
+			if (l1 == 0.0f)
+			{
+				u = v = 0.0f;
+				return;
+			}
+			u = x / l1;
+			v = y / l1;
+			if (z < 0.0f)
+			{
+				float fu = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+				float fv = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+				u = fu;
+				v = fv;
+			}
+		}
+
+		inline void octahedral_decode(float u, float v, float &x, float &y, float &z)
+		{
+			z = 1.0f - std::fabs(u) - std::fabs(v);
+			x = u;
+			y = v;
+			if (z < 0.0f)
+			{
+				x = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+				y = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+			}
+			float length = std::sqrt(x * x + y * y + z * z);
+			x /= length;
+			y /= length;
+			z /= length;
+		}
+
+		// Picks the best of the four neighbouring grid points rather than the nearest one in
+		// octahedral space, which roughly halves the worst angular error.
+		inline void octahedral_quantize(const vector3f &n, int bits, std::int32_t &qu, std::int32_t &qv)
+		{
+			float u, v;
+			octahedral_encode(n.x, n.y, n.z, u, v);
+			float scale = static_cast<float>((1 << (bits - 1)) - 1);
+			std::int32_t base_u = static_cast<std::int32_t>(std::floor(u * scale));
+			std::int32_t base_v = static_cast<std::int32_t>(std::floor(v * scale));
+			float length = n.length();
+			float best = -2.0f;
+			for (int i = 0; i < 4; ++i)
+			{
+				std::int32_t cu = base_u + (i & 1), cv = base_v + (i >> 1);
+				cu = cu > scale ? static_cast<std::int32_t>(scale) : cu;
+				cv = cv > scale ? static_cast<std::int32_t>(scale) : cv;
+				float x, y, z;
+				octahedral_decode(dequantize_snorm(cu, bits), dequantize_snorm(cv, bits), x, y, z);
+				float d = length > 0.0f ? (x * n.x + y * n.y + z * n.z) / length : 0.0f;
+				if (d > best)
+				{
+					best = d;
+					qu = cu;
+					qv = cv;
+				}
+			}
+		}
+
+		inline octahedral16 encode_octahedral16(const vector3f &n)
+		{
+			std::int32_t u, v;
+			octahedral_quantize(n, 16, u, v);
+			octahedral16 o = { { static_cast<std::int16_t>(u), static_cast<std::int16_t>(v) } };
+			return o;
+		}
+
+		inline void decode_octahedral16(const octahedral16 &o, vector3f &n)
+		{
+			octahedral_decode(dequantize_snorm(o.v[0], 16), dequantize_snorm(o.v[1], 16), n.x, n.y, n.z);
+		}
+
+		inline packed_snorm_1010102 pack_snorm_1010102(float x, float y, float z, float w)
+		{
+			std::uint32_t bits = (static_cast<std::uint32_t>(quantize_snorm(x, 10)) & 0x3ffu)
+				| (static_cast<std::uint32_t>(quantize_snorm(y, 10)) & 0x3ffu) << 10
+				| (static_cast<std::uint32_t>(quantize_snorm(z, 10)) & 0x3ffu) << 20
+				| (static_cast<std::uint32_t>(quantize_snorm(w, 2)) & 0x3u) << 30;
+			packed_snorm_1010102 p = { bits };
+			return p;
+		}
+
+		inline void unpack_snorm_1010102(const packed_snorm_1010102 &p, float out[4])
+		{
+			// sign extend each field
+			auto field = [&p](int shift, int bits) {
+				std::int32_t v = static_cast<std::int32_t>(p.bits << (32 - shift - bits));
+				return v >> (32 - bits);
+			};
+			out[0] = dequantize_snorm(field(0, 10), 10);
+			out[1] = dequantize_snorm(field(10, 10), 10);
+			out[2] = dequantize_snorm(field(20, 10), 10);
+			out[3] = dequantize_snorm(field(30, 2), 2);
+		}
+
+		inline packed_unorm_1010102 pack_unorm_1010102(float x, float y, float z, float w)
+		{
+			packed_unorm_1010102 p = { quantize_unorm(x, 10) | quantize_unorm(y, 10) << 10
+				| quantize_unorm(z, 10) << 20 | quantize_unorm(w, 2) << 30 };
+			return p;
+		}
+
+		inline void unpack_unorm_1010102(const packed_unorm_1010102 &p, float out[4])
+		{
+			out[0] = dequantize_unorm(p.bits & 0x3ffu, 10);
+			out[1] = dequantize_unorm(p.bits >> 10 & 0x3ffu, 10);
+			out[2] = dequantize_unorm(p.bits >> 20 & 0x3ffu, 10);
+			out[3] = dequantize_unorm(p.bits >> 30, 2);
+		}
+
+		// Tangent direction as octahedral x/y in the first two fields, the bitangent sign
+		// in w; z is unused. Decodes to a vec4 the shader unfolds with the same octahedral math.
+		inline packed_snorm_1010102 encode_octahedral_tangent(const vector4f &t)
+		{
+			std::int32_t u, v;
+			octahedral_quantize(vector3f(t.x, t.y, t.z), 10, u, v);
+			std::uint32_t bits = (static_cast<std::uint32_t>(u) & 0x3ffu) | (static_cast<std::uint32_t>(v) & 0x3ffu) << 10
+				| (static_cast<std::uint32_t>(t.w < 0.0f ? -1 : 1) & 0x3u) << 30;
+			packed_snorm_1010102 p = { bits };
+			return p;
+		}
+
+		inline void decode_octahedral_tangent(const packed_snorm_1010102 &p, vector4f &t)
+		{
+			float f[4];
+			unpack_snorm_1010102(p, f);
+			octahedral_decode(f[0], f[1], t.x, t.y, t.z);
+			t.w = f[3];
+		}
+
+		// Maps positions into a box so 16 bit normalized integers cover exactly the mesh.
+		// The shader gets them back as offset + value * scale.
+		struct quantization_box
+		{
+			float offset[3];
+			float scale[3];
+		};
+
+		// unorm: offset is the minimum corner and scale the extent; snorm: offset is the
+		// center and scale the half extent.
+		inline quantization_box make_quantization_box(const std::vector<vector3f> &positions, bool snorm)
+		{
+			float lo[3] = { 0.0f, 0.0f, 0.0f }, hi[3] = { 0.0f, 0.0f, 0.0f };
+			for (std::size_t i = 0; i < positions.size(); ++i)
+			{
+				const float p[3] = { positions[i].x, positions[i].y, positions[i].z };
+				for (int c = 0; c < 3; ++c)
+				{
+					lo[c] = i == 0 || p[c] < lo[c] ? p[c] : lo[c];
+					hi[c] = i == 0 || p[c] > hi[c] ? p[c] : hi[c];
+				}
+			}
+
+			quantization_box box;
+			for (int c = 0; c < 3; ++c)
+			{
+				float extent = hi[c] - lo[c];
+				box.offset[c] = snorm ? (lo[c] + hi[c]) * 0.5f : lo[c];
+				box.scale[c] = extent > 0.0f ? (snorm ? extent * 0.5f : extent) : 1.0f;
+			}
+			return box;
+		}
+
+		inline unorm16x3 encode_position_unorm16(const vector3f &p, const quantization_box &box)
+		{
+			unorm16x3 q = { {
+				static_cast<std::uint16_t>(quantize_unorm((p.x - box.offset[0]) / box.scale[0], 16)),
+				static_cast<std::uint16_t>(quantize_unorm((p.y - box.offset[1]) / box.scale[1], 16)),
+				static_cast<std::uint16_t>(quantize_unorm((p.z - box.offset[2]) / box.scale[2], 16)) }, 0 };
+			return q;
+		}
+
+		inline void decode_position_unorm16(const unorm16x3 &q, const quantization_box &box, vector3f &p)
+		{
+			p.x = box.offset[0] + dequantize_unorm(q.v[0], 16) * box.scale[0];
+			p.y = box.offset[1] + dequantize_unorm(q.v[1], 16) * box.scale[1];
+			p.z = box.offset[2] + dequantize_unorm(q.v[2], 16) * box.scale[2];
+		}
+
+		inline snorm16x3 encode_position_snorm16(const vector3f &p, const quantization_box &box)
+		{
+			snorm16x3 q = { {
+				static_cast<std::int16_t>(quantize_snorm((p.x - box.offset[0]) / box.scale[0], 16)),
+				static_cast<std::int16_t>(quantize_snorm((p.y - box.offset[1]) / box.scale[1], 16)),
+				static_cast<std::int16_t>(quantize_snorm((p.z - box.offset[2]) / box.scale[2], 16)) }, 0 };
+			return q;
+		}
+
+		inline void decode_position_snorm16(const snorm16x3 &q, const quantization_box &box, vector3f &p)
+		{
+			p.x = box.offset[0] + dequantize_snorm(q.v[0], 16) * box.scale[0];
+			p.y = box.offset[1] + dequantize_snorm(q.v[1], 16) * box.scale[1];
+			p.z = box.offset[2] + dequantize_snorm(q.v[2], 16) * box.scale[2];
+		}
+
+		inline half2 encode_half2(const vector2f &v)
+		{
+			half2 h = { { float_to_half(v.x), float_to_half(v.y) } };
+			return h;
+		}
+
+		inline half4 encode_half4(const vector4f &v)
+		{
+			half4 h = { { float_to_half(v.x), float_to_half(v.y), float_to_half(v.z), float_to_half(v.w) } };
+			return h;
+		}
+
+		// One line of a quantization report.
+		struct attribute_report
+		{
+			std::string name;
+			std::string format;
+			std::size_t raw_bytes;
+			std::size_t packed_bytes;
+			double max_error;
+			double rms_error;
+			const char *unit;		// what the errors are measured in
+		};
+
+		struct quantization_report
+		{
+			std::vector<attribute_report> attributes;
+
+			std::size_t raw_bytes() const
+			{
+				std::size_t n = 0;
+				for (const auto &a : attributes)
+					n += a.raw_bytes;
+				return n;
+			}
+
+			std::size_t packed_bytes() const
+			{
+				std::size_t n = 0;
+				for (const auto &a : attributes)
+					n += a.packed_bytes;
+				return n;
+			}
+
+			void write(std::ostream &out) const
+			{
+				out << std::left << std::setw(10) << "attribute" << std::setw(30) << "format" << std::right
+					<< std::setw(12) << "raw" << std::setw(12) << "packed" << std::setw(14) << "max error" << std::setw(14) << "rms error" << "\n";
+				for (const auto &a : attributes)
+					out << std::left << std::setw(10) << a.name << std::setw(30) << a.format << std::right
+						<< std::setw(12) << a.raw_bytes << std::setw(12) << a.packed_bytes
+						<< std::setw(14) << a.max_error << std::setw(14) << a.rms_error << " " << a.unit << "\n";
+				std::size_t raw = raw_bytes(), packed = packed_bytes();
+				out << std::left << std::setw(40) << "total" << std::right << std::setw(12) << raw << std::setw(12) << packed
+					<< "  (" << (packed ? static_cast<double>(raw) / packed : 0.0) << "x smaller)\n";
+			}
+		};
+
+		// Attribute streams as stored by quantize_mesh(). Empty streams were not in the input.
+		struct quantized_mesh
+		{
+			quantization_box box;					// positions are box.offset + unorm16 * box.scale
+			std::vector<unorm16x3> positions;
+			std::vector<octahedral16> normals;
+			std::vector<half2> uvs;
+			std::vector<packed_snorm_1010102> tangents;	// octahedral, w is the bitangent sign
+			quantization_report report;
+		};
+
+		// Everything quantize_mesh() produces in one 20 byte vertex, 48 bytes as floats.
+		struct quantized_vertex
+		{
+			unorm16x3 position;
+			octahedral16 normal;
+			half2 uv;
+			packed_snorm_1010102 tangent;
+		};
+
+		inline std::vector<quantized_vertex> interleave(const quantized_mesh &mesh)
+		{
+			std::vector<quantized_vertex> vertices(mesh.positions.size(), quantized_vertex());
+			for (std::size_t i = 0; i < vertices.size(); ++i)
+			{
+				vertices[i].position = mesh.positions[i];
+				if (i < mesh.normals.size())
+					vertices[i].normal = mesh.normals[i];
+				if (i < mesh.uvs.size())
+					vertices[i].uv = mesh.uvs[i];
+				if (i < mesh.tangents.size())
+					vertices[i].tangent = mesh.tangents[i];
+			}
+			return vertices;
+		}
+
+		namespace detail
+		{
+			struct error_accumulator
+			{
+				double max;
+				double sum_squared;
+				std::size_t count;
+
+				error_accumulator() : max(0.0), sum_squared(0.0), count(0) {}
+
+				void add(double e)
+				{
+					max = e > max ? e : max;
+					sum_squared += e * e;
+					++count;
+				}
+
+				double rms() const { return count ? std::sqrt(sum_squared / count) : 0.0; }
+			};
+
+			inline double angle_degrees(float ax, float ay, float az, float bx, float by, float bz)
+			{
+				double la = std::sqrt(double(ax) * ax + double(ay) * ay + double(az) * az);
+				double lb = std::sqrt(double(bx) * bx + double(by) * by + double(bz) * bz);
+				if (la == 0.0 || lb == 0.0)
+					return 0.0;
+				double d = (double(ax) * bx + double(ay) * by + double(az) * bz) / (la * lb);
+				d = d > 1.0 ? 1.0 : (d < -1.0 ? -1.0 : d);
+				return std::acos(d) * 57.29577951308232;
+			}
+		}
+
+		// Quantizes whichever streams are given: positions to unorm16 in their bounding box,
+		// normals to 16 bit octahedral, uvs to half floats and tangents to octahedral
+		// 10-10-10-2. Every value is decoded again to fill in the report.
+		inline quantized_mesh quantize_mesh(const std::vector<vector3f> &positions, const std::vector<vector3f> &normals,
+			const std::vector<vector2f> &uvs, const std::vector<vector4f> &tangents)
+		{
+			quantized_mesh mesh;
+			mesh.box = make_quantization_box(positions, false);
+
+			if (!positions.empty())
+			{
+				detail::error_accumulator err;
+				mesh.positions.reserve(positions.size());
+				vector3f d;
+				for (const auto &p : positions)
+				{
+					mesh.positions.push_back(encode_position_unorm16(p, mesh.box));
+					decode_position_unorm16(mesh.positions.back(), mesh.box, d);
+					err.add(std::sqrt(double(d.x - p.x) * (d.x - p.x) + double(d.y - p.y) * (d.y - p.y) + double(d.z - p.z) * (d.z - p.z)));
+				}
+				mesh.report.attributes.push_back({ "position", "unorm16x3 in box", positions.size() * 12,
+					mesh.positions.size() * sizeof(unorm16x3), err.max, err.rms(), "units" });
+			}
+
+			if (!normals.empty())
+			{
+				detail::error_accumulator err;
+				mesh.normals.reserve(normals.size());
+				vector3f d;
+				for (const auto &n : normals)
+				{
+					mesh.normals.push_back(encode_octahedral16(n));
+					decode_octahedral16(mesh.normals.back(), d);
+					err.add(detail::angle_degrees(n.x, n.y, n.z, d.x, d.y, d.z));
+				}
+				mesh.report.attributes.push_back({ "normal", "octahedral snorm16x2", normals.size() * 12,
+					mesh.normals.size() * sizeof(octahedral16), err.max, err.rms(), "degrees" });
+			}
+
+			if (!uvs.empty())
+			{
+				detail::error_accumulator err;
+				mesh.uvs.reserve(uvs.size());
+				for (const auto &uv : uvs)
+				{
+					mesh.uvs.push_back(encode_half2(uv));
+					double du = half_to_float(mesh.uvs.back().v[0]) - uv.x, dv = half_to_float(mesh.uvs.back().v[1]) - uv.y;
+					err.add(std::sqrt(du * du + dv * dv));
+				}
+				mesh.report.attributes.push_back({ "uv", "half2", uvs.size() * 8,
+					mesh.uvs.size() * sizeof(half2), err.max, err.rms(), "uv units" });
+			}
+
+			if (!tangents.empty())
+			{
+				detail::error_accumulator err;
+				std::size_t sign_flips = 0;
+				mesh.tangents.reserve(tangents.size());
+				vector4f d;
+				for (const auto &t : tangents)
+				{
+					mesh.tangents.push_back(encode_octahedral_tangent(t));
+					decode_octahedral_tangent(mesh.tangents.back(), d);
+					err.add(detail::angle_degrees(t.x, t.y, t.z, d.x, d.y, d.z));
+					sign_flips += (t.w < 0.0f) != (d.w < 0.0f);
+				}
+				mesh.report.attributes.push_back({ "tangent", "octahedral snorm 10-10-10-2", tangents.size() * 16,
+					mesh.tangents.size() * sizeof(packed_snorm_1010102), err.max, err.rms(), sign_flips ? "degrees, SIGN LOST" : "degrees" });
+			}
+
+			return mesh;
+		}
+	}
+}
+
+#endif // !KNU_QUANTIZATION_HPP
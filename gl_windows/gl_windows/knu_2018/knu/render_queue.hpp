@@ -0,0 +1,291 @@
+#ifndef KNU_RENDER_QUEUE_HPP
+#define KNU_RENDER_QUEUE_HPP
+
+#include <knu/job_system.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Bit layout of a draw's sort key, most significant first:
+		//
+		//	layer 4 | program 12 | material 16 | texture 12 | depth 20
+		//
+		// so sorted draws go layer by layer, and within a layer switch programs least, then
+		// materials, then textures, and run front to back where everything else matches.
+		// Ids have to fit their field, they come back out of the key as the state to bind.
+		namespace sort_key
+		{
+			const int depth_bits = 20;
+			const int texture_bits = 12;
+			const int material_bits = 16;
+			const int program_bits = 12;
+			const int layer_bits = 4;
+
+			const int texture_shift = depth_bits;
+			const int material_shift = texture_shift + texture_bits;
+			const int program_shift = material_shift + material_bits;
+			const int layer_shift = program_shift + program_bits;
+
+			inline std::uint64_t make(std::uint32_t layer, std::uint32_t program, std::uint32_t material, std::uint32_t texture, std::uint32_t depth)
+			{
+				return static_cast<std::uint64_t>(layer & ((1u << layer_bits) - 1)) << layer_shift
+					| static_cast<std::uint64_t>(program & ((1u << program_bits) - 1)) << program_shift
+					| static_cast<std::uint64_t>(material & ((1u << material_bits) - 1)) << material_shift
+					| static_cast<std::uint64_t>(texture & ((1u << texture_bits) - 1)) << texture_shift
+					| (depth & ((1u << depth_bits) - 1));
+			}
+
+			// View distance quantized over [0, far_distance]. Translucent layers pass
+			// back_to_front so the farthest draws sort first.
+			inline std::uint32_t depth(float distance, float far_distance, bool back_to_front = false)
+			{
+				const std::uint32_t top = (1u << depth_bits) - 1;
+				float t = far_distance > 0.0f ? distance / far_distance : 0.0f;
+				t = (std::min)((std::max)(t, 0.0f), 1.0f);
+				std::uint32_t d = static_cast<std::uint32_t>(t * top);
+				return back_to_front ? top - d : d;
+			}
+
+			inline std::uint32_t layer(std::uint64_t key) { return static_cast<std::uint32_t>(key >> layer_shift) & ((1u << layer_bits) - 1); }
+			inline std::uint32_t program(std::uint64_t key) { return static_cast<std::uint32_t>(key >> program_shift) & ((1u << program_bits) - 1); }
+			inline std::uint32_t material(std::uint64_t key) { return static_cast<std::uint32_t>(key >> material_shift) & ((1u << material_bits) - 1); }
+			inline std::uint32_t texture(std::uint64_t key) { return static_cast<std::uint32_t>(key >> texture_shift) & ((1u << texture_bits) - 1); }
+		}
+
+		struct render_command
+		{
+			std::uint64_t key;
+			std::uint32_t index;		// the caller's draw, e.g. into frame_packet::draws
+		};
+
+		enum render_state_bits
+		{
+			render_layer_changed = 1,
+			render_program_changed = 2,
+			render_material_changed = 4,
+			render_texture_changed = 8
+		};
+
+		// Consecutive sorted commands that share layer, program, material and texture.
+		// changed says which of those differ from the previous run and need binding.
+		struct render_run
+		{
+			std::uint32_t layer;
+			std::uint32_t program;
+			std::uint32_t material;
+			std::uint32_t texture;
+			unsigned changed;
+			const render_command *first;
+			std::size_t count;
+		};
+
+		struct render_queue_stats
+		{
+			std::size_t commands;
+			double sort_ms;
+			int sort_passes;				// radix passes run, digits every key shares are skipped
+			std::size_t runs;
+			std::size_t layer_changes;
+			std::size_t program_changes;
+			std::size_t material_changes;
+			std::size_t texture_changes;
+			std::size_t unsorted_changes;	// program, material and texture changes in submission order
+		};
+
+		// Draw commands for one frame, sorted by key with a stable LSD radix sort. Fill it
+		// with push(), or resize() and write commands() from several jobs, then sort() and
+		// execute(). Capacity is kept from frame to frame.
+		class render_queue
+		{
+			std::vector<render_command> entries;
+			std::vector<render_command> scratch;
+			std::vector<std::size_t> counts;		// chunk * 256 + digit
+			render_queue_stats stats;
+
+		private:
+			struct change_counts
+			{
+				std::size_t runs, layers, programs, materials, textures;
+			};
+
+			static unsigned changes(std::uint64_t a, std::uint64_t b)
+			{
+				std::uint64_t d = a ^ b;
+				unsigned c = 0;
+				if (sort_key::layer(d))
+					c |= render_layer_changed;
+				if (sort_key::program(d))
+					c |= render_program_changed;
+				if (sort_key::material(d))
+					c |= render_material_changed;
+				if (sort_key::texture(d))
+					c |= render_texture_changed;
+				return c;
+			}
+
+			// Changes between each command in [first, last) and the one before it.
+			void count_changes(std::size_t first, std::size_t last, change_counts &out) const
+			{
+				out = change_counts();
+				for (std::size_t i = (std::max)(first, std::size_t(1)); i < last; ++i)
+				{
+					unsigned c = changes(entries[i - 1].key, entries[i].key);
+					out.runs += c != 0;
+					out.layers += (c & render_layer_changed) != 0;
+					out.programs += (c & render_program_changed) != 0;
+					out.materials += (c & render_material_changed) != 0;
+					out.textures += (c & render_texture_changed) != 0;
+				}
+			}
+
+			// Splits the queue into the chunks the passes work on, one per thread at most.
+			template<typename function>
+			void for_chunks(job_system *jobs, std::size_t chunk_count, std::size_t chunk_size, function fn)
+			{
+				auto body = [&](std::size_t first_chunk, std::size_t last_chunk) {
+					for (std::size_t c = first_chunk; c < last_chunk; ++c)
+						fn(c, c * chunk_size, (std::min)((c + 1) * chunk_size, entries.size()));
+				};
+				if (jobs && chunk_count > 1)
+					jobs->parallel_for(0, chunk_count, 1, body);
+				else
+					body(0, chunk_count);
+			}
+
+			void radix_sort(job_system *jobs)
+			{
+				auto start = std::chrono::steady_clock::now();
+				const std::size_t n = entries.size();
+				const std::size_t min_chunk = 16384;
+				std::size_t chunk_count = jobs ? (std::min)(static_cast<std::size_t>(jobs->get_thread_count()), (n + min_chunk - 1) / min_chunk) : 1;
+				chunk_count = (std::max)(chunk_count, std::size_t(1));
+				const std::size_t chunk_size = (n + chunk_count - 1) / chunk_count;
+
+				// which bits differ anywhere, and what submission order would have cost
+				std::vector<std::uint64_t> differ(chunk_count, 0);
+				std::vector<change_counts> unsorted(chunk_count);
+				for_chunks(jobs, chunk_count, chunk_size, [&](std::size_t c, std::size_t first, std::size_t last) {
+					std::uint64_t d = 0;
+					for (std::size_t i = first; i < last; ++i)
+						d |= entries[i].key ^ entries[0].key;
+					differ[c] = d;
+					count_changes(first, last, unsorted[c]);
+				});
+
+				std::uint64_t varying = 0;
+				stats = render_queue_stats();
+				stats.commands = n;
+				for (std::size_t c = 0; c < chunk_count; ++c)
+				{
+					varying |= differ[c];
+					stats.unsorted_changes += unsorted[c].programs + unsorted[c].materials + unsorted[c].textures;
+				}
+
+				scratch.resize(n);
+				counts.resize(chunk_count * 256);
+				for (int shift = 0; shift < 64; shift += 8)
+				{
+					if (!((varying >> shift) & 0xff))
+						continue;
+
+					for_chunks(jobs, chunk_count, chunk_size, [&](std::size_t c, std::size_t first, std::size_t last) {
+						std::size_t *count = &counts[c * 256];
+						std::fill(count, count + 256, std::size_t(0));
+						for (std::size_t i = first; i < last; ++i)
+							++count[(entries[i].key >> shift) & 0xff];
+					});
+
+					// digit major, chunk minor, which is what keeps the sort stable
+					std::size_t offset = 0;
+					for (std::size_t digit = 0; digit < 256; ++digit)
+					{
+						for (std::size_t c = 0; c < chunk_count; ++c)
+						{
+							std::size_t count = counts[c * 256 + digit];
+							counts[c * 256 + digit] = offset;
+							offset += count;
+						}
+					}
+
+					for_chunks(jobs, chunk_count, chunk_size, [&](std::size_t c, std::size_t first, std::size_t last) {
+						std::size_t *next = &counts[c * 256];
+						for (std::size_t i = first; i < last; ++i)
+							scratch[next[(entries[i].key >> shift) & 0xff]++] = entries[i];
+					});
+
+					entries.swap(scratch);
+					++stats.sort_passes;
+				}
+
+				std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+				stats.sort_ms = elapsed.count();
+
+				std::vector<change_counts> sorted(chunk_count);
+				for_chunks(jobs, chunk_count, chunk_size, [&](std::size_t c, std::size_t first, std::size_t last) {
+					count_changes(first, last, sorted[c]);
+				});
+				stats.runs = n ? 1 : 0;
+				for (const change_counts &s : sorted)
+				{
+					stats.runs += s.runs;
+					stats.layer_changes += s.layers;
+					stats.program_changes += s.programs;
+					stats.material_changes += s.materials;
+					stats.texture_changes += s.textures;
+				}
+			}
+
+		public:
+			render_queue() : stats() {}
+
+			void clear() { entries.clear(); }
+			void reserve(std::size_t count) { entries.reserve(count); }
+			void resize(std::size_t count) { entries.resize(count); }
+
+			void push(std::uint64_t key, std::uint32_t index)
+			{
+				entries.push_back(render_command{ key, index });
+			}
+
+			// Single threaded below a few chunks' worth of commands, where the jobs cost more
+			// than they save.
+			void sort() { radix_sort(nullptr); }
+			void sort(job_system &jobs) { radix_sort(&jobs); }
+
+			// Calls fn(const render_run &) for each run in sorted order. The first run has
+			// every changed bit set.
+			template<typename function>
+			void execute(function fn) const
+			{
+				std::size_t i = 0;
+				std::uint64_t previous = 0;
+				while (i < entries.size())
+				{
+					std::uint64_t key = entries[i].key;
+					std::size_t end = i + 1;
+					while (end < entries.size() && !changes(key, entries[end].key))
+						++end;
+
+					render_run run = { sort_key::layer(key), sort_key::program(key), sort_key::material(key), sort_key::texture(key),
+						i == 0 ? 0xfu : changes(previous, key), &entries[i], end - i };
+					fn(run);
+
+					previous = key;
+					i = end;
+				}
+			}
+
+			render_command *commands() { return entries.data(); }
+			const std::vector<render_command> &get_commands() const { return entries; }
+			std::size_t size() const { return entries.size(); }
+			const render_queue_stats &get_stats() const { return stats; }
+		};
+	}
+}
+
+#endif // !KNU_RENDER_QUEUE_HPP
@@ -0,0 +1,265 @@
+#ifndef KNU_RENDER_THREAD_HPP
+#define KNU_RENDER_THREAD_HPP
+
+#include <knu/fixed_timestep.hpp>
+#include <knu/render_queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Matrices are kept as plain column major floats so building a packet never goes
+		// through the math library's chatty move operations.
+		struct draw_item
+		{
+			float model[16];
+			std::uint32_t mesh;
+			std::uint32_t material;
+		};
+
+		// Everything the renderer needs for one frame. The simulation fills it, the render
+		// thread only reads it, and nobody touches it while the other side owns it.
+		struct frame_packet
+		{
+			std::uint64_t frame_index;
+			float alpha;				// interpolation between the last two simulation steps
+			int viewport_width;
+			int viewport_height;
+			float clear_color[4];
+			float clear_depth;
+			float view[16];
+			float projection[16];
+			std::vector<draw_item> draws;	// capacity is kept from frame to frame
+			render_queue queue;				// draws in the order to submit them, sorted on the simulation side
+
+			frame_packet() :
+				frame_index(0),
+				alpha(0.0f),
+				viewport_width(0),
+				viewport_height(0),
+				clear_color(),
+				clear_depth(1.0f),
+				view(),
+				projection()
+			{}
+		};
+
+		// Single producer, single consumer ring of preallocated packets. Neither side ever
+		// takes a lock; each only publishes its own counter.
+		template<typename packet>
+		class packet_ring
+		{
+			std::vector<packet> slots;
+			std::atomic<std::uint64_t> produced;
+			std::atomic<std::uint64_t> consumed;
+
+		public:
+			explicit packet_ring(std::size_t capacity = 2) :
+				slots(capacity),
+				produced(0),
+				consumed(0)
+			{
+			}
+
+			void resize(std::size_t capacity)
+			{
+				slots.clear();
+				slots.resize(capacity);
+				produced = 0;
+				consumed = 0;
+			}
+
+			// producer side, nullptr while every slot is still waiting to be consumed
+			packet *try_begin_write()
+			{
+				std::uint64_t p = produced.load(std::memory_order_relaxed);
+				if (p - consumed.load(std::memory_order_acquire) >= slots.size())
+					return nullptr;
+				return &slots[p % slots.size()];
+			}
+
+			void end_write()
+			{
+				produced.store(produced.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+
+			// consumer side, nullptr while nothing has been published
+			packet *try_begin_read()
+			{
+				std::uint64_t c = consumed.load(std::memory_order_relaxed);
+				if (c == produced.load(std::memory_order_acquire))
+					return nullptr;
+				return &slots[c % slots.size()];
+			}
+
+			void end_read()
+			{
+				consumed.store(consumed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+
+			std::size_t in_flight() const
+			{
+				return static_cast<std::size_t>(produced.load(std::memory_order_acquire) - consumed.load(std::memory_order_acquire));
+			}
+
+			std::size_t capacity() const { return slots.size(); }
+		};
+
+		struct render_thread_stats
+		{
+			timing_stats render;			// draw submission on the render thread
+			timing_stats present;			// buffer swap on the render thread
+			timing_stats render_idle;		// render thread waiting for a packet
+			timing_stats producer_stall;	// simulation thread waiting for a free packet
+			std::uint64_t frames;
+		};
+
+		// Owns the gl context on its own thread and renders packets handed over by the
+		// simulation. With a depth of 2 the simulation builds frame n+1 while frame n renders.
+		class render_thread
+		{
+		public:
+			using render_function = std::function<void(const frame_packet &)>;
+
+		private:
+			packet_ring<frame_packet> ring;
+			std::thread worker;
+			std::atomic<bool> running;
+			std::function<void()> attach_context;
+			std::function<void()> detach_context;
+			render_function render;
+			std::function<void()> present;
+			render_thread_stats stats;
+			std::mutex stats_mutex;
+			frame_packet *writing;
+
+		private:
+			// spins briefly before backing off to short sleeps
+			static void back_off(int &attempt)
+			{
+				if (++attempt < 64)
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+
+			void thread_main()
+			{
+				attach_context();
+
+				while (running.load(std::memory_order_acquire) || ring.in_flight())
+				{
+					auto idle_start = std::chrono::steady_clock::now();
+					frame_packet *p = nullptr;
+					int attempt = 0;
+					while (!(p = ring.try_begin_read()))
+					{
+						if (!running.load(std::memory_order_acquire))
+							break;
+						back_off(attempt);
+					}
+					if (!p)
+						break;
+
+					auto render_start = std::chrono::steady_clock::now();
+					render(*p);
+					auto present_start = std::chrono::steady_clock::now();
+					present();
+					auto present_end = std::chrono::steady_clock::now();
+
+					ring.end_read();
+
+					std::lock_guard<std::mutex> lock(stats_mutex);
+					stats.render_idle.add(render_start - idle_start);
+					stats.render.add(present_start - render_start);
+					stats.present.add(present_end - present_start);
+					++stats.frames;
+				}
+
+				detach_context();
+			}
+
+		public:
+			render_thread() :
+				running(false),
+				stats(),
+				writing(nullptr)
+			{
+			}
+
+			~render_thread()
+			{
+				stop();
+			}
+
+			// No copy constructor or assignment
+			render_thread(const render_thread &) = delete;
+			render_thread &operator=(const render_thread &) = delete;
+
+			// The caller must release the context before start(); attach makes it current on
+			// the render thread and detach releases it again when the thread stops.
+			void start(int depth, std::function<void()> attach, render_function render_, std::function<void()> present_,
+				std::function<void()> detach)
+			{
+				if (running)
+					throw std::runtime_error("Render thread already running");
+
+				ring.resize(depth < 1 ? 1 : depth);
+				attach_context = attach;
+				detach_context = detach;
+				render = render_;
+				present = present_;
+				running = true;
+				worker = std::thread(&render_thread::thread_main, this);
+			}
+
+			// Renders whatever is still queued, then joins.
+			void stop()
+			{
+				if (!worker.joinable())
+					return;
+
+				running.store(false, std::memory_order_release);
+				worker.join();
+			}
+
+			// Simulation side: waits for a packet the render thread is done with.
+			frame_packet &begin_packet()
+			{
+				auto start = std::chrono::steady_clock::now();
+				int attempt = 0;
+				while (!(writing = ring.try_begin_write()))
+					back_off(attempt);
+
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				stats.producer_stall.add(std::chrono::steady_clock::now() - start);
+				return *writing;
+			}
+
+			void submit_packet()
+			{
+				writing = nullptr;
+				ring.end_write();
+			}
+
+			bool is_running() const { return running; }
+			int get_depth() const { return static_cast<int>(ring.capacity()); }
+
+			render_thread_stats get_stats()
+			{
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				return stats;
+			}
+		};
+	}
+}
+
+#endif // !KNU_RENDER_THREAD_HPP
@@ -0,0 +1,217 @@
+#ifndef KNU_RESIZE_MANAGER_HPP
+#define KNU_RESIZE_MANAGER_HPP
+
+#include <knu/knu_texture.hpp>
+#include <chrono>
+#include <cstdint>
+
+namespace knu
+{
+	namespace graphics
+	{
+		// Collapses a stream of window size changes into one settled size. notify() is called
+		// for every resize event and only stores the size; settle() reports a size once it has
+		// stopped changing for the debounce period. The first size settles immediately.
+		class resize_manager
+		{
+		public:
+			using clock = std::chrono::steady_clock;
+
+		private:
+			int pending_width;
+			int pending_height;
+			int settled_width;
+			int settled_height;
+			bool pending;
+			clock::time_point last_change;
+			clock::duration debounce;
+			std::uint64_t notifications;
+			std::uint64_t settles;
+
+		public:
+			explicit resize_manager(double debounce_ms = 100.0) :
+				pending_width(0),
+				pending_height(0),
+				settled_width(0),
+				settled_height(0),
+				pending(false),
+				debounce(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(debounce_ms))),
+				notifications(0),
+				settles(0)
+			{
+			}
+
+			void notify(int width, int height)
+			{
+				++notifications;
+				if (width == pending_width && height == pending_height && pending)
+					return;
+
+				pending_width = width;
+				pending_height = height;
+				pending = width != settled_width || height != settled_height;
+				last_change = clock::now();
+			}
+
+			// True once per new settled size, which is written to width and height.
+			bool settle(int &width, int &height)
+			{
+				if (!pending)
+					return false;
+				if (settles && clock::now() - last_change < debounce)
+					return false;
+
+				settled_width = width = pending_width;
+				settled_height = height = pending_height;
+				pending = false;
+				++settles;
+				return true;
+			}
+
+			void set_debounce(double ms)
+			{
+				debounce = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(ms));
+			}
+
+			bool is_settling() const { return pending; }
+			int get_settled_width() const { return settled_width; }
+			int get_settled_height() const { return settled_height; }
+			std::uint64_t get_notifications() const { return notifications; }
+			std::uint64_t get_settles() const { return settles; }
+		};
+
+		// Offscreen color and depth target whose attachments are sized in power of two
+		// buckets. Rendering uses the requested size as the viewport, so resizing only
+		// reallocates when a bucket boundary is crossed upward, or when the window shrinks
+		// to a quarter of the allocated area. GL thread only.
+		class render_target
+		{
+			GLuint fbo;
+			GLuint depth;
+			texture color;
+			GLenum color_format;
+			GLenum depth_format;
+			int width;				// region in use
+			int height;
+			int allocated_width;	// attachment size
+			int allocated_height;
+			std::uint64_t reallocations;
+
+		private:
+			static int bucket(int size)
+			{
+				int b = 64;
+				while (b < size)
+					b <<= 1;
+				return b;
+			}
+
+			void allocate(int w, int h)
+			{
+				if (!fbo)
+					glGenFramebuffers(1, &fbo);
+				if (!depth)
+					glGenRenderbuffers(1, &depth);
+
+				color.create(texture_type::texture_2d, color_format, w, h, 1, 1);
+				sampler_state single_level;
+				single_level.min_filter = GL_LINEAR;
+				single_level.wrap_s = single_level.wrap_t = GL_CLAMP_TO_EDGE;
+				color.set_sampler(single_level);
+
+				glBindRenderbuffer(GL_RENDERBUFFER, depth);
+				glRenderbufferStorage(GL_RENDERBUFFER, depth_format, w, h);
+
+				glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color.obj(), 0);
+				glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+
+				GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				if (status != GL_FRAMEBUFFER_COMPLETE)
+					throw std::runtime_error("Incomplete render target: " + std::to_string(status));
+
+				allocated_width = w;
+				allocated_height = h;
+				++reallocations;
+			}
+
+		public:
+			explicit render_target(GLenum color_format_ = GL_RGBA8, GLenum depth_format_ = GL_DEPTH_COMPONENT24) :
+				fbo(0),
+				depth(0),
+				color_format(color_format_),
+				depth_format(depth_format_),
+				width(0),
+				height(0),
+				allocated_width(0),
+				allocated_height(0),
+				reallocations(0)
+			{
+			}
+
+			~render_target()
+			{
+				release();
+			}
+
+			// No copy constructor or assignment
+			render_target(const render_target &) = delete;
+			render_target &operator=(const render_target &) = delete;
+
+			void release()
+			{
+				if (fbo)
+					glDeleteFramebuffers(1, &fbo);
+				if (depth)
+					glDeleteRenderbuffers(1, &depth);
+				fbo = depth = 0;
+				color = texture();
+				allocated_width = allocated_height = 0;
+			}
+
+			// Makes room for a w by h region. Returns true if the attachments were reallocated.
+			bool ensure(int w, int h)
+			{
+				width = w;
+				height = h;
+
+				int bw = bucket(w), bh = bucket(h);
+				bool grow = bw > allocated_width || bh > allocated_height;
+				bool shrink = static_cast<std::int64_t>(bw) * bh * 4 <= static_cast<std::int64_t>(allocated_width) * allocated_height;
+				if (!fbo || grow || shrink)
+				{
+					allocate(bw, bh);
+					return true;
+				}
+				return false;
+			}
+
+			// Binds for drawing with the viewport covering the region in use.
+			void bind()
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+				glViewport(0, 0, width, height);
+			}
+
+			// Copies the region in use to the default framebuffer.
+			void blit_to_default(int dst_width, int dst_height)
+			{
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+				glBlitFramebuffer(0, 0, width, height, 0, 0, dst_width, dst_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			}
+
+			inline GLuint obj() const { return fbo; }
+			texture &get_color() { return color; }
+			int get_width() const { return width; }
+			int get_height() const { return height; }
+			int get_allocated_width() const { return allocated_width; }
+			int get_allocated_height() const { return allocated_height; }
+			std::uint64_t get_reallocations() const { return reallocations; }
+		};
+	}
+}
+
+#endif // !KNU_RESIZE_MANAGER_HPP
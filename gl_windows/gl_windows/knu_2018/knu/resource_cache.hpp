@@ -0,0 +1,332 @@
+#ifndef KNU_RESOURCE_CACHE_HPP
+#define KNU_RESOURCE_CACHE_HPP
+
+#include <knu/knu_texture.hpp>
+#include <knu/mapped_file.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct cache_budget
+		{
+			std::size_t cpu_bytes;
+			std::size_t gpu_bytes;
+
+			cache_budget() :
+				cpu_bytes(256 << 20),
+				gpu_bytes(512 << 20)
+			{}
+		};
+
+		struct cache_stats
+		{
+			std::uint64_t hits;				// path and modification time already known
+			std::uint64_t misses;			// file had to be decoded
+			std::uint64_t content_hits;		// new path, but identical bytes were already resident
+			std::uint64_t cpu_evictions;
+			std::uint64_t gpu_evictions;
+			std::size_t cpu_bytes;
+			std::size_t gpu_bytes;
+			std::size_t entries;
+		};
+
+		// Images and textures keyed by file content. A path is only rehashed when its
+		// modification time or size changes, and two paths with the same bytes share one
+		// decoded image. Handles are shared_ptrs; entries still referenced outside the cache
+		// are never evicted, the rest are dropped least recently used first.
+		class resource_cache
+		{
+			struct entry
+			{
+				std::shared_ptr<image> img;
+				std::shared_ptr<texture> tex;
+				std::string source_path;
+				std::vector<std::string> aliases;	// paths whose record points here
+				std::list<std::uint64_t>::iterator lru_position;
+			};
+
+			struct path_record
+			{
+				std::int64_t mtime;
+				std::uint64_t size;
+				std::uint64_t content_hash;
+			};
+
+			std::unordered_map<std::string, path_record> paths;
+			std::unordered_map<std::uint64_t, entry> entries;
+			std::list<std::uint64_t> lru;		// most recently used at the front
+			cache_budget budget;
+			cache_stats stats;
+			std::mutex cache_mutex;
+
+		private:
+			// mtime at the finest resolution the file system keeps, whole seconds would miss an
+			// edit made within the same second as the previous load.
+			static bool file_stamp(const std::string &path, std::int64_t &mtime, std::uint64_t &size)
+			{
+#ifdef _WIN32
+				WIN32_FILE_ATTRIBUTE_DATA data;
+				if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+					return false;
+				// 100ns intervals
+				mtime = static_cast<std::int64_t>(static_cast<std::uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32 | data.ftLastWriteTime.dwLowDateTime);
+				size = static_cast<std::uint64_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+#else
+				struct stat st;
+				if (stat(path.c_str(), &st) != 0)
+					return false;
+#ifdef __APPLE__
+				mtime = static_cast<std::int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+				mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+				size = static_cast<std::uint64_t>(st.st_size);
+#endif
+				return true;
+			}
+
+			// 64 bit FNV-1a over the file bytes
+			static std::uint64_t content_hash(const std::string &path)
+			{
+				mapped_file file(path);
+				file.will_need();
+
+				std::uint64_t h = 14695981039346656037ull;
+				const unsigned char *data = file.data();
+				for (std::size_t i = 0, n = file.size(); i < n; ++i)
+					h = (h ^ data[i]) * 1099511628211ull;
+				return h;
+			}
+
+			void touch(entry &e)
+			{
+				lru.splice(lru.begin(), lru, e.lru_position);
+				e.lru_position = lru.begin();
+			}
+
+			// The requesting path becomes the entry's source, it was just checked against the
+			// content hash, while the first path to create the entry may since have changed.
+			// content_hit says the path itself was new or modified.
+			entry &find_or_create(const std::string &path, bool &content_hit)
+			{
+				std::int64_t mtime;
+				std::uint64_t size;
+				if (!file_stamp(path, mtime, size))
+					throw std::runtime_error("Unable to open file: " + path);
+
+				auto p = paths.find(path);
+				if (p != paths.end() && p->second.mtime == mtime && p->second.size == size)
+				{
+					auto e = entries.find(p->second.content_hash);
+					if (e != entries.end())
+					{
+						content_hit = false;
+						e->second.source_path = path;
+						touch(e->second);
+						return e->second;
+					}
+				}
+
+				std::uint64_t hash = content_hash(path);
+				paths[path] = path_record{ mtime, size, hash };
+
+				auto e = entries.find(hash);
+				if (e != entries.end())
+				{
+					content_hit = true;
+					e->second.source_path = path;
+					add_alias(e->second, path);
+					touch(e->second);
+					return e->second;
+				}
+
+				lru.push_front(hash);
+				entry &created = entries[hash];
+				created.source_path = path;
+				created.aliases.push_back(path);
+				created.lru_position = lru.begin();
+				content_hit = false;
+				stats.entries = entries.size();
+				return created;
+			}
+
+			static void add_alias(entry &e, const std::string &path)
+			{
+				if (std::find(e.aliases.begin(), e.aliases.end(), path) == e.aliases.end())
+					e.aliases.push_back(path);
+			}
+
+			// Drops the entry and the path records still pointing at it, a record that has
+			// since been rehashed to other content is left alone.
+			std::list<std::uint64_t>::iterator erase_entry(std::list<std::uint64_t>::iterator position)
+			{
+				auto e = entries.find(*position);
+				for (const std::string &alias : e->second.aliases)
+				{
+					auto p = paths.find(alias);
+					if (p != paths.end() && p->second.content_hash == e->first)
+						paths.erase(p);
+				}
+				entries.erase(e);
+				stats.entries = entries.size();
+				return lru.erase(position);
+			}
+
+			// Each acquire counts once: a miss when something had to be decoded, else a hit.
+			void count_hit(bool content_hit)
+			{
+				if (content_hit)
+					++stats.content_hits;
+				else
+					++stats.hits;
+			}
+
+			// A failed load leaves nothing behind, an entry created only for it is erased.
+			void load_image(entry &e)
+			{
+				auto img = std::make_shared<image>();
+				try
+				{
+					img->load_image(e.source_path);
+				}
+				catch (...)
+				{
+					if (!e.img && !e.tex)
+						erase_entry(e.lru_position);
+					throw;
+				}
+				++stats.misses;
+				stats.cpu_bytes += img->get_size();
+				e.img = std::move(img);
+			}
+
+			void evict()
+			{
+				// walk from the least recently used end, skipping anything still handed out
+				auto i = lru.end();
+				while (i != lru.begin() && (stats.cpu_bytes > budget.cpu_bytes || stats.gpu_bytes > budget.gpu_bytes))
+				{
+					--i;
+					entry &e = entries.find(*i)->second;
+
+					if (stats.cpu_bytes > budget.cpu_bytes && e.img && e.img.use_count() == 1)
+					{
+						stats.cpu_bytes -= e.img->get_size();
+						e.img.reset();
+						++stats.cpu_evictions;
+					}
+
+					if (stats.gpu_bytes > budget.gpu_bytes && e.tex && e.tex.use_count() == 1)
+					{
+						stats.gpu_bytes -= e.tex->memory_usage();
+						e.tex.reset();
+						++stats.gpu_evictions;
+					}
+
+					if (!e.img && !e.tex)
+						i = erase_entry(i);
+				}
+
+				stats.entries = entries.size();
+			}
+
+		public:
+			explicit resource_cache(const cache_budget &budget_ = cache_budget()) :
+				budget(budget_),
+				stats()
+			{
+			}
+
+			// No copy constructor or assignment
+			resource_cache(const resource_cache &) = delete;
+			resource_cache &operator=(const resource_cache &) = delete;
+
+			std::shared_ptr<image> acquire_image(const std::string &path)
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				bool content_hit;
+				entry &e = find_or_create(path, content_hit);
+				if (e.img)
+					count_hit(content_hit);
+				else
+					load_image(e);
+
+				std::shared_ptr<image> handle = e.img;
+				evict();
+				return handle;
+			}
+
+			// Must be called from the thread owning the gl context.
+			std::shared_ptr<texture> acquire_texture(const std::string &path, bool mipmaps = true)
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				bool content_hit;
+				entry &e = find_or_create(path, content_hit);
+
+				if (e.tex || e.img)
+					count_hit(content_hit);
+
+				if (!e.tex)
+				{
+					if (!e.img)
+						load_image(e);
+					auto tex = std::make_shared<texture>();
+					tex->create(*e.img, mipmaps);
+					stats.gpu_bytes += tex->memory_usage();
+					e.tex = std::move(tex);
+				}
+
+				std::shared_ptr<texture> handle = e.tex;
+				evict();
+				return handle;
+			}
+
+			void set_budget(const cache_budget &budget_)
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				budget = budget_;
+				evict();
+			}
+
+			// Evicts everything not referenced outside the cache.
+			void trim()
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				cache_budget saved = budget;
+				budget.cpu_bytes = 0;
+				budget.gpu_bytes = 0;
+				evict();
+				budget = saved;
+			}
+
+			cache_budget get_budget()
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				return budget;
+			}
+
+			cache_stats get_stats()
+			{
+				std::lock_guard<std::mutex> lock(cache_mutex);
+				return stats;
+			}
+		};
+	}
+}
+
+#endif // !KNU_RESOURCE_CACHE_HPP
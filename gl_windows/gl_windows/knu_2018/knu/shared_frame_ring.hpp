@@ -0,0 +1,530 @@
+#ifndef KNU_SHARED_FRAME_RING_HPP
+#define KNU_SHARED_FRAME_RING_HPP
+
+// No GL in here, a reading process only needs this header (and -lrt on older glibc).
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace knu
+{
+	// Layout of the shared block: one header, then slot_count slots of slot_stride bytes,
+	// each a slot header followed by pixels. Everything is 64 byte aligned so the counters
+	// a reader polls never share a cache line with pixels being written.
+	struct shared_frame_header
+	{
+		std::uint32_t magic;			// 'KSFR'
+		std::uint32_t version;
+		std::uint32_t slot_count;
+		std::uint32_t max_width;
+		std::uint32_t max_height;
+		std::uint32_t reserved;
+		std::uint64_t slot_stride;		// bytes from one slot header to the next
+		std::uint64_t writer_pid;
+		alignas(64) std::atomic<std::uint64_t> published;	// frames published so far
+	};
+
+	// Per slot sequence lock. While frame n is written the sequence is 2n + 1, once it is
+	// complete 2n + 2, so a reader knows both which frame it has and whether it was torn.
+	struct shared_frame_slot
+	{
+		std::atomic<std::uint64_t> sequence;
+		std::uint64_t frame_index;		// the producer's own frame number
+		std::uint64_t publish_ns;		// steady clock, comparable across processes
+		std::uint32_t width;
+		std::uint32_t height;
+		std::uint32_t stride;			// bytes per row
+		std::uint32_t format;			// 0 = rgba8, bottom row first
+		unsigned char padding[24];
+	};
+
+	static_assert(sizeof(shared_frame_slot) == 64, "slot header must stay one cache line");
+
+	namespace detail
+	{
+		const std::uint32_t shared_frame_magic = 0x5246534b;
+		const std::uint32_t shared_frame_version = 1;
+
+		inline std::uint64_t steady_ns()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+#ifndef _WIN32
+		// Whether the block at path may still be in use. Only a ring whose writer process
+		// is gone counts as abandoned, anything unrecognized is left alone.
+		inline bool shared_block_alive(const std::string &path)
+		{
+			int fd = shm_open(path.c_str(), O_RDONLY, 0);
+			if (fd == -1)
+				return errno != ENOENT;
+
+			bool alive = true;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(shared_frame_header))
+			{
+				void *v = mmap(nullptr, sizeof(shared_frame_header), PROT_READ, MAP_SHARED, fd, 0);
+				if (v != MAP_FAILED)
+				{
+					const shared_frame_header *h = static_cast<const shared_frame_header *>(v);
+					if (h->magic == shared_frame_magic && h->writer_pid)
+						alive = kill(static_cast<pid_t>(h->writer_pid), 0) == 0 || errno == EPERM;
+					munmap(v, sizeof(shared_frame_header));
+				}
+			}
+			::close(fd);
+			return alive;
+		}
+#endif
+
+		// A named block of shared memory, created by the writer and opened by readers.
+		class shared_memory
+		{
+			std::string name;
+			unsigned char *view;
+			std::size_t view_size;
+			bool owner;
+#ifdef _WIN32
+			HANDLE mapping_handle;
+#endif
+
+		public:
+			shared_memory() :
+				view(nullptr),
+				view_size(0),
+				owner(false)
+#ifdef _WIN32
+				, mapping_handle(nullptr)
+#endif
+			{
+			}
+
+			~shared_memory()
+			{
+				close();
+			}
+
+			// No copy constructor or assignment
+			shared_memory(const shared_memory &) = delete;
+			shared_memory &operator=(const shared_memory &) = delete;
+
+			// Throws if the name is taken by a block that is still in use, another writer's
+			// ring must not be replaced under its readers.
+			void create(const std::string &name_, std::size_t size)
+			{
+				close();
+#ifdef _WIN32
+				mapping_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+					static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32), static_cast<DWORD>(size), ("Local\\" + name_).c_str());
+				if (!mapping_handle)
+					throw std::runtime_error("Unable to create shared memory: " + name_);
+				if (GetLastError() == ERROR_ALREADY_EXISTS)
+				{
+					close();
+					throw std::runtime_error("Shared memory already in use: " + name_);
+				}
+				view = static_cast<unsigned char *>(MapViewOfFile(mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+				std::string path = "/" + name_;
+				int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+				if (fd == -1 && errno == EEXIST)
+				{
+					if (shared_block_alive(path))
+						throw std::runtime_error("Shared memory already in use: " + name_);
+					// a writer that crashed left it behind
+					shm_unlink(path.c_str());
+					fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+				}
+				if (fd == -1)
+					throw std::runtime_error("Unable to create shared memory: " + name_);
+				if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+				{
+					::close(fd);
+					shm_unlink(path.c_str());
+					throw std::runtime_error("Unable to size shared memory: " + name_);
+				}
+				void *v = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				::close(fd);
+				view = v == MAP_FAILED ? nullptr : static_cast<unsigned char *>(v);
+				if (!view)
+					shm_unlink(path.c_str());
+#endif
+				if (!view)
+				{
+					close();
+					throw std::runtime_error("Unable to map shared memory: " + name_);
+				}
+				name = name_;
+				view_size = size;
+				owner = true;
+			}
+
+			// Maps an existing block read only. False if nobody has created it yet.
+			bool open(const std::string &name_)
+			{
+				close();
+#ifdef _WIN32
+				mapping_handle = OpenFileMappingA(FILE_MAP_READ, FALSE, ("Local\\" + name_).c_str());
+				if (!mapping_handle)
+					return false;
+				view = static_cast<unsigned char *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+				MEMORY_BASIC_INFORMATION info;
+				if (view && VirtualQuery(view, &info, sizeof(info)))
+					view_size = info.RegionSize;
+#else
+				int fd = shm_open(("/" + name_).c_str(), O_RDONLY, 0);
+				if (fd == -1)
+					return false;
+				struct stat st;
+				if (fstat(fd, &st) == 0 && st.st_size > 0)
+				{
+					void *v = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+					if (v != MAP_FAILED)
+					{
+						view = static_cast<unsigned char *>(v);
+						view_size = static_cast<std::size_t>(st.st_size);
+					}
+				}
+				::close(fd);
+#endif
+				if (!view)
+				{
+					close();
+					return false;
+				}
+				name = name_;
+				return true;
+			}
+
+			void close()
+			{
+#ifdef _WIN32
+				if (view)
+					UnmapViewOfFile(view);
+				if (mapping_handle)
+					CloseHandle(mapping_handle);
+				mapping_handle = nullptr;
+#else
+				if (view)
+					munmap(view, view_size);
+				if (owner)
+					shm_unlink(("/" + name).c_str());
+#endif
+				view = nullptr;
+				view_size = 0;
+				owner = false;
+				name.clear();
+			}
+
+			unsigned char *data() const { return view; }
+			std::size_t size() const { return view_size; }
+		};
+	}
+
+	struct shared_frame_writer_stats
+	{
+		std::uint64_t published;
+		std::uint64_t bytes;
+		std::uint64_t oversized;		// frames larger than a slot, not published
+	};
+
+	// Producer side. Never waits for readers: a slow reader is lapped and finds out from
+	// the sequence numbers. begin_frame() hands out the slot's pixel memory directly so the
+	// frame is copied once, from wherever it is (a mapped pixel buffer) into shared memory.
+	class shared_frame_writer
+	{
+		detail::shared_memory memory;
+		shared_frame_header *header;
+		shared_frame_slot *current;		// slot between begin_frame() and end_frame()
+		std::uint64_t current_number;
+		shared_frame_writer_stats stats;
+
+	private:
+		shared_frame_slot *slot(std::uint64_t n) const
+		{
+			return reinterpret_cast<shared_frame_slot *>(memory.data() + sizeof(shared_frame_header) + (n % header->slot_count) * header->slot_stride);
+		}
+
+	public:
+		shared_frame_writer() :
+			header(nullptr),
+			current(nullptr),
+			current_number(0),
+			stats()
+		{
+		}
+
+		shared_frame_writer(const std::string &name, std::uint32_t slot_count, std::uint32_t max_width, std::uint32_t max_height) :
+			shared_frame_writer()
+		{
+			create(name, slot_count, max_width, max_height);
+		}
+
+		// No copy constructor or assignment
+		shared_frame_writer(const shared_frame_writer &) = delete;
+		shared_frame_writer &operator=(const shared_frame_writer &) = delete;
+
+		// Three slots is enough for a reader that keeps up; more gives it slack for hiccups.
+		void create(const std::string &name, std::uint32_t slot_count, std::uint32_t max_width, std::uint32_t max_height)
+		{
+			static_assert(sizeof(shared_frame_header) % 64 == 0, "slots must start on a cache line");
+			if (slot_count < 2)
+				slot_count = 2;
+
+			std::uint64_t pixels = static_cast<std::uint64_t>(max_width) * max_height * 4;
+			std::uint64_t stride = (sizeof(shared_frame_slot) + pixels + 4095) & ~std::uint64_t(4095);
+			memory.create(name, static_cast<std::size_t>(sizeof(shared_frame_header) + stride * slot_count));
+
+			header = new (memory.data()) shared_frame_header();
+			header->magic = detail::shared_frame_magic;
+			header->version = detail::shared_frame_version;
+			header->slot_count = slot_count;
+			header->max_width = max_width;
+			header->max_height = max_height;
+			header->reserved = 0;
+			header->slot_stride = stride;
+#ifdef _WIN32
+			header->writer_pid = GetCurrentProcessId();
+#else
+			header->writer_pid = static_cast<std::uint64_t>(getpid());
+#endif
+			for (std::uint32_t i = 0; i < slot_count; ++i)
+				new (slot(i)) shared_frame_slot();
+			header->published.store(0, std::memory_order_release);
+			stats = shared_frame_writer_stats();
+		}
+
+		void close()
+		{
+			header = nullptr;
+			current = nullptr;
+			memory.close();
+		}
+
+		// Pixel memory for a width x height rgba8 frame, or nullptr if it does not fit a slot.
+		// Rows are tightly packed. Finish with end_frame().
+		unsigned char *begin_frame(std::uint32_t width, std::uint32_t height, std::uint64_t frame_index)
+		{
+			if (!header)
+				return nullptr;
+			if (static_cast<std::uint64_t>(width) * height * 4 > header->slot_stride - sizeof(shared_frame_slot))
+			{
+				++stats.oversized;
+				return nullptr;
+			}
+
+			current_number = header->published.load(std::memory_order_relaxed);
+			current = slot(current_number);
+			current->sequence.store(current_number * 2 + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			current->frame_index = frame_index;
+			current->width = width;
+			current->height = height;
+			current->stride = width * 4;
+			current->format = 0;
+			return reinterpret_cast<unsigned char *>(current + 1);
+		}
+
+		void end_frame()
+		{
+			if (!current)
+				return;
+			current->publish_ns = detail::steady_ns();
+			current->sequence.store(current_number * 2 + 2, std::memory_order_release);
+			header->published.store(current_number + 1, std::memory_order_release);
+			stats.bytes += static_cast<std::uint64_t>(current->stride) * current->height;
+			++stats.published;
+			current = nullptr;
+		}
+
+		bool write(const unsigned char *pixels, std::uint32_t width, std::uint32_t height, std::uint64_t frame_index)
+		{
+			unsigned char *dst = begin_frame(width, height, frame_index);
+			if (!dst)
+				return false;
+			std::memcpy(dst, pixels, static_cast<std::size_t>(width) * height * 4);
+			end_frame();
+			return true;
+		}
+
+		bool is_open() const { return header != nullptr; }
+		const shared_frame_writer_stats &get_stats() const { return stats; }
+	};
+
+	struct shared_frame
+	{
+		const unsigned char *pixels;	// bottom row first
+		std::uint32_t width;
+		std::uint32_t height;
+		std::uint32_t stride;
+		std::uint64_t frame_index;
+		std::uint64_t number;			// position in the ring's stream, gaps mean skipped frames
+		double latency_ms;				// publish to acquire
+	};
+
+	struct shared_frame_reader_stats
+	{
+		std::uint64_t received;
+		std::uint64_t skipped;			// published but overwritten before this reader got to them
+		std::uint64_t torn;				// overwritten while being read, counted in skipped too
+		double latency_ms_total;
+		double latency_ms_max;
+	};
+
+	// Consumer side, for any process on the machine. acquire() returns a frame in place in
+	// shared memory; whatever was done with it only counts if release() then says the
+	// writer did not overwrite the slot meanwhile. read() copies and does that check for you.
+	class shared_frame_reader
+	{
+		detail::shared_memory memory;
+		const shared_frame_header *header;
+		std::uint64_t next;				// next frame number wanted
+		shared_frame_reader_stats stats;
+
+	private:
+		const shared_frame_slot *slot(std::uint64_t n) const
+		{
+			return reinterpret_cast<const shared_frame_slot *>(memory.data() + sizeof(shared_frame_header) + (n % header->slot_count) * header->slot_stride);
+		}
+
+	public:
+		shared_frame_reader() :
+			header(nullptr),
+			next(0),
+			stats()
+		{
+		}
+
+		// No copy constructor or assignment
+		shared_frame_reader(const shared_frame_reader &) = delete;
+		shared_frame_reader &operator=(const shared_frame_reader &) = delete;
+
+		// False until a writer has created the ring. Starts with the newest frame.
+		bool open(const std::string &name)
+		{
+			header = nullptr;
+			if (!memory.open(name))
+				return false;
+
+			const shared_frame_header *h = reinterpret_cast<const shared_frame_header *>(memory.data());
+			if (memory.size() < sizeof(shared_frame_header) || h->magic != detail::shared_frame_magic || h->version != detail::shared_frame_version)
+			{
+				memory.close();
+				throw std::runtime_error("Not a frame ring: " + name);
+			}
+			header = h;
+			std::uint64_t published = header->published.load(std::memory_order_acquire);
+			next = published ? published - 1 : 0;
+			stats = shared_frame_reader_stats();
+			return true;
+		}
+
+		void close()
+		{
+			header = nullptr;
+			memory.close();
+		}
+
+		// The oldest frame this reader has not seen that is still in the ring. With latest
+		// set, jumps to the newest one instead. False if nothing new has been published.
+		bool acquire(shared_frame &frame, bool latest = false)
+		{
+			if (!header)
+				return false;
+
+			for (;;)
+			{
+				std::uint64_t published = header->published.load(std::memory_order_acquire);
+				if (next >= published)
+					return false;
+
+				std::uint64_t oldest = published > header->slot_count ? published - header->slot_count + 1 : 0;
+				std::uint64_t wanted = latest ? published - 1 : (next < oldest ? oldest : next);
+				stats.skipped += wanted - next;
+				next = wanted;
+
+				const shared_frame_slot *s = slot(wanted);
+				if (s->sequence.load(std::memory_order_acquire) != wanted * 2 + 2)
+				{
+					// lapped between the two loads, or the writer is on it right now
+					++stats.torn;
+					++stats.skipped;
+					++next;
+					continue;
+				}
+
+				frame.pixels = reinterpret_cast<const unsigned char *>(s + 1);
+				frame.width = s->width;
+				frame.height = s->height;
+				frame.stride = s->stride;
+				frame.frame_index = s->frame_index;
+				frame.number = wanted;
+				std::uint64_t now = detail::steady_ns();
+				frame.latency_ms = now > s->publish_ns ? (now - s->publish_ns) / 1e6 : 0.0;
+				return true;
+			}
+		}
+
+		// True if the frame from acquire() was intact the whole time it was used.
+		bool release(const shared_frame &frame)
+		{
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const shared_frame_slot *s = slot(frame.number);
+			next = frame.number + 1;
+			if (s->sequence.load(std::memory_order_relaxed) != frame.number * 2 + 2)
+			{
+				++stats.torn;
+				++stats.skipped;
+				return false;
+			}
+
+			++stats.received;
+			stats.latency_ms_total += frame.latency_ms;
+			stats.latency_ms_max = frame.latency_ms > stats.latency_ms_max ? frame.latency_ms : stats.latency_ms_max;
+			return true;
+		}
+
+		// Copies the next intact frame into pixels. False if nothing new was published.
+		bool read(std::vector<unsigned char> &pixels, shared_frame &frame, bool latest = false)
+		{
+			while (acquire(frame, latest))
+			{
+				std::size_t bytes = static_cast<std::size_t>(frame.stride) * frame.height;
+				pixels.resize(bytes);
+				std::memcpy(pixels.data(), frame.pixels, bytes);
+				if (release(frame))
+				{
+					frame.pixels = pixels.data();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Whether the writer has published anything since open(), e.g. to detect it went away.
+		std::uint64_t get_published() const { return header ? header->published.load(std::memory_order_acquire) : 0; }
+		std::uint64_t get_writer_pid() const { return header ? header->writer_pid : 0; }
+		bool is_open() const { return header != nullptr; }
+		const shared_frame_reader_stats &get_stats() const { return stats; }
+	};
+}
+
+#endif // !KNU_SHARED_FRAME_RING_HPP
@@ -0,0 +1,395 @@
+#ifndef KNU_TEXTURE_ATLAS_HPP
+#define KNU_TEXTURE_ATLAS_HPP
+
+#include <knu/knu_texture.hpp>
+#include <knu/mathlibrary6.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct atlas_rect
+		{
+			int x;
+			int y;
+			int width;
+			int height;
+		};
+
+		// Skyline bottom-left rectangle packer. Given the same inserts in the same order it
+		// always produces the same placements.
+		class skyline_packer
+		{
+			struct segment
+			{
+				int x;
+				int y;
+				int width;
+			};
+
+			int width;
+			int height;
+			std::vector<segment> skyline;
+			std::size_t used_area;
+
+		private:
+			// lowest y a w x h rectangle can sit at when its left edge starts at segment i
+			bool fit(std::size_t i, int w, int h, int &y) const
+			{
+				int x = skyline[i].x;
+				if (x + w > width)
+					return false;
+
+				int width_left = w;
+				y = skyline[i].y;
+				for (std::size_t j = i; width_left > 0; ++j)
+				{
+					if (j == skyline.size())
+						return false;
+					y = (std::max)(y, skyline[j].y);
+					if (y + h > height)
+						return false;
+					width_left -= skyline[j].width;
+				}
+				return true;
+			}
+
+			void add_segment(std::size_t i, const atlas_rect &r)
+			{
+				segment s = { r.x, r.y + r.height, r.width };
+				skyline.insert(skyline.begin() + i, s);
+
+				// trim or remove the segments now hidden under the new one
+				for (std::size_t j = i + 1; j < skyline.size(); )
+				{
+					int shadow = skyline[j - 1].x + skyline[j - 1].width - skyline[j].x;
+					if (shadow <= 0)
+						break;
+
+					skyline[j].x += shadow;
+					skyline[j].width -= shadow;
+					if (skyline[j].width <= 0)
+						skyline.erase(skyline.begin() + j);
+					else
+						break;
+				}
+
+				// merge neighbours at the same height
+				for (std::size_t j = 0; j + 1 < skyline.size(); )
+				{
+					if (skyline[j].y == skyline[j + 1].y)
+					{
+						skyline[j].width += skyline[j + 1].width;
+						skyline.erase(skyline.begin() + j + 1);
+					}
+					else
+						++j;
+				}
+			}
+
+		public:
+			skyline_packer(int width_, int height_) :
+				width(width_),
+				height(height_),
+				skyline(1, segment{ 0, 0, width_ }),
+				used_area(0)
+			{
+			}
+
+			bool insert(int w, int h, atlas_rect &out)
+			{
+				int best_top = height + 1;
+				int best_width = width + 1;
+				std::size_t best_index = skyline.size();
+				int best_y = 0;
+
+				for (std::size_t i = 0; i < skyline.size(); ++i)
+				{
+					int y;
+					if (!fit(i, w, h, y))
+						continue;
+
+					// lowest top edge wins, ties go to the narrowest segment then leftmost
+					if (y + h < best_top || (y + h == best_top && skyline[i].width < best_width))
+					{
+						best_top = y + h;
+						best_width = skyline[i].width;
+						best_index = i;
+						best_y = y;
+					}
+				}
+
+				if (best_index == skyline.size())
+					return false;
+
+				out = atlas_rect{ skyline[best_index].x, best_y, w, h };
+				add_segment(best_index, out);
+				used_area += static_cast<std::size_t>(w) * h;
+				return true;
+			}
+
+			double occupancy() const
+			{
+				return static_cast<double>(used_area) / (static_cast<double>(width) * height);
+			}
+		};
+
+		struct atlas_settings
+		{
+			int page_width;
+			int page_height;
+			int padding;		// texels around each sprite so filtering does not pick up neighbours
+			bool extrude;		// fill the padding with the sprite's edge texels instead of transparent black
+
+			atlas_settings() :
+				page_width(2048),
+				page_height(2048),
+				padding(2),
+				extrude(true)
+			{}
+		};
+
+		struct atlas_sprite
+		{
+			std::string name;
+			int page;
+			atlas_rect rect;				// texels covered by the sprite itself, padding excluded
+			knu::math::vector4f uv;		// (u0, v0, u1, v1)
+		};
+
+		struct atlas_layout
+		{
+			int pages;
+			std::vector<int> page_of;			// indexed like the input sizes
+			std::vector<atlas_rect> rects;		// padded cells
+			double efficiency;					// sprite texels / page texels
+		};
+
+		// Places w x h cells (padding included) first fit over the pages. The input order is
+		// sorted internally, so the result depends only on the sizes and settings.
+		inline atlas_layout pack_atlas(const std::vector<std::pair<int, int>> &sizes, const atlas_settings &settings)
+		{
+			std::vector<std::size_t> order(sizes.size());
+			for (std::size_t i = 0; i < order.size(); ++i)
+				order[i] = i;
+
+			// tall and wide first packs tighter; the index keeps equal sizes stable
+			std::sort(order.begin(), order.end(), [&sizes](std::size_t a, std::size_t b) {
+				if (sizes[a].second != sizes[b].second)
+					return sizes[a].second > sizes[b].second;
+				if (sizes[a].first != sizes[b].first)
+					return sizes[a].first > sizes[b].first;
+				return a < b;
+			});
+
+			atlas_layout layout;
+			layout.pages = 0;
+			layout.page_of.assign(sizes.size(), -1);
+			layout.rects.resize(sizes.size());
+
+			std::vector<skyline_packer> packers;
+			std::size_t sprite_area = 0;
+			int pad2 = settings.padding * 2;
+
+			for (std::size_t i : order)
+			{
+				int w = sizes[i].first + pad2;
+				int h = sizes[i].second + pad2;
+				if (w > settings.page_width || h > settings.page_height)
+					throw std::runtime_error("Sprite does not fit an atlas page: " + std::to_string(sizes[i].first) + "x" + std::to_string(sizes[i].second));
+
+				std::size_t page = 0;
+				for (; page < packers.size(); ++page)
+					if (packers[page].insert(w, h, layout.rects[i]))
+						break;
+
+				if (page == packers.size())
+				{
+					packers.push_back(skyline_packer(settings.page_width, settings.page_height));
+					packers.back().insert(w, h, layout.rects[i]);
+				}
+
+				layout.page_of[i] = static_cast<int>(page);
+				sprite_area += static_cast<std::size_t>(sizes[i].first) * sizes[i].second;
+			}
+
+			layout.pages = static_cast<int>(packers.size());
+			layout.efficiency = layout.pages ? static_cast<double>(sprite_area) /
+				(static_cast<double>(settings.page_width) * settings.page_height * layout.pages) : 0.0;
+			return layout;
+		}
+
+		// Packs many small images into a few RGBA8 pages so they can be drawn from one
+		// texture (one layer per page) instead of one texture bind per image.
+		class texture_atlas
+		{
+			atlas_settings settings;
+			std::vector<std::pair<std::string, std::shared_ptr<image>>> inputs;
+			std::unordered_set<std::string> input_names;
+			std::vector<atlas_sprite> sprites;
+			std::unordered_map<std::string, std::size_t> sprite_index;
+			std::vector<image> pages;
+			double efficiency;
+
+		private:
+			// source texel as RGBA, whatever channel order the image was loaded with
+			static void fetch(const image &img, int x, int y, unsigned char *rgba)
+			{
+				int bpp = img.get_bytes_per_pixel();
+				const unsigned char *p = img.get_data() + (static_cast<std::size_t>(y) * img.get_width() + x) * bpp;
+				bool bgr = img.get_format() == 0x80E1 /*GL_BGRA*/ || img.get_format() == 0x80E0 /*GL_BGR*/;
+
+				rgba[0] = bgr ? p[2] : p[0];
+				rgba[1] = p[1];
+				rgba[2] = bgr ? p[0] : p[2];
+				rgba[3] = bpp == 4 ? p[3] : 255;
+			}
+
+			void blit(const image &img, unsigned char *page, const atlas_rect &cell)
+			{
+				int pad = settings.padding;
+				int w = img.get_width();
+				int h = img.get_height();
+
+				for (int y = -pad; y < h + pad; ++y)
+				{
+					for (int x = -pad; x < w + pad; ++x)
+					{
+						bool inside = x >= 0 && y >= 0 && x < w && y < h;
+						if (!inside && !settings.extrude)
+							continue;
+
+						int sx = (std::min)((std::max)(x, 0), w - 1);
+						int sy = (std::min)((std::max)(y, 0), h - 1);
+						std::size_t dst = (static_cast<std::size_t>(cell.y + pad + y) * settings.page_width + cell.x + pad + x) * 4;
+						fetch(img, sx, sy, page + dst);
+					}
+				}
+			}
+
+		public:
+			explicit texture_atlas(const atlas_settings &settings_ = atlas_settings()) :
+				settings(settings_),
+				efficiency(0.0)
+			{
+			}
+
+			// Names are unique, otherwise their packing order and which one find() returns
+			// would depend on the sort.
+			void add(std::string name, std::shared_ptr<image> img)
+			{
+				if (!input_names.insert(name).second)
+					throw std::runtime_error("Duplicate atlas sprite name: " + name);
+				inputs.emplace_back(name, std::move(img));
+			}
+
+			void build()
+			{
+				// sorting by name first makes the result independent of the order add() was called in
+				std::sort(inputs.begin(), inputs.end(), [](const std::pair<std::string, std::shared_ptr<image>> &a,
+					const std::pair<std::string, std::shared_ptr<image>> &b) { return a.first < b.first; });
+
+				std::vector<std::pair<int, int>> sizes;
+				sizes.reserve(inputs.size());
+				for (const auto &in : inputs)
+					sizes.emplace_back(in.second->get_width(), in.second->get_height());
+
+				atlas_layout layout = pack_atlas(sizes, settings);
+				efficiency = layout.efficiency;
+
+				std::size_t page_bytes = static_cast<std::size_t>(settings.page_width) * settings.page_height * 4;
+				std::vector<std::unique_ptr<unsigned char[]>> pixels(layout.pages);
+				for (auto &p : pixels)
+				{
+					p.reset(new unsigned char[page_bytes]);
+					memset(p.get(), 0, page_bytes);
+				}
+
+				sprites.clear();
+				sprite_index.clear();
+				sprites.resize(inputs.size());
+
+				float inv_w = 1.0f / settings.page_width;
+				float inv_h = 1.0f / settings.page_height;
+
+				for (std::size_t i = 0; i < inputs.size(); ++i)
+				{
+					const atlas_rect &cell = layout.rects[i];
+					const image &img = *inputs[i].second;
+					blit(img, pixels[layout.page_of[i]].get(), cell);
+
+					atlas_sprite &s = sprites[i];
+					s.name = inputs[i].first;
+					s.page = layout.page_of[i];
+					s.rect = atlas_rect{ cell.x + settings.padding, cell.y + settings.padding, img.get_width(), img.get_height() };
+					s.uv.x = s.rect.x * inv_w;
+					s.uv.y = s.rect.y * inv_h;
+					s.uv.z = (s.rect.x + s.rect.width) * inv_w;
+					s.uv.w = (s.rect.y + s.rect.height) * inv_h;
+					sprite_index[s.name] = i;
+				}
+
+				pages.clear();
+				pages.resize(layout.pages);
+				for (int p = 0; p < layout.pages; ++p)
+					pages[p].create("atlas page " + std::to_string(p), settings.page_width, settings.page_height, 4,
+						0x1908 /*GL_RGBA*/, 0x8058 /*GL_RGBA8*/, std::move(pixels[p]));
+			}
+
+			// Stores every page as one layer of a 2d array texture.
+			void upload(texture &t, bool mipmaps = true)
+			{
+				t.create(texture_type::texture_2d_array, GL_RGBA8, settings.page_width, settings.page_height,
+					static_cast<int>(pages.size()), mipmaps ? 0 : 1);
+				for (std::size_t p = 0; p < pages.size(); ++p)
+					t.upload(pages[p], 0, static_cast<int>(p));
+				if (mipmaps)
+					t.generate_mipmaps();
+			}
+
+			const atlas_sprite &get_sprite(const std::string &name) const
+			{
+				auto i = sprite_index.find(name);
+				if (i == sprite_index.end())
+					throw std::runtime_error("Unable to find sprite: " + name);
+				return sprites[i->second];
+			}
+
+			// Hash of names and placements, stable across runs, for keying a baked atlas cache.
+			std::uint64_t layout_hash() const
+			{
+				std::uint64_t h = 14695981039346656037ull;
+				auto mix = [&h](const void *data, std::size_t size) {
+					const unsigned char *b = static_cast<const unsigned char *>(data);
+					for (std::size_t i = 0; i < size; ++i)
+						h = (h ^ b[i]) * 1099511628211ull;
+				};
+
+				for (const auto &s : sprites)
+				{
+					mix(s.name.data(), s.name.size());
+					int values[5] = { s.page, s.rect.x, s.rect.y, s.rect.width, s.rect.height };
+					mix(values, sizeof(values));
+				}
+				return h;
+			}
+
+			const std::vector<atlas_sprite> &get_sprites() const { return sprites; }
+			std::vector<image> &get_pages() { return pages; }
+			int get_page_count() const { return static_cast<int>(pages.size()); }
+			double get_efficiency() const { return efficiency; }
+			const atlas_settings &get_settings() const { return settings; }
+		};
+	}
+}
+
+#endif // !KNU_TEXTURE_ATLAS_HPP
@@ -0,0 +1,285 @@
+#ifndef KNU_TEXTURE_STREAMER_HPP
+#define KNU_TEXTURE_STREAMER_HPP
+
+#include <knu/knu_texture.hpp>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace knu
+{
+	namespace graphics
+	{
+		struct streamer_stats
+		{
+			std::size_t bytes_last_frame;
+			std::size_t peak_bytes_per_frame;
+			double average_bytes_per_frame;		// exponential moving average
+			std::size_t queue_depth;			// requests not yet fully uploaded
+			std::size_t queued_bytes;
+			double stall_ms_last_frame;			// time spent waiting on slot fences
+			double total_stall_ms;
+			std::uint64_t busy_slot_frames;		// frames that stopped early because the ring was full
+			std::uint64_t completed_uploads;
+			std::uint64_t frames;
+		};
+
+		// Streams image data into textures through a ring of persistently mapped pixel unpack
+		// buffer slots. Each slot is guarded by a fence so the cpu never writes memory the gpu
+		// is still reading, and no more than the per frame budget is copied in one update().
+		// Large images are split by rows and trickle in over several frames. macOS has no
+		// persistent mapping, so there each slot is mapped unsynchronized while it is filled.
+		class texture_streamer
+		{
+			struct request
+			{
+				texture *target;
+				std::shared_ptr<image> source;
+				int level;
+				int layer;
+				int next_row;
+				std::function<void()> on_complete;
+			};
+
+			// one slot's copy, submitted once the slot's memory is no longer being written
+			struct pending_upload
+			{
+				texture *target;
+				int level;
+				int layer;
+				int first_row;
+				int width;
+				int rows;
+				GLenum format;
+				std::size_t offset;
+			};
+
+			GLuint pbo;
+			unsigned char *mapped;		// the whole ring, or on macOS the current slot while filling it
+			std::size_t slot_size;
+			int slot_count;
+			int current_slot;
+			std::vector<GLsync> fences;
+			std::deque<request> queue;
+			std::vector<pending_upload> pending;
+			std::vector<std::function<void()>> completed;
+			std::size_t frame_budget;
+			streamer_stats stats;
+
+		private:
+			static std::size_t row_bytes(image &img)
+			{
+				return static_cast<std::size_t>(img.get_size() / img.get_height());
+			}
+
+			// Returns false when the gpu still owns the slot. Only waits when block is true.
+			bool acquire_slot(bool block)
+			{
+				GLsync &fence = fences[current_slot];
+				if (!fence)
+					return true;
+
+				auto start = std::chrono::steady_clock::now();
+				GLuint64 timeout = block ? 1000000000ull : 0;
+				GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+				std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+				stats.stall_ms_last_frame += waited.count();
+				stats.total_stall_ms += waited.count();
+
+				if (result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED)
+					return false;
+
+				glDeleteSync(fence);
+				fence = nullptr;
+				return true;
+			}
+
+			// Copies as many rows as fit into the current slot and the remaining budget.
+			std::size_t fill_slot(std::size_t budget_left)
+			{
+				std::size_t used = 0;
+#ifdef __APPLE__
+				// no persistent mapping on 4.1; the fence already guards the slot, so map it
+				// unsynchronized rather than let the driver wait on the whole buffer
+				unsigned char *slot_memory = static_cast<unsigned char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+					current_slot * slot_size, slot_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+				if (!slot_memory)
+					return 0;
+#else
+				unsigned char *slot_memory = mapped + current_slot * slot_size;
+#endif
+
+				while (!queue.empty() && used < budget_left)
+				{
+					request &r = queue.front();
+					image &img = *r.source;
+					std::size_t pitch = row_bytes(img);
+
+					std::size_t space = (std::min)(slot_size - used, budget_left - used);
+					int rows = static_cast<int>((std::min)(space / pitch, static_cast<std::size_t>(img.get_height() - r.next_row)));
+					// always make progress on rows wider than the whole budget
+					if (rows == 0 && used == 0)
+						rows = 1;
+					if (rows == 0)
+						break;
+
+					std::size_t size = rows * pitch;
+					memcpy(slot_memory + used, img.get_data() + r.next_row * pitch, size);
+
+					pending.push_back(pending_upload{ r.target, r.level, r.layer, r.next_row, img.get_width(), rows,
+						img.get_format(), current_slot * slot_size + used });
+
+					r.next_row += rows;
+					used += size;
+					stats.queued_bytes -= size;
+
+					if (r.next_row == img.get_height())
+					{
+						if (r.on_complete)
+							completed.push_back(std::move(r.on_complete));
+						queue.pop_front();
+						++stats.completed_uploads;
+					}
+				}
+
+#ifdef __APPLE__
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+#endif
+				// sourcing a mapped buffer is an error without persistent mapping, so the
+				// texture copies wait until the slot is written
+				for (const pending_upload &u : pending)
+					u.target->sub_image(u.level, u.layer, 0, u.first_row, u.width, u.rows, u.format,
+						GL_UNSIGNED_BYTE, reinterpret_cast<const void *>(u.offset));
+				pending.clear();
+
+				for (auto &done : completed)
+					done();
+				completed.clear();
+
+				return used;
+			}
+
+			void pump(std::size_t budget, bool block)
+			{
+				std::size_t sent = 0;
+
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+				while (!queue.empty() && sent < budget)
+				{
+					if (!acquire_slot(block))
+					{
+						++stats.busy_slot_frames;
+						break;
+					}
+
+					std::size_t used = fill_slot(budget - sent);
+					if (used == 0)
+						break;
+
+					fences[current_slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+					current_slot = (current_slot + 1) % slot_count;
+					sent += used;
+				}
+
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				stats.bytes_last_frame = sent;
+			}
+
+		public:
+			// slot_size_ bounds the largest single row that can be streamed
+			texture_streamer(std::size_t slot_size_ = 4 << 20, int slot_count_ = 3, std::size_t frame_budget_ = 8 << 20) :
+				pbo(0),
+				mapped(nullptr),
+				slot_size(slot_size_),
+				slot_count(slot_count_),
+				current_slot(0),
+				fences(slot_count_, nullptr),
+				frame_budget(frame_budget_),
+				stats()
+			{
+				GLsizeiptr total = static_cast<GLsizeiptr>(slot_size * slot_count);
+
+				glGenBuffers(1, &pbo);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+#ifdef __APPLE__
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, total, nullptr, GL_STREAM_DRAW);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#else
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glBufferStorage(GL_PIXEL_UNPACK_BUFFER, total, nullptr, flags);
+				mapped = static_cast<unsigned char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total, flags));
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				if (!mapped)
+					throw std::runtime_error("Unable to map texture streaming buffer");
+#endif
+			}
+
+			~texture_streamer()
+			{
+				for (GLsync f : fences)
+					if (f)
+						glDeleteSync(f);
+
+#ifndef __APPLE__
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#endif
+				glDeleteBuffers(1, &pbo);
+			}
+
+			// No copy constructor or assignment
+			texture_streamer(const texture_streamer &) = delete;
+			texture_streamer &operator=(const texture_streamer &) = delete;
+
+			// The texture must outlive the request; on_complete runs on the gl thread from
+			// update() once the last row has been submitted.
+			void enqueue(texture &target, std::shared_ptr<image> source, int level = 0, int layer = 0,
+				std::function<void()> on_complete = std::function<void()>())
+			{
+				if (row_bytes(*source) > slot_size)
+					throw std::runtime_error("Image row does not fit a streaming slot: " + source->get_image_name());
+
+				stats.queued_bytes += source->get_size();
+				queue.push_back(request{ &target, std::move(source), level, layer, 0, std::move(on_complete) });
+				stats.queue_depth = queue.size();
+			}
+
+			// Call once per frame from the thread owning the context.
+			void update()
+			{
+				stats.stall_ms_last_frame = 0.0;
+				pump(frame_budget, false);
+
+				++stats.frames;
+				stats.peak_bytes_per_frame = (std::max)(stats.peak_bytes_per_frame, stats.bytes_last_frame);
+				stats.average_bytes_per_frame += (stats.bytes_last_frame - stats.average_bytes_per_frame) * 0.05;
+				stats.queue_depth = queue.size();
+			}
+
+			// Uploads everything still queued, ignoring the budget and waiting on fences.
+			void flush()
+			{
+				stats.stall_ms_last_frame = 0.0;
+				while (!queue.empty())
+					pump(slot_size * slot_count, true);
+				stats.queue_depth = 0;
+			}
+
+			void set_frame_budget(std::size_t bytes) { frame_budget = bytes; }
+			std::size_t get_frame_budget() const { return frame_budget; }
+			bool is_idle() const { return queue.empty(); }
+			const streamer_stats &get_stats() const { return stats; }
+		};
+	}
+}
+
+#endif // !KNU_TEXTURE_STREAMER_HPP
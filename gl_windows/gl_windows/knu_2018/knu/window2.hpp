@@ -21,15 +21,27 @@
 
 #ifdef __APPLE__
 #include <SDL2/SDL.h>
+#include <OpenGL/gl3.h>
 #endif
 
+#ifdef __linux__
+#include <SDL2/SDL.h>
+#endif
+
+#include <knu/event_queue.hpp>
+#include <knu/headless_context.hpp>
+
 class window_class
 {
 	SDL_Window *window;
 	SDL_GLContext context;
 	bool quit;
 	std::function < void(SDL_Event *)> event_callback;
-
+	knu::event_queue *events;
+	knu::graphics::headless_context headless;	// linux only, used when there is no window
+	bool headless_mode;
+	int headless_width;
+	int headless_height;
 
 private:
 	void process_event(SDL_Event *event)
@@ -45,9 +57,14 @@ public:
 	window_class():
 		window(nullptr),
 		context(0),
-		quit(false)
+		quit(false),
+		events(nullptr),
+		headless_mode(false),
+		headless_width(0),
+		headless_height(0)
 	{
-		unsigned initFlags = SDL_INIT_EVENTS | SDL_INIT_TIMER |	SDL_INIT_VIDEO;
+		// video is initialized by create(), a headless context has no display to connect to
+		unsigned initFlags = SDL_INIT_EVENTS | SDL_INIT_TIMER;
 		if (0 != SDL_Init(initFlags))
 		{
 			std::string error = SDL_GetError();
@@ -63,14 +80,24 @@ public:
 
 	~window_class()
 	{
-		SDL_GL_MakeCurrent(window, 0);
-		SDL_GL_DeleteContext(context);
-        SDL_DestroyWindow(window);
+		if (window)
+		{
+			SDL_GL_MakeCurrent(window, 0);
+			SDL_GL_DeleteContext(context);
+			SDL_DestroyWindow(window);
+		}
+		headless.destroy();
 		SDL_Quit();
 	}
 
 	void create(int width, int height, int majorVersion, int minorVersion, bool debug, int depthBits = 24, int stencilBits = 0, unsigned flags = SDL_WINDOW_RESIZABLE | SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL)
 	{	
+		if (0 != SDL_InitSubSystem(SDL_INIT_VIDEO))
+		{
+			std::string error = SDL_GetError();
+			throw (std::runtime_error("Unable to initialize SDL video: " + error));
+		}
+
 		SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
 		SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
 		SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
@@ -114,6 +141,26 @@ public:
 #endif
 		
 	}
+
+	// Context without a visible window; render into a framebuffer object. On linux this is
+	// EGL (a gpu, or llvmpipe when there is none) or OSMesa when built with KNU_USE_OSMESA,
+	// elsewhere a hidden SDL window.
+	void create_headless(int width, int height, int majorVersion, int minorVersion, bool debug)
+	{
+		headless_mode = true;
+		headless_width = width;
+		headless_height = height;
+#ifdef __linux__
+		headless.create(width, height, majorVersion, minorVersion, debug);
+#else
+		create(width, height, majorVersion, minorVersion, debug, 24, 0, SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
+#endif
+	}
+
+	bool is_headless() const
+	{
+		return headless_mode;
+	}
 	
 	void set_quit(bool val) 
 	{
@@ -125,13 +172,50 @@ public:
 		event_callback = c;
 	}
 
+	// When set, poll_events() queues events for the consumer to drain instead of calling
+	// the event callback.
+	void set_event_queue(knu::event_queue *queue)
+	{
+		events = queue;
+	}
+
 	inline void poll_events()
 	{
 		SDL_Event event;
 		while (SDL_PollEvent(&event))
 		{
-			process_event(&event);
+			if (events)
+				events->push(event);
+			else
+				process_event(&event);
 		}
+
+		if (events)
+			events->flush();
+	}
+
+	// A context is current on one thread at a time. Release it before another thread
+	// makes it current, e.g. when handing rendering to a render thread.
+	void make_current()
+	{
+		if (window)
+			SDL_GL_MakeCurrent(window, context);
+		else
+			headless.make_current();
+	}
+
+	void release_context()
+	{
+		if (window)
+			SDL_GL_MakeCurrent(window, 0);
+		else
+			headless.release();
+	}
+
+	// OSMesa contexts stay on the thread that created them, everything else can move.
+	bool can_release_context() const
+	{
+		return window || headless.can_release();
 	}
 
 	inline bool is_active() const
@@ -141,22 +225,61 @@ public:
 	
 	inline void swap_buffers()
 	{
-		SDL_GL_SwapWindow(window);
+		if (window)
+			SDL_GL_SwapWindow(window);
+		else
+			glFlush();
 	}
     
     void set_window_title(std::string title)
     {
-        SDL_SetWindowTitle(window, title.c_str());
+		if (window)
+			SDL_SetWindowTitle(window, title.c_str());
     }
 
-	void set_swap_val(int val /*0 for immediate refresh, 1 for synchronization with display*/)
+	// 0 for immediate refresh, 1 for synchronization with display, -1 for adaptive vsync
+	// (tears instead of stalling when a frame is late). Returns false if the driver refused.
+	bool set_swap_val(int val)
 	{
-		SDL_GL_SetSwapInterval(val);
+		if (!window)
+			return val == 0;
+		return 0 == SDL_GL_SetSwapInterval(val);
+	}
+
+	// adaptive vsync when the driver has it, regular vsync otherwise
+	bool enable_adaptive_vsync()
+	{
+		if (set_swap_val(-1))
+			return true;
+		set_swap_val(1);
+		return false;
+	}
+
+	int get_swap_val() const
+	{
+		if (!window)
+			return 0;
+		return SDL_GL_GetSwapInterval();
+	}
+
+	// refresh rate of the display the window is on, 0 if unknown
+	int get_refresh_rate()
+	{
+		SDL_DisplayMode mode;
+		if (!window || 0 != SDL_GetWindowDisplayMode(window, &mode))
+			return 0;
+		return mode.refresh_rate;
 	}
 
 	void get_window_size(int &width, int &height)
 	{
-		SDL_GetWindowSize(window, &width, &height);
+		if (window)
+			SDL_GetWindowSize(window, &width, &height);
+		else
+		{
+			width = headless_width;
+			height = headless_height;
+		}
 	}
 };
 
@@ -1,13 +1,88 @@
+#include <cctype>
 #include <iostream>
+#include <string>
 #include "app.hpp"
+#include "benchmarks.hpp"
+#include <knu/obj_converter.hpp>
 
 
 using namespace std;
 
 int main(int argc, char *argv[]) {
 
+	// gl_windows --bench <name> [args...] runs a benchmark instead of the app
+	if (argc > 1 && string(argv[1]) == "--bench")
+		return run_benchmark(argc - 2, argv + 2);
+
+	// gl_windows --convert <model.obj> <model.kmsh> bakes a mesh for knu::graphics::mesh_file
+	if (argc > 3 && string(argv[1]) == "--convert")
+	{
+		try
+		{
+			knu::job_system jobs;
+			knu::graphics::convert_obj(jobs, argv[2], argv[3]);
+		}
+		catch (std::exception &e)
+		{
+			cerr << e.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// --headless [frames] [width height] renders offscreen without a window
+	// --export <name> publishes frames to the shared memory ring <name>
+	bool headless = false;
+	std::uint64_t frames = 1000;
+	int width = 1920, height = 1080;
+	string export_name;
+	auto is_number = [&](int i) { return i < argc && isdigit(static_cast<unsigned char>(argv[i][0])); };
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--headless")
+		{
+			headless = true;
+			if (is_number(i + 1))
+				frames = stoull(argv[++i]);
+			if (is_number(i + 1) && is_number(i + 2))
+			{
+				width = stoi(argv[++i]);
+				height = stoi(argv[++i]);
+			}
+		}
+		else if (arg == "--export" && i + 1 < argc)
+			export_name = argv[++i];
+	}
+
+	if (headless)
+	{
+		main_app app(true, width, height);
+		app.set_frame_limit(frames);
+		if (!export_name.empty())
+		{
+			knu::graphics::export_settings settings;
+			settings.name = export_name;
+			app.start_export(settings);
+		}
+		int result = app.run();
+		knu::percentile_summary frame = app.get_telemetry().get_session_frame();
+		cout << "headless: " << frame.samples << " frames, p50 " << frame.p50_ms << " ms, p99 "
+			<< frame.p99_ms << " ms, max " << frame.max_ms << " ms\n";
+		const knu::graphics::render_queue_stats &queue = app.get_queue_stats();
+		cout << "render queue: " << queue.commands << " commands in " << queue.runs << " runs, sort "
+			<< queue.sort_ms << " ms, " << app.get_state_binds() << " state binds over the session\n";
+		return result;
+	}
+
 	// A change
 	main_app app;
+	if (!export_name.empty())
+	{
+		knu::graphics::export_settings settings;
+		settings.name = export_name;
+		app.start_export(settings);
+	}
 
 	return app.run();
 }
\ No newline at end of file